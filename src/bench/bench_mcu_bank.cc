@@ -0,0 +1,85 @@
+#include "benchutil.h"
+#include "rv32core.h"
+#include "rv32_core_bank.h"
+#include "rom.h"
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Runs a population of cores with the same firmware (a loop of integer arithmetic with
+// a data-dependent branch) as independent cores with run(), and in lockstep in an RV32CoreBank:
+// all starting from the same seed, so that they never diverge, and from different seeds,
+// so that they split up and meet again once per iteration.
+
+static const uint32_t N_CORES = 256;
+static const uint64_t CYCLES_PER_TICK = 10000;
+static const uint32_t N_TICKS = 20;
+
+static const uint32_t firmware[] = {
+#include "firmware/mcu_lockstep.hex"
+};
+
+class BankCore : public RV32Core {
+public:
+	BankCore(uint32_t seed) : rom(1) {
+		std::vector<uint8_t> text(1024, 0);
+		memcpy(text.data(), firmware, sizeof(firmware));
+		rom.set_contents(text.data());
+		system_bus->attach_peripheral(&rom, 0x00000000);
+		set_register(10, seed);
+	}
+	uint32_t result() const { return get_register(11) ^ get_register(12); }
+
+	ROM rom;
+};
+
+static void run(bool sameSeed) {
+	std::vector<BankCore*> alone, banked;
+	std::vector<RV32Core*> cores;
+	for (uint32_t i = 0; i < N_CORES; ++i) {
+		uint32_t seed = sameSeed ? 2463534242u : 2463534242u + i * 7919u;
+		alone.push_back(new BankCore(seed));
+		banked.push_back(new BankCore(seed));
+		cores.push_back(banked[i]);
+	}
+	RV32CoreBank bank(cores);
+
+	double tAlone = bench_time([&]() {
+		for (uint32_t tick = 0; tick < N_TICKS; ++tick) {
+			for (uint32_t i = 0; i < N_CORES; ++i) {
+				alone[i]->run(CYCLES_PER_TICK);
+			}
+		}
+	});
+	double tBanked = bench_time([&]() {
+		for (uint32_t tick = 0; tick < N_TICKS; ++tick) {
+			bank.run(CYCLES_PER_TICK);
+		}
+	});
+
+	uint32_t mismatches = 0;
+	for (uint32_t i = 0; i < N_CORES; ++i) {
+		if (alone[i]->result() != banked[i]->result()) {
+			++mismatches;
+		}
+		delete alone[i];
+		delete banked[i];
+	}
+
+	uint64_t instructions = (uint64_t)N_CORES * N_TICKS * CYCLES_PER_TICK;
+	printf("%s:\n", sameSeed ? "same seed (never diverge)" : "different seeds (diverge every iteration)");
+	bench_report("  independent cores, run()", instructions, tAlone, "insn");
+	bench_report("  core bank", instructions, tBanked, "insn");
+	printf("  %-38s %10.1f cores\n", "mean cores per step",
+			(double)bank.get_core_instructions() / (double)bank.get_steps());
+	if (mismatches != 0) {
+		printf("  %u cores got different results\n", mismatches);
+	}
+}
+
+int main() {
+	printf("%u cores, %s\n", N_CORES, RV32CoreBank::is_vectorized() ? "AVX2" : "scalar");
+	run(true);
+	run(false);
+	return 0;
+}
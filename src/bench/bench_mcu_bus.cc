@@ -0,0 +1,102 @@
+#include "benchutil.h"
+#include "system_bus.h"
+#include "rom.h"
+#include "ram.h"
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+// Compares word loads and stores through a SystemBus that looks pages up in a std::map
+// and always calls the peripheral (as it was originally written) with the page table
+// and direct host memory access.
+
+static const uint32_t N_ACCESSES = 1 << 24;
+static const uint32_t ROM_BASE = 0x00000000;
+static const uint32_t RAM_BASE = 0x10000000;
+static const uint32_t N_PAGES = 16;
+
+class OldSystemBus {
+public:
+	void attach_peripheral(SystemBusPeripheral *p, uint32_t baseAddress) {
+		for (uint32_t i = 0; i < p->get_number_of_pages(); ++i) {
+			mapped_pages[(baseAddress >> 10) + i] = p;
+		}
+	}
+	uint32_t load_word(uint32_t pAddr) {
+		std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pAddr >> 10);
+		if (it != mapped_pages.end()) {
+			return it->second->read_word(pAddr);
+		} else {
+			return 0;
+		}
+	}
+	void store_word(uint32_t pAddr, uint32_t value) {
+		std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pAddr >> 10);
+		if (it != mapped_pages.end()) {
+			it->second->write_word(pAddr, value);
+		}
+	}
+protected:
+	std::map<uint32_t, SystemBusPeripheral*> mapped_pages;
+};
+
+// a read from ROM or RAM, or a write to RAM, at a random word-aligned address
+struct Access {
+	uint32_t addr;
+	bool store;
+};
+
+template <typename Bus> static uint32_t run(Bus &bus, const std::vector<Access> &accesses) {
+	uint32_t sum = 0;
+	for (size_t i = 0; i < accesses.size(); ++i) {
+		if (accesses[i].store) {
+			bus.store_word(accesses[i].addr, sum);
+		} else {
+			sum += bus.load_word(accesses[i].addr);
+		}
+	}
+	return sum;
+}
+
+int main() {
+	std::mt19937 rng(42);
+	std::vector<Access> accesses(N_ACCESSES);
+	for (size_t i = 0; i < accesses.size(); ++i) {
+		uint32_t offset = (rng() % (N_PAGES * 1024)) & ~0x00000003;
+		accesses[i].store = (rng() % 4 == 0);
+		accesses[i].addr = ((accesses[i].store || rng() % 2 == 0) ? RAM_BASE : ROM_BASE) + offset;
+	}
+
+	std::vector<uint8_t> contents(N_PAGES * 1024);
+	for (size_t i = 0; i < contents.size(); ++i) {
+		contents[i] = (uint8_t)rng();
+	}
+
+	ROM oldRom(N_PAGES), newRom(N_PAGES);
+	RAM oldRam(N_PAGES), newRam(N_PAGES);
+	oldRom.set_contents(contents.data());
+	newRom.set_contents(contents.data());
+	oldRam.set_contents(contents.data());
+	newRam.set_contents(contents.data());
+
+	OldSystemBus oldBus;
+	oldBus.attach_peripheral(&oldRom, ROM_BASE);
+	oldBus.attach_peripheral(&oldRam, RAM_BASE);
+	SystemBus newBus;
+	newBus.attach_peripheral(&newRom, ROM_BASE);
+	newBus.attach_peripheral(&newRam, RAM_BASE);
+
+	uint32_t oldSum = 0, newSum = 0;
+	double tOld = bench_time([&]() { oldSum = run(oldBus, accesses); });
+	double tNew = bench_time([&]() { newSum = run(newBus, accesses); });
+	if (oldSum != newSum) {
+		printf("mismatch: 0x%08x vs 0x%08x\n", oldSum, newSum);
+		return 1;
+	}
+
+	bench_report("std::map + peripheral call", N_ACCESSES, tOld, "access");
+	bench_report("page table + host memory", N_ACCESSES, tNew, "access");
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include "benchutil.h"
+#include "rv32core.h"
+#include "rom.h"
+#include "ram.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+// Runs a loop-heavy firmware (fill a table in RAM, then checksum it over and over)
+// on an RV32Core: fetching and decoding every instruction as step() originally did,
+// through the decoded-instruction cache one step() at a time, through run(),
+// with the JIT, and translated ahead of time.
+
+static const uint32_t N_PASSES = 10000;
+static const uint32_t RETURN_ADDRESS = 0xDDCCDDCC;
+static const uint64_t CYCLES_PER_TICK = 100000;
+
+static const uint32_t firmware[] = {
+#include "firmware/mcu_loop.hex"
+};
+
+class BenchCore : public RV32Core {
+public:
+	BenchCore() : rom(4), ram(4) {
+		std::vector<uint8_t> text(4 * 1024, 0);
+		for (uint32_t i = 0; i < sizeof(firmware) / sizeof(firmware[0]); ++i) {
+			text[4*i+0] = (uint8_t)((firmware[i] & 0x000000FF));
+			text[4*i+1] = (uint8_t)((firmware[i] & 0x0000FF00) >>  8);
+			text[4*i+2] = (uint8_t)((firmware[i] & 0x00FF0000) >> 16);
+			text[4*i+3] = (uint8_t)((firmware[i] & 0xFF000000) >> 24);
+		}
+		rom.set_contents(text.data());
+		system_bus->attach_peripheral(&rom, 0x00000000);
+		system_bus->attach_peripheral(&ram, 0x10000000);
+	}
+
+	void start(uint32_t passes) {
+		pc = 0;
+		set_register(1, RETURN_ADDRESS);
+		set_register(10, passes);
+	}
+
+	// the original step(): fetch through the bus and decode every time
+	uint64_t run_uncached() {
+		uint64_t n = 0;
+		while (pc != RETURN_ADDRESS) {
+			uint32_t insn = system_bus->load_word(pc);
+			next_pc = pc + 4;
+			execute(insn);
+			pc = next_pc;
+			++n;
+		}
+		return n;
+	}
+
+	// returns the number of instructions retired
+	uint64_t run_steps() {
+		uint64_t start = instret;
+		while (pc != RETURN_ADDRESS) {
+			step();
+		}
+		return instret - start;
+	}
+
+	// run() in slices of a tick's worth of cycles, for exactly n instructions
+	uint64_t run_ticks(uint64_t n) {
+		uint64_t start = instret;
+		while (instret - start < n) {
+			run(std::min<uint64_t>(CYCLES_PER_TICK, n - (instret - start)));
+		}
+		return instret - start;
+	}
+
+	bool use_aot() { return use_translated_rom(&rom, 0x00000000); }
+
+	uint32_t result() const { return get_register(10); }
+	uint32_t get_pc() const { return pc; }
+
+protected:
+	ROM rom;
+	RAM ram;
+};
+
+int main(int argc, char **argv) {
+	uint32_t passes = (argc > 1) ? (uint32_t)atoi(argv[1]) : N_PASSES;
+
+	BenchCore uncached;
+	uint64_t nUncached = 0;
+	uncached.start(passes);
+	double tUncached = bench_time([&]() { nUncached = uncached.run_uncached(); });
+
+	BenchCore cached;
+	uint64_t nCached = 0;
+	cached.start(passes);
+	double tCached = bench_time([&]() { nCached = cached.run_steps(); });
+
+	BenchCore threaded;
+	uint64_t nThreaded = 0;
+	threaded.start(passes);
+	double tThreaded = bench_time([&]() { nThreaded = threaded.run_ticks(nUncached); });
+
+	BenchCore jit;
+	uint64_t nJIT = 0;
+	bool haveJIT = jit.set_jit_enabled(true);
+	jit.start(passes);
+	double tJIT = bench_time([&]() { nJIT = jit.run_steps(); });
+
+	BenchCore aot;
+	uint64_t nAOT = 0;
+	bool haveAOT = aot.use_aot();
+	aot.start(passes);
+	double tAOT = bench_time([&]() { nAOT = aot.run_steps(); });
+
+	if (nCached != nUncached || cached.result() != uncached.result()
+			|| nThreaded != nUncached || threaded.result() != uncached.result()
+			|| threaded.get_pc() != RETURN_ADDRESS
+			|| nJIT != nUncached || jit.result() != uncached.result()
+			|| nAOT != nUncached || aot.result() != uncached.result()) {
+		printf("mismatch: %llu instructions (result 0x%08x) vs %llu (0x%08x) vs %llu (0x%08x) vs %llu (0x%08x)\n",
+				(unsigned long long)nUncached, uncached.result(),
+				(unsigned long long)nCached, cached.result(),
+				(unsigned long long)nJIT, jit.result(),
+				(unsigned long long)nAOT, aot.result());
+		return 1;
+	}
+
+	bench_report("fetch+decode every step", nUncached, tUncached, "insn");
+	bench_report("decoded-instruction cache", nCached, tCached, "insn");
+	bench_report("run() (threaded dispatch)", nThreaded, tThreaded, "insn");
+	bench_report(haveJIT ? "JIT" : "JIT (unsupported; interpreter)", nJIT, tJIT, "insn");
+	bench_report(haveAOT ? "ahead-of-time translation" : "AOT (no translation; interpreter)", nAOT, tAOT, "insn");
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "benchutil.h"
+#include "rv32core.h"
+#include "rv32_profiler.h"
+#include "rom.h"
+#include "ram.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Runs the bench_mcu_loop firmware through run() with and without a profiler,
+// interpreted and with the JIT, to see what profiling costs; then prints the hot blocks.
+
+static const uint32_t N_PASSES = 10000;
+static const uint32_t RETURN_ADDRESS = 0xDDCCDDCC;
+static const uint64_t CYCLES_PER_TICK = 100000;
+static const int N_REPEATS = 10; // alternating, keeping the fastest of each, as the timings are noisy
+
+static const uint32_t firmware[] = {
+#include "firmware/mcu_loop.hex"
+};
+
+class BenchCore : public RV32Core {
+public:
+	BenchCore() : rom(4), ram(4) {
+		std::vector<uint8_t> text(4 * 1024, 0);
+		for (uint32_t i = 0; i < sizeof(firmware) / sizeof(firmware[0]); ++i) {
+			text[4*i+0] = (uint8_t)((firmware[i] & 0x000000FF));
+			text[4*i+1] = (uint8_t)((firmware[i] & 0x0000FF00) >>  8);
+			text[4*i+2] = (uint8_t)((firmware[i] & 0x00FF0000) >> 16);
+			text[4*i+3] = (uint8_t)((firmware[i] & 0xFF000000) >> 24);
+		}
+		rom.set_contents(text.data());
+		system_bus->attach_peripheral(&rom, 0x00000000);
+		system_bus->attach_peripheral(&ram, 0x10000000);
+	}
+
+	void start(uint32_t passes) {
+		pc = 0;
+		set_register(1, RETURN_ADDRESS);
+		set_register(10, passes);
+	}
+
+	// returns the number of instructions retired
+	uint64_t run_steps() {
+		uint64_t start = instret;
+		while (pc != RETURN_ADDRESS) {
+			step();
+		}
+		return instret - start;
+	}
+
+	// run() in slices of a tick's worth of cycles, for exactly n instructions
+	uint64_t run_ticks(uint64_t n) {
+		uint64_t start = instret;
+		while (instret - start < n) {
+			run(std::min<uint64_t>(CYCLES_PER_TICK, n - (instret - start)));
+		}
+		return instret - start;
+	}
+
+	uint32_t result() const { return get_register(10); }
+
+protected:
+	ROM rom;
+	RAM ram;
+};
+
+// returns the time taken, or a negative number if the results don't match the reference
+static double run(uint32_t passes, uint64_t n, uint32_t expected, bool jit, RV32Profiler *profiler) {
+	BenchCore core;
+	if (jit && !core.set_jit_enabled(true)) {
+		return 0.0;
+	}
+	core.set_profiler(profiler);
+	core.start(passes);
+	uint64_t ran = 0;
+	double t = bench_time([&]() { ran = core.run_ticks(n); });
+	if (ran != n || core.result() != expected) {
+		return -1.0;
+	}
+	return t;
+}
+
+int main(int argc, char **argv) {
+	uint32_t passes = (argc > 1) ? (uint32_t)atoi(argv[1]) : N_PASSES;
+
+	BenchCore reference;
+	reference.start(passes);
+	uint64_t n = reference.run_steps();
+	uint32_t expected = reference.result();
+
+	for (int jit = 0; jit < 2; ++jit) {
+		RV32Profiler profiler(0x00000000, 4 * 1024);
+		double tPlain = 0.0;
+		double tProfiled = 0.0;
+		for (int i = 0; i < N_REPEATS; ++i) {
+			profiler = RV32Profiler(0x00000000, 4 * 1024);
+			double t0 = run(passes, n, expected, jit != 0, NULL);
+			double t1 = run(passes, n, expected, jit != 0, &profiler);
+			if (t0 < 0.0 || t1 < 0.0 || profiler.get_instructions() != n) {
+				printf("mismatch\n");
+				return 1;
+			}
+			tPlain = (i == 0) ? t0 : std::min(tPlain, t0);
+			tProfiled = (i == 0) ? t1 : std::min(tProfiled, t1);
+		}
+		if (tPlain == 0.0) {
+			printf("JIT unsupported\n");
+			break;
+		}
+		bench_report(jit ? "JIT, no profiler" : "interpreter, no profiler", n, tPlain, "insn");
+		bench_report(jit ? "JIT, profiled" : "interpreter, profiled", n, tProfiled, "insn");
+		printf("%-40s %10.1f%%\n", "overhead", 100.0 * (tProfiled - tPlain) / tPlain);
+		if (!jit) {
+			printf("%llu samples\n", (unsigned long long)profiler.get_samples());
+			profiler.write_hot_blocks(std::cout, 5);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include "benchutil.h"
+#include "rom.h"
+#include "rom_image.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Loads the same 64 KB firmware into many ROMs: with a private malloc'd copy each
+// (as ROM::set_contents() originally did) and through the shared image store.
+
+static const uint32_t N_ROMS = 10000;
+static const uint32_t N_PAGES = 64;
+
+int main() {
+	std::vector<uint8_t> firmware(N_PAGES * 1024);
+	for (size_t i = 0; i < firmware.size(); ++i) {
+		firmware[i] = (uint8_t)(i * 2654435761u >> 24);
+	}
+
+	std::vector<uint8_t*> copies(N_ROMS);
+	double tCopied = bench_time([&]() {
+		for (uint32_t i = 0; i < N_ROMS; ++i) {
+			copies[i] = (uint8_t*)malloc(firmware.size());
+			memcpy(copies[i], firmware.data(), firmware.size());
+		}
+	});
+	uint64_t copiedBytes = (uint64_t)N_ROMS * firmware.size();
+	for (uint32_t i = 0; i < N_ROMS; ++i) {
+		free(copies[i]);
+	}
+
+	std::vector<ROM*> roms(N_ROMS);
+	double tShared = bench_time([&]() {
+		ROMImage *image = ROMImage::acquire(firmware.data(), firmware.size());
+		for (uint32_t i = 0; i < N_ROMS; ++i) {
+			roms[i] = new ROM(image);
+		}
+		image->release();
+	});
+	uint64_t sharedBytes = ROMImage::get_total_size();
+	for (uint32_t i = 0; i < N_ROMS; ++i) {
+		delete roms[i];
+	}
+
+	bench_report("private copy per ROM", N_ROMS, tCopied, "ROM");
+	printf("%-40s %10.1f MB\n", "  firmware held", copiedBytes / 1048576.0);
+	bench_report("shared ROM image", N_ROMS, tShared, "ROM");
+	printf("%-40s %10.1f MB\n", "  firmware held", sharedBytes / 1048576.0);
+	return 0;
+}
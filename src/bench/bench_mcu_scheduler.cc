@@ -0,0 +1,116 @@
+#include "benchutil.h"
+#include "rv32core.h"
+#include "rom.h"
+#include "mcu_scheduler.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Thousands of MCUs scheduled with the same budget every tick, on 1 worker thread and more:
+// a few of them busy all the time and the rest waiting for input, which arrives
+// at a handful of them each tick. Reports the time per tick at the median and the tail,
+// and checks that every thread count gets the same results.
+
+static const uint32_t N_MCUS = 4000;
+static const uint32_t N_TICKS = 200;
+static const uint64_t CYCLES_PER_TICK = 1000;
+static const uint32_t INPUT_BASE = 0x40000000;
+
+// x31 is the input register; the MCU does some work for each input,
+// or all the time if x30 is set, and keeps a checksum in x6
+static const uint32_t firmware[] = {
+	0x000fa283, // poll: lw x5, 0(x31)
+	0x000f1463, // bnez x30, work
+	0xfe028ce3, // beqz x5, poll
+	0x000fa023, // work: sw x0, 0(x31)
+	0x06400393, // li x7, 100
+	0x00d31293, // loop: slli x5, x6, 13
+	0x00534333, // xor x6, x6, x5
+	0x01135293, // srli x5, x6, 17
+	0x00534333, // xor x6, x6, x5
+	0xfff38393, // addi x7, x7, -1
+	0xfe0396e3, // bnez x7, loop
+	0xfd5ff06f, // j poll
+};
+
+// a register that the host sets and the MCU clears
+class InputRegister : public SystemBusPeripheral {
+public:
+	InputRegister() : value(0) {}
+	uint32_t get_number_of_pages() const { return 1; }
+	uint8_t read_byte(uint32_t pAddr) { return (uint8_t)value; }
+	uint16_t read_halfword(uint32_t pAddr) { return (uint16_t)value; }
+	uint32_t read_word(uint32_t pAddr) { return value; }
+	void write_byte(uint32_t pAddr, uint8_t v) { value = v; }
+	void write_halfword(uint32_t pAddr, uint16_t v) { value = v; }
+	void write_word(uint32_t pAddr, uint32_t v) { value = v; }
+	void cycle() {}
+	void timestep() {}
+
+	void set(uint32_t v) { value = v; changed(); }
+	uint32_t value;
+};
+
+class SchedulerBenchMCU : public RV32Core {
+public:
+	SchedulerBenchMCU(uint32_t seed, bool busy) : rom(1) {
+		std::vector<uint8_t> text(1024, 0);
+		memcpy(text.data(), firmware, sizeof(firmware));
+		rom.set_contents(text.data());
+		system_bus->attach_peripheral(&rom, 0);
+		system_bus->attach_peripheral(&input, INPUT_BASE);
+		xRegister[31] = INPUT_BASE;
+		xRegister[30] = busy ? 1 : 0;
+		xRegister[6] = seed;
+		set_spin_detection(true);
+	}
+	uint32_t checksum() const { return xRegister[6]; }
+
+	ROM rom;
+	InputRegister input;
+};
+
+static uint64_t run(uint32_t workers) {
+	std::vector<SchedulerBenchMCU*> mcus(N_MCUS);
+	MCUScheduler scheduler;
+	scheduler.set_worker_threads(workers);
+	for (uint32_t i = 0; i < N_MCUS; ++i) {
+		mcus[i] = new SchedulerBenchMCU(i + 1, i % 100 == 0);
+		scheduler.add_core(mcus[i]);
+	}
+	double t = bench_time([&]() {
+		for (uint32_t tick = 0; tick < N_TICKS; ++tick) {
+			for (uint32_t i = tick % 20; i < N_MCUS; i += 20) {
+				mcus[i]->input.set(1);
+			}
+			scheduler.tick(CYCLES_PER_TICK);
+		}
+	});
+
+	uint64_t checksum = 0;
+	uint64_t ran = 0;
+	for (uint32_t i = 0; i < N_MCUS; ++i) {
+		checksum = checksum * 31 + mcus[i]->checksum() + mcus[i]->get_cycle();
+		ran += scheduler.get_cycles_run(i);
+		delete mcus[i];
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "%u worker thread(s)", scheduler.get_worker_threads());
+	bench_report(name, ran, t, "insn");
+	printf("  tick time: median %.3f ms, p99 %.3f ms, worst %.3f ms\n",
+			scheduler.get_tick_time(50) * 1e3, scheduler.get_tick_time(99) * 1e3,
+			scheduler.get_tick_time(100) * 1e3);
+	return checksum;
+}
+
+int main() {
+	printf("%u MCUs, %u ticks of %u cycles, %u hardware threads\n", N_MCUS, N_TICKS,
+			(unsigned)CYCLES_PER_TICK, std::thread::hardware_concurrency());
+	uint64_t serial = run(1);
+	bool same = run(2) == serial;
+	same = run(0) == serial && same;
+	printf("results %s\n", same ? "match" : "DIFFER");
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include "benchutil.h"
+#include "rv32core.h"
+#include "rom.h"
+#include "interrupt_controller.h"
+#include "timer.h"
+#include "mcu_scheduler.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// A population of MCUs that mostly wait for an input register to be set, then handle it:
+// scheduled with every core spinning through its whole budget, and with spin detection
+// putting the waiting cores to sleep. Then MCUs that wait for a fixed delay over and over:
+// by busy-waiting on the cycle CSR, and by sleeping until their timer goes off.
+
+static const uint32_t N_MCUS = 1000;
+static const uint32_t N_TICKS = 200;
+static const uint64_t CYCLES_PER_TICK = 2000;
+static const uint32_t DELAY = 5000;
+static const uint32_t INPUT_BASE = 0x40000000;
+static const uint32_t INTERRUPTS_BASE = 0x40001000;
+static const uint32_t TIMER_BASE = 0x40002000;
+
+// x31 is the input register (or the interrupt controller), x30 the timer and x7 the delay;
+// each counts the events it handled in x6
+static const uint32_t polling[] = {
+	0x000fa283, // poll: lw x5, 0(x31)
+	0xfe028ee3, // beqz x5, poll
+	0x000fa023, // sw x0, 0(x31)
+	0x00130313, // addi x6, x6, 1
+	0xff1ff06f, // j poll
+};
+
+static const uint32_t busyWaiting[] = {
+	0xc00022f3, // delay: csrr x5, cycle
+	0x007282b3, // add x5, x5, x7
+	0xc00024f3, // wait: csrr x9, cycle
+	0xfe54eee3, // bltu x9, x5, wait
+	0x00130313, // addi x6, x6, 1
+	0xfedff06f, // j delay
+};
+
+static const uint32_t timerWaiting[] = {
+	0xc00022f3, // delay: csrr x5, cycle
+	0x007282b3, // add x5, x5, x7
+	0x000f2223, // sw x0, COMPAREH(x30)
+	0x005f2023, // sw x5, COMPARE(x30)
+	0x10500073, // wfi
+	0x008fa403, // lw x8, CLAIM(x31)
+	0x00130313, // addi x6, x6, 1
+	0xfe5ff06f, // j delay
+};
+
+// a register that the host sets and the MCU clears
+class InputRegister : public SystemBusPeripheral {
+public:
+	InputRegister() : value(0) {}
+	uint32_t get_number_of_pages() const { return 1; }
+	uint8_t read_byte(uint32_t pAddr) { return (uint8_t)value; }
+	uint16_t read_halfword(uint32_t pAddr) { return (uint16_t)value; }
+	uint32_t read_word(uint32_t pAddr) { return value; }
+	void write_byte(uint32_t pAddr, uint8_t v) { value = v; }
+	void write_halfword(uint32_t pAddr, uint16_t v) { value = v; }
+	void write_word(uint32_t pAddr, uint32_t v) { value = v; }
+	void cycle() {}
+	void timestep() {}
+
+	void set(uint32_t v) { value = v; changed(); }
+	uint32_t value;
+};
+
+class SleepBenchMCU : public RV32Core {
+public:
+	SleepBenchMCU(const uint32_t *firmware, size_t size, bool spinDetection)
+	: rom(1), timer(&interrupts, 0) {
+		std::vector<uint8_t> text(1024, 0);
+		memcpy(text.data(), firmware, size);
+		rom.set_contents(text.data());
+		system_bus->attach_peripheral(&rom, 0);
+		system_bus->attach_peripheral(&input, INPUT_BASE);
+		system_bus->attach_peripheral(&interrupts, INTERRUPTS_BASE);
+		system_bus->attach_peripheral(&timer, TIMER_BASE);
+		set_interrupt_controller(&interrupts);
+		interrupts.write_word(INTERRUPTS_BASE + InterruptController::ENABLE, 1);
+		xRegister[31] = (firmware == polling) ? INPUT_BASE : INTERRUPTS_BASE;
+		xRegister[30] = TIMER_BASE;
+		xRegister[7] = DELAY;
+		set_spin_detection(spinDetection);
+	}
+	uint32_t handled() const { return xRegister[6]; }
+
+	ROM rom;
+	InputRegister input;
+	InterruptController interrupts;
+	Timer timer;
+};
+
+static double run(const uint32_t *firmware, size_t size, bool spinDetection, const char *name) {
+	std::vector<SleepBenchMCU*> mcus(N_MCUS);
+	MCUScheduler scheduler;
+	for (uint32_t i = 0; i < N_MCUS; ++i) {
+		mcus[i] = new SleepBenchMCU(firmware, size, spinDetection);
+		scheduler.add_core(mcus[i]);
+	}
+	double t = bench_time([&]() {
+		for (uint32_t tick = 0; tick < N_TICKS; ++tick) {
+			// a few inputs arrive every tick
+			for (uint32_t i = tick % 50; i < N_MCUS; i += 50) {
+				mcus[i]->input.set(1);
+			}
+			scheduler.tick(CYCLES_PER_TICK);
+		}
+	});
+
+	uint64_t handled = 0;
+	double ratio = 0.0;
+	for (uint32_t i = 0; i < N_MCUS; ++i) {
+		handled += mcus[i]->handled();
+		ratio += scheduler.get_sleep_ratio(i);
+		delete mcus[i];
+	}
+	bench_report(name, (uint64_t)N_MCUS * N_TICKS * CYCLES_PER_TICK, t, "cycle");
+	printf("  %u events handled, mean sleep ratio %.3f\n", (unsigned)handled, ratio / N_MCUS);
+	return t;
+}
+
+int main() {
+	double tSpinning = run(polling, sizeof(polling), false, "polling cores spin");
+	double tSleeping = run(polling, sizeof(polling), true, "polling cores sleep");
+	printf("%-40s %10.1fx\n", "speedup", tSpinning / tSleeping);
+	double tBusy = run(busyWaiting, sizeof(busyWaiting), false, "delays busy-wait");
+	double tTimer = run(timerWaiting, sizeof(timerWaiting), false, "delays sleep until the timer");
+	printf("%-40s %10.1fx\n", "speedup", tBusy / tTimer);
+	return 0;
+}
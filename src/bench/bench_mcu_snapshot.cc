@@ -0,0 +1,66 @@
+#include "benchutil.h"
+#include "system_bus.h"
+#include "ram.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Checkpoints a 256 KB RAM after every burst of a few stores: by copying all of it
+// (as a save had to before) and with copy-on-write snapshots.
+
+static const uint32_t N_SNAPSHOTS = 20000;
+static const uint32_t N_PAGES = 256;
+static const uint32_t STORES_PER_SNAPSHOT = 16;
+static const uint32_t RAM_BASE = 0x10000000;
+
+int main() {
+	std::mt19937 rng(42);
+	std::vector<uint32_t> addresses(N_SNAPSHOTS * STORES_PER_SNAPSHOT);
+	for (size_t i = 0; i < addresses.size(); ++i) {
+		// mostly to a few hot pages, like a stack and some globals
+		uint32_t page = (rng() % 4 == 0) ? rng() % N_PAGES : rng() % 4;
+		addresses[i] = RAM_BASE + page * 1024 + (rng() % 256) * 4;
+	}
+
+	RAM copiedRam(N_PAGES);
+	SystemBus copiedBus;
+	copiedBus.attach_peripheral(&copiedRam, RAM_BASE);
+	std::vector<uint8_t> copy(N_PAGES * 1024);
+	double tCopied = bench_time([&]() {
+		for (uint32_t i = 0; i < N_SNAPSHOTS; ++i) {
+			for (uint32_t j = 0; j < STORES_PER_SNAPSHOT; ++j) {
+				copiedBus.store_word(addresses[i * STORES_PER_SNAPSHOT + j], i);
+			}
+			for (uint32_t p = 0; p < N_PAGES; ++p) {
+				memcpy(copy.data() + 1024 * p, copiedRam.get_readable_pages()[p], 1024);
+			}
+			bench_keep(copy[0]);
+		}
+	});
+
+	RAM cowRam(N_PAGES);
+	SystemBus cowBus;
+	cowBus.attach_peripheral(&cowRam, RAM_BASE);
+	PeripheralSnapshot *last = NULL;
+	uint64_t pagesCopied = 0;
+	double tCOW = bench_time([&]() {
+		for (uint32_t i = 0; i < N_SNAPSHOTS; ++i) {
+			for (uint32_t j = 0; j < STORES_PER_SNAPSHOT; ++j) {
+				cowBus.store_word(addresses[i * STORES_PER_SNAPSHOT + j], i);
+			}
+			pagesCopied += cowRam.get_dirty_pages().size();
+			delete last;
+			last = cowRam.save_state();
+		}
+	});
+	delete last;
+
+	bench_report("copy all of RAM", N_SNAPSHOTS, tCopied, "snapshot");
+	printf("%-40s %10.1f KB\n", "  copied per snapshot", (double)N_PAGES);
+	bench_report("copy-on-write snapshot", N_SNAPSHOTS, tCOW, "snapshot");
+	printf("%-40s %10.1f KB\n", "  copied per snapshot", (double)pagesCopied / N_SNAPSHOTS);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#include "benchutil.h"
+#include "system_bus.h"
+#include "ram.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Builds a population of MCUs that each declare 64 KB of RAM but only use a stack page
+// and a page of globals, and reports how much of the declared RAM is actually allocated.
+
+static const uint32_t N_MCUS = 10000;
+static const uint32_t N_PAGES = 64;
+static const uint32_t RAM_BASE = 0x10000000;
+
+int main() {
+	std::vector<RAM*> rams(N_MCUS);
+	std::vector<SystemBus*> buses(N_MCUS);
+	double t = bench_time([&]() {
+		for (uint32_t i = 0; i < N_MCUS; ++i) {
+			rams[i] = new RAM(N_PAGES);
+			buses[i] = new SystemBus();
+			buses[i]->attach_peripheral(rams[i], RAM_BASE);
+			buses[i]->store_word(RAM_BASE + 64, i);
+			buses[i]->store_word(RAM_BASE + N_PAGES * 1024 - 16, i);
+		}
+	});
+
+	uint64_t declared = 0, resident = 0;
+	for (uint32_t i = 0; i < N_MCUS; ++i) {
+		declared += rams[i]->get_declared_size();
+		resident += rams[i]->get_resident_size();
+		delete buses[i];
+		delete rams[i];
+	}
+
+	bench_report("create RAM and touch two pages", N_MCUS, t, "MCU");
+	printf("%-40s %10.1f MB\n", "  declared", declared / 1048576.0);
+	printf("%-40s %10.1f MB\n", "  resident", resident / 1048576.0);
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include "benchutil.h"
+#include "voxel_store.h"
+#include "vector.h"
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Compares insert and lookup throughput of the chunked VoxelStore
+// against the hash map of hash sets that World used previously.
+
+typedef std::unordered_map<Vector, std::unordered_set<VoxelOccupant*> > VoxelMap;
+
+static const uint32_t WORLD_DIM = 512;
+static const uint32_t N_MACHINES = 16384;
+static const uint32_t MACHINE_MAX_Z = 16;
+static const uint32_t N_LOOKUPS = 1 << 23;
+
+int main(int argc, char **argv) {
+	std::default_random_engine rng(12345);
+	std::uniform_int_distribution<int32_t> xyDist(0, WORLD_DIM - 1);
+	std::uniform_int_distribution<int32_t> zDist(1, MACHINE_MAX_Z);
+
+	// one bedrock layer plus a scattering of machines above it
+	std::vector<Vector> positions;
+	positions.reserve(WORLD_DIM * WORLD_DIM + N_MACHINES);
+	for (uint32_t y = 0; y < WORLD_DIM; ++y) {
+		for (uint32_t x = 0; x < WORLD_DIM; ++x) {
+			positions.push_back(Vector(x, y, 0));
+		}
+	}
+	for (uint32_t i = 0; i < N_MACHINES; ++i) {
+		positions.push_back(Vector(xyDist(rng), xyDist(rng), zDist(rng)));
+	}
+	std::vector<BenchOccupant> occupants(positions.size());
+
+	std::vector<Vector> queries;
+	queries.reserve(N_LOOKUPS);
+	std::uniform_int_distribution<int32_t> queryZDist(0, MACHINE_MAX_Z);
+	for (uint32_t i = 0; i < N_LOOKUPS; ++i) {
+		queries.push_back(Vector(xyDist(rng), xyDist(rng), queryZDist(rng)));
+	}
+
+	VoxelMap *map = new VoxelMap();
+	double mapInsert = bench_time([&]() {
+		for (size_t i = 0; i < positions.size(); ++i) {
+			(*map)[positions[i]].insert(&occupants[i]);
+		}
+	});
+	uint64_t mapFound = 0;
+	double mapLookup = bench_time([&]() {
+		for (const Vector &q : queries) {
+			VoxelMap::const_iterator it = map->find(q);
+			if (it != map->end()) {
+				mapFound += it->second.size();
+			}
+		}
+	});
+	double mapErase = bench_time([&]() {
+		for (size_t i = 0; i < positions.size(); ++i) {
+			(*map)[positions[i]].erase(&occupants[i]);
+		}
+	});
+	delete map;
+
+	VoxelStore *store = new VoxelStore(WORLD_DIM, WORLD_DIM);
+	double storeInsert = bench_time([&]() {
+		for (size_t i = 0; i < positions.size(); ++i) {
+			store->insert(positions[i], &occupants[i], 0);
+		}
+	});
+	uint64_t storeFound = 0;
+	double storeLookup = bench_time([&]() {
+		for (const Vector &q : queries) {
+			const VoxelCell *cell = store->find(q);
+			if (cell != NULL) {
+				storeFound += cell->size();
+			}
+		}
+	});
+	size_t chunks = store->get_number_of_chunks();
+	double storeErase = bench_time([&]() {
+		for (size_t i = 0; i < positions.size(); ++i) {
+			store->erase(positions[i], &occupants[i]);
+		}
+	});
+	delete store;
+
+	bench_keep(mapFound);
+	bench_keep(storeFound);
+	if (mapFound != storeFound) {
+		printf("MISMATCH: map found %lu occupants, store found %lu\n",
+				(unsigned long)mapFound, (unsigned long)storeFound);
+		return 1;
+	}
+
+	printf("%u x %u world, %lu occupants, %u lookups, %lu chunks\n", WORLD_DIM, WORLD_DIM,
+			(unsigned long)positions.size(), N_LOOKUPS, (unsigned long)chunks);
+	bench_report("insert (unordered_map)", positions.size(), mapInsert, "ops");
+	bench_report("insert (VoxelStore)", positions.size(), storeInsert, "ops");
+	bench_report("lookup (unordered_map)", N_LOOKUPS, mapLookup, "ops");
+	bench_report("lookup (VoxelStore)", N_LOOKUPS, storeLookup, "ops");
+	bench_report("erase (unordered_map)", positions.size(), mapErase, "ops");
+	bench_report("erase (VoxelStore)", positions.size(), storeErase, "ops");
+	return 0;
+}
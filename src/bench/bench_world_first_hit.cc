@@ -0,0 +1,108 @@
+#include "benchutil.h"
+#include "world.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+// Compares ways of finding the first blocking occupant along a ray:
+// raycast() followed by get_occupants() on each voxel, trace_ray() with
+// occupants_at() on each voxel, and first_hit().
+
+static const uint32_t WORLD_DIM = 512;
+static const uint32_t DEFAULT_N_BLOCKS = 2000;
+static const uint32_t N_RAYS = 1 << 16;
+static const int32_t MAX_LENGTH = 256;
+static const int32_t CLUSTER_SIZE = 32;
+static const uint32_t BLOCKS_PER_CLUSTER = 200;
+
+static bool blocks(const VoxelOccupant *occ) {
+	return occ->impedesXYMovement() || occ->impedesZMovement();
+}
+
+int main(int argc, char **argv) {
+	uint32_t nBlocks = DEFAULT_N_BLOCKS;
+	if (argc > 1) {
+		nBlocks = (uint32_t)atoi(argv[1]);
+	}
+	std::default_random_engine rng(12345);
+	std::uniform_int_distribution<int32_t> xyDist(0, WORLD_DIM - 1);
+	std::uniform_int_distribution<int32_t> blockZDist(1, 8);
+	std::uniform_int_distribution<int32_t> rayZDist(1, 24);
+	std::uniform_int_distribution<int32_t> dDist(-MAX_LENGTH, MAX_LENGTH);
+	std::uniform_int_distribution<int32_t> dzDist(-4, 4);
+
+	World *world = new World(WORLD_DIM, WORLD_DIM);
+	int32_t clusterX = 0, clusterY = 0;
+	world->create_bedrock_layer();
+	// blocks are built in clusters, like machines around a few bases
+	std::uniform_int_distribution<int32_t> clusterDist(0, WORLD_DIM - CLUSTER_SIZE);
+	std::uniform_int_distribution<int32_t> offsetDist(0, CLUSTER_SIZE - 1);
+	for (uint32_t i = 0; i < nBlocks; ++i) {
+		if (i % BLOCKS_PER_CLUSTER == 0) {
+			clusterX = clusterDist(rng);
+			clusterY = clusterDist(rng);
+		}
+		BenchOccupant *block = new BenchOccupant(true);
+		Vector position(clusterX + offsetDist(rng), clusterY + offsetDist(rng), blockZDist(rng));
+		if (!world->add_occupant(position, Vector(0,0,0), block)) delete block;
+	}
+	std::vector<Ray> rays;
+	for (uint32_t i = 0; i < N_RAYS; ++i) {
+		rays.push_back(Ray(Vector(xyDist(rng), xyDist(rng), rayZDist(rng)), Vector(dDist(rng), dDist(rng), dzDist(rng))));
+	}
+
+	uint64_t setHits = 0;
+	double setTime = bench_time([&]() {
+		for (const Ray &ray : rays) {
+			std::vector<Vector> voxels = world->raycast(ray.origin, ray.direction);
+			for (const Vector &v : voxels) {
+				bool hit = false;
+				for (VoxelOccupant *occ : world->get_occupants(v)) {
+					if (blocks(occ)) hit = true;
+				}
+				if (hit) {
+					++setHits;
+					break;
+				}
+			}
+		}
+	});
+	uint64_t traceHits = 0;
+	double traceTime = bench_time([&]() {
+		for (const Ray &ray : rays) {
+			world->trace_ray(ray.origin, ray.direction, [&](const Vector &v) {
+				for (VoxelOccupant *occ : world->occupants_at(v)) {
+					if (blocks(occ)) {
+						++traceHits;
+						return false;
+					}
+				}
+				return true;
+			});
+		}
+	});
+	uint64_t firstHits = 0;
+	double firstHitTime = bench_time([&]() {
+		for (const Ray &ray : rays) {
+			Vector hit(0,0,0);
+			if (world->first_hit(ray.origin, ray.direction, hit) != NULL) {
+				++firstHits;
+			}
+		}
+	});
+
+	printf("%u blocks\n", nBlocks);
+	bench_report("raycast() + get_occupants()", N_RAYS, setTime, "rays");
+	bench_report("trace_ray() + occupants_at()", N_RAYS, traceTime, "rays");
+	bench_report("first_hit()", N_RAYS, firstHitTime, "rays");
+	printf("%llu of %u rays hit something\n", (unsigned long long)firstHits, N_RAYS);
+	if (setHits != firstHits || traceHits != firstHits) {
+		printf("results differ!\n");
+		return 1;
+	}
+	delete world;
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include "benchutil.h"
+#include "world.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Measures how World::timestep() scales with the number of worker threads
+// when most of a tick is spent in occupants' preprocess() methods.
+
+static const uint32_t WORLD_DIM = 256;
+static const uint32_t N_PROCESSORS = 4096;
+static const uint32_t TICKS = 50;
+
+// Stands in for a machine running its microcontroller for one timestep.
+class BenchProcessor : public BenchOccupant {
+public:
+	BenchProcessor(uint32_t work) : work(work), state(work) {}
+	virtual bool requires_preprocessing() const { return true; }
+	virtual void preprocess() {
+		uint64_t x = state;
+		for (uint32_t i = 0; i < work; ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+		}
+		state = x;
+	}
+	uint64_t get_state() const { return state; }
+protected:
+	uint32_t work;
+	uint64_t state;
+};
+
+int main(int argc, char **argv) {
+	uint32_t maxThreads = std::thread::hardware_concurrency();
+	if (argc > 1) {
+		maxThreads = (uint32_t)atoi(argv[1]);
+	}
+	if (maxThreads == 0) maxThreads = 1;
+
+	printf("%u preprocessing occupants, %u ticks per run\n", N_PROCESSORS, TICKS);
+	double singleThreaded = 0.0;
+	for (uint32_t threads = 1; threads <= maxThreads; threads *= 2) {
+		World *world = new World(WORLD_DIM, WORLD_DIM);
+		world->set_worker_threads(threads);
+		for (uint32_t i = 0; i < N_PROCESSORS; ++i) {
+			// a few processors are much busier than the rest
+			uint32_t work = (i % 64 == 0) ? 20000 : 2000;
+			Vector position(i % WORLD_DIM, i / WORLD_DIM, 1);
+			world->add_occupant(position, Vector(0,0,0), new BenchProcessor(work));
+		}
+		double seconds = bench_time([&]() {
+			for (uint32_t t = 0; t < TICKS; ++t) {
+				world->timestep();
+			}
+		});
+		if (threads == 1) {
+			singleThreaded = seconds;
+		}
+		printf("%3u threads: %10.2f ticks/s  (speedup %.2fx)\n",
+				threads, TICKS / seconds, singleThreaded / seconds);
+		delete world;
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include "benchutil.h"
+#include "world.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Compares World::raycast() as it was originally written (fmod-based boundary
+// crossings, a vector per ray that is then copied) with trace_ray() and the batch raycast().
+
+static const uint32_t WORLD_DIM = 512;
+static const uint32_t N_RAYS = 1 << 20;
+static const int32_t MAX_LENGTH = 32;
+
+static double old_intbound(double s, double ds) {
+	if (ds < 0.0) {
+		return old_intbound(-s, -ds);
+	} else {
+		s = fmod(s, 1.0);
+		return (1.0 - s) / ds;
+	}
+}
+
+static int old_sgn(int val) {
+	return (0 < val) - (val < 0);
+}
+
+static std::vector<Vector> old_raycast(const World *w, Vector origin, Vector direction) {
+	std::vector<Vector> visitedVoxels;
+	int x = origin.getX();
+	int y = origin.getY();
+	int z = origin.getZ();
+	int dx = direction.getX();
+	int dy = direction.getY();
+	int dz = direction.getZ();
+	int stepX = old_sgn(dx);
+	int stepY = old_sgn(dy);
+	int stepZ = old_sgn(dz);
+	double tMaxX = old_intbound(x + 0.5, dx);
+	double tMaxY = old_intbound(y + 0.5, dy);
+	double tMaxZ = old_intbound(z + 0.5, dz);
+	double tDeltaX = (double)(stepX) / (double)(dx);
+	double tDeltaY = (double)(stepY) / (double)(dy);
+	double tDeltaZ = (double)(stepZ) / (double)(dz);
+	if (dx == 0 && dy == 0 && dz == 0) {
+		return visitedVoxels;
+	}
+	Vector destination = origin + direction;
+	while (true) {
+		if (tMaxX < tMaxY) {
+			if (tMaxX < tMaxZ) {
+				x += stepX;
+				tMaxX += tDeltaX;
+			} else {
+				z += stepZ;
+				tMaxZ += tDeltaZ;
+			}
+		} else {
+			if (tMaxY < tMaxZ) {
+				y += stepY;
+				tMaxY += tDeltaY;
+			} else {
+				z += stepZ;
+				tMaxZ += tDeltaZ;
+			}
+		}
+		Vector nextVoxel(x, y, z);
+		if (!w->location_in_bounds(nextVoxel)) break;
+		visitedVoxels.push_back(nextVoxel);
+		if (nextVoxel == destination) break;
+	}
+	return std::vector<Vector>(visitedVoxels);
+}
+
+int main(int argc, char **argv) {
+	std::default_random_engine rng(12345);
+	std::uniform_int_distribution<int32_t> xyDist(MAX_LENGTH, WORLD_DIM - MAX_LENGTH - 1);
+	std::uniform_int_distribution<int32_t> zDist(MAX_LENGTH, 2 * MAX_LENGTH);
+	// positive directions only, so that every ray ends at its destination
+	std::uniform_int_distribution<int32_t> dDist(0, MAX_LENGTH);
+	std::vector<Ray> rays;
+	rays.reserve(N_RAYS);
+	for (uint32_t i = 0; i < N_RAYS; ++i) {
+		rays.push_back(Ray(Vector(xyDist(rng), xyDist(rng), zDist(rng)), Vector(dDist(rng), dDist(rng), dDist(rng))));
+	}
+	World *world = new World(WORLD_DIM, WORLD_DIM);
+
+	uint64_t oldVoxels = 0;
+	double oldTime = bench_time([&]() {
+		for (const Ray &ray : rays) {
+			std::vector<Vector> voxels = old_raycast(world, ray.origin, ray.direction);
+			oldVoxels += voxels.size();
+		}
+	});
+	uint64_t traceVoxels = 0;
+	double traceTime = bench_time([&]() {
+		for (const Ray &ray : rays) {
+			world->trace_ray(ray.origin, ray.direction, [&](const Vector &v) {
+				++traceVoxels;
+				return true;
+			});
+		}
+	});
+	std::vector<Vector> voxels;
+	std::vector<size_t> firstVoxel;
+	// once to size the buffers, then again as a caller reusing them would
+	world->raycast(rays, voxels, firstVoxel);
+	double batchTime = bench_time([&]() {
+		world->raycast(rays, voxels, firstVoxel);
+	});
+
+	bench_report("original raycast()", oldVoxels, oldTime, "voxels");
+	bench_report("trace_ray()", traceVoxels, traceTime, "voxels");
+	bench_report("batch raycast(), reused buffers", voxels.size(), batchTime, "voxels");
+	if (oldVoxels != traceVoxels || oldVoxels != voxels.size()) {
+		printf("results differ!\n");
+		return 1;
+	}
+	delete world;
+	return 0;
+}
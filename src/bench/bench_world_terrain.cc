@@ -0,0 +1,66 @@
+#include "benchutil.h"
+#include "world.h"
+#include "structures.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Compares building a bedrock layer out of one Bedrock occupant per column,
+// as World::create_bedrock_layer() used to, with the implicit terrain layer.
+
+static const uint32_t DEFAULT_WORLD_DIM = 1024;
+
+// resident set size of this process, in kB
+static long current_rss_kb() {
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) return 0;
+	char line[256];
+	long rss = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			rss = atol(line + 6);
+			break;
+		}
+	}
+	fclose(f);
+	return rss;
+}
+
+int main(int argc, char **argv) {
+	uint32_t dim = DEFAULT_WORLD_DIM;
+	if (argc > 1) {
+		dim = (uint32_t)atoi(argv[1]);
+	}
+	uint64_t columns = (uint64_t)dim * dim;
+	printf("%ux%u world\n", dim, dim);
+
+	long rssBefore = current_rss_kb();
+	World *implicit = NULL;
+	double implicitTime = bench_time([&]() {
+		implicit = new World(dim, dim);
+		implicit->create_bedrock_layer();
+	});
+	long implicitRss = current_rss_kb() - rssBefore;
+	bench_keep(implicit);
+	bench_report("implicit bedrock layer", columns, implicitTime, "columns");
+	delete implicit;
+
+	rssBefore = current_rss_kb();
+	World *explicitWorld = NULL;
+	double explicitTime = bench_time([&]() {
+		explicitWorld = new World(dim, dim);
+		for (uint32_t y = 0; y < dim; ++y) {
+			for (uint32_t x = 0; x < dim; ++x) {
+				explicitWorld->add_occupant(Vector(x, y, 0), Vector(0, 0, 0), new Bedrock());
+			}
+		}
+	});
+	long explicitRss = current_rss_kb() - rssBefore;
+	bench_keep(explicitWorld);
+	bench_report("one Bedrock occupant per column", columns, explicitTime, "columns");
+	delete explicitWorld;
+
+	printf("memory: implicit %ld kB, per-column occupants %ld kB\n", implicitRss, explicitRss);
+	return 0;
+}
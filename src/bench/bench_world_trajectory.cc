@@ -0,0 +1,131 @@
+#include "benchutil.h"
+#include "world.h"
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+// Compares World::calculate_trajectory(), which tests the cached voxel traits,
+// with the same checks made through each occupant's virtual methods,
+// as calculate_trajectory() used to.
+
+static const uint32_t WORLD_DIM = 256;
+static const uint32_t N_BLOCKS = 16384;
+static const uint32_t N_FLOORS = 16384;
+static const uint32_t N_MOVERS = 4096;
+static const uint32_t TRAJECTORY_LENGTH = 8;
+static const uint32_t ROUNDS = 50;
+
+// Walks on top of things, like a robot.
+class BenchMover : public BenchOccupant {
+public:
+	BenchMover() : BenchOccupant(false) {}
+	virtual bool needsSupport() const { return true; }
+	virtual bool canMove() const { return true; }
+};
+
+// Shares its voxel and holds up anything standing in it.
+class BenchFloor : public BenchOccupant {
+public:
+	BenchFloor() : BenchOccupant(false) {}
+	virtual bool supportsOthers() const { return true; }
+};
+
+// The obstacle and support checks of calculate_trajectory(), one virtual call per occupant,
+// including the pass over the current position that the ramp TODO used to make.
+static Vector reference_trajectory(const World *w, const VoxelOccupant *obj, const std::vector<Vector> &traj) {
+	std::deque<Vector> trajectory;
+	trajectory.push_back(obj->get_position());
+	trajectory.insert(trajectory.end(), traj.begin(), traj.end());
+	Vector currentPosition = obj->get_position();
+	while (!trajectory.empty()) {
+		Vector nextPosition = trajectory.front(); trajectory.pop_front();
+		Vector deltaP = nextPosition - currentPosition;
+		bool moveXY = deltaP.getX() != 0 || deltaP.getY() != 0;
+		bool moveZ = deltaP.getZ() != 0;
+		w->for_each_occupant(currentPosition, obj->get_extents(), [&](VoxelOccupant *occ) {});
+		VoxelOccupant *obstacle = w->find_occupant(nextPosition, obj->get_extents(), [&](VoxelOccupant *occ) {
+			if (occ == obj) return false;
+			return (moveXY && occ->impedesXYMovement()) || (moveZ && occ->impedesZMovement());
+		});
+		if (obstacle != NULL) break;
+		if (obj->needsSupport()) {
+			Vector footprintSize(obj->get_extents().getX(), obj->get_extents().getY(), 1);
+			bool isSupported = w->find_occupant(nextPosition, footprintSize, [](VoxelOccupant *occ) {
+				return occ->supportsOthers();
+			}) != NULL;
+			if (!isSupported) {
+				Vector belowNewPosition = nextPosition - Vector(0, 0, 1);
+				bool canMoveDown = w->find_occupant(belowNewPosition, footprintSize, [](VoxelOccupant *occ) {
+					return occ->impedesZMovement();
+				}) == NULL;
+				bench_keep(canMoveDown);
+			}
+		}
+		currentPosition = nextPosition;
+	}
+	return currentPosition;
+}
+
+int main(int argc, char **argv) {
+	std::default_random_engine rng(12345);
+	std::uniform_int_distribution<int32_t> xyDist(0, WORLD_DIM - 1);
+	std::uniform_int_distribution<int32_t> stepDist(-1, 1);
+
+	World *world = new World(WORLD_DIM, WORLD_DIM);
+	world->create_bedrock_layer();
+	for (uint32_t i = 0; i < N_BLOCKS; ++i) {
+		BenchOccupant *block = new BenchOccupant(true);
+		if (!world->add_occupant(Vector(xyDist(rng), xyDist(rng), 1), Vector(0,0,0), block)) delete block;
+	}
+	for (uint32_t i = 0; i < N_FLOORS; ++i) {
+		BenchFloor *floor = new BenchFloor();
+		if (!world->add_occupant(Vector(xyDist(rng), xyDist(rng), 1), Vector(0,0,0), floor)) delete floor;
+	}
+	std::vector<BenchMover*> movers;
+	std::vector< std::vector<Vector> > trajectories;
+	while (movers.size() < N_MOVERS) {
+		BenchMover *mover = new BenchMover();
+		Vector position(xyDist(rng), xyDist(rng), 1);
+		if (!world->add_occupant(position, Vector(0,0,0), mover)) {
+			delete mover;
+			continue;
+		}
+		movers.push_back(mover);
+		std::vector<Vector> trajectory;
+		Vector step(stepDist(rng), stepDist(rng), 0);
+		for (uint32_t i = 0; i < TRAJECTORY_LENGTH; ++i) {
+			position = position + step;
+			trajectory.push_back(position);
+		}
+		trajectories.push_back(trajectory);
+	}
+
+	uint64_t calls = (uint64_t)ROUNDS * movers.size();
+	int64_t referenceSum = 0;
+	double referenceTime = bench_time([&]() {
+		for (uint32_t r = 0; r < ROUNDS; ++r) {
+			for (size_t i = 0; i < movers.size(); ++i) {
+				referenceSum += reference_trajectory(world, movers[i], trajectories[i]).getX();
+			}
+		}
+	});
+	int64_t cachedSum = 0;
+	double cachedTime = bench_time([&]() {
+		for (uint32_t r = 0; r < ROUNDS; ++r) {
+			for (size_t i = 0; i < movers.size(); ++i) {
+				cachedSum += world->calculate_trajectory(movers[i], trajectories[i]).getX();
+			}
+		}
+	});
+
+	bench_report("per-occupant virtual calls", calls, referenceTime, "trajectories");
+	bench_report("cached voxel traits", calls, cachedTime, "trajectories");
+	if (referenceSum != cachedSum) {
+		printf("results differ!\n");
+		return 1;
+	}
+	delete world;
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _BENCH_BENCHUTIL_
+#define _BENCH_BENCHUTIL_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include "voxel_occupant.h"
+
+// Shared helpers for the benchmark programs.
+
+// Runs f() once and returns the elapsed wall-clock time in seconds.
+template <typename F> double bench_time(F f) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(stop - start).count();
+}
+
+// Prints one result line in the form "<name>: <rate> M<unit>/s (<seconds> s)".
+inline void bench_report(const char *name, uint64_t operations, double seconds, const char *unit) {
+	printf("%-40s %10.2f M%s/s  (%.3f s)\n", name, (double)operations / seconds / 1e6, unit, seconds);
+}
+
+// Keeps the optimizer from discarding a computed value.
+template <typename T> void bench_keep(const T &value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+// A minimal occupant with no material, for benchmarks that only exercise the World.
+class BenchOccupant : public VoxelOccupant {
+public:
+	BenchOccupant(bool solid = false) : solid(solid) {}
+	virtual ~BenchOccupant() {}
+
+	virtual bool impedesXYMovement() const { return solid; }
+	virtual bool impedesZMovement() const { return solid; }
+	virtual bool impedesXYFluidFlow() const { return solid; }
+	virtual bool impedesZFluidFlow() const { return solid; }
+	virtual bool supportsOthers() const { return solid; }
+	virtual bool needsSupport() const { return false; }
+	virtual bool canMove() const { return false; }
+	virtual uint16_t get_kind() const { return 0; }
+	virtual uint32_t get_type() const { return 0; }
+	virtual Vector get_extents() const { return Vector(1,1,1); }
+	virtual bool requires_timestep() const { return false; }
+	virtual bool has_world_updates() const { return false; }
+	virtual int32_t get_maximum_durability() const { return 1; }
+protected:
+	bool solid;
+};
+
+#endif // _BENCH_BENCHUTIL_
@@ -0,0 +1,215 @@
+#include "decoded_instruction.h"
+
+static int32_t i_immediate(uint32_t insn) {
+	return ((int32_t)insn) >> 20;
+}
+
+static int32_t s_immediate(uint32_t insn) {
+	return (((int32_t)insn) >> 20 & 0xFFFFFFE0) | ((insn >> 7) & 0x0000001F);
+}
+
+static int32_t b_immediate(uint32_t insn) {
+	// [12] [10:5] in the upper bits, [4:1] [11] in the lower bits
+	return (((int32_t)(insn & 0x80000000)) >> (31-12))
+		| ((insn & 0x7E000000) >> (25-5))
+		| ((insn & 0x00000F00) >> (8-1))
+		| ((insn & 0x00000080) << (11-7));
+}
+
+static int32_t j_immediate(uint32_t insn) {
+	// [20] [10:1] [11] [19:12]
+	return (((int32_t)(insn & 0x80000000)) >> (31-20))
+		| (insn & 0x000FF000)
+		| ((insn & 0x00100000) >> (20-11))
+		| ((insn & 0x7FE00000) >> (21-1));
+}
+
+static uint8_t decode_LOAD(uint8_t funct3) {
+	switch (funct3) {
+	case 0b000: return RV32_LB;
+	case 0b001: return RV32_LH;
+	case 0b010: return RV32_LW;
+	case 0b100: return RV32_LBU;
+	case 0b101: return RV32_LHU;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_STORE(uint8_t funct3) {
+	switch (funct3) {
+	case 0b000: return RV32_SB;
+	case 0b001: return RV32_SH;
+	case 0b010: return RV32_SW;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_OP_IMM(uint8_t funct3, uint8_t funct7) {
+	switch (funct3) {
+	case 0: return RV32_ADDI;
+	case 1: return (funct7 == 0) ? RV32_SLLI : RV32_ILLEGAL;
+	case 2: return RV32_SLTI;
+	case 3: return RV32_SLTIU;
+	case 4: return RV32_XORI;
+	case 5:
+		if (funct7 == 0) return RV32_SRLI;
+		if (funct7 == 0b0100000) return RV32_SRAI;
+		return RV32_ILLEGAL;
+	case 6: return RV32_ORI;
+	default: return RV32_ANDI;
+	}
+}
+
+static uint8_t decode_OP(uint8_t funct3, uint8_t funct7) {
+	static const uint8_t integerOps[8] = {
+		RV32_ADD, RV32_SLL, RV32_SLT, RV32_SLTU, RV32_XOR, RV32_SRL, RV32_OR, RV32_AND
+	};
+	static const uint8_t mulDivOps[8] = {
+		RV32_MUL, RV32_MULH, RV32_MULHSU, RV32_MULHU, RV32_DIV, RV32_DIVU, RV32_REM, RV32_REMU
+	};
+	switch (funct7) {
+	case 0b0000000: return integerOps[funct3];
+	case 0b0000001: return mulDivOps[funct3];
+	case 0b0100000:
+		if (funct3 == 0b000) return RV32_SUB;
+		if (funct3 == 0b101) return RV32_SRA;
+		return RV32_ILLEGAL;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_BRANCH(uint8_t funct3) {
+	switch (funct3) {
+	case 0b000: return RV32_BEQ;
+	case 0b001: return RV32_BNE;
+	case 0b100: return RV32_BLT;
+	case 0b101: return RV32_BGE;
+	case 0b110: return RV32_BLTU;
+	case 0b111: return RV32_BGEU;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_MISC_MEM(uint8_t funct3) {
+	switch (funct3) {
+	case 0b000: return RV32_FENCE;
+	case 0b001: return RV32_FENCE_I;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_SYSTEM(uint8_t funct3, uint32_t funct12) {
+	switch (funct3) {
+	case 0b000:
+		switch (funct12) {
+		case 0b000000000000: return RV32_SCALL;
+		case 0b000000000001: return RV32_SBREAK;
+		case 0b000100000000: return RV32_ERET;
+		// WFI moved from 0x102 to 0x105 in later versions of the privileged spec
+		case 0b000100000010: return RV32_WFI;
+		case 0b000100000101: return RV32_WFI;
+		default: return RV32_ILLEGAL;
+		}
+	case 0b001: return RV32_CSRRW;
+	case 0b010: return RV32_CSRRS;
+	case 0b011: return RV32_CSRRC;
+	case 0b101: return RV32_CSRRWI;
+	case 0b110: return RV32_CSRRSI;
+	case 0b111: return RV32_CSRRCI;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+static uint8_t decode_AMO(uint8_t funct3, uint8_t funct7) {
+	if (funct3 != 0b010) {
+		return RV32_ILLEGAL;
+	}
+	// decode the 5 highest bits of funct7
+	switch (funct7 >> 2) {
+	case 0b00010: return RV32_LR_W;
+	case 0b00011: return RV32_SC_W;
+	case 0b00001: return RV32_AMOSWAP_W;
+	case 0b00000: return RV32_AMOADD_W;
+	case 0b00100: return RV32_AMOXOR_W;
+	case 0b01100: return RV32_AMOAND_W;
+	case 0b01000: return RV32_AMOOR_W;
+	case 0b10000: return RV32_AMOMIN_W;
+	case 0b10100: return RV32_AMOMAX_W;
+	case 0b11000: return RV32_AMOMINU_W;
+	case 0b11100: return RV32_AMOMAXU_W;
+	default: return RV32_ILLEGAL;
+	}
+}
+
+void decode_instruction(uint32_t insn, DecodedInstruction &d) {
+	d.op = RV32_ILLEGAL;
+	d.rd = (insn & 0b00000000000000000000111110000000) >> 7;
+	d.rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
+	d.rs2 = (insn & 0b00000001111100000000000000000000) >> 20;
+	d.imm = 0;
+
+	// Table 8.1 gives us a quick way to decode most of an instruction:
+	// check that bits [1:0] are "11", then
+	// check bits [6:2] of the instruction word
+	if ((insn & 0x00000003) != 3) {
+		// bits [1:0] not "11", this is not an RV32 base opcode
+		return;
+	}
+
+	uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
+	uint8_t funct7 = (insn & 0b11111110000000000000000000000000) >> 25;
+
+	switch ((insn & 0x0000007C) >> 2) {
+	case 0: // LOAD
+		d.op = decode_LOAD(funct3);
+		d.imm = i_immediate(insn);
+		break;
+	case 3: // MISC-MEM
+		d.op = decode_MISC_MEM(funct3);
+		break;
+	case 4: // OP-IMM
+		d.op = decode_OP_IMM(funct3, funct7);
+		if (d.op == RV32_SLLI || d.op == RV32_SRLI || d.op == RV32_SRAI) {
+			d.imm = d.rs2; // shamt
+		} else {
+			d.imm = i_immediate(insn);
+		}
+		break;
+	case 5: // AUIPC
+		d.op = RV32_AUIPC;
+		d.imm = (int32_t)(insn & 0xFFFFF000);
+		break;
+	case 8: // STORE
+		d.op = decode_STORE(funct3);
+		d.imm = s_immediate(insn);
+		break;
+	case 11: // AMO
+		d.op = decode_AMO(funct3, funct7);
+		break;
+	case 12: // OP
+		d.op = decode_OP(funct3, funct7);
+		break;
+	case 13: // LUI
+		d.op = RV32_LUI;
+		d.imm = (int32_t)(insn & 0xFFFFF000);
+		break;
+	case 24: // BRANCH
+		d.op = decode_BRANCH(funct3);
+		d.imm = b_immediate(insn);
+		break;
+	case 25: // JALR
+		d.op = RV32_JALR;
+		d.imm = i_immediate(insn);
+		break;
+	case 27: // JAL
+		d.op = RV32_JAL;
+		d.imm = j_immediate(insn);
+		break;
+	case 28: // SYSTEM
+		d.op = decode_SYSTEM(funct3, insn >> 20);
+		d.imm = (int32_t)(insn >> 20); // CSR number
+		break;
+	default:
+		break;
+	}
+}
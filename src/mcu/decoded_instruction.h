@@ -0,0 +1,75 @@
+#ifndef _MCU_DECODED_INSTRUCTION_
+#define _MCU_DECODED_INSTRUCTION_
+
+#include <cstdint>
+
+// Every operation the core can execute, one per instruction (not per opcode).
+enum RV32Operation {
+	RV32_ILLEGAL = 0,
+	// U-type and jumps
+	RV32_LUI, RV32_AUIPC, RV32_JAL, RV32_JALR,
+	// branches
+	RV32_BEQ, RV32_BNE, RV32_BLT, RV32_BGE, RV32_BLTU, RV32_BGEU,
+	// loads and stores
+	RV32_LB, RV32_LH, RV32_LW, RV32_LBU, RV32_LHU,
+	RV32_SB, RV32_SH, RV32_SW,
+	// OP-IMM
+	RV32_ADDI, RV32_SLTI, RV32_SLTIU, RV32_XORI, RV32_ORI, RV32_ANDI,
+	RV32_SLLI, RV32_SRLI, RV32_SRAI,
+	// OP
+	RV32_ADD, RV32_SUB, RV32_SLL, RV32_SLT, RV32_SLTU,
+	RV32_XOR, RV32_SRL, RV32_SRA, RV32_OR, RV32_AND,
+	RV32_MUL, RV32_MULH, RV32_MULHSU, RV32_MULHU,
+	RV32_DIV, RV32_DIVU, RV32_REM, RV32_REMU,
+	// MISC-MEM
+	RV32_FENCE, RV32_FENCE_I,
+	// SYSTEM
+	RV32_SCALL, RV32_SBREAK, RV32_ERET, RV32_WFI,
+	RV32_CSRRW, RV32_CSRRS, RV32_CSRRC, RV32_CSRRWI, RV32_CSRRSI, RV32_CSRRCI,
+	// AMO
+	RV32_LR_W, RV32_SC_W,
+	RV32_AMOSWAP_W, RV32_AMOADD_W, RV32_AMOXOR_W, RV32_AMOAND_W, RV32_AMOOR_W,
+	RV32_AMOMIN_W, RV32_AMOMAX_W, RV32_AMOMINU_W, RV32_AMOMAXU_W,
+
+	RV32_NUMBER_OF_OPERATIONS
+};
+
+/*
+ * An instruction with all of its fields pulled out ahead of time.
+ * imm is already sign-extended (or zero-extended) and shifted into place:
+ * the branch/jump offset, the upper immediate for LUI/AUIPC,
+ * the shift amount for SLLI/SRLI/SRAI, and the CSR number for CSR instructions.
+ * For CSRR*I, rs1 holds the 5-bit zero-extended immediate.
+ */
+struct DecodedInstruction {
+	uint8_t op; // an RV32Operation
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	int32_t imm;
+};
+
+void decode_instruction(uint32_t insn, DecodedInstruction &d);
+
+// RV32M division, including division by zero and signed overflow,
+// for the execution engines that don't do it inline
+inline uint32_t rv32_div(uint32_t x1, uint32_t x2) {
+	if (x2 == 0) return 0xFFFFFFFF;
+	if (x1 == 0x80000000 && x2 == 0xFFFFFFFF) return x1;
+	return (uint32_t)((int32_t)x1 / (int32_t)x2);
+}
+inline uint32_t rv32_divu(uint32_t x1, uint32_t x2) {
+	if (x2 == 0) return 0xFFFFFFFF;
+	return x1 / x2;
+}
+inline uint32_t rv32_rem(uint32_t x1, uint32_t x2) {
+	if (x2 == 0) return x1;
+	if (x1 == 0x80000000 && x2 == 0xFFFFFFFF) return 0;
+	return (uint32_t)((int32_t)x1 % (int32_t)x2);
+}
+inline uint32_t rv32_remu(uint32_t x1, uint32_t x2) {
+	if (x2 == 0) return x1;
+	return x1 % x2;
+}
+
+#endif // _MCU_DECODED_INSTRUCTION_
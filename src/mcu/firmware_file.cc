@@ -0,0 +1,44 @@
+#include "firmware_file.h"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+bool read_firmware_file(const std::string &filename, std::vector<uint8_t> &image) {
+	std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+	if (!in) {
+		fprintf(stderr, "can't read %s\n", filename.c_str());
+		return false;
+	}
+	std::stringstream contents;
+	contents << in.rdbuf();
+	std::string s = contents.str();
+
+	if (filename.size() < 4 || filename.compare(filename.size() - 4, 4, ".hex") != 0) {
+		image.assign(s.begin(), s.end());
+		return true;
+	}
+
+	image.clear();
+	size_t i = 0;
+	while (i < s.size()) {
+		if (s.compare(i, 2, "//") == 0) {
+			i = s.find('\n', i);
+			if (i == std::string::npos) break;
+		} else if (isxdigit((unsigned char)s[i])) {
+			char *end;
+			uint32_t word = (uint32_t)strtoul(s.c_str() + i, &end, 16);
+			i = end - s.c_str();
+			for (int b = 0; b < 4; ++b) {
+				image.push_back((uint8_t)(word >> (8*b)));
+			}
+		} else if (isspace((unsigned char)s[i]) || s[i] == ',') {
+			++i;
+		} else {
+			fprintf(stderr, "%s: unexpected '%c'\n", filename.c_str(), s[i]);
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,14 @@
+#ifndef _MCU_FIRMWARE_FILE_
+#define _MCU_FIRMWARE_FILE_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reads a firmware image for the command-line tools: either raw little-endian binary, or
+// (if its name ends in .hex) a list of 32-bit hex words separated by commas and/or whitespace,
+// with // comments, so that the same file can be #included into a C array.
+// Returns false (after saying why on stderr) if the file can't be read or parsed.
+bool read_firmware_file(const std::string &filename, std::vector<uint8_t> &image);
+
+#endif // _MCU_FIRMWARE_FILE_
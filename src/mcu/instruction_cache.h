@@ -0,0 +1,58 @@
+#ifndef _MCU_INSTRUCTION_CACHE_
+#define _MCU_INSTRUCTION_CACHE_
+
+#include <atomic>
+#include <cstdint>
+#include "decoded_instruction.h"
+
+/*
+ * A direct-mapped cache of decoded instructions, indexed by the (word-aligned)
+ * address they were fetched from. The core only caches word-aligned fetches,
+ * so a store only ever has to check the entries for the words it touches.
+ * Harts on other threads invalidate entries through the bus, so the tags are atomic;
+ * as with FENCE.I, a hart that runs code another hart has just written may still see the old code.
+ */
+class InstructionCache {
+public:
+	static const uint32_t NUMBER_OF_ENTRIES = 1024;
+
+	struct Entry {
+		std::atomic<uint32_t> tag; // the address this instruction was fetched from
+		DecodedInstruction insn;
+
+		bool holds(uint32_t pc) const { return tag.load(std::memory_order_relaxed) == pc; }
+		void fill(uint32_t pc) { tag.store(pc, std::memory_order_relaxed); }
+	};
+
+	InstructionCache() { flush(); }
+
+	// The entry that `pc` maps to; it holds the instruction at `pc` only if its tag is `pc`.
+	Entry & lookup(uint32_t pc) { return entries[(pc >> 2) & (NUMBER_OF_ENTRIES - 1)]; }
+
+	// Called for every store of nBytes at addr.
+	void invalidate(uint32_t addr, uint32_t nBytes) {
+		invalidate_word(addr & ~0x00000003);
+		invalidate_word((addr + nBytes - 1) & ~0x00000003);
+	}
+
+	void flush() {
+		for (uint32_t i = 0; i < NUMBER_OF_ENTRIES; ++i) {
+			entries[i].fill(INVALID_TAG);
+		}
+	}
+
+protected:
+	// instructions are never cached from an odd address
+	static const uint32_t INVALID_TAG = 0x00000001;
+
+	Entry entries[NUMBER_OF_ENTRIES];
+
+	void invalidate_word(uint32_t addr) {
+		Entry &e = lookup(addr);
+		if (e.holds(addr)) {
+			e.fill(INVALID_TAG);
+		}
+	}
+};
+
+#endif // _MCU_INSTRUCTION_CACHE_
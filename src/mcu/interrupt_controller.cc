@@ -0,0 +1,89 @@
+#include "interrupt_controller.h"
+
+const uint32_t InterruptController::PENDING;
+const uint32_t InterruptController::ENABLE;
+const uint32_t InterruptController::CLAIM;
+const uint32_t InterruptController::NO_LINE;
+
+void InterruptController::raise(uint32_t line) {
+	pending |= 1u << line;
+	changed();
+}
+
+uint32_t InterruptController::read_word(uint32_t pAddr) {
+	switch (translate_address(pAddr) & ~0x3u) {
+	case PENDING:
+		return pending;
+	case ENABLE:
+		return enabled;
+	case CLAIM:
+	{
+		uint32_t claimable = pending & enabled;
+		if (claimable == 0) {
+			return NO_LINE;
+		}
+		uint32_t line = (uint32_t)__builtin_ctz(claimable);
+		clear(line);
+		return line;
+	}
+	default:
+		return 0;
+	}
+}
+
+// narrower accesses see (and replace) part of the word they fall in
+uint8_t InterruptController::read_byte(uint32_t pAddr) {
+	return (uint8_t)(read_word(pAddr) >> (8 * (pAddr & 0x3)));
+}
+
+uint16_t InterruptController::read_halfword(uint32_t pAddr) {
+	return (uint16_t)(read_word(pAddr) >> (8 * (pAddr & 0x2)));
+}
+
+void InterruptController::write_word(uint32_t pAddr, uint32_t value) {
+	switch (translate_address(pAddr) & ~0x3u) {
+	case PENDING:
+		pending &= ~value;
+		break;
+	case ENABLE:
+		enabled = value;
+		break;
+	default:
+		break;
+	}
+}
+
+void InterruptController::write_byte(uint32_t pAddr, uint8_t value) {
+	uint32_t shift = 8 * (pAddr & 0x3);
+	if ((translate_address(pAddr) & ~0x3u) == PENDING) {
+		write_word(pAddr, (uint32_t)value << shift);
+	} else {
+		write_word(pAddr, (enabled & ~(0xFFu << shift)) | ((uint32_t)value << shift));
+	}
+}
+
+void InterruptController::write_halfword(uint32_t pAddr, uint16_t value) {
+	uint32_t shift = 8 * (pAddr & 0x2);
+	if ((translate_address(pAddr) & ~0x3u) == PENDING) {
+		write_word(pAddr, (uint32_t)value << shift);
+	} else {
+		write_word(pAddr, (enabled & ~(0xFFFFu << shift)) | ((uint32_t)value << shift));
+	}
+}
+
+PeripheralSnapshot * InterruptController::save_state() {
+	Snapshot *snapshot = new Snapshot();
+	snapshot->pending = pending;
+	snapshot->enabled = enabled;
+	return snapshot;
+}
+
+void InterruptController::restore_state(const PeripheralSnapshot *snapshot) {
+	const Snapshot *s = dynamic_cast<const Snapshot*>(snapshot);
+	if (s == NULL) {
+		return;
+	}
+	pending = s->pending;
+	enabled = s->enabled;
+	changed();
+}
@@ -0,0 +1,60 @@
+#ifndef _MCU_INTERRUPT_CONTROLLER_
+#define _MCU_INTERRUPT_CONTROLLER_
+
+#include <cstdint>
+#include "system_bus.h"
+
+/*
+ * Collects up to 32 interrupt lines from other peripherals (or the host) into the core's
+ * external interrupt. A raised line stays pending until the firmware clears or claims it;
+ * while any enabled line is pending, the core takes an external interrupt (cause 15)
+ * whenever it has interrupts enabled, and doesn't stay asleep either way.
+ *
+ * One page of registers, all 32 bits:
+ *   0x0 PENDING  lines that have been raised; writing 1s clears those lines
+ *   0x4 ENABLE   lines that interrupt the core
+ *   0x8 CLAIM    reads (and clears) the lowest enabled pending line, or 0xFFFFFFFF if there is none
+ */
+class InterruptController : public SystemBusPeripheral {
+public:
+	static const uint32_t PENDING = 0x0;
+	static const uint32_t ENABLE = 0x4;
+	static const uint32_t CLAIM = 0x8;
+	static const uint32_t NO_LINE = 0xFFFFFFFF;
+
+	InterruptController() : pending(0), enabled(0) {}
+	virtual ~InterruptController() {}
+
+	void raise(uint32_t line);
+	void clear(uint32_t line) { pending &= ~(1u << line); }
+	// true if an enabled line is pending
+	bool is_asserted() const { return (pending & enabled) != 0; }
+	uint32_t get_pending() const { return pending; }
+
+	uint32_t get_number_of_pages() const { return 1; }
+
+	uint8_t read_byte(uint32_t pAddr);
+	uint16_t read_halfword(uint32_t pAddr);
+	uint32_t read_word(uint32_t pAddr);
+
+	void write_byte(uint32_t pAddr, uint8_t value);
+	void write_halfword(uint32_t pAddr, uint16_t value);
+	void write_word(uint32_t pAddr, uint32_t value);
+
+	PeripheralSnapshot * save_state();
+	void restore_state(const PeripheralSnapshot *snapshot);
+
+	void cycle() {}
+	void timestep() {}
+protected:
+	uint32_t pending;
+	uint32_t enabled;
+
+	class Snapshot : public PeripheralSnapshot {
+	public:
+		uint32_t pending;
+		uint32_t enabled;
+	};
+};
+
+#endif // _MCU_INTERRUPT_CONTROLLER_
@@ -0,0 +1,133 @@
+#include "mcu_scheduler.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+const uint32_t MCUScheduler::TICK_HISTORY;
+
+MCUScheduler::MCUScheduler()
+: thread_pool(NULL), deterministic(true), tasksValid(false), nextTickTime(0) {}
+
+MCUScheduler::~MCUScheduler() {
+	delete thread_pool;
+}
+
+void MCUScheduler::add_core(RV32Core *core) {
+	Core c;
+	c.core = core;
+	c.cyclesRun = 0;
+	c.cyclesSlept = 0;
+	c.overshoot = 0;
+	cores.push_back(c);
+	tasksValid = false;
+}
+
+void MCUScheduler::set_worker_threads(uint32_t workers) {
+	if (thread_pool != NULL) {
+		delete thread_pool;
+		thread_pool = NULL;
+	}
+	ThreadPool *pool = new ThreadPool(workers);
+	if (pool->get_number_of_workers() > 1) {
+		thread_pool = pool;
+	} else {
+		delete pool;
+	}
+}
+
+uint32_t MCUScheduler::get_worker_threads() const {
+	if (thread_pool == NULL) {
+		return 1;
+	} else {
+		return thread_pool->get_number_of_workers();
+	}
+}
+
+void MCUScheduler::set_deterministic(bool enabled) {
+	deterministic = enabled;
+	tasksValid = false;
+}
+
+void MCUScheduler::build_tasks() {
+	tasks.clear();
+	std::map<SystemBus*, uint32_t> taskForBus;
+	for (uint32_t i = 0; i < cores.size(); ++i) {
+		SystemBus *bus = cores[i].core->get_system_bus();
+		if (deterministic) {
+			std::map<SystemBus*, uint32_t>::iterator it = taskForBus.find(bus);
+			if (it != taskForBus.end()) {
+				tasks[it->second].push_back(i);
+				continue;
+			}
+			taskForBus[bus] = (uint32_t)tasks.size();
+		}
+		tasks.push_back(std::vector<uint32_t>(1, i));
+	}
+	tasksValid = true;
+}
+
+void MCUScheduler::run_core(Core &c, uint64_t cyclesPerTick) {
+	// a core that ran past its last budget has that much less of this one
+	uint64_t budget = cyclesPerTick > c.overshoot ? cyclesPerTick - c.overshoot : 0;
+	uint64_t startCycle = c.core->get_cycle();
+	uint64_t startInstret = c.core->get_instret();
+	// a sleeping core costs a call, unless one of its deadlines wakes it up
+	uint64_t elapsed = 0;
+	while (elapsed < budget) {
+		RV32Core::RunResult result = c.core->run(budget - elapsed);
+		elapsed = c.core->get_cycle() - startCycle;
+		if (result != RV32Core::RUN_TRAPPED) {
+			break;
+		}
+	}
+	c.overshoot = c.overshoot + elapsed > cyclesPerTick ? c.overshoot + elapsed - cyclesPerTick : 0;
+	uint64_t ran = c.core->get_instret() - startInstret;
+	c.cyclesRun += ran;
+	c.cyclesSlept += elapsed - ran;
+}
+
+void MCUScheduler::tick(uint64_t cyclesPerTick) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (thread_pool == NULL) {
+		for (size_t i = 0; i < cores.size(); ++i) {
+			run_core(cores[i], cyclesPerTick);
+		}
+	} else {
+		if (!tasksValid) {
+			build_tasks();
+		}
+		thread_pool->parallel_for(tasks.size(), [&](size_t t) {
+			const std::vector<uint32_t> &task = tasks[t];
+			for (size_t i = 0; i < task.size(); ++i) {
+				run_core(cores[task[i]], cyclesPerTick);
+			}
+		});
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (tickTimes.size() < TICK_HISTORY) {
+		tickTimes.push_back(seconds);
+	} else {
+		tickTimes[nextTickTime] = seconds;
+		nextTickTime = (nextTickTime + 1) % TICK_HISTORY;
+	}
+}
+
+double MCUScheduler::get_sleep_ratio(uint32_t core) const {
+	const Core &c = cores[core];
+	if (c.cyclesRun + c.cyclesSlept == 0) {
+		return 0.0;
+	}
+	return (double)c.cyclesSlept / (double)(c.cyclesRun + c.cyclesSlept);
+}
+
+double MCUScheduler::get_tick_time(double percentile) const {
+	if (tickTimes.empty()) {
+		return 0.0;
+	}
+	std::vector<double> sorted(tickTimes);
+	std::sort(sorted.begin(), sorted.end());
+	double rank = percentile / 100.0 * (double)(sorted.size() - 1);
+	size_t index = (size_t)std::max(0.0, std::min(rank + 0.5, (double)(sorted.size() - 1)));
+	return sorted[index];
+}
@@ -0,0 +1,84 @@
+#ifndef _MCU_MCU_SCHEDULER_
+#define _MCU_MCU_SCHEDULER_
+
+#include <cstdint>
+#include <vector>
+#include "rv32core.h"
+
+class ThreadPool;
+
+/*
+ * Runs a set of cores for the same number of cycles each tick, spread over worker threads.
+ * Sleeping cores are skipped, and a core that goes to sleep partway through
+ * its budget sleeps through the rest of it, so a tick costs roughly as much as the
+ * cores that are actually busy. Cores still wake up at their timers' deadlines, including ones
+ * the firmware sets partway through a tick, at the exact cycle in the interpreter
+ * and at the end of the block in translated code (see RV32Core::run()). The scheduler doesn't own the cores.
+ *
+ * Translated code is only preempted between blocks, so a core can overshoot its budget;
+ * the overshoot is taken out of its next tick's budget, and over any number of ticks
+ * no core gets ahead of the others by more than one block.
+ *
+ * In deterministic mode (the default) cores that share a system bus run on the same thread,
+ * one after the other in the order they were added, so that a tick's results don't depend
+ * on the number of threads or on how the cores are spread over them; otherwise every core
+ * may run on a different thread, and cores that share a bus interleave unpredictably.
+ */
+class MCUScheduler {
+public:
+	MCUScheduler();
+	~MCUScheduler();
+
+	void add_core(RV32Core *core);
+	uint32_t get_number_of_cores() const { return (uint32_t)cores.size(); }
+
+	// Sets the number of threads that run the cores, counting the calling thread;
+	// 0 means one per hardware thread. The default is 1, which runs every core in order.
+	void set_worker_threads(uint32_t workers);
+	uint32_t get_worker_threads() const;
+	void set_deterministic(bool enabled);
+	bool is_deterministic() const { return deterministic; }
+
+	// Runs every awake core for cyclesPerTick cycles, less whatever it overshot last time.
+	void tick(uint64_t cyclesPerTick);
+
+	// cycles each core spent running and asleep over every tick so far
+	uint64_t get_cycles_run(uint32_t core) const { return cores[core].cyclesRun; }
+	uint64_t get_cycles_slept(uint32_t core) const { return cores[core].cyclesSlept; }
+	// the fraction of its cycles the core spent asleep (0 before the first tick)
+	double get_sleep_ratio(uint32_t core) const;
+	// cycles the core has run past its budgets, to be taken out of the next tick's
+	uint64_t get_overshoot(uint32_t core) const { return cores[core].overshoot; }
+
+	// The wall-clock time tick() took, in seconds, at the given percentile (0 to 100)
+	// of the last TICK_HISTORY ticks: e.g. 50 for the median, 99 for the tail, 100 for the worst.
+	// 0 before the first tick.
+	double get_tick_time(double percentile) const;
+	uint32_t get_number_of_tick_times() const { return (uint32_t)tickTimes.size(); }
+	static const uint32_t TICK_HISTORY = 1024;
+
+protected:
+	struct Core {
+		RV32Core *core;
+		uint64_t cyclesRun;
+		uint64_t cyclesSlept;
+		uint64_t overshoot;
+	};
+	std::vector<Core> cores;
+	ThreadPool *thread_pool; // NULL when running single-threaded
+	bool deterministic;
+	// the cores that each parallel task runs in order; rebuilt when cores or the mode change
+	std::vector< std::vector<uint32_t> > tasks;
+	bool tasksValid;
+	std::vector<double> tickTimes; // a ring of the last TICK_HISTORY ticks' times
+	uint32_t nextTickTime;
+
+	void build_tasks();
+	void run_core(Core &c, uint64_t cyclesPerTick);
+
+private:
+	MCUScheduler(const MCUScheduler &);
+	MCUScheduler & operator=(const MCUScheduler &);
+};
+
+#endif // _MCU_MCU_SCHEDULER_
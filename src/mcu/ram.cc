@@ -1,29 +1,174 @@
 #include "ram.h"
+#include <cstdlib>
 #include <cstring>
 
+RAM::Snapshot::Snapshot(const std::vector<Frame*> &frames)
+: frames(frames) {
+	for (size_t i = 0; i < frames.size(); ++i) {
+		retain_frame(frames[i]);
+	}
+}
+
+RAM::Snapshot::~Snapshot() {
+	for (size_t i = 0; i < frames.size(); ++i) {
+		release_frame(frames[i]);
+	}
+}
+
+std::vector<uint32_t> RAM::Snapshot::get_changed_pages(const Snapshot *since) const {
+	std::vector<uint32_t> changed;
+	for (uint32_t i = 0; i < frames.size(); ++i) {
+		if (i >= since->frames.size() || frames[i] != since->frames[i]) {
+			changed.push_back(i);
+		}
+	}
+	return changed;
+}
+
 RAM::RAM(uint32_t nPages)
-: nPages(nPages), memory(NULL) {
-	memory = (uint8_t*)malloc(sizeof(uint8_t) * 1024 * nPages);
+: nPages(nPages), frames(nPages), pages(NULL), writablePages(NULL), dirty(nPages, false) {
+	pages = new uint8_t*[nPages];
+	writablePages = new uint8_t*[nPages];
+	for (uint32_t i = 0; i < nPages; ++i) {
+		frames[i] = zero_frame();
+		pages[i] = frames[i]->data;
+		writablePages[i] = NULL;
+	}
 }
 
 RAM::~RAM() {
-	if (memory != NULL) {
-		free(memory);
-		memory = NULL;
+	for (uint32_t i = 0; i < nPages; ++i) {
+		release_frame(frames[i]);
+	}
+	delete[] pages;
+	delete[] writablePages;
+}
+
+RAM::Frame * RAM::new_frame() {
+	Frame *frame = new Frame;
+	frame->references = 1;
+	return frame;
+}
+
+RAM::Frame * RAM::zero_frame() {
+	static Frame * const zeroes = []() {
+		Frame *frame = new_frame();
+		memset(frame->data, 0, sizeof(frame->data));
+		return frame;
+	}();
+	return zeroes;
+}
+
+// the frame of zeroes isn't counted, so that untouched pages don't all contend for it
+void RAM::retain_frame(Frame *frame) {
+	if (frame != zero_frame()) {
+		frame->references++;
 	}
 }
 
+void RAM::release_frame(Frame *frame) {
+	if (frame != zero_frame() && --frame->references == 0) {
+		delete frame;
+	}
+}
+
+// Harts on other threads can be loading from (and, once it's writable, storing to) the page
+// while its frame changes, so the new one is published with release order for the bus to acquire.
+// Only one hart at a time gets here, as the bus locks around stores that go through a peripheral.
+void RAM::make_writable(uint32_t page) {
+	Frame *frame = frames[page];
+	if (frame == zero_frame() || frame->references != 1) {
+		Frame *copy = new_frame();
+		memcpy(copy->data, frame->data, sizeof(copy->data));
+		release_frame(frame);
+		frames[page] = copy;
+		__atomic_store_n(&pages[page], (uint8_t*)copy->data, __ATOMIC_RELEASE);
+	}
+	dirty[page] = true;
+	__atomic_store_n(&writablePages[page], pages[page], __ATOMIC_RELEASE);
+}
+
+void RAM::use_frames(const std::vector<Frame*> &newFrames) {
+	for (uint32_t i = 0; i < nPages; ++i) {
+		retain_frame(newFrames[i]);
+		release_frame(frames[i]);
+		frames[i] = newFrames[i];
+		pages[i] = frames[i]->data;
+		writablePages[i] = NULL;
+		dirty[i] = false;
+	}
+	changed();
+}
+
+PeripheralSnapshot * RAM::save_state() {
+	Snapshot *snapshot = new Snapshot(frames);
+	for (uint32_t i = 0; i < nPages; ++i) {
+		writablePages[i] = NULL;
+		dirty[i] = false;
+	}
+	return snapshot;
+}
+
+void RAM::restore_state(const PeripheralSnapshot *snapshot) {
+	const Snapshot *s = dynamic_cast<const Snapshot*>(snapshot);
+	if (s == NULL || s->frames.size() != nPages) {
+		return;
+	}
+	use_frames(s->frames);
+}
+
+std::vector<uint32_t> RAM::get_dirty_pages() const {
+	std::vector<uint32_t> dirtyPages;
+	for (uint32_t i = 0; i < nPages; ++i) {
+		if (dirty[i]) {
+			dirtyPages.push_back(i);
+		}
+	}
+	return dirtyPages;
+}
+
 void RAM::set_contents(uint8_t *contents) {
 	if (contents == NULL) {
 		return;
 	}
-	memcpy(memory, contents, 1024*nPages*sizeof(uint8_t));
+	static const uint8_t zeroes[1024] = {0};
+	for (uint32_t i = 0; i < nPages; ++i) {
+		if (memcmp(contents + 1024 * i, zeroes, 1024) == 0) {
+			release_frame(frames[i]);
+			frames[i] = zero_frame();
+			pages[i] = frames[i]->data;
+			writablePages[i] = NULL;
+			dirty[i] = true;
+		} else {
+			make_writable(i);
+			memcpy(pages[i], contents + 1024 * i, 1024);
+		}
+	}
+	changed();
+}
+
+uint32_t RAM::get_resident_size() const {
+	uint32_t resident = 0;
+	for (uint32_t i = 0; i < nPages; ++i) {
+		if (frames[i] != zero_frame()) {
+			resident += 1024;
+		}
+	}
+	return resident;
+}
+
+uint8_t * RAM::byte_for_write(uint32_t localAddr) {
+	uint32_t page = localAddr >> 10;
+	if (writablePages[page] == NULL) {
+		make_writable(page);
+	}
+	return writablePages[page] + (localAddr & 0x3FF);
 }
 
 uint8_t RAM::read_byte(uint32_t pAddr) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr < 1024*nPages) {
-		return memory[local_addr];
+		return __atomic_load_n(&pages[local_addr >> 10][local_addr & 0x3FF], __ATOMIC_RELAXED);
 	} else {
 		return 0;
 	}
@@ -32,8 +177,8 @@ uint8_t RAM::read_byte(uint32_t pAddr) {
 uint16_t RAM::read_halfword(uint32_t pAddr) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr+1 < 1024*nPages) {
-		uint16_t retval = (uint16_t)memory[local_addr+0];
-		retval |= ((uint16_t)memory[local_addr+1]) << 8;
+		uint16_t retval = (uint16_t)read_byte(pAddr);
+		retval |= ((uint16_t)read_byte(pAddr+1)) << 8;
 		return retval;
 	} else {
 		return 0;
@@ -43,37 +188,43 @@ uint16_t RAM::read_halfword(uint32_t pAddr) {
 uint32_t RAM::read_word(uint32_t pAddr) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr+3 < 1024*nPages) {
-		uint32_t retval = (uint32_t)memory[local_addr+0];
-		retval |= ((uint32_t)memory[local_addr+1]) << 8;
-		retval |= ((uint32_t)memory[local_addr+2]) << 16;
-		retval |= ((uint32_t)memory[local_addr+3]) << 24;
+		uint32_t retval = (uint32_t)read_byte(pAddr);
+		retval |= ((uint32_t)read_byte(pAddr+1)) << 8;
+		retval |= ((uint32_t)read_byte(pAddr+2)) << 16;
+		retval |= ((uint32_t)read_byte(pAddr+3)) << 24;
 		return retval;
 	} else {
 		return 0;
 	}
 }
 
+// other harts may be loading the same bytes directly, so each one is stored atomically
 void RAM::write_byte(uint32_t pAddr, uint8_t value) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr < 1024*nPages) {
-		memory[local_addr] = value;
+		__atomic_store_n(byte_for_write(local_addr), value, __ATOMIC_RELAXED);
 	}
 }
 
 void RAM::write_halfword(uint32_t pAddr, uint16_t value) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr+1 < 1024*nPages) {
-		memory[local_addr+0] = (uint8_t)((value & 0x00FF));
-		memory[local_addr+1] = (uint8_t)((value & 0xFF00) >>  8);
+		write_byte(pAddr+0, (uint8_t)((value & 0x00FF)));
+		write_byte(pAddr+1, (uint8_t)((value & 0xFF00) >>  8));
 	}
 }
 
 void RAM::write_word(uint32_t pAddr, uint32_t value) {
 	uint32_t local_addr = translate_address(pAddr);
 	if (local_addr+3 < 1024*nPages) {
-		memory[local_addr+0] = (uint8_t)((value & 0x000000FF));
-		memory[local_addr+1] = (uint8_t)((value & 0x0000FF00) >>  8);
-		memory[local_addr+2] = (uint8_t)((value & 0x00FF0000) >> 16);
-		memory[local_addr+3] = (uint8_t)((value & 0xFF000000) >> 24);
+		if ((local_addr & 0x00000003) == 0) {
+			// in one page, and never seen half written (pages are in RISC-V byte order, as is the host)
+			__atomic_store_n((uint32_t*)byte_for_write(local_addr), value, __ATOMIC_RELAXED);
+			return;
+		}
+		write_byte(pAddr+0, (uint8_t)((value & 0x000000FF)));
+		write_byte(pAddr+1, (uint8_t)((value & 0x0000FF00) >>  8));
+		write_byte(pAddr+2, (uint8_t)((value & 0x00FF0000) >> 16));
+		write_byte(pAddr+3, (uint8_t)((value & 0xFF000000) >> 24));
 	}
 }
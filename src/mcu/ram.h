@@ -1,17 +1,56 @@
 #ifndef _MCU_RAM_
 #define _MCU_RAM_
 
+#include <atomic>
 #include <cstdint>
+#include <vector>
 #include "system_bus.h"
 
+/*
+ * RAM is made of 1 KB page frames, allocated on the first write to each page:
+ * until then a page shares a single frame of zeroes with every other untouched page.
+ * Frames are also shared copy-on-write with snapshots:
+ * save_state() copies no memory, it only takes a reference to every frame,
+ * and the first write to a shared frame (by the RAM or, after a restore, by anything
+ * else using the snapshot) copies just that page.
+ * Pages that are clean or shared have no writable host page, so their first write
+ * goes through write_*(), which copies the frame if necessary and marks the page dirty.
+ */
 class RAM: public SystemBusPeripheral {
 public:
+	// the contents of one page, and how many RAMs and snapshots share it
+	struct Frame {
+		std::atomic<uint32_t> references;
+		uint8_t data[1024];
+	};
+
+	class Snapshot : public PeripheralSnapshot {
+	public:
+		Snapshot(const std::vector<Frame*> &frames);
+		virtual ~Snapshot();
+		// the pages that are different in this snapshot than in since,
+		// which must be a snapshot of the same RAM (or a fork of it); found without comparing memory
+		std::vector<uint32_t> get_changed_pages(const Snapshot *since) const;
+		uint32_t get_number_of_pages() const { return (uint32_t)frames.size(); }
+		const uint8_t * get_page(uint32_t page) const { return frames[page]->data; }
+	protected:
+		friend class RAM;
+		std::vector<Frame*> frames;
+	};
+
+	// starts out all zeroes, with nothing allocated
 	RAM(uint32_t nPages);
 	virtual ~RAM();
 
 	uint32_t get_number_of_pages() const { return nPages; }
+	// pages of contents that are all zeroes are left unallocated
 	void set_contents(uint8_t *contents);
 
+	// bytes of RAM the MCU sees, and bytes actually allocated for it
+	// (counting frames shared with snapshots or forks in full)
+	uint32_t get_declared_size() const { return 1024 * nPages; }
+	uint32_t get_resident_size() const;
+
     uint8_t read_byte(uint32_t pAddr);
     uint16_t read_halfword(uint32_t pAddr);
     uint32_t read_word(uint32_t pAddr);
@@ -20,11 +59,35 @@ public:
     void write_halfword(uint32_t pAddr, uint16_t value);
     void write_word(uint32_t pAddr, uint32_t value);
 
+    uint8_t * const * get_readable_pages() { return pages; }
+    uint8_t * const * get_writable_pages() { return writablePages; }
+
+    // Returns a Snapshot of the current contents, and starts tracking dirty pages afresh.
+    PeripheralSnapshot * save_state();
+    // Goes back to the contents of a Snapshot (from this RAM or another of the same size).
+    void restore_state(const PeripheralSnapshot *snapshot);
+
+    // the pages written since the last save_state() or restore_state()
+    std::vector<uint32_t> get_dirty_pages() const;
+
     void cycle() {}
     void timestep() {}
 protected:
 	uint32_t nPages;
-	uint8_t * memory;
+	std::vector<Frame*> frames;
+	uint8_t ** pages; // the data of each frame
+	uint8_t ** writablePages; // the data of each frame that is exclusively ours and dirty, otherwise NULL
+	std::vector<bool> dirty;
+
+	static Frame * new_frame();
+	// every untouched page's frame, which is never freed or written
+	static Frame * zero_frame();
+	static void retain_frame(Frame *frame);
+	static void release_frame(Frame *frame);
+	// makes the page's frame exclusively ours and marks it dirty
+	void make_writable(uint32_t page);
+	void use_frames(const std::vector<Frame*> &newFrames);
+	uint8_t * byte_for_write(uint32_t localAddr);
 };
 
-#endif /* MCU_ROM_H_ */
+#endif /* MCU_RAM_H_ */
@@ -1,23 +1,67 @@
 #include "rom.h"
+#include <cstdlib>
 #include <cstring>
 
 ROM::ROM(uint32_t nPages)
-: nPages(nPages), memory(NULL) {
-	memory = (uint8_t*)malloc(sizeof(uint8_t) * 1024 * nPages);
+: nPages(nPages), image(NULL), memory(NULL), pages(NULL) {
+	pages = new uint8_t*[nPages];
+	ROMImage *zeroes = ROMImage::acquire(NULL, 1024 * nPages);
+	use_image(zeroes);
+	zeroes->release();
+}
+
+ROM::ROM(ROMImage *image)
+: nPages(image->get_size() / 1024), image(NULL), memory(NULL), pages(NULL) {
+	pages = new uint8_t*[nPages];
+	use_image(image);
 }
 
 ROM::~ROM() {
-	if (memory != NULL) {
-		free(memory);
-		memory = NULL;
+	if (image != NULL) {
+		image->release();
+		image = NULL;
+	}
+	delete[] pages;
+}
+
+void ROM::use_image(ROMImage *newImage) {
+	newImage->retain();
+	if (image != NULL) {
+		image->release();
+	}
+	image = newImage;
+	memory = image->get_data();
+	// the bus only ever reads through these
+	for (uint32_t i = 0; i < nPages; ++i) {
+		pages[i] = const_cast<uint8_t*>(memory) + 1024 * i;
 	}
+	changed();
 }
 
 void ROM::set_contents(uint8_t *contents) {
 	if (contents == NULL) {
 		return;
 	}
-	memcpy(memory, contents, 1024*nPages*sizeof(uint8_t));
+	ROMImage *newImage = ROMImage::acquire(contents, 1024 * nPages);
+	use_image(newImage);
+	newImage->release();
+}
+
+bool ROM::set_image(ROMImage *newImage) {
+	if (newImage->get_size() != 1024 * nPages) {
+		return false;
+	}
+	use_image(newImage);
+	return true;
+}
+
+uint64_t ROM::hash_contents(const uint8_t *contents, size_t nBytes) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < nBytes; ++i) {
+		hash ^= contents[i];
+		hash *= 0x00000100000001b3ULL;
+	}
+	return hash;
 }
 
 uint8_t ROM::read_byte(uint32_t pAddr) {
@@ -2,15 +2,30 @@
 #define _MCU_ROM_
 
 #include <cstdint>
+#include <cstddef>
 #include "system_bus.h"
+#include "rom_image.h"
 
 class ROM: public SystemBusPeripheral {
 public:
+	// starts out all zeroes
 	ROM(uint32_t nPages);
+	// shares image (taking a reference of its own) instead of copying it
+	ROM(ROMImage *image);
 	virtual ~ROM();
 
 	uint32_t get_number_of_pages() const { return nPages; }
+	// switches to the shared image with these contents, loading it if no other ROM has
 	void set_contents(uint8_t *contents);
+	// switches to image, which must be the same size as the ROM; returns false if it isn't
+	bool set_image(ROMImage *image);
+	ROMImage * get_image() const { return image; }
+
+	// identifies the contents of the ROM, e.g. to find an ahead-of-time translation of them
+	uint64_t get_content_hash() const { return image->get_hash(); }
+	uint32_t get_size() const { return 1024 * nPages; }
+	// 64-bit FNV-1a
+	static uint64_t hash_contents(const uint8_t *contents, size_t nBytes);
 
     uint8_t read_byte(uint32_t pAddr);
     uint16_t read_halfword(uint32_t pAddr);
@@ -20,11 +35,19 @@ public:
     void write_halfword(uint32_t pAddr, uint16_t value) {}
     void write_word(uint32_t pAddr, uint32_t value) {}
 
+    // loads go straight to memory, stores are ignored by write_*()
+    uint8_t * const * get_readable_pages() { return pages; }
+    bool is_read_only() const { return true; }
+
     void cycle() {}
     void timestep() {}
 protected:
 	uint32_t nPages;
-	uint8_t * memory;
+	ROMImage * image;
+	const uint8_t * memory; // the image's data
+	uint8_t ** pages; // the start of each page in memory
+
+	void use_image(ROMImage *image);
 };
 
 #endif /* MCU_ROM_H_ */
@@ -0,0 +1,155 @@
+#include "rom_image.h"
+#include "rom.h"
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ROM_IMAGE_MMAP
+#else
+#include <fstream>
+#include <sstream>
+#endif
+
+// every loaded image, by hash; constructed on first use
+static std::mutex & images_lock() {
+	static std::mutex lock;
+	return lock;
+}
+static std::unordered_multimap<uint64_t, ROMImage*> & images() {
+	static std::unordered_multimap<uint64_t, ROMImage*> images;
+	return images;
+}
+
+ROMImage::ROMImage(uint8_t *data, uint32_t size, uint64_t hash, bool mapped)
+: data(data), size(size), hash(hash), mapped(mapped), references(1) {}
+
+ROMImage::~ROMImage() {
+#ifdef ROM_IMAGE_MMAP
+	if (mapped) {
+		munmap(data, size);
+		return;
+	}
+#endif
+	free(data);
+}
+
+ROMImage * ROMImage::find_and_retain(const uint8_t *data, uint32_t size, uint64_t hash) {
+	typedef std::unordered_multimap<uint64_t, ROMImage*>::iterator iterator;
+	std::pair<iterator, iterator> range = images().equal_range(hash);
+	for (iterator it = range.first; it != range.second; ++it) {
+		ROMImage *image = it->second;
+		if (image->size == size && memcmp(image->data, data, size) == 0) {
+			++image->references;
+			return image;
+		}
+	}
+	return NULL;
+}
+
+ROMImage * ROMImage::acquire(const uint8_t *contents, uint32_t nBytes) {
+	uint8_t *data = (uint8_t*)malloc(nBytes);
+	if (contents != NULL) {
+		memcpy(data, contents, nBytes);
+	} else {
+		memset(data, 0, nBytes);
+	}
+	uint64_t hash = ROM::hash_contents(data, nBytes);
+
+	std::lock_guard<std::mutex> guard(images_lock());
+	ROMImage *image = find_and_retain(data, nBytes, hash);
+	if (image != NULL) {
+		free(data);
+		return image;
+	}
+	image = new ROMImage(data, nBytes, hash, false);
+	images().insert(std::make_pair(hash, image));
+	return image;
+}
+
+ROMImage * ROMImage::map_file(const std::string &filename) {
+#ifdef ROM_IMAGE_MMAP
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7FFFFC00) {
+		close(fd);
+		return NULL;
+	}
+	// the rest of the last page is within the file's last host page, so it reads as zeroes
+	uint32_t size = ((uint32_t)st.st_size + 1023) & ~1023u;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *data = (uint8_t*)mapping;
+	uint64_t hash = ROM::hash_contents(data, size);
+
+	std::lock_guard<std::mutex> guard(images_lock());
+	ROMImage *image = find_and_retain(data, size, hash);
+	if (image != NULL) {
+		munmap(mapping, size);
+		return image;
+	}
+	image = new ROMImage(data, size, hash, true);
+	images().insert(std::make_pair(hash, image));
+	return image;
+#else
+	std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+	if (!in) {
+		return NULL;
+	}
+	std::stringstream contents;
+	contents << in.rdbuf();
+	std::string s = contents.str();
+	if (s.empty()) {
+		return NULL;
+	}
+	s.resize((s.size() + 1023) & ~(size_t)1023, '\0');
+	return acquire((const uint8_t*)s.data(), (uint32_t)s.size());
+#endif
+}
+
+void ROMImage::retain() {
+	std::lock_guard<std::mutex> guard(images_lock());
+	++references;
+}
+
+void ROMImage::release() {
+	{
+		std::lock_guard<std::mutex> guard(images_lock());
+		if (--references > 0) {
+			return;
+		}
+		typedef std::unordered_multimap<uint64_t, ROMImage*>::iterator iterator;
+		std::pair<iterator, iterator> range = images().equal_range(hash);
+		for (iterator it = range.first; it != range.second; ++it) {
+			if (it->second == this) {
+				images().erase(it);
+				break;
+			}
+		}
+	}
+	delete this;
+}
+
+uint32_t ROMImage::get_number_of_images() {
+	std::lock_guard<std::mutex> guard(images_lock());
+	return (uint32_t)images().size();
+}
+
+uint64_t ROMImage::get_total_size() {
+	std::lock_guard<std::mutex> guard(images_lock());
+	uint64_t total = 0;
+	for (std::unordered_multimap<uint64_t, ROMImage*>::iterator it = images().begin(); it != images().end(); ++it) {
+		total += it->second->size;
+	}
+	return total;
+}
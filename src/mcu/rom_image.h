@@ -0,0 +1,55 @@
+#ifndef _MCU_ROM_IMAGE_
+#define _MCU_ROM_IMAGE_
+
+#include <cstdint>
+#include <string>
+
+/*
+ * The read-only contents of one or more ROMs. Images are content-addressed:
+ * acquiring an image with the same contents as one that is already loaded
+ * returns that image instead of another copy, so any number of ROMs running
+ * the same firmware share a single buffer. Images are reference-counted
+ * and freed (or unmapped) when the last reference is released.
+ * Acquiring and releasing images is thread-safe.
+ */
+class ROMImage {
+public:
+	// Returns an image of nBytes (a multiple of 1024) copied from contents,
+	// or of zeroes if contents is NULL, with one reference held by the caller.
+	static ROMImage * acquire(const uint8_t *contents, uint32_t nBytes);
+	// Maps a raw firmware file into memory read-only, padded with zeroes to a whole
+	// number of 1 KB pages. Returns NULL if the file can't be read or is empty.
+	static ROMImage * map_file(const std::string &filename);
+
+	void retain();
+	void release();
+
+	const uint8_t * get_data() const { return data; }
+	uint32_t get_size() const { return size; }
+	// ROM::hash_contents() of the data
+	uint64_t get_hash() const { return hash; }
+	bool is_mapped() const { return mapped; }
+
+	// how many distinct images are loaded, and how many bytes they take up
+	static uint32_t get_number_of_images();
+	static uint64_t get_total_size();
+
+protected:
+	ROMImage(uint8_t *data, uint32_t size, uint64_t hash, bool mapped);
+	~ROMImage();
+
+	uint8_t *data;
+	uint32_t size;
+	uint64_t hash;
+	bool mapped; // by map_file(), rather than malloc'd
+	uint32_t references;
+
+	// returns an image identical to (data, size) that is already loaded, with a new reference, or NULL
+	static ROMImage * find_and_retain(const uint8_t *data, uint32_t size, uint64_t hash);
+
+private:
+	ROMImage(const ROMImage &);
+	ROMImage & operator=(const ROMImage &);
+};
+
+#endif // _MCU_ROM_IMAGE_
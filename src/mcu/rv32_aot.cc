@@ -0,0 +1,22 @@
+#include "rv32_aot.h"
+#include <vector>
+
+// constructed on first use, since registrations run during static initialization
+static std::vector<const RV32AOTImage*> & aot_images() {
+	static std::vector<const RV32AOTImage*> images;
+	return images;
+}
+
+RV32AOTRegistration::RV32AOTRegistration(const RV32AOTImage *image) {
+	aot_images().push_back(image);
+}
+
+const RV32AOTImage * find_aot_image(uint64_t hash, uint32_t size, uint32_t baseAddress) {
+	std::vector<const RV32AOTImage*> &images = aot_images();
+	for (size_t i = 0; i < images.size(); ++i) {
+		if (images[i]->hash == hash && images[i]->size == size && images[i]->baseAddress == baseAddress) {
+			return images[i];
+		}
+	}
+	return NULL;
+}
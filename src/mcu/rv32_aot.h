@@ -0,0 +1,45 @@
+#ifndef _MCU_RV32_AOT_
+#define _MCU_RV32_AOT_
+
+#include <cstdint>
+#include "system_bus.h"
+#include "decoded_instruction.h"
+#include "rv32_jit.h"
+
+/*
+ * Firmware images translated ahead of time into C++ by the rv32_aot tool
+ * and compiled into the simulator (see add_rv32_aot_firmware() in mcu/CMakeLists.txt).
+ *
+ * A translation is only valid for exactly the ROM contents it was made from,
+ * at the address it was made for, so images are looked up by ROM::get_content_hash().
+ * Like the JIT, translated code leaves SYSTEM instructions, AMOs, FENCE.I,
+ * illegal instructions and MMIO accesses to the interpreter.
+ */
+struct RV32AOTImage {
+	// Runs from pc until the first branch or jump, or until something the interpreter
+	// has to handle (with e.instructions possibly 0). Returns false if pc isn't in the image.
+	typedef bool (*RunFunction)(uint32_t *xRegister, SystemBus *bus, uint32_t pc, RV32JIT::Exit &e);
+
+	uint64_t hash; // ROM::hash_contents() of the whole ROM
+	uint32_t baseAddress;
+	uint32_t size; // in bytes
+	RunFunction run;
+};
+
+// Returns the image translated from a ROM with this hash and size at baseAddress, or NULL.
+const RV32AOTImage * find_aot_image(uint64_t hash, uint32_t size, uint32_t baseAddress);
+
+// Generated code registers its image with a static instance of this.
+class RV32AOTRegistration {
+public:
+	RV32AOTRegistration(const RV32AOTImage *image);
+};
+
+// used by the generated code
+inline bool rv32_aot_exit(RV32JIT::Exit &e, uint32_t pc, uint32_t n) {
+	e.pc = pc;
+	e.instructions = n;
+	return true;
+}
+
+#endif // _MCU_RV32_AOT_
@@ -0,0 +1,192 @@
+/*
+ * rv32_aot: translates a firmware image into C++ that registers itself with the
+ * simulator as an RV32AOTImage (see rv32_aot.h).
+ *
+ * usage: rv32_aot <image> <base address> <ROM pages> <output.cc>
+ *
+ * The image is either raw binary or a .hex file (see firmware_file.h).
+ * It is padded with zeroes to fill the given number of ROM pages, and only matches
+ * a ROM of exactly that size.
+ *
+ * Every word in the image becomes a case in one switch statement, with each instruction
+ * falling through to the next, so execution can start at any address; a block ends at
+ * the first branch or jump, or just before anything that the interpreter must handle.
+ */
+
+#include "rom.h"
+#include "firmware_file.h"
+#include "decoded_instruction.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::string hex(uint32_t value) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "0x%08xu", value);
+	return buf;
+}
+
+static std::string reg(uint8_t r) {
+	return "x[" + std::to_string(r) + "]";
+}
+
+static std::string imm(int32_t value) {
+	return "(uint32_t)" + std::to_string(value);
+}
+
+// the statement(s) for one instruction at pc
+static std::string translate(const DecodedInstruction &d, uint32_t pc) {
+	std::string rd = reg(d.rd), rs1 = reg(d.rs1), rs2 = reg(d.rs2);
+	std::string exitHere = "return rv32_aot_exit(e, " + hex(pc) + ", n);";
+	std::string value, condition;
+	const char *loadType = NULL, *loadExtend = "";
+	const char *storeType = NULL;
+
+	switch (d.op) {
+	case RV32_LUI: value = hex(d.imm); break;
+	case RV32_AUIPC: value = hex(pc + d.imm); break;
+	case RV32_JAL:
+		return (d.rd != 0 ? rd + " = " + hex(pc + 4) + "; " : std::string())
+			+ "return rv32_aot_exit(e, " + hex(pc + d.imm) + ", n + 1);";
+	case RV32_JALR:
+		return "{ uint32_t target = (" + rs1 + " + " + imm(d.imm) + ") & ~1u; "
+			+ (d.rd != 0 ? rd + " = " + hex(pc + 4) + "; " : std::string())
+			+ "return rv32_aot_exit(e, target, n + 1); }";
+
+	case RV32_BEQ: condition = rs1 + " == " + rs2; break;
+	case RV32_BNE: condition = rs1 + " != " + rs2; break;
+	case RV32_BLT: condition = "(int32_t)" + rs1 + " < (int32_t)" + rs2; break;
+	case RV32_BGE: condition = "(int32_t)" + rs1 + " >= (int32_t)" + rs2; break;
+	case RV32_BLTU: condition = rs1 + " < " + rs2; break;
+	case RV32_BGEU: condition = rs1 + " >= " + rs2; break;
+
+	case RV32_LB: loadType = "uint8_t"; loadExtend = "(uint32_t)(int8_t)"; break;
+	case RV32_LH: loadType = "uint16_t"; loadExtend = "(uint32_t)(int16_t)"; break;
+	case RV32_LW: loadType = "uint32_t"; break;
+	case RV32_LBU: loadType = "uint8_t"; break;
+	case RV32_LHU: loadType = "uint16_t"; break;
+	case RV32_SB: storeType = "uint8_t"; break;
+	case RV32_SH: storeType = "uint16_t"; break;
+	case RV32_SW: storeType = "uint32_t"; break;
+
+	case RV32_ADDI: value = rs1 + " + " + imm(d.imm); break;
+	case RV32_SLTI: value = "(uint32_t)((int32_t)" + rs1 + " < " + std::to_string(d.imm) + ")"; break;
+	case RV32_SLTIU: value = "(uint32_t)(" + rs1 + " < " + imm(d.imm) + ")"; break;
+	case RV32_XORI: value = rs1 + " ^ " + imm(d.imm); break;
+	case RV32_ORI: value = rs1 + " | " + imm(d.imm); break;
+	case RV32_ANDI: value = rs1 + " & " + imm(d.imm); break;
+	case RV32_SLLI: value = rs1 + " << " + std::to_string(d.imm); break;
+	case RV32_SRLI: value = rs1 + " >> " + std::to_string(d.imm); break;
+	case RV32_SRAI: value = "(uint32_t)((int32_t)" + rs1 + " >> " + std::to_string(d.imm) + ")"; break;
+
+	case RV32_ADD: value = rs1 + " + " + rs2; break;
+	case RV32_SUB: value = rs1 + " - " + rs2; break;
+	case RV32_SLL: value = rs1 + " << (" + rs2 + " & 31)"; break;
+	case RV32_SLT: value = "(uint32_t)((int32_t)" + rs1 + " < (int32_t)" + rs2 + ")"; break;
+	case RV32_SLTU: value = "(uint32_t)(" + rs1 + " < " + rs2 + ")"; break;
+	case RV32_XOR: value = rs1 + " ^ " + rs2; break;
+	case RV32_SRL: value = rs1 + " >> (" + rs2 + " & 31)"; break;
+	case RV32_SRA: value = "(uint32_t)((int32_t)" + rs1 + " >> (" + rs2 + " & 31))"; break;
+	case RV32_OR: value = rs1 + " | " + rs2; break;
+	case RV32_AND: value = rs1 + " & " + rs2; break;
+	case RV32_MUL: value = rs1 + " * " + rs2; break;
+	case RV32_MULH:
+		value = "(uint32_t)(((int64_t)(int32_t)" + rs1 + " * (int64_t)(int32_t)" + rs2 + ") >> 32)"; break;
+	case RV32_MULHSU:
+		value = "(uint32_t)((uint64_t)((int64_t)(int32_t)" + rs1 + " * (int64_t)" + rs2 + ") >> 32)"; break;
+	case RV32_MULHU: value = "(uint32_t)(((uint64_t)" + rs1 + " * (uint64_t)" + rs2 + ") >> 32)"; break;
+	case RV32_DIV: value = "rv32_div(" + rs1 + ", " + rs2 + ")"; break;
+	case RV32_DIVU: value = "rv32_divu(" + rs1 + ", " + rs2 + ")"; break;
+	case RV32_REM: value = "rv32_rem(" + rs1 + ", " + rs2 + ")"; break;
+	case RV32_REMU: value = "rv32_remu(" + rs1 + ", " + rs2 + ")"; break;
+
+	case RV32_FENCE: return "++n;";
+	default:
+		// SYSTEM, AMO, FENCE.I and illegal instructions are left to the interpreter
+		return exitHere;
+	}
+
+	if (!condition.empty()) {
+		return "return rv32_aot_exit(e, (" + condition + ") ? " + hex(pc + d.imm) + " : "
+			+ hex(pc + 4) + ", n + 1);";
+	}
+	if (loadType != NULL) {
+		return std::string("{ ") + loadType + " v; if (!bus->load_direct(" + rs1 + " + " + imm(d.imm)
+			+ ", v)) { " + exitHere + " }" + (d.rd != 0 ? " " + rd + " = " + loadExtend + "v;" : std::string())
+			+ " } ++n;";
+	}
+	if (storeType != NULL) {
+		return std::string("if (!bus->store_direct(") + rs1 + " + " + imm(d.imm) + ", (" + storeType + ")"
+			+ rs2 + ")) { " + exitHere + " } ++n;";
+	}
+	return (d.rd != 0 ? rd + " = " + value + "; " : std::string()) + "++n;";
+}
+
+int main(int argc, char **argv) {
+	if (argc != 5) {
+		fprintf(stderr, "usage: %s <image> <base address> <ROM pages> <output.cc>\n", argv[0]);
+		return 1;
+	}
+	std::string imageFilename = argv[1];
+	uint32_t baseAddress = (uint32_t)strtoul(argv[2], NULL, 0);
+	uint32_t nPages = (uint32_t)strtoul(argv[3], NULL, 0);
+	uint32_t size = 1024 * nPages;
+
+	std::vector<uint8_t> image;
+	if (!read_firmware_file(imageFilename, image)) {
+		return 1;
+	}
+	if (image.size() > size) {
+		fprintf(stderr, "%s: %s is %u bytes, which doesn't fit in %u ROM pages\n",
+				argv[0], imageFilename.c_str(), (unsigned)image.size(), nPages);
+		return 1;
+	}
+	image.resize(size, 0);
+	uint64_t hash = ROM::hash_contents(image.data(), image.size());
+
+	// the zero padding at the end is left untranslated
+	uint32_t nWords = size / 4;
+	while (nWords > 0 && image[4*nWords-4] == 0 && image[4*nWords-3] == 0
+			&& image[4*nWords-2] == 0 && image[4*nWords-1] == 0) {
+		--nWords;
+	}
+
+	std::ostringstream out;
+	out << "// Generated by rv32_aot from " << imageFilename << "; do not edit.\n\n";
+	out << "#include \"rv32_aot.h\"\n\n";
+	out << "static bool run(uint32_t *x, SystemBus *bus, uint32_t pc, RV32JIT::Exit &e) {\n";
+	out << "\tuint32_t n = 0;\n";
+	out << "\tswitch (pc) {\n";
+	out << "\tdefault:\n\t\treturn false;\n";
+	for (uint32_t i = 0; i < nWords; ++i) {
+		uint32_t word = (uint32_t)image[4*i] | ((uint32_t)image[4*i+1] << 8)
+				| ((uint32_t)image[4*i+2] << 16) | ((uint32_t)image[4*i+3] << 24);
+		DecodedInstruction d;
+		decode_instruction(word, d);
+		uint32_t pc = baseAddress + 4*i;
+		out << "\tcase " << hex(pc) << ": // " << hex(word).substr(0, 10) << "\n";
+		out << "\t\t" << translate(d, pc) << "\n";
+	}
+	out << "\t}\n";
+	out << "\treturn rv32_aot_exit(e, " << hex(baseAddress + 4*nWords) << ", n);\n";
+	out << "}\n\n";
+
+	char hashString[32];
+	snprintf(hashString, sizeof(hashString), "0x%016llxULL", (unsigned long long)hash);
+	out << "static const RV32AOTImage image = { " << hashString << ", "
+		<< hex(baseAddress) << ", " << hex(size) << ", &run };\n";
+	out << "static RV32AOTRegistration registration(&image);\n";
+
+	std::ofstream file(argv[4]);
+	file << out.str();
+	if (!file) {
+		fprintf(stderr, "%s: can't write %s\n", argv[0], argv[4]);
+		return 1;
+	}
+	return 0;
+}
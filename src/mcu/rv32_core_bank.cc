@@ -0,0 +1,404 @@
+#include "rv32_core_bank.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+static const uint32_t LANES = 8;
+
+/*
+ * The operations the bank runs across cores: lane() for one core,
+ * and lanes() for 8 at once, where AVX2 has an equivalent.
+ * Conditions return true (lane()) or all ones (lanes()) where they hold.
+ */
+#if defined(__AVX2__)
+#define LANES_OP(body) static __m256i lanes(__m256i a, __m256i b) { return body; }
+static inline __m256i flip_sign(__m256i v) { return _mm256_xor_si256(v, _mm256_set1_epi32((int)0x80000000)); }
+static inline __m256i shift_amount(__m256i v) { return _mm256_and_si256(v, _mm256_set1_epi32(31)); }
+#else
+#define LANES_OP(body)
+#endif
+
+struct OpAdd { static uint32_t lane(uint32_t a, uint32_t b) { return a + b; } LANES_OP(_mm256_add_epi32(a, b)) };
+struct OpSub { static uint32_t lane(uint32_t a, uint32_t b) { return a - b; } LANES_OP(_mm256_sub_epi32(a, b)) };
+struct OpAnd { static uint32_t lane(uint32_t a, uint32_t b) { return a & b; } LANES_OP(_mm256_and_si256(a, b)) };
+struct OpOr { static uint32_t lane(uint32_t a, uint32_t b) { return a | b; } LANES_OP(_mm256_or_si256(a, b)) };
+struct OpXor { static uint32_t lane(uint32_t a, uint32_t b) { return a ^ b; } LANES_OP(_mm256_xor_si256(a, b)) };
+struct OpSll { static uint32_t lane(uint32_t a, uint32_t b) { return a << (b & 31); }
+	LANES_OP(_mm256_sllv_epi32(a, shift_amount(b))) };
+struct OpSrl { static uint32_t lane(uint32_t a, uint32_t b) { return a >> (b & 31); }
+	LANES_OP(_mm256_srlv_epi32(a, shift_amount(b))) };
+struct OpSra { static uint32_t lane(uint32_t a, uint32_t b) { return (uint32_t)((int32_t)a >> (b & 31)); }
+	LANES_OP(_mm256_srav_epi32(a, shift_amount(b))) };
+struct OpSlt { static uint32_t lane(uint32_t a, uint32_t b) { return ((int32_t)a < (int32_t)b) ? 1 : 0; }
+	LANES_OP(_mm256_srli_epi32(_mm256_cmpgt_epi32(b, a), 31)) };
+struct OpSltu { static uint32_t lane(uint32_t a, uint32_t b) { return (a < b) ? 1 : 0; }
+	LANES_OP(_mm256_srli_epi32(_mm256_cmpgt_epi32(flip_sign(b), flip_sign(a)), 31)) };
+struct OpMul { static uint32_t lane(uint32_t a, uint32_t b) { return a * b; } LANES_OP(_mm256_mullo_epi32(a, b)) };
+
+// no AVX2 equivalent
+struct OpMulh { static uint32_t lane(uint32_t a, uint32_t b) {
+	return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32); } };
+struct OpMulhsu { static uint32_t lane(uint32_t a, uint32_t b) {
+	return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(uint64_t)b) >> 32); } };
+struct OpMulhu { static uint32_t lane(uint32_t a, uint32_t b) {
+	return (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32); } };
+struct OpDiv { static uint32_t lane(uint32_t a, uint32_t b) { return rv32_div(a, b); } };
+struct OpDivu { static uint32_t lane(uint32_t a, uint32_t b) { return rv32_divu(a, b); } };
+struct OpRem { static uint32_t lane(uint32_t a, uint32_t b) { return rv32_rem(a, b); } };
+struct OpRemu { static uint32_t lane(uint32_t a, uint32_t b) { return rv32_remu(a, b); } };
+
+// AVX2 has no "not equal" or "greater or equal" comparisons, so for those conditions
+// lanes() returns all ones where they don't hold, and inverse is set
+struct CondEq { static const bool inverse = false; static bool lane(uint32_t a, uint32_t b) { return a == b; }
+	LANES_OP(_mm256_cmpeq_epi32(a, b)) };
+struct CondNe { static const bool inverse = true; static bool lane(uint32_t a, uint32_t b) { return a != b; }
+	LANES_OP(_mm256_cmpeq_epi32(a, b)) };
+struct CondLt { static const bool inverse = false; static bool lane(uint32_t a, uint32_t b) { return (int32_t)a < (int32_t)b; }
+	LANES_OP(_mm256_cmpgt_epi32(b, a)) };
+struct CondGe { static const bool inverse = true; static bool lane(uint32_t a, uint32_t b) { return (int32_t)a >= (int32_t)b; }
+	LANES_OP(_mm256_cmpgt_epi32(b, a)) };
+struct CondLtu { static const bool inverse = false; static bool lane(uint32_t a, uint32_t b) { return a < b; }
+	LANES_OP(_mm256_cmpgt_epi32(flip_sign(b), flip_sign(a))) };
+struct CondGeu { static const bool inverse = true; static bool lane(uint32_t a, uint32_t b) { return a >= b; }
+	LANES_OP(_mm256_cmpgt_epi32(flip_sign(b), flip_sign(a))) };
+
+#undef LANES_OP
+
+RV32CoreBank::RV32CoreBank(const std::vector<RV32Core*> &cores)
+: cores(cores), nCores((uint32_t)cores.size()),
+  stride(((uint32_t)cores.size() + LANES - 1) / LANES * LANES),
+  x(32 * stride, 0), pc(stride, 0), active(stride, 0), remaining(stride, 0), instret(stride, 0),
+  steps(0), coreInstructions(0) {}
+
+bool RV32CoreBank::is_vectorized() {
+#if defined(__AVX2__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+void RV32CoreBank::gather(uint64_t cycleBudget) {
+	for (uint32_t i = 0; i < nCores; ++i) {
+		RV32Core *core = cores[i];
+		core->trapped = false;
+		core->sync_trace();
+		core->poll_peripherals();
+		if (core->sleeping && core->is_sleeping()) {
+			core->idleCycles += cycleBudget;
+			remaining[i] = 0;
+		} else {
+			remaining[i] = cycleBudget;
+		}
+		for (int r = 0; r < 32; ++r) {
+			x[r * stride + i] = core->xRegister[r];
+		}
+		x[i] = 0;
+		pc[i] = core->pc;
+		instret[i] = core->instret;
+	}
+}
+
+void RV32CoreBank::scatter() {
+	for (uint32_t i = 0; i < nCores; ++i) {
+		RV32Core *core = cores[i];
+		for (int r = 0; r < 32; ++r) {
+			core->xRegister[r] = x[r * stride + i];
+		}
+		core->pc = pc[i];
+		core->instret = instret[i];
+	}
+}
+
+void RV32CoreBank::run(uint64_t cycleBudget) {
+	gather(cycleBudget);
+	// the ROM may have new contents, or a core a restored state, since the last run
+	icache.flush();
+	SystemBus *bus = cores.empty() ? NULL : cores[0]->get_system_bus();
+	// true while every core with cycles left is at the same PC as the first core that ran the last step,
+	// so the next step doesn't need to look for the lowest PC
+	bool together = false;
+	uint32_t leader = 0;
+	uint32_t stepPC = 0;
+	for (;;) {
+		if (together) {
+			stepPC = pc[leader];
+		} else {
+			// the lowest PC of any core with cycles left
+			bool found = false;
+			for (uint32_t i = 0; i < nCores; ++i) {
+				if (remaining[i] > 0 && (!found || pc[i] < stepPC)) {
+					stepPC = pc[i];
+					found = true;
+				}
+			}
+			if (!found) {
+				break;
+			}
+		}
+		// branch-free, so that it vectorizes
+		uint32_t nActive = 0;
+		uint32_t nLeft = 0;
+		for (uint32_t i = 0; i < nCores; ++i) {
+			uint32_t left = (uint32_t)(remaining[i] > 0);
+			uint32_t here = left & (uint32_t)(pc[i] == stepPC);
+			nLeft += left;
+			active[i] = 0 - here;
+			remaining[i] -= here;
+			instret[i] += here;
+			nActive += here;
+		}
+		if (nActive == 0) {
+			break;
+		}
+		leader = 0;
+		while (!active[leader]) {
+			++leader;
+		}
+
+		DecodedInstruction d;
+		InstructionCache::Entry &entry = icache.lookup(stepPC);
+		if ((stepPC & 0x00000003) == 0 && entry.holds(stepPC)) {
+			d = entry.insn;
+		} else if ((stepPC & 0x00000003) == 0 && bus->is_read_only(stepPC)) {
+			// stores don't reach this cache (it isn't registered with the bus), so it only holds code from ROM
+			decode_instruction(bus->load_word(stepPC), entry.insn);
+			entry.fill(stepPC);
+			d = entry.insn;
+		} else {
+			decode_instruction(bus->load_word(stepPC), d);
+		}
+		together = step(stepPC, d) && nActive == nLeft;
+		++steps;
+		coreInstructions += nActive;
+	}
+	scatter();
+}
+
+template <typename Op> void RV32CoreBank::alu(const DecodedInstruction &d, bool immediate) {
+	if (d.rd == 0) {
+		return;
+	}
+	uint32_t *result = column(d.rd);
+	const uint32_t *a = column(d.rs1);
+	const uint32_t *b = column(d.rs2);
+	uint32_t imm = (uint32_t)d.imm;
+#if defined(__AVX2__)
+	__m256i vImm = _mm256_set1_epi32((int)imm);
+	for (uint32_t i = 0; i < stride; i += LANES) {
+		__m256i mask = _mm256_loadu_si256((const __m256i*)&active[i]);
+		__m256i va = _mm256_loadu_si256((const __m256i*)&a[i]);
+		__m256i vb = immediate ? vImm : _mm256_loadu_si256((const __m256i*)&b[i]);
+		__m256i old = _mm256_loadu_si256((const __m256i*)&result[i]);
+		_mm256_storeu_si256((__m256i*)&result[i], _mm256_blendv_epi8(old, Op::lanes(va, vb), mask));
+	}
+#else
+	for (uint32_t i = 0; i < nCores; ++i) {
+		if (active[i]) {
+			result[i] = Op::lane(a[i], immediate ? imm : b[i]);
+		}
+	}
+#endif
+}
+
+template <typename Op> void RV32CoreBank::alu_per_core(const DecodedInstruction &d) {
+	if (d.rd == 0) {
+		return;
+	}
+	uint32_t *result = column(d.rd);
+	const uint32_t *a = column(d.rs1);
+	const uint32_t *b = column(d.rs2);
+	for (uint32_t i = 0; i < nCores; ++i) {
+		if (active[i]) {
+			result[i] = Op::lane(a[i], b[i]);
+		}
+	}
+}
+
+template <typename Condition> void RV32CoreBank::branch(const DecodedInstruction &d, uint32_t stepPC) {
+	const uint32_t *a = column(d.rs1);
+	const uint32_t *b = column(d.rs2);
+	uint32_t taken = stepPC + d.imm;
+	uint32_t notTaken = stepPC + 4;
+#if defined(__AVX2__)
+	__m256i vTaken = _mm256_set1_epi32((int)(Condition::inverse ? notTaken : taken));
+	__m256i vNotTaken = _mm256_set1_epi32((int)(Condition::inverse ? taken : notTaken));
+	for (uint32_t i = 0; i < stride; i += LANES) {
+		__m256i mask = _mm256_loadu_si256((const __m256i*)&active[i]);
+		__m256i condition = Condition::lanes(_mm256_loadu_si256((const __m256i*)&a[i]),
+				_mm256_loadu_si256((const __m256i*)&b[i]));
+		__m256i target = _mm256_blendv_epi8(vNotTaken, vTaken, condition);
+		__m256i old = _mm256_loadu_si256((const __m256i*)&pc[i]);
+		_mm256_storeu_si256((__m256i*)&pc[i], _mm256_blendv_epi8(old, target, mask));
+	}
+#else
+	for (uint32_t i = 0; i < nCores; ++i) {
+		if (active[i]) {
+			pc[i] = Condition::lane(a[i], b[i]) ? taken : notTaken;
+		}
+	}
+#endif
+	trace_transfers(stepPC);
+}
+
+// the active cores that didn't go on to stepPC + 4 took a branch or jump, which goes into their traces
+void RV32CoreBank::trace_transfers(uint32_t stepPC) {
+	for (uint32_t i = 0; i < nCores; ++i) {
+		if (active[i] && pc[i] != stepPC + 4) {
+			cores[i]->trace.transfer(stepPC, pc[i], instret[i]);
+		}
+	}
+}
+
+void RV32CoreBank::set_pc(uint32_t target) {
+	for (uint32_t i = 0; i < nCores; ++i) {
+		pc[i] = active[i] ? target : pc[i];
+	}
+}
+
+void RV32CoreBank::set_register(int rd, uint32_t value) {
+	if (rd == 0) {
+		return;
+	}
+	uint32_t *result = column(rd);
+	for (uint32_t i = 0; i < nCores; ++i) {
+		result[i] = active[i] ? value : result[i];
+	}
+}
+
+bool RV32CoreBank::step(uint32_t stepPC, const DecodedInstruction &d) {
+	const uint32_t next = stepPC + 4;
+	const uint32_t *a = column(d.rs1);
+	const uint32_t *b = column(d.rs2);
+
+	switch (d.op) {
+	case RV32_LUI: set_register(d.rd, (uint32_t)d.imm); break;
+	case RV32_AUIPC: set_register(d.rd, stepPC + d.imm); break;
+	case RV32_JAL:
+		set_register(d.rd, next);
+		set_pc(stepPC + d.imm);
+		trace_transfers(stepPC);
+		return true;
+	case RV32_JALR:
+		for (uint32_t i = 0; i < nCores; ++i) {
+			if (active[i]) {
+				pc[i] = (a[i] + d.imm) & ~0x00000001;
+			}
+		}
+		set_register(d.rd, next);
+		trace_transfers(stepPC);
+		return false;
+
+	case RV32_BEQ: branch<CondEq>(d, stepPC); return false;
+	case RV32_BNE: branch<CondNe>(d, stepPC); return false;
+	case RV32_BLT: branch<CondLt>(d, stepPC); return false;
+	case RV32_BGE: branch<CondGe>(d, stepPC); return false;
+	case RV32_BLTU: branch<CondLtu>(d, stepPC); return false;
+	case RV32_BGEU: branch<CondGeu>(d, stepPC); return false;
+
+	// each core has its own memory
+	case RV32_LB: case RV32_LH: case RV32_LW: case RV32_LBU: case RV32_LHU:
+	{
+		uint32_t *result = column(d.rd);
+		for (uint32_t i = 0; i < nCores; ++i) {
+			if (!active[i]) {
+				continue;
+			}
+			SystemBus *bus = cores[i]->get_system_bus();
+			uint32_t addr = a[i] + d.imm;
+			uint32_t value;
+			switch (d.op) {
+			case RV32_LB: value = (uint32_t)(int32_t)(int8_t)bus->load_byte(addr); break;
+			case RV32_LH: value = (uint32_t)(int32_t)(int16_t)bus->load_halfword(addr); break;
+			case RV32_LW: value = bus->load_word(addr); break;
+			case RV32_LBU: value = bus->load_byte(addr); break;
+			default: value = bus->load_halfword(addr); break;
+			}
+			if (d.rd != 0) {
+				result[i] = value;
+			}
+		}
+	} break;
+	case RV32_SB: case RV32_SH: case RV32_SW:
+		for (uint32_t i = 0; i < nCores; ++i) {
+			if (!active[i]) {
+				continue;
+			}
+			SystemBus *bus = cores[i]->get_system_bus();
+			uint32_t addr = a[i] + d.imm;
+			switch (d.op) {
+			case RV32_SB: bus->store_byte(addr, (uint8_t)b[i]); break;
+			case RV32_SH: bus->store_halfword(addr, (uint16_t)b[i]); break;
+			default: bus->store_word(addr, b[i]); break;
+			}
+		}
+		break;
+
+	case RV32_ADDI: alu<OpAdd>(d, true); break;
+	case RV32_SLTI: alu<OpSlt>(d, true); break;
+	case RV32_SLTIU: alu<OpSltu>(d, true); break;
+	case RV32_XORI: alu<OpXor>(d, true); break;
+	case RV32_ORI: alu<OpOr>(d, true); break;
+	case RV32_ANDI: alu<OpAnd>(d, true); break;
+	case RV32_SLLI: alu<OpSll>(d, true); break;
+	case RV32_SRLI: alu<OpSrl>(d, true); break;
+	case RV32_SRAI: alu<OpSra>(d, true); break;
+
+	case RV32_ADD: alu<OpAdd>(d, false); break;
+	case RV32_SUB: alu<OpSub>(d, false); break;
+	case RV32_SLL: alu<OpSll>(d, false); break;
+	case RV32_SLT: alu<OpSlt>(d, false); break;
+	case RV32_SLTU: alu<OpSltu>(d, false); break;
+	case RV32_XOR: alu<OpXor>(d, false); break;
+	case RV32_SRL: alu<OpSrl>(d, false); break;
+	case RV32_SRA: alu<OpSra>(d, false); break;
+	case RV32_OR: alu<OpOr>(d, false); break;
+	case RV32_AND: alu<OpAnd>(d, false); break;
+	case RV32_MUL: alu<OpMul>(d, false); break;
+	case RV32_MULH: alu_per_core<OpMulh>(d); break;
+	case RV32_MULHSU: alu_per_core<OpMulhsu>(d); break;
+	case RV32_MULHU: alu_per_core<OpMulhu>(d); break;
+	case RV32_DIV: alu_per_core<OpDiv>(d); break;
+	case RV32_DIVU: alu_per_core<OpDivu>(d); break;
+	case RV32_REM: alu_per_core<OpRem>(d); break;
+	case RV32_REMU: alu_per_core<OpRemu>(d); break;
+
+	case RV32_FENCE: break;
+
+	default:
+		for (uint32_t i = 0; i < nCores; ++i) {
+			if (active[i]) {
+				step_core(i, stepPC, d);
+			}
+		}
+		return false;
+	}
+	set_pc(next);
+	return true;
+}
+
+// the instruction goes to the core's own interpreter, with the core's registers copied in and back out
+void RV32CoreBank::step_core(uint32_t i, uint32_t stepPC, const DecodedInstruction &d) {
+	RV32Core *core = cores[i];
+	for (int r = 0; r < 32; ++r) {
+		core->xRegister[r] = x[r * stride + i];
+	}
+	core->pc = stepPC;
+	core->next_pc = stepPC + 4;
+	// instret already counts this instruction
+	core->instret = instret[i] - 1;
+	core->execute(d);
+	core->instret = instret[i];
+	pc[i] = core->next_pc;
+	if (pc[i] != stepPC + 4) {
+		// trapped (which the trace already has) or returned from a trap
+		core->trace.transfer(stepPC, pc[i], instret[i]);
+	}
+	for (int r = 1; r < 32; ++r) {
+		x[r * stride + i] = core->xRegister[r];
+	}
+	if (core->sleeping) {
+		core->idleCycles += remaining[i];
+		remaining[i] = 0;
+	}
+}
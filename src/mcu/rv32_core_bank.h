@@ -0,0 +1,69 @@
+#ifndef _MCU_RV32_CORE_BANK_
+#define _MCU_RV32_CORE_BANK_
+
+#include <cstdint>
+#include <vector>
+#include "rv32core.h"
+#include "decoded_instruction.h"
+#include "instruction_cache.h"
+
+/*
+ * Experimental: runs a group of cores with the same firmware in lockstep.
+ * The bank keeps their registers column-wise (each register of every core side by side)
+ * and interprets each instruction once for all of the cores at the lowest PC,
+ * 8 cores at a time with AVX2 when the build has it. Cores that branch apart
+ * take turns until they reach the same PC again (the lowest PC always goes first,
+ * so they meet up again after an if/else or at the top of a loop).
+ * Loads and stores go through each core's own bus, and anything that isn't plain integer
+ * arithmetic or control flow (CSRs, traps, AMOs, ...) goes to each core's own interpreter.
+ *
+ * Instructions are fetched from the first core, so every core must have the same code at
+ * every address any of them runs (e.g. the same ROM image). Only code in ROM is kept decoded,
+ * and only until the end of run(), so code the cores write to RAM, new ROM contents
+ * and restored states are all picked up.
+ * Peripherals are only polled at the start of run(), so timer deadlines within the budget
+ * aren't met exactly, and a core that goes to sleep stays asleep until the next run().
+ * Each core's trace (see RV32Trace) gets the same records as if it had run on its own.
+ */
+class RV32CoreBank {
+public:
+	RV32CoreBank(const std::vector<RV32Core*> &cores);
+
+	// Runs every core for cycleBudget cycles (one per instruction).
+	void run(uint64_t cycleBudget);
+
+	uint32_t get_number_of_cores() const { return nCores; }
+	// instructions interpreted by the bank, and how many cores ran them in total
+	uint64_t get_steps() const { return steps; }
+	uint64_t get_core_instructions() const { return coreInstructions; }
+	// true if the bank interprets instructions for 8 cores at a time
+	static bool is_vectorized();
+
+protected:
+	std::vector<RV32Core*> cores;
+	uint32_t nCores;
+	uint32_t stride; // nCores rounded up to a whole number of vectors
+	std::vector<uint32_t> x; // register r of core i is x[r * stride + i]
+	std::vector<uint32_t> pc;
+	std::vector<uint32_t> active; // all ones for the cores at the PC being stepped, otherwise 0
+	std::vector<uint64_t> remaining; // cycles left in each core's budget
+	std::vector<uint64_t> instret;
+	InstructionCache icache; // decoded code from ROM, flushed by every run()
+	uint64_t steps;
+	uint64_t coreInstructions;
+
+	uint32_t * column(int r) { return &x[r * stride]; }
+	void gather(uint64_t cycleBudget);
+	void scatter();
+	// one instruction at stepPC, for the active cores; returns true if they all went on to the same PC
+	bool step(uint32_t stepPC, const DecodedInstruction &d);
+	void step_core(uint32_t core, uint32_t stepPC, const DecodedInstruction &d);
+	template <typename Op> void alu(const DecodedInstruction &d, bool immediate);
+	template <typename Op> void alu_per_core(const DecodedInstruction &d);
+	template <typename Condition> void branch(const DecodedInstruction &d, uint32_t stepPC);
+	void trace_transfers(uint32_t stepPC);
+	void set_pc(uint32_t target);
+	void set_register(int rd, uint32_t value);
+};
+
+#endif // _MCU_RV32_CORE_BANK_
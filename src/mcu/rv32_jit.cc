@@ -0,0 +1,484 @@
+#include "rv32_jit.h"
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define RV32_JIT_SUPPORTED 1
+#else
+#define RV32_JIT_SUPPORTED 0
+#endif
+
+/*
+ * Helpers called from translated code. Loads return the (extended) value,
+ * or JIT_EXIT if the access has to go through the interpreter.
+ */
+
+static const uint64_t JIT_EXIT = 0x100000000ULL;
+
+static uint64_t jit_lb(SystemBus *bus, uint32_t addr) {
+	uint8_t v;
+	if (!bus->load_direct(addr, v)) return JIT_EXIT;
+	return (uint32_t)(int32_t)(int8_t)v;
+}
+static uint64_t jit_lh(SystemBus *bus, uint32_t addr) {
+	uint16_t v;
+	if (!bus->load_direct(addr, v)) return JIT_EXIT;
+	return (uint32_t)(int32_t)(int16_t)v;
+}
+static uint64_t jit_lw(SystemBus *bus, uint32_t addr) {
+	uint32_t v;
+	if (!bus->load_direct(addr, v)) return JIT_EXIT;
+	return v;
+}
+static uint64_t jit_lbu(SystemBus *bus, uint32_t addr) {
+	uint8_t v;
+	if (!bus->load_direct(addr, v)) return JIT_EXIT;
+	return v;
+}
+static uint64_t jit_lhu(SystemBus *bus, uint32_t addr) {
+	uint16_t v;
+	if (!bus->load_direct(addr, v)) return JIT_EXIT;
+	return v;
+}
+static bool jit_sb(SystemBus *bus, uint32_t addr, uint32_t value) {
+	return bus->store_direct(addr, (uint8_t)value);
+}
+static bool jit_sh(SystemBus *bus, uint32_t addr, uint32_t value) {
+	return bus->store_direct(addr, (uint16_t)value);
+}
+static bool jit_sw(SystemBus *bus, uint32_t addr, uint32_t value) {
+	return bus->store_direct(addr, value);
+}
+
+/*
+ * Encodes the handful of x86-64 instructions the translator needs.
+ * Translated code keeps rbx pointing at the guest register file and r12 at the bus,
+ * and only uses eax, ecx, edx, esi and edi as scratch registers.
+ */
+namespace {
+
+enum X86Register { EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESI = 6, EDI = 7 };
+
+// condition codes, as used by Jcc/SETcc/CMOVcc
+enum X86Condition { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD };
+
+// group-1 ALU operations: the /digit of 0x81 and the opcode of "op r32, r/m32"
+enum X86AluOp { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+static const uint8_t ALU_RM_OPCODE[8] = { 0x03, 0x0B, 0, 0, 0x23, 0x2B, 0x33, 0x3B };
+
+// group-2 shifts: the /digit of 0xC1 and 0xD3
+enum X86ShiftOp { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+class Emitter {
+public:
+	Emitter(uint8_t *buffer, size_t offset) : buffer(buffer), offset(offset) {}
+
+	size_t get_offset() const { return offset; }
+
+	void byte(uint8_t b) { buffer[offset++] = b; }
+	void imm32(uint32_t v) { memcpy(buffer + offset, &v, 4); offset += 4; }
+	void imm64(uint64_t v) { memcpy(buffer + offset, &v, 8); offset += 8; }
+
+	// ModRM for [rbx + 4*guestReg], which always fits in a disp8
+	void guest(int reg, int guestReg) {
+		byte(0x40 | (reg << 3) | EBX);
+		byte((uint8_t)(4 * guestReg));
+	}
+
+	// mov reg, x[guestReg]
+	void load(X86Register reg, int guestReg) { byte(0x8B); guest(reg, guestReg); }
+	// mov x[guestReg], reg
+	void store(int guestReg, X86Register reg) { byte(0x89); guest(reg, guestReg); }
+	// mov dword x[guestReg], imm
+	void store_imm(int guestReg, uint32_t imm) { byte(0xC7); guest(0, guestReg); imm32(imm); }
+	// movsxd r64, x[guestReg]
+	void load_sign_extended(X86Register reg, int guestReg) { byte(0x48); byte(0x63); guest(reg, guestReg); }
+
+	void mov_imm(X86Register reg, uint32_t imm) { byte(0xB8 + reg); imm32(imm); }
+	void mov(X86Register dst, X86Register src) { byte(0x89); byte(0xC0 | (src << 3) | dst); }
+
+	// op reg, x[guestReg]
+	void alu(X86AluOp op, X86Register reg, int guestReg) { byte(ALU_RM_OPCODE[op]); guest(reg, guestReg); }
+	// op reg, imm
+	void alu_imm(X86AluOp op, X86Register reg, uint32_t imm) { byte(0x81); byte(0xC0 | (op << 3) | reg); imm32(imm); }
+
+	void shift_imm(X86ShiftOp op, X86Register reg, uint8_t amount) { byte(0xC1); byte(0xC0 | (op << 3) | reg); byte(amount); }
+	// shift by cl
+	void shift_cl(X86ShiftOp op, X86Register reg) { byte(0xD3); byte(0xC0 | (op << 3) | reg); }
+
+	// imul reg, x[guestReg]
+	void imul(X86Register reg, int guestReg) { byte(0x0F); byte(0xAF); guest(reg, guestReg); }
+	// rax = high 32 bits of rax * rcx, in eax
+	void imul_high64() {
+		byte(0x48); byte(0x0F); byte(0xAF); byte(0xC1); // imul rax, rcx
+		byte(0x48); byte(0xC1); byte(0xE8); byte(32);   // shr rax, 32
+	}
+
+	// eax = condition ? 1 : 0
+	void set_eax(X86Condition cc) {
+		byte(0x0F); byte(0x90 + cc); byte(0xC0);  // setcc al
+		byte(0x0F); byte(0xB6); byte(0xC0);       // movzx eax, al
+	}
+	void cmov(X86Condition cc, X86Register dst, X86Register src) {
+		byte(0x0F); byte(0x40 + cc); byte(0xC0 | (dst << 3) | src);
+	}
+
+	// calls a C function; the first argument has already been placed in rdi etc.
+	void call(const void *f) {
+		byte(0x48); byte(0xB8); imm64((uint64_t)(uintptr_t)f); // mov rax, f
+		byte(0xFF); byte(0xD0);                                // call rax
+	}
+	void mov_rdi_bus() { byte(0x4C); byte(0x89); byte(0xE7); } // mov rdi, r12
+
+	// jumps over the next `length` bytes if the (load) helper's result is a value, not JIT_EXIT
+	void skip_unless_exit_load(uint8_t length) {
+		byte(0x48); byte(0x0F); byte(0xBA); byte(0xE0); byte(32); // bt rax, 32
+		byte(0x73); byte(length);                                 // jnc
+	}
+	// jumps over the next `length` bytes if the (store) helper returned true
+	void skip_unless_exit_store(uint8_t length) {
+		byte(0x84); byte(0xC0);      // test al, al
+		byte(0x75); byte(length);    // jnz
+	}
+
+	void jmp(size_t target) {
+		byte(0xE9);
+		imm32((uint32_t)(target - (offset + 4)));
+	}
+
+	// Leaves the block with eax = next pc; `instructions` have been retired.
+	// Always EXIT_LENGTH bytes long.
+	static const uint8_t EXIT_LENGTH = 15;
+	void exit(uint32_t nextPC, uint32_t instructions, size_t epilogue) {
+		mov_imm(EAX, nextPC);
+		exit_eax(instructions, epilogue);
+	}
+	void exit_eax(uint32_t instructions, size_t epilogue) {
+		mov_imm(EDX, instructions);
+		jmp(epilogue);
+	}
+
+protected:
+	uint8_t *buffer;
+	size_t offset;
+};
+
+// the most code a single guest instruction can turn into, with room to spare
+static const size_t MAX_INSTRUCTION_CODE = 64;
+static const size_t MAX_BLOCK_CODE = 32 + (RV32JIT::MAX_BLOCK_LENGTH + 1) * MAX_INSTRUCTION_CODE;
+
+}
+
+RV32JIT::RV32JIT(uint32_t *xRegister, SystemBus *bus)
+: xRegister(xRegister), bus(bus), code(NULL), codeSize(0), epilogue(0)
+{
+	flush();
+}
+
+RV32JIT::~RV32JIT() {
+#if RV32_JIT_SUPPORTED
+	if (code != NULL) {
+		munmap(code, CODE_BUFFER_SIZE);
+	}
+#endif
+}
+
+bool RV32JIT::is_supported() {
+	return RV32_JIT_SUPPORTED != 0;
+}
+
+void RV32JIT::flush() {
+	blocks.clear();
+	for (uint32_t i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+		blockCache[i].pc = 0x00000001; // never a block's address
+		blockCache[i].f = NULL;
+	}
+	codeSize = 0;
+}
+
+bool RV32JIT::map_code_buffer() {
+#if RV32_JIT_SUPPORTED
+	if (code == NULL) {
+		void *p = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			code = (uint8_t*)p;
+		}
+	}
+#endif
+	return code != NULL;
+}
+
+void RV32JIT::set_writable(bool writable) {
+#if RV32_JIT_SUPPORTED
+	mprotect(code, CODE_BUFFER_SIZE, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC));
+#endif
+}
+
+void RV32JIT::emit_epilogue() {
+	Emitter e(code, codeSize);
+	epilogue = e.get_offset();
+	// return ((uint64_t)edx << 32) | eax
+	e.byte(0x48); e.byte(0xC1); e.byte(0xE2); e.byte(32); // shl rdx, 32
+	e.byte(0x48); e.byte(0x09); e.byte(0xD0);             // or rax, rdx
+	e.byte(0x41); e.byte(0x5D);                           // pop r13
+	e.byte(0x41); e.byte(0x5C);                           // pop r12
+	e.byte(0x5B);                                         // pop rbx
+	e.byte(0xC3);                                         // ret
+	codeSize = e.get_offset();
+}
+
+bool RV32JIT::run(uint32_t pc, Exit &e) {
+	CachedBlock &cached = blockCache[(pc >> 2) & (BLOCK_CACHE_SIZE - 1)];
+	BlockFunction f;
+	if (cached.pc == pc) {
+		f = cached.f;
+	} else {
+		std::unordered_map<uint32_t, BlockFunction>::iterator it = blocks.find(pc);
+		if (it != blocks.end()) {
+			f = it->second;
+		} else {
+			f = NULL;
+			// only code in ROM is translated (see translate()), so nothing else needs the buffer
+			if ((pc & 0x00000003) == 0 && bus->is_read_only(pc) && map_code_buffer()) {
+				set_writable(true);
+				if (codeSize + MAX_BLOCK_CODE > CODE_BUFFER_SIZE) {
+					// out of room; start over
+					flush();
+				}
+				if (codeSize == 0) {
+					emit_epilogue();
+				}
+				f = translate(pc);
+				set_writable(false);
+			}
+			blocks[pc] = f;
+		}
+		cached.pc = pc;
+		cached.f = f;
+	}
+	if (f == NULL) {
+		return false;
+	}
+	uint64_t result = f(xRegister, bus);
+	e.pc = (uint32_t)result;
+	e.instructions = (uint32_t)(result >> 32);
+	return true;
+}
+
+RV32JIT::BlockFunction RV32JIT::translate(uint32_t pc) {
+	if (code == NULL || (pc & 0x00000003) != 0) {
+		return NULL;
+	}
+	Emitter e(code, codeSize);
+	size_t start = e.get_offset();
+	e.byte(0x53);                          // push rbx
+	e.byte(0x41); e.byte(0x54);            // push r12
+	e.byte(0x41); e.byte(0x55);            // push r13 (keeps the stack 16-byte aligned for calls)
+	e.byte(0x48); e.byte(0x89); e.byte(0xFB); // mov rbx, rdi
+	e.byte(0x49); e.byte(0x89); e.byte(0xF4); // mov r12, rsi
+
+	uint32_t n = 0; // instructions translated so far
+	bool ended = false;
+	while (!ended) {
+		uint32_t insnPC = pc + 4 * n;
+		uint32_t word;
+		if (n == MAX_BLOCK_LENGTH || !bus->is_read_only(insnPC) || !bus->load_direct(insnPC, word)) {
+			if (n == 0) {
+				// not in ROM
+				return NULL;
+			}
+			e.exit(insnPC, n, epilogue);
+			break;
+		}
+		DecodedInstruction d;
+		decode_instruction(word, d);
+		int rd = d.rd;
+		int rs1 = d.rs1;
+		int rs2 = d.rs2;
+		uint32_t imm = (uint32_t)d.imm;
+
+		switch (d.op) {
+		case RV32_LUI:
+			if (rd != 0) e.store_imm(rd, imm);
+			break;
+		case RV32_AUIPC:
+			if (rd != 0) e.store_imm(rd, insnPC + imm);
+			break;
+		case RV32_JAL:
+			if (rd != 0) e.store_imm(rd, insnPC + 4);
+			e.exit(insnPC + imm, n + 1, epilogue);
+			ended = true;
+			break;
+		case RV32_JALR:
+			e.load(EAX, rs1);
+			e.alu_imm(ALU_ADD, EAX, imm);
+			e.alu_imm(ALU_AND, EAX, ~0x00000001);
+			if (rd != 0) e.store_imm(rd, insnPC + 4);
+			e.exit_eax(n + 1, epilogue);
+			ended = true;
+			break;
+
+		case RV32_BEQ: case RV32_BNE: case RV32_BLT: case RV32_BGE: case RV32_BLTU: case RV32_BGEU:
+		{
+			X86Condition cc;
+			switch (d.op) {
+			case RV32_BEQ: cc = CC_E; break;
+			case RV32_BNE: cc = CC_NE; break;
+			case RV32_BLT: cc = CC_L; break;
+			case RV32_BGE: cc = CC_GE; break;
+			case RV32_BLTU: cc = CC_B; break;
+			default: cc = CC_AE; break;
+			}
+			e.load(ECX, rs1);
+			e.mov_imm(EAX, insnPC + 4);
+			e.mov_imm(EDX, insnPC + imm);
+			e.alu(ALU_CMP, ECX, rs2);
+			e.cmov(cc, EAX, EDX);
+			e.exit_eax(n + 1, epilogue);
+			ended = true;
+		} break;
+
+		case RV32_LB: case RV32_LH: case RV32_LW: case RV32_LBU: case RV32_LHU:
+		{
+			const void *helper;
+			switch (d.op) {
+			case RV32_LB: helper = (const void*)&jit_lb; break;
+			case RV32_LH: helper = (const void*)&jit_lh; break;
+			case RV32_LW: helper = (const void*)&jit_lw; break;
+			case RV32_LBU: helper = (const void*)&jit_lbu; break;
+			default: helper = (const void*)&jit_lhu; break;
+			}
+			e.mov_rdi_bus();
+			e.load(ESI, rs1);
+			e.alu_imm(ALU_ADD, ESI, imm);
+			e.call(helper);
+			e.skip_unless_exit_load(Emitter::EXIT_LENGTH);
+			e.exit(insnPC, n, epilogue);
+			if (rd != 0) e.store(rd, EAX);
+		} break;
+		case RV32_SB: case RV32_SH: case RV32_SW:
+		{
+			const void *helper;
+			switch (d.op) {
+			case RV32_SB: helper = (const void*)&jit_sb; break;
+			case RV32_SH: helper = (const void*)&jit_sh; break;
+			default: helper = (const void*)&jit_sw; break;
+			}
+			e.mov_rdi_bus();
+			e.load(ESI, rs1);
+			e.alu_imm(ALU_ADD, ESI, imm);
+			e.load(EDX, rs2);
+			e.call(helper);
+			e.skip_unless_exit_store(Emitter::EXIT_LENGTH);
+			e.exit(insnPC, n, epilogue);
+		} break;
+
+		case RV32_ADDI: case RV32_XORI: case RV32_ORI: case RV32_ANDI:
+			if (rd != 0) {
+				X86AluOp op = (d.op == RV32_ADDI) ? ALU_ADD : (d.op == RV32_XORI) ? ALU_XOR
+						: (d.op == RV32_ORI) ? ALU_OR : ALU_AND;
+				e.load(EAX, rs1);
+				e.alu_imm(op, EAX, imm);
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_SLTI: case RV32_SLTIU:
+			if (rd != 0) {
+				e.load(EAX, rs1);
+				e.alu_imm(ALU_CMP, EAX, imm);
+				e.set_eax(d.op == RV32_SLTI ? CC_L : CC_B);
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_SLLI: case RV32_SRLI: case RV32_SRAI:
+			if (rd != 0) {
+				X86ShiftOp op = (d.op == RV32_SLLI) ? SHIFT_SHL : (d.op == RV32_SRLI) ? SHIFT_SHR : SHIFT_SAR;
+				e.load(EAX, rs1);
+				e.shift_imm(op, EAX, (uint8_t)imm);
+				e.store(rd, EAX);
+			}
+			break;
+
+		case RV32_ADD: case RV32_SUB: case RV32_XOR: case RV32_OR: case RV32_AND:
+			if (rd != 0) {
+				X86AluOp op = (d.op == RV32_ADD) ? ALU_ADD : (d.op == RV32_SUB) ? ALU_SUB
+						: (d.op == RV32_XOR) ? ALU_XOR : (d.op == RV32_OR) ? ALU_OR : ALU_AND;
+				e.load(EAX, rs1);
+				e.alu(op, EAX, rs2);
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_SLT: case RV32_SLTU:
+			if (rd != 0) {
+				e.load(EAX, rs1);
+				e.alu(ALU_CMP, EAX, rs2);
+				e.set_eax(d.op == RV32_SLT ? CC_L : CC_B);
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_SLL: case RV32_SRL: case RV32_SRA:
+			if (rd != 0) {
+				// x86 also only uses the low 5 bits of cl for 32-bit shifts
+				X86ShiftOp op = (d.op == RV32_SLL) ? SHIFT_SHL : (d.op == RV32_SRL) ? SHIFT_SHR : SHIFT_SAR;
+				e.load(ECX, rs2);
+				e.load(EAX, rs1);
+				e.shift_cl(op, EAX);
+				e.store(rd, EAX);
+			}
+			break;
+
+		case RV32_MUL:
+			if (rd != 0) {
+				e.load(EAX, rs1);
+				e.imul(EAX, rs2);
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_MULH: case RV32_MULHSU: case RV32_MULHU:
+			if (rd != 0) {
+				// 64-bit products of the (sign- or zero-) extended operands
+				if (d.op == RV32_MULHU) {
+					e.load(EAX, rs1);
+				} else {
+					e.load_sign_extended(EAX, rs1);
+				}
+				if (d.op == RV32_MULH) {
+					e.load_sign_extended(ECX, rs2);
+				} else {
+					e.load(ECX, rs2);
+				}
+				e.imul_high64();
+				e.store(rd, EAX);
+			}
+			break;
+		case RV32_DIV: case RV32_DIVU: case RV32_REM: case RV32_REMU:
+			if (rd != 0) {
+				const void *helper = (d.op == RV32_DIV) ? (const void*)&rv32_div
+						: (d.op == RV32_DIVU) ? (const void*)&rv32_divu
+						: (d.op == RV32_REM) ? (const void*)&rv32_rem : (const void*)&rv32_remu;
+				e.load(EDI, rs1);
+				e.load(ESI, rs2);
+				e.call(helper);
+				e.store(rd, EAX);
+			}
+			break;
+
+		case RV32_FENCE:
+			break;
+
+		default:
+			// SYSTEM, AMO, FENCE.I and illegal instructions are left to the interpreter
+			if (n == 0) {
+				// nothing to translate; the interpreter runs this instruction itself
+				return NULL;
+			}
+			e.exit(insnPC, n, epilogue);
+			ended = true;
+			continue;
+		}
+		++n;
+	}
+
+	codeSize = e.get_offset();
+	return (BlockFunction)(void*)(code + start);
+}
@@ -0,0 +1,89 @@
+#ifndef _MCU_RV32_JIT_
+#define _MCU_RV32_JIT_
+
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include "system_bus.h"
+#include "decoded_instruction.h"
+
+/*
+ * Translates basic blocks of RV32IMA code into native x86-64 code, for one core.
+ *
+ * Only code in read-only memory (ROM) is translated, so stores never have to check
+ * whether they overwrite a translated block; code anywhere else is left to the interpreter.
+ * A block runs up to and including the first branch or jump, and stops short of anything
+ * the interpreter has to handle itself: SYSTEM instructions (traps, ERET, CSRs), AMOs
+ * (LR/SC and the reservation set), FENCE.I and illegal instructions.
+ * Guest registers stay in the core's register file; loads and stores go straight
+ * to the bus' host memory, and a block exits just before any access that would
+ * have to go through a peripheral (MMIO) so that the interpreter can perform it.
+ *
+ * The code buffer is only mapped once there's something to translate, and is never writable
+ * and executable at once: it's only made writable while a block is being translated.
+ * Each core translates its own blocks; firmware that many cores run should rather be
+ * translated ahead of time (see rv32_aot.h), which every core shares.
+ *
+ * Only available on x86-64 Linux; elsewhere is_supported() is false.
+ */
+class RV32JIT {
+public:
+	// The result of running a block: the address of the next instruction to execute
+	// and how many instructions were retired before getting there.
+	struct Exit {
+		uint32_t pc;
+		uint32_t instructions;
+	};
+
+	RV32JIT(uint32_t *xRegister, SystemBus *bus);
+	~RV32JIT();
+
+	static bool is_supported();
+
+	// Runs the block at pc, translating it first if necessary.
+	// Returns false if there is no block at pc (the interpreter has to execute
+	// at least the instruction there); otherwise e.instructions may still be 0
+	// if the very first access went to a peripheral.
+	bool run(uint32_t pc, Exit &e);
+
+	// Throws away every translation, e.g. after the ROM has been changed.
+	void flush();
+
+	// false until the first block is translated
+	bool has_code_buffer() const { return code != NULL; }
+
+	static const uint32_t MAX_BLOCK_LENGTH = 64;
+	static const size_t CODE_BUFFER_SIZE = 256 * 1024;
+
+protected:
+	typedef uint64_t (*BlockFunction)(uint32_t *xRegister, SystemBus *bus);
+
+	uint32_t *xRegister;
+	SystemBus *bus;
+
+	uint8_t *code; // NULL until it's needed
+	size_t codeSize; // bytes used
+	size_t epilogue; // offset of the code every block returns through (written first)
+
+	// the block for every PC that has been looked up; NULL if there is none
+	std::unordered_map<uint32_t, BlockFunction> blocks;
+	// the most recently used blocks, direct-mapped by PC
+	struct CachedBlock {
+		uint32_t pc;
+		BlockFunction f;
+	};
+	static const uint32_t BLOCK_CACHE_SIZE = 256;
+	CachedBlock blockCache[BLOCK_CACHE_SIZE];
+
+	BlockFunction translate(uint32_t pc);
+	void emit_epilogue();
+	// maps the code buffer if it isn't yet; false if it can't be
+	bool map_code_buffer();
+	void set_writable(bool writable);
+
+private:
+	RV32JIT(const RV32JIT &);
+	RV32JIT & operator=(const RV32JIT &);
+};
+
+#endif // _MCU_RV32_JIT_
@@ -0,0 +1,149 @@
+#include "rv32_profiler.h"
+#include <algorithm>
+#include <cstdio>
+
+const uint32_t RV32Profiler::DEFAULT_SAMPLE_PERIOD;
+const uint32_t RV32Profiler::MAX_STACK_DEPTH;
+
+RV32Profiler::RV32Profiler(uint32_t base, uint32_t size, uint32_t samplePeriod)
+: base(base), size(size & ~0x00000003), table(size / 4),
+  deeperCalls(0), samplePeriod(samplePeriod == 0 ? 1 : samplePeriod),
+  nextSample(this->samplePeriod), nSamples(0) {}
+
+void RV32Profiler::reset() {
+	std::fill(table.begin(), table.end(), Counts());
+	others.clear();
+	stackSamples.clear();
+	nSamples = 0;
+	// the stack and when the next sample is due carry on
+}
+
+RV32Profiler::Counts & RV32Profiler::other(uint32_t pc) {
+	return others[pc];
+}
+
+void RV32Profiler::irregular(Counts &c, uint64_t length) {
+	if (c.length == 0) {
+		c.length = length;
+		c.entries += 1;
+	} else {
+		c.otherEntries += 1;
+		c.otherInstructions += length;
+	}
+}
+
+uint64_t RV32Profiler::get_instructions() const {
+	uint64_t instructions = 0;
+	for (uint32_t i = 0; i < table.size(); ++i) {
+		instructions += table[i].get_instructions();
+	}
+	for (std::map<uint32_t, Counts>::const_iterator it = others.begin(); it != others.end(); ++it) {
+		instructions += it->second.get_instructions();
+	}
+	return instructions;
+}
+
+void RV32Profiler::call(uint32_t target, uint32_t returnAddress) {
+	if (stack.size() >= MAX_STACK_DEPTH) {
+		++deeperCalls;
+		return;
+	}
+	Frame f;
+	f.function = target;
+	f.returnAddress = returnAddress;
+	stack.push_back(f);
+}
+
+void RV32Profiler::ret(uint32_t target) {
+	if (deeperCalls > 0) {
+		--deeperCalls;
+		return;
+	}
+	// returns to somewhere further out (e.g. after a longjmp) unwind to it,
+	// and returns that match no call (e.g. from code that ran before profiling started) are ignored
+	for (size_t i = stack.size(); i > 0; --i) {
+		if (stack[i - 1].returnAddress == target) {
+			stack.resize(i - 1);
+			return;
+		}
+	}
+}
+
+void RV32Profiler::sample(uint64_t instret) {
+	std::vector<uint32_t> functions(stack.size());
+	for (size_t i = 0; i < stack.size(); ++i) {
+		functions[i] = stack[i].function;
+	}
+	++stackSamples[functions];
+	++nSamples;
+	// a sample every samplePeriod instructions, however long ago the last one was
+	nextSample = instret + samplePeriod - (instret - nextSample) % samplePeriod;
+}
+
+std::vector<RV32Profiler::Block> RV32Profiler::get_hot_blocks(uint32_t n) const {
+	std::vector<Block> blocks;
+	for (uint32_t i = 0; i < table.size(); ++i) {
+		if (table[i].length > 0) {
+			Block b;
+			b.pc = base + 4 * i;
+			b.entries = table[i].get_entries();
+			b.instructions = table[i].get_instructions();
+			blocks.push_back(b);
+		}
+	}
+	for (std::map<uint32_t, Counts>::const_iterator it = others.begin(); it != others.end(); ++it) {
+		Block b;
+		b.pc = it->first;
+		b.entries = it->second.get_entries();
+		b.instructions = it->second.get_instructions();
+		blocks.push_back(b);
+	}
+	std::sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) {
+		return a.instructions > b.instructions || (a.instructions == b.instructions && a.pc < b.pc);
+	});
+	if (blocks.size() > n) {
+		blocks.resize(n);
+	}
+	return blocks;
+}
+
+std::string RV32Profiler::describe(uint32_t address, bool withOffset) const {
+	char buf[16];
+	std::map<uint32_t, std::string>::const_iterator it = symbols.upper_bound(address);
+	if (it == symbols.begin()) {
+		snprintf(buf, sizeof(buf), "0x%08x", address);
+		return buf;
+	}
+	--it;
+	if (!withOffset || it->first == address) {
+		return it->second;
+	}
+	snprintf(buf, sizeof(buf), "+0x%x", address - it->first);
+	return it->second + buf;
+}
+
+void RV32Profiler::write_hot_blocks(std::ostream &out, uint32_t n) const {
+	std::vector<Block> blocks = get_hot_blocks(n);
+	uint64_t instructions = get_instructions();
+	char buf[96];
+	snprintf(buf, sizeof(buf), "%-10s %7s %14s %14s  %s\n", "block", "share", "entries", "instructions", "where");
+	out << buf;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		const Block &b = blocks[i];
+		double share = instructions == 0 ? 0.0 : 100.0 * (double)b.instructions / (double)instructions;
+		snprintf(buf, sizeof(buf), "0x%08x %6.2f%% %14llu %14llu  ", b.pc, share,
+				(unsigned long long)b.entries, (unsigned long long)b.instructions);
+		out << buf << describe(b.pc, true) << "\n";
+	}
+}
+
+void RV32Profiler::write_folded_stacks(std::ostream &out) const {
+	typedef std::map<std::vector<uint32_t>, uint64_t>::const_iterator iterator;
+	for (iterator it = stackSamples.begin(); it != stackSamples.end(); ++it) {
+		out << "root";
+		for (size_t i = 0; i < it->first.size(); ++i) {
+			out << ";" << describe(it->first[i], false);
+		}
+		out << " " << it->second << "\n";
+	}
+}
@@ -0,0 +1,116 @@
+#ifndef _MCU_RV32_PROFILER_
+#define _MCU_RV32_PROFILER_
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Where a core's cycles go: how many times each basic block ran and how many instructions
+ * that came to, and call stacks sampled every so many instructions.
+ * A block starts wherever the core lands after a branch, jump or trap (or where run() starts)
+ * and runs up to and including the next one; with the JIT or AOT translation, blocks are
+ * whatever step() runs at once. Blocks starting in [base, base + size) (e.g. the ROM) are counted
+ * in a flat table; any others go through a map, which is slower.
+ *
+ * Stacks are followed through ra rather than unwound from the stack, which would need
+ * frame pointers: a jal or jalr that links to ra is a call, and a jalr through ra that
+ * doesn't link is a return. Each frame is the address of the function that was called.
+ *
+ * A core only profiles what run() runs, and only while it has a profiler (see RV32Core::set_profiler());
+ * without one, run() takes exactly the same path as before.
+ *
+ * The core calls block() at the end of every block, so that has to be cheap: a block remembers
+ * how long it was the first time it ran, and a block that runs that long again only counts an entry.
+ * Blocks of any other length (cut short by the end of a run or a trap, or code that changed)
+ * are counted on the side, and instruction counts are worked out from all that when asked for.
+ * Even so, profiling costs something per block, not per instruction, so code with very short blocks
+ * pays the most. bench_mcu_profile's hot loop is 6 instructions long, and there profiling costs
+ * the interpreter about 6% but the JIT about 11%: the 10% target is missed with the JIT on short-block code.
+ */
+class RV32Profiler {
+public:
+	RV32Profiler(uint32_t base, uint32_t size, uint32_t samplePeriod = DEFAULT_SAMPLE_PERIOD);
+
+	static const uint32_t DEFAULT_SAMPLE_PERIOD = 10007; // prime, so as not to line up with loops
+	static const uint32_t MAX_STACK_DEPTH = 64;
+
+	// Names for addresses in the reports: an address is shown as the name
+	// of the closest symbol at or below it (plus an offset, except in stacks).
+	void add_symbol(uint32_t address, const std::string &name) { symbols[address] = name; }
+
+	struct Block {
+		uint32_t pc;
+		uint64_t entries;
+		uint64_t instructions;
+	};
+	// the n blocks that ran the most instructions, most first
+	std::vector<Block> get_hot_blocks(uint32_t n) const;
+	// every instruction counted in a block (which walks every block)
+	uint64_t get_instructions() const;
+	uint64_t get_samples() const { return nSamples; }
+
+	// One line per block: its address, its share of every instruction, entries and instructions.
+	void write_hot_blocks(std::ostream &out, uint32_t n) const;
+	// One line per distinct stack, outermost function first: "root;f;g <samples>",
+	// as flamegraph.pl and similar tools read; root is whatever ran outside of any call.
+	void write_folded_stacks(std::ostream &out) const;
+
+	void reset();
+
+	// how a block ends, as far as the stack goes (EXIT_UNKNOWN until the core has looked)
+	enum BlockExit { EXIT_PLAIN, EXIT_CALL, EXIT_RETURN, EXIT_UNKNOWN };
+	struct Counts {
+		Counts() : entries(0), length(0), otherEntries(0), otherInstructions(0), exit(EXIT_UNKNOWN) {}
+		uint64_t entries; // entries that ran length instructions
+		uint64_t length; // how long the first block that started here was (0 if none yet)
+		uint64_t otherEntries; // and entries that ran any other number
+		uint64_t otherInstructions;
+		uint8_t exit; // how a block of length instructions ends
+		uint64_t get_entries() const { return entries + otherEntries; }
+		uint64_t get_instructions() const { return entries * length + otherInstructions; }
+	};
+
+	// called by the core when a block that started at pc has run length instructions
+	Counts & block(uint32_t pc, uint64_t length) {
+		uint32_t offset = pc - base;
+		Counts &c = (offset < size && (offset & 0x00000003) == 0) ? table[offset >> 2] : other(pc);
+		if (c.length == length) {
+			c.entries += 1;
+		} else {
+			irregular(c, length);
+		}
+		return c;
+	}
+	void call(uint32_t target, uint32_t returnAddress);
+	void ret(uint32_t target);
+	bool sample_due(uint64_t instret) const { return instret >= nextSample; }
+	uint64_t get_next_sample() const { return nextSample; }
+	void sample(uint64_t instret);
+
+protected:
+	uint32_t base;
+	uint32_t size;
+	std::vector<Counts> table; // one for each word in [base, base + size)
+	std::map<uint32_t, Counts> others;
+	Counts & other(uint32_t pc);
+	void irregular(Counts &c, uint64_t length);
+
+	struct Frame {
+		uint32_t function;
+		uint32_t returnAddress;
+	};
+	std::vector<Frame> stack; // the innermost call last
+	uint32_t deeperCalls; // calls past MAX_STACK_DEPTH, which aren't on the stack
+	uint32_t samplePeriod;
+	uint64_t nextSample;
+	uint64_t nSamples;
+	std::map<std::vector<uint32_t>, uint64_t> stackSamples; // outermost function first
+
+	std::map<uint32_t, std::string> symbols;
+	std::string describe(uint32_t address, bool withOffset) const;
+};
+
+#endif // _MCU_RV32_PROFILER_
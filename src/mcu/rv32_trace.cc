@@ -0,0 +1,241 @@
+#include "rv32_trace.h"
+
+const uint32_t RV32Trace::DEFAULT_SIZE;
+const uint32_t RV32Trace::CHUNK_SIZE;
+const uint32_t RV32Trace::TRAP_INTERRUPT;
+
+// "RVTR", then the format version
+static const uint32_t FILE_MAGIC = 0x52545652;
+static const uint32_t FILE_VERSION = 1;
+
+RV32Trace::RV32Trace(uint32_t words)
+: buffer(NULL), mask(0), position(0), lastPC(0), lastInstret(0) {
+	resize(words);
+}
+
+RV32Trace::~RV32Trace() {
+	delete[] buffer;
+}
+
+void RV32Trace::resize(uint32_t words) {
+	uint32_t size = 2 * CHUNK_SIZE;
+	while (size < words && size < 0x80000000) {
+		size *= 2;
+	}
+	delete[] buffer;
+	buffer = new uint32_t[size];
+	mask = size - 1;
+	position = 0;
+	// the next record starts the first chunk, with a sync from wherever the core was
+}
+
+void RV32Trace::transfer_slow(uint32_t from, uint32_t to, uint64_t retired) {
+	uint64_t count = retired - lastInstret;
+	uint32_t offset = to - from;
+	if (count == 0) {
+		// already recorded, as a trap
+		return;
+	}
+	if (count > 0x3FFFFFFF) {
+		// only by wrapping around the address space
+		sync(to, retired);
+		return;
+	}
+	if (count <= 0xFFFF && ((offset + 0x8000) & 0xFFFF0003) == 0) {
+		uint32_t record = TAG_NEAR | ((offset << 14) & 0x3FFF0000) | (uint32_t)count;
+		append(&record, 1);
+	} else {
+		uint32_t record[2] = { TAG_FAR | (uint32_t)count, to };
+		append(record, 2);
+	}
+	lastInstret = retired;
+	lastPC = to;
+}
+
+void RV32Trace::trap(uint32_t cause, bool interrupt, uint64_t instret, uint32_t handler) {
+	uint64_t count = instret - lastInstret;
+	uint32_t record[3] = { TAG_TRAP | (uint32_t)count, cause | (interrupt ? TRAP_INTERRUPT : 0), handler };
+	append(record, 3);
+	lastInstret = interrupt ? instret : instret + 1;
+	lastPC = handler;
+}
+
+void RV32Trace::sync(uint32_t pc, uint64_t instret) {
+	lastPC = pc;
+	lastInstret = instret;
+	uint32_t record[4] = { SYNC, pc, (uint32_t)instret, (uint32_t)(instret >> 32) };
+	// a chunk starts with one anyway
+	if ((position & (CHUNK_SIZE - 1)) != 0) {
+		append(record, 4);
+	}
+}
+
+void RV32Trace::append(const uint32_t *words, uint32_t n) {
+	uint32_t used = (uint32_t)(position & (CHUNK_SIZE - 1));
+	if (used == 0 || used + n > CHUNK_SIZE) {
+		while ((position & (CHUNK_SIZE - 1)) != 0) {
+			put(PAD);
+		}
+		put(SYNC);
+		put(lastPC);
+		put((uint32_t)lastInstret);
+		put((uint32_t)(lastInstret >> 32));
+	}
+	for (uint32_t i = 0; i < n; ++i) {
+		put(words[i]);
+	}
+}
+
+std::vector<uint32_t> RV32Trace::get_records() const {
+	uint64_t size = (uint64_t)mask + 1;
+	uint64_t start = 0;
+	if (position > size) {
+		start = (position - size + CHUNK_SIZE - 1) & ~(uint64_t)(CHUNK_SIZE - 1);
+	}
+	std::vector<uint32_t> records;
+	records.reserve((size_t)(position - start));
+	for (uint64_t i = start; i < position; ++i) {
+		records.push_back(buffer[i & mask]);
+	}
+	return records;
+}
+
+static void write_word(std::ostream &out, uint32_t word) {
+	char bytes[4] = { (char)word, (char)(word >> 8), (char)(word >> 16), (char)(word >> 24) };
+	out.write(bytes, 4);
+}
+
+static bool read_word(std::istream &in, uint32_t &word) {
+	unsigned char bytes[4];
+	if (!in.read((char*)bytes, 4)) {
+		return false;
+	}
+	word = (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+	return true;
+}
+
+void RV32Trace::write(std::ostream &out, uint32_t pc, uint64_t instret) const {
+	std::vector<uint32_t> records = get_records();
+	write_word(out, FILE_MAGIC);
+	write_word(out, FILE_VERSION);
+	write_word(out, pc);
+	write_word(out, (uint32_t)instret);
+	write_word(out, (uint32_t)(instret >> 32));
+	write_word(out, (uint32_t)records.size());
+	for (size_t i = 0; i < records.size(); ++i) {
+		write_word(out, records[i]);
+	}
+}
+
+bool RV32Trace::read(std::istream &in, std::vector<uint32_t> &records, uint32_t &pc, uint64_t &instret) {
+	uint32_t magic, version, low, high, n;
+	if (!read_word(in, magic) || magic != FILE_MAGIC || !read_word(in, version) || version != FILE_VERSION
+			|| !read_word(in, pc) || !read_word(in, low) || !read_word(in, high) || !read_word(in, n)) {
+		return false;
+	}
+	instret = (uint64_t)low | ((uint64_t)high << 32);
+	records.clear();
+	for (uint32_t i = 0; i < n; ++i) {
+		uint32_t word;
+		if (!read_word(in, word)) {
+			return false;
+		}
+		records.push_back(word);
+	}
+	return true;
+}
+
+static void add_event(std::vector<RV32Trace::Event> &events, uint8_t kind, uint32_t pc, uint64_t instret, uint32_t cause) {
+	RV32Trace::Event e;
+	e.kind = kind;
+	e.pc = pc;
+	e.instret = instret;
+	e.cause = cause;
+	events.push_back(e);
+}
+
+// count instructions straight through from pc
+static void run_straight(std::vector<RV32Trace::Event> &events, uint32_t &pc, uint64_t &instret, uint64_t count) {
+	for (uint64_t i = 0; i < count; ++i) {
+		add_event(events, RV32Trace::Event::INSTRUCTION, pc, instret, 0);
+		pc += 4;
+		instret += 1;
+	}
+}
+
+bool RV32Trace::replay(const std::vector<uint32_t> &records, uint32_t pc, uint64_t instret,
+		std::vector<Event> &events) {
+	events.clear();
+	bool started = false;
+	uint32_t curPC = 0;
+	uint64_t curInstret = 0;
+	size_t i = 0;
+	while (i < records.size()) {
+		uint32_t word = records[i];
+		uint32_t tag = word & 0xC0000000;
+		if (word == PAD) {
+			i += 1;
+			continue;
+		}
+		if (word == SYNC) {
+			if (i + 4 > records.size()) {
+				return false;
+			}
+			uint32_t syncPC = records[i+1];
+			uint64_t syncInstret = (uint64_t)records[i+2] | ((uint64_t)records[i+3] << 32);
+			if (started && (syncPC != curPC || syncInstret != curInstret)) {
+				add_event(events, Event::GAP, syncPC, syncInstret, 0);
+			}
+			started = true;
+			curPC = syncPC;
+			curInstret = syncInstret;
+			i += 4;
+			continue;
+		}
+		if (!started || tag == PAD) {
+			return false;
+		}
+		if (tag == TAG_NEAR) {
+			uint32_t count = word & 0x0000FFFF;
+			if (count == 0) {
+				return false;
+			}
+			int32_t offset = ((int32_t)(word << 2) >> 16) & ~0x00000003;
+			run_straight(events, curPC, curInstret, count);
+			curPC = curPC - 4 + (uint32_t)offset;
+			i += 1;
+		} else if (tag == TAG_FAR) {
+			if (i + 2 > records.size() || (word & 0x3FFFFFFF) == 0) {
+				return false;
+			}
+			run_straight(events, curPC, curInstret, word & 0x3FFFFFFF);
+			curPC = records[i+1];
+			i += 2;
+		} else {
+			if (i + 3 > records.size()) {
+				return false;
+			}
+			uint32_t cause = records[i+1];
+			run_straight(events, curPC, curInstret, word & 0x3FFFFFFF);
+			if (cause & TRAP_INTERRUPT) {
+				add_event(events, Event::INTERRUPT, curPC, curInstret, cause & ~TRAP_INTERRUPT);
+			} else {
+				add_event(events, Event::INSTRUCTION, curPC, curInstret, 0);
+				add_event(events, Event::TRAP, curPC, curInstret, cause);
+				curInstret += 1;
+			}
+			curPC = records[i+2];
+			i += 3;
+		}
+	}
+	if (!started) {
+		return true;
+	}
+	// and the rest of the way to where the core is now
+	if (instret >= curInstret && pc == curPC + 4 * (uint32_t)(instret - curInstret)) {
+		run_straight(events, curPC, curInstret, instret - curInstret);
+	} else {
+		add_event(events, Event::GAP, pc, instret, 0);
+	}
+	return true;
+}
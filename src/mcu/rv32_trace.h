@@ -0,0 +1,111 @@
+#ifndef _MCU_RV32_TRACE_
+#define _MCU_RV32_TRACE_
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+/*
+ * A bounded record of where a core has been, cheap enough to leave on: every taken branch,
+ * jump, trap and interrupt goes into a ring buffer of 32-bit words, and everything in between
+ * ran straight through, so together with the code (e.g. the ROM) the trace gives back every
+ * instruction that ran, as far back as the buffer goes.
+ *
+ * Records, tagged by their top two bits:
+ *   00 near: [29:16] signed word offset from the last instruction to where it went,
+ *            [15:0] instructions retired since the last record, including the last one
+ *   01 far: [29:0] instructions retired, including the last one; then where it went
+ *   10 trap: [29:0] instructions retired before the trap; then the cause (with TRAP_INTERRUPT
+ *            set for an interrupt, taken in between instructions, rather than an exception,
+ *            where the instruction that trapped counts as retired too); then the handler
+ *   11 SYNC: then the pc and instret (low word first) that the records after it start from,
+ *      or PAD: nothing
+ * The buffer is split into chunks of CHUNK_SIZE words, and each chunk starts with a sync,
+ * so decoding starts at the oldest chunk that hasn't been partly overwritten.
+ */
+class RV32Trace {
+public:
+	RV32Trace(uint32_t words = DEFAULT_SIZE);
+	~RV32Trace();
+
+	static const uint32_t DEFAULT_SIZE = 1024;
+	static const uint32_t CHUNK_SIZE = 256;
+
+	// Throws away the trace, and keeps words (rounded up to a power of two, and at least two chunks) from now on.
+	void resize(uint32_t words);
+	uint32_t get_size() const { return mask + 1; }
+	// how many words have been recorded, including any that have been overwritten
+	uint64_t get_words_recorded() const { return position; }
+
+	// called by the core: the instruction at from, which retired as instruction number retired, went to
+	void transfer(uint32_t from, uint32_t to, uint64_t retired) {
+		uint64_t count = retired - lastInstret;
+		uint32_t offset = to - from;
+		if (count - 1 < 0xFFFF && ((offset + 0x8000) & 0xFFFF0003) == 0 && (position & (CHUNK_SIZE - 1)) != 0) {
+			buffer[position & mask] = ((offset << 14) & 0x3FFF0000) | (uint32_t)count;
+			++position;
+			lastInstret = retired;
+			lastPC = to;
+		} else {
+			transfer_slow(from, to, retired);
+		}
+	}
+	// a trap to handler after instret instructions
+	void trap(uint32_t cause, bool interrupt, uint64_t instret, uint32_t handler);
+	// the core is at pc after instret instructions, however it got there
+	void sync(uint32_t pc, uint64_t instret);
+	// whether the core could have got to pc after instret instructions without anything the trace missed
+	bool follows(uint32_t pc, uint64_t instret) const {
+		return instret >= lastInstret && pc == lastPC + 4 * (uint32_t)(instret - lastInstret);
+	}
+
+	// the records from the oldest whole chunk on
+	std::vector<uint32_t> get_records() const;
+	// Saves the records, and where the core is now (which the trace only has up to the last record).
+	void write(std::ostream &out, uint32_t pc, uint64_t instret) const;
+	static bool read(std::istream &in, std::vector<uint32_t> &records, uint32_t &pc, uint64_t &instret);
+
+	struct Event {
+		enum Kind {
+			INSTRUCTION, // the instruction at pc ran
+			TRAP, // and trapped
+			INTERRUPT, // an interrupt was taken before the instruction at pc
+			GAP, // the core moved to pc without the trace seeing how (e.g. restore_state())
+		};
+		uint8_t kind;
+		uint32_t pc;
+		uint64_t instret; // instructions retired before this one
+		uint32_t cause; // for traps and interrupts
+	};
+	// Every instruction in the records (and after them, up to pc and instret), oldest first.
+	// Returns false if the records are malformed.
+	static bool replay(const std::vector<uint32_t> &records, uint32_t pc, uint64_t instret,
+			std::vector<Event> &events);
+
+	static const uint32_t TRAP_INTERRUPT = 0x80000000;
+
+protected:
+	static const uint32_t TAG_NEAR = 0x00000000;
+	static const uint32_t TAG_FAR = 0x40000000;
+	static const uint32_t TAG_TRAP = 0x80000000;
+	static const uint32_t PAD = 0xC0000000;
+	static const uint32_t SYNC = 0xC0000001;
+
+	uint32_t *buffer;
+	uint32_t mask;
+	uint64_t position;
+	// where the core went with the last record
+	uint32_t lastPC;
+	uint64_t lastInstret;
+
+	void transfer_slow(uint32_t from, uint32_t to, uint64_t retired);
+	void append(const uint32_t *words, uint32_t n);
+	void put(uint32_t word) { buffer[position & mask] = word; ++position; }
+
+private:
+	RV32Trace(const RV32Trace &);
+	RV32Trace & operator=(const RV32Trace &);
+};
+
+#endif // _MCU_RV32_TRACE_
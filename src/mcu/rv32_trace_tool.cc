@@ -0,0 +1,129 @@
+/*
+ * rv32_trace: prints every instruction in a trace saved by RV32Core::save_trace(),
+ * with the code taken from the firmware image the core was running.
+ *
+ * usage: rv32_trace <trace> <image> <base address>
+ *
+ * The image is either raw binary or a .hex file (see firmware_file.h), as loaded at base address.
+ * One line per instruction: how many instructions had retired before it, its address,
+ * and the instruction, or ? for code outside the image (e.g. in RAM).
+ */
+
+#include "rv32_trace.h"
+#include "firmware_file.h"
+#include "decoded_instruction.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// in RV32Operation order
+static const char * const names[] = {
+	"illegal",
+	"lui", "auipc", "jal", "jalr",
+	"beq", "bne", "blt", "bge", "bltu", "bgeu",
+	"lb", "lh", "lw", "lbu", "lhu",
+	"sb", "sh", "sw",
+	"addi", "slti", "sltiu", "xori", "ori", "andi",
+	"slli", "srli", "srai",
+	"add", "sub", "sll", "slt", "sltu",
+	"xor", "srl", "sra", "or", "and",
+	"mul", "mulh", "mulhsu", "mulhu",
+	"div", "divu", "rem", "remu",
+	"fence", "fence.i",
+	"scall", "sbreak", "eret", "wfi",
+	"csrrw", "csrrs", "csrrc", "csrrwi", "csrrsi", "csrrci",
+	"lr.w", "sc.w",
+	"amoswap.w", "amoadd.w", "amoxor.w", "amoand.w", "amoor.w",
+	"amomin.w", "amomax.w", "amominu.w", "amomaxu.w",
+};
+
+static std::string disassemble(uint32_t word, uint32_t pc) {
+	DecodedInstruction d;
+	decode_instruction(word, d);
+	char buf[64];
+	const char *name = names[d.op];
+	unsigned rd = d.rd, rs1 = d.rs1, rs2 = d.rs2;
+	if (d.op == RV32_LUI || d.op == RV32_AUIPC) {
+		snprintf(buf, sizeof(buf), "%s x%u, 0x%x", name, rd, (uint32_t)d.imm >> 12);
+	} else if (d.op == RV32_JAL) {
+		snprintf(buf, sizeof(buf), "%s x%u, 0x%08x", name, rd, pc + d.imm);
+	} else if (d.op == RV32_JALR) {
+		snprintf(buf, sizeof(buf), "%s x%u, %d(x%u)", name, rd, d.imm, rs1);
+	} else if (d.op >= RV32_BEQ && d.op <= RV32_BGEU) {
+		snprintf(buf, sizeof(buf), "%s x%u, x%u, 0x%08x", name, rs1, rs2, pc + d.imm);
+	} else if (d.op >= RV32_LB && d.op <= RV32_LHU) {
+		snprintf(buf, sizeof(buf), "%s x%u, %d(x%u)", name, rd, d.imm, rs1);
+	} else if (d.op >= RV32_SB && d.op <= RV32_SW) {
+		snprintf(buf, sizeof(buf), "%s x%u, %d(x%u)", name, rs2, d.imm, rs1);
+	} else if (d.op >= RV32_ADDI && d.op <= RV32_SRAI) {
+		snprintf(buf, sizeof(buf), "%s x%u, x%u, %d", name, rd, rs1, d.imm);
+	} else if (d.op >= RV32_ADD && d.op <= RV32_REMU) {
+		snprintf(buf, sizeof(buf), "%s x%u, x%u, x%u", name, rd, rs1, rs2);
+	} else if (d.op >= RV32_CSRRW && d.op <= RV32_CSRRC) {
+		snprintf(buf, sizeof(buf), "%s x%u, 0x%03x, x%u", name, rd, (uint32_t)d.imm, rs1);
+	} else if (d.op >= RV32_CSRRWI && d.op <= RV32_CSRRCI) {
+		snprintf(buf, sizeof(buf), "%s x%u, 0x%03x, %u", name, rd, (uint32_t)d.imm, rs1);
+	} else if (d.op == RV32_LR_W) {
+		snprintf(buf, sizeof(buf), "%s x%u, (x%u)", name, rd, rs1);
+	} else if (d.op >= RV32_SC_W && d.op <= RV32_AMOMAXU_W) {
+		snprintf(buf, sizeof(buf), "%s x%u, x%u, (x%u)", name, rd, rs2, rs1);
+	} else {
+		snprintf(buf, sizeof(buf), "%s", name);
+	}
+	return buf;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <trace> <image> <base address>\n", argv[0]);
+		return 1;
+	}
+	std::vector<uint32_t> records;
+	uint32_t pc;
+	uint64_t instret;
+	std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+	if (!RV32Trace::read(in, records, pc, instret)) {
+		fprintf(stderr, "%s: can't read a trace from %s\n", argv[0], argv[1]);
+		return 1;
+	}
+	std::vector<uint8_t> image;
+	if (!read_firmware_file(argv[2], image)) {
+		return 1;
+	}
+	uint32_t baseAddress = (uint32_t)strtoul(argv[3], NULL, 0);
+
+	std::vector<RV32Trace::Event> events;
+	if (!RV32Trace::replay(records, pc, instret, events)) {
+		fprintf(stderr, "%s: %s is corrupt\n", argv[0], argv[1]);
+		return 1;
+	}
+	for (size_t i = 0; i < events.size(); ++i) {
+		const RV32Trace::Event &e = events[i];
+		switch (e.kind) {
+		case RV32Trace::Event::INSTRUCTION: {
+			uint32_t offset = e.pc - baseAddress;
+			if (offset < image.size() && image.size() - offset >= 4 && (offset & 0x00000003) == 0) {
+				uint32_t word = (uint32_t)image[offset] | ((uint32_t)image[offset+1] << 8)
+						| ((uint32_t)image[offset+2] << 16) | ((uint32_t)image[offset+3] << 24);
+				printf("%12llu  %08x  %08x  %s\n", (unsigned long long)e.instret, e.pc, word,
+						disassemble(word, e.pc).c_str());
+			} else {
+				printf("%12llu  %08x  ?\n", (unsigned long long)e.instret, e.pc);
+			}
+		} break;
+		case RV32Trace::Event::TRAP:
+			printf("%12s  trap, cause %u\n", "", e.cause);
+			break;
+		case RV32Trace::Event::INTERRUPT:
+			printf("%12s  interrupt, cause %u\n", "", e.cause);
+			break;
+		case RV32Trace::Event::GAP:
+			printf("%12s  ... moved to %08x after %llu instructions\n", "", e.pc, (unsigned long long)e.instret);
+			break;
+		}
+	}
+	return 0;
+}
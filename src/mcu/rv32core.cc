@@ -1,30 +1,570 @@
 #include "rv32core.h"
+#include "rom.h"
+#include "interrupt_controller.h"
+#include "rv32_profiler.h"
+#include <cstring>
+#include <stdexcept>
 
 RV32Core::RV32Core()
-: pc(0), next_pc(0), system_bus(new SystemBus()),
+: pc(0), next_pc(0), trapped(false), sleeping(false), sleepChanges(0), spinDetection(false),
+  system_bus(new SystemBus()), ownsBus(true), hartid(0), reservedValue(0), interrupts(NULL), profiler(NULL), jit(NULL),
+  aotRom(NULL), aotBaseAddress(0), aot(NULL),
   mstatus_ie(false), mstatus_ie1(false),
   mscratch(0), mepc(0), mcause(0), mbadaddr(0),
-  instret(0)
+  instret(0), idleCycles(0), cyclesPerTimestep(DEFAULT_CYCLES_PER_TIMESTEP)
 {
 	for (int i = 0; i < 32; ++i) {
 		xRegister[i] = 0;
 	}
+	hartid = system_bus->add_hart(&icache);
+}
+
+RV32Core::RV32Core(SystemBus *sharedBus)
+: pc(0), next_pc(0), trapped(false), sleeping(false), sleepChanges(0), spinDetection(false),
+  system_bus(sharedBus), ownsBus(false), hartid(0), reservedValue(0), interrupts(NULL), profiler(NULL), jit(NULL),
+  aotRom(NULL), aotBaseAddress(0), aot(NULL),
+  mstatus_ie(false), mstatus_ie1(false),
+  mscratch(0), mepc(0), mcause(0), mbadaddr(0),
+  instret(0), idleCycles(0), cyclesPerTimestep(DEFAULT_CYCLES_PER_TIMESTEP)
+{
+	for (int i = 0; i < 32; ++i) {
+		xRegister[i] = 0;
+	}
+	hartid = system_bus->add_hart(&icache);
+	if (hartid == SystemBus::NO_HART) {
+		throw std::runtime_error("too many harts on one system bus");
+	}
 }
 
 RV32Core::~RV32Core() {
+    if (jit != NULL) {
+        delete jit;
+    }
     if (system_bus != NULL) {
-        delete system_bus;
+        if (ownsBus) {
+            delete system_bus;
+        } else {
+            system_bus->remove_hart(hartid);
+        }
     }
 }
 
+bool RV32Core::set_jit_enabled(bool enabled) {
+	if (enabled && jit == NULL) {
+		if (!RV32JIT::is_supported()) {
+			return false;
+		}
+		jit = new RV32JIT(xRegister, system_bus);
+	} else if (!enabled && jit != NULL) {
+		delete jit;
+		jit = NULL;
+	}
+	return true;
+}
+
+bool RV32Core::use_translated_rom(const ROM *rom, uint32_t baseAddress) {
+	aotRom = rom;
+	aotBaseAddress = baseAddress;
+	aot = NULL;
+	if (rom != NULL) {
+		aot = find_aot_image(rom->get_content_hash(), rom->get_size(), baseAddress);
+	}
+	return aot != NULL;
+}
+
+RV32Core::Snapshot * RV32Core::save_state() {
+	Snapshot *snapshot = new Snapshot();
+	memcpy(snapshot->xRegister, xRegister, sizeof(xRegister));
+	snapshot->pc = pc;
+	snapshot->mstatus_ie = mstatus_ie;
+	snapshot->mstatus_ie1 = mstatus_ie1;
+	snapshot->mscratch = mscratch;
+	snapshot->mepc = mepc;
+	snapshot->mcause = mcause;
+	snapshot->mbadaddr = mbadaddr;
+	snapshot->instret = instret;
+	snapshot->idleCycles = idleCycles;
+	snapshot->sleeping = sleeping;
+	snapshot->bus = system_bus->save_state();
+	return snapshot;
+}
+
+void RV32Core::restore_state(const Snapshot *snapshot) {
+	memcpy(xRegister, snapshot->xRegister, sizeof(xRegister));
+	pc = snapshot->pc;
+	mstatus_ie = snapshot->mstatus_ie;
+	mstatus_ie1 = snapshot->mstatus_ie1;
+	mscratch = snapshot->mscratch;
+	mepc = snapshot->mepc;
+	mcause = snapshot->mcause;
+	mbadaddr = snapshot->mbadaddr;
+	instret = snapshot->instret;
+	idleCycles = snapshot->idleCycles;
+	system_bus->restore_state(snapshot->bus);
+	flush_instruction_cache();
+	sleeping = snapshot->sleeping;
+	sleepChanges = system_bus->get_peripheral_changes();
+	trace.sync(pc, instret);
+}
+
+void RV32Core::set_trace_size(uint32_t words) {
+	trace.resize(words);
+	trace.sync(pc, instret);
+}
+
+void RV32Core::flush_instruction_cache() {
+	icache.flush();
+	if (jit != NULL) {
+		jit->flush();
+	}
+	if (aotRom != NULL) {
+		use_translated_rom(aotRom, aotBaseAddress);
+	}
+}
+
+bool RV32Core::is_sleeping() {
+	if (sleeping && system_bus->get_peripheral_changes() != sleepChanges) {
+		sleeping = false;
+	}
+	return sleeping;
+}
+
+void RV32Core::sleep() {
+	sleeping = true;
+	sleepChanges = system_bus->get_peripheral_changes();
+}
+
+bool RV32Core::poll_peripherals() {
+	system_bus->advance_to(get_cycle());
+	if (interrupts != NULL && interrupts->is_asserted()) {
+		sleeping = false;
+		if (mstatus_ie) {
+			external_interrupt();
+			return true;
+		}
+	}
+	return false;
+}
+
 void RV32Core::step() {
-	uint32_t insn = system_bus->load_word(pc);
+	sync_trace();
+	single_step();
+}
+
+void RV32Core::single_step() {
+	// taking an interrupt counts as the step
+	if ((interrupts != NULL || system_bus->has_timed_peripherals()) && poll_peripherals()) {
+		return;
+	}
+	if (sleeping && is_sleeping()) {
+		return;
+	}
+	if (aot != NULL) {
+		RV32JIT::Exit e;
+		if (aot->run(xRegister, system_bus, pc, e) && e.instructions > 0) {
+			instret += e.instructions;
+			// a block runs straight through, so only its last instruction can go anywhere else
+			uint32_t last = pc + 4 * (e.instructions - 1);
+			if (e.pc != last + 4) {
+				trace.transfer(last, e.pc, instret);
+			}
+			pc = e.pc;
+			return;
+		}
+	}
+	if (jit != NULL) {
+		RV32JIT::Exit e;
+		if (jit->run(pc, e) && e.instructions > 0) {
+			instret += e.instructions;
+			uint32_t last = pc + 4 * (e.instructions - 1);
+			if (e.pc != last + 4) {
+				trace.transfer(last, e.pc, instret);
+			}
+			pc = e.pc;
+			return;
+		}
+		// otherwise the instruction at pc needs the interpreter
+	}
+	// decode each instruction once, the first time it is fetched from a given address;
+	// the copy keeps it intact even if it overwrites itself
+	DecodedInstruction insn;
+	if ((pc & 0x00000003) == 0) {
+		InstructionCache::Entry &entry = icache.lookup(pc);
+		if (!entry.holds(pc)) {
+			decode_instruction(system_bus->load_word(pc), entry.insn);
+			entry.fill(pc);
+		}
+		insn = entry.insn;
+	} else {
+		decode_instruction(system_bus->load_word(pc), insn);
+	}
 	next_pc = pc + 4;
 	execute(insn);
 	instret += 1L;
+	if (next_pc != pc + 4) {
+		trace.transfer(pc, next_pc, instret);
+	}
 	pc = next_pc;
 }
 
+RV32Core::RunResult RV32Core::run(uint64_t cycleBudget) {
+	trapped = false;
+	sync_trace();
+	const uint64_t end = get_cycle() + cycleBudget;
+	for (;;) {
+		if (poll_peripherals()) {
+			return RUN_TRAPPED;
+		}
+		uint64_t now = get_cycle();
+		if (now >= end) {
+			return RUN_BUDGET_EXHAUSTED;
+		}
+		// run (or sleep) in slices that end at each deadline, so that it's noticed on time;
+		// a store to a timed peripheral ends the slice too, as the deadline may have moved
+		uint64_t until = end;
+		uint64_t deadline = system_bus->get_next_deadline();
+		if (deadline > now && deadline < end) {
+			until = deadline;
+		}
+		if (sleeping && is_sleeping()) {
+			idleCycles += until - now;
+			if (until == end) {
+				return RUN_SLEEPING;
+			}
+			continue;
+		}
+
+		if (profiler != NULL) {
+			// samples are taken in between slices, so a slice stops when the next one is due
+			if (profiler->sample_due(instret)) {
+				profiler->sample(instret);
+			}
+			uint64_t sampleAt = now + (profiler->get_next_sample() - instret);
+			if (sampleAt < until) {
+				until = sampleAt;
+			}
+		}
+
+		RunResult result = RUN_BUDGET_EXHAUSTED;
+		if (jit == NULL && aot == NULL) {
+			if (profiler == NULL) {
+				result = run_interpreted<false>(until - now);
+			} else {
+				result = run_interpreted<true>(until - now);
+			}
+		} else {
+			uint64_t stop = instret + (until - now);
+			const uint32_t deadlineChanges = system_bus->get_deadline_changes();
+			if (profiler == NULL) {
+				while (instret < stop && !trapped && !sleeping && system_bus->get_deadline_changes() == deadlineChanges) {
+					single_step();
+				}
+			} else {
+				while (instret < stop && !trapped && !sleeping && system_bus->get_deadline_changes() == deadlineChanges) {
+					uint32_t stepPC = pc;
+					uint64_t stepInstret = instret;
+					single_step();
+					profile_step(stepPC, stepInstret);
+				}
+			}
+			if (trapped) {
+				result = RUN_TRAPPED;
+			}
+		}
+		if (result == RUN_TRAPPED) {
+			return result;
+		}
+		// otherwise, the slice ran out or was cut short, or the core went to sleep (for the rest of the budget, unless woken)
+	}
+}
+
+inline void RV32Core::profile_step(uint32_t stepPC, uint64_t stepInstret) {
+	uint64_t length = instret - stepInstret;
+	if (length == 0) {
+		return;
+	}
+	RV32Profiler::Counts &c = profiler->block(stepPC, length);
+	// a step runs straight through, so its last instruction says whether it called or returned
+	uint32_t last = stepPC + 4 * (uint32_t)(length - 1);
+	uint8_t exit;
+	if (c.length == length) {
+		if (c.exit == RV32Profiler::EXIT_UNKNOWN) {
+			c.exit = block_exit(last);
+		}
+		exit = c.exit;
+	} else {
+		exit = block_exit(last);
+	}
+	if (exit == RV32Profiler::EXIT_CALL) {
+		profiler->call(pc, last + 4);
+	} else if (exit == RV32Profiler::EXIT_RETURN) {
+		profiler->ret(pc);
+	}
+}
+
+uint8_t RV32Core::block_exit(uint32_t last) {
+	DecodedInstruction d;
+	decode_instruction(system_bus->load_word(last), d);
+	if (d.op == RV32_JAL || d.op == RV32_JALR) {
+		if (d.rd == 1) {
+			return RV32Profiler::EXIT_CALL;
+		} else if (d.op == RV32_JALR && d.rd == 0 && d.rs1 == 1) {
+			return RV32Profiler::EXIT_RETURN;
+		}
+	}
+	return RV32Profiler::EXIT_PLAIN;
+}
+
+#if defined(__GNUC__)
+
+/*
+ * The interpreter loop behind run(): the same as calling step() over and over,
+ * but the PC, the register file and the instruction count stay in locals,
+ * and each handler jumps straight to the next instruction's handler (GCC's labels as values).
+ * Every handler writes rd unconditionally; x0 is zeroed again before each instruction.
+ * Anything that can trap or touches CSRs goes through execute().
+ * A store that may have moved a deadline ends the run, for run() to start a new slice.
+ * With spin detection on, every backward jump remembers the registers at its target,
+ * to compare with the next time around (see set_spin_detection()).
+ * The profiling version also tells the profiler about every block, call and return.
+ */
+template <bool Profiling> RV32Core::RunResult RV32Core::run_interpreted(uint64_t cycleBudget) {
+	// in RV32Operation order
+	static const void * const handlers[] = {
+		&&op_slow, // ILLEGAL
+		&&op_LUI, &&op_AUIPC, &&op_JAL, &&op_JALR,
+		&&op_BEQ, &&op_BNE, &&op_BLT, &&op_BGE, &&op_BLTU, &&op_BGEU,
+		&&op_LB, &&op_LH, &&op_LW, &&op_LBU, &&op_LHU,
+		&&op_SB, &&op_SH, &&op_SW,
+		&&op_ADDI, &&op_SLTI, &&op_SLTIU, &&op_XORI, &&op_ORI, &&op_ANDI,
+		&&op_SLLI, &&op_SRLI, &&op_SRAI,
+		&&op_ADD, &&op_SUB, &&op_SLL, &&op_SLT, &&op_SLTU,
+		&&op_XOR, &&op_SRL, &&op_SRA, &&op_OR, &&op_AND,
+		&&op_MUL, &&op_MULH, &&op_MULHSU, &&op_MULHU,
+		&&op_DIV, &&op_DIVU, &&op_REM, &&op_REMU,
+		&&op_FENCE, &&op_slow, // FENCE.I
+		&&op_slow, &&op_slow, &&op_slow, &&op_slow, // SCALL, SBREAK, ERET, WFI
+		&&op_slow, &&op_slow, &&op_slow, &&op_slow, &&op_slow, &&op_slow, // CSRs
+		&&op_slow, &&op_slow, // LR, SC
+		&&op_slow, &&op_slow, &&op_slow, &&op_slow, &&op_slow, // AMOs
+		&&op_slow, &&op_slow, &&op_slow, &&op_slow,
+	};
+	static_assert(sizeof(handlers) / sizeof(handlers[0]) == RV32_NUMBER_OF_OPERATIONS,
+			"one handler per RV32Operation");
+
+	if (cycleBudget == 0) {
+		return RUN_BUDGET_EXHAUSTED;
+	}
+	uint32_t * const x = xRegister;
+	SystemBus * const bus = system_bus;
+	const uint32_t deadlineChanges = bus->get_deadline_changes();
+	const uint64_t startInstret = instret;
+	uint32_t curPC = pc;
+	uint64_t n = 0; // instructions retired so far
+	RunResult result = RUN_BUDGET_EXHAUSTED;
+	DecodedInstruction d;
+
+	// spin detection
+	const bool spinning = spinDetection && bus->get_number_of_harts() <= 1; // see set_spin_detection()
+	uint32_t sideEffects = 0; // stores and trips through execute()
+	uint32_t loopHead = 0; // the target of the backward jump being checked
+	uint32_t spinHead = 1; // where the last backward jump went (never a valid target),
+	uint64_t spinStart = 0; // when,
+	uint32_t spinSideEffects = 0;
+	uint32_t spinRegisters[32]; // and with what registers
+
+	// profiling: where the current block started, and at which instruction
+	RV32Profiler * const prof = profiler;
+	uint32_t blockPC = curPC;
+	uint64_t blockStart = 0;
+
+#define NEXT(target) do { curPC = (target); if (++n == cycleBudget) goto done; goto fetch; } while (0)
+// the current instruction ends a block, and the next one starts at target
+#define END_BLOCK(target) do { \
+		prof->block(blockPC, n + 1 - blockStart); \
+		blockPC = (target); \
+		blockStart = n + 1; \
+	} while (0)
+#define JUMP(target) do { \
+		uint32_t t_ = (target); \
+		trace.transfer(curPC, t_, startInstret + n + 1); \
+		if (Profiling) END_BLOCK(t_); \
+		if (spinning && t_ <= curPC) { loopHead = t_; goto check_spin; } \
+		NEXT(t_); \
+	} while (0)
+#define X1 x[d.rs1]
+#define X2 x[d.rs2]
+#define BRANCH(condition) do { \
+		if (condition) JUMP(curPC + d.imm); \
+		if (Profiling) END_BLOCK(curPC + 4); \
+		NEXT(curPC + 4); \
+	} while (0)
+#define STORED() do { \
+		++sideEffects; \
+		if (bus->get_deadline_changes() != deadlineChanges) { curPC += 4; ++n; goto done; } \
+		NEXT(curPC + 4); \
+	} while (0)
+
+fetch:
+	x[0] = 0;
+	if ((curPC & 0x00000003) == 0) {
+		InstructionCache::Entry &entry = icache.lookup(curPC);
+		if (!entry.holds(curPC)) {
+			decode_instruction(bus->load_word(curPC), entry.insn);
+			entry.fill(curPC);
+		}
+		d = entry.insn;
+	} else {
+		decode_instruction(bus->load_word(curPC), d);
+	}
+	goto *handlers[d.op];
+
+op_LUI: x[d.rd] = (uint32_t)d.imm; NEXT(curPC + 4);
+op_AUIPC: x[d.rd] = curPC + d.imm; NEXT(curPC + 4);
+op_JAL:
+	if (Profiling && d.rd == 1) prof->call(curPC + d.imm, curPC + 4);
+	x[d.rd] = curPC + 4;
+	JUMP(curPC + d.imm);
+op_JALR: {
+	uint32_t target = (X1 + d.imm) & ~0x00000001;
+	if (Profiling && d.rd == 1) prof->call(target, curPC + 4);
+	else if (Profiling && d.rd == 0 && d.rs1 == 1) prof->ret(target);
+	x[d.rd] = curPC + 4;
+	JUMP(target);
+}
+
+op_BEQ: BRANCH(X1 == X2);
+op_BNE: BRANCH(X1 != X2);
+op_BLT: BRANCH((int32_t)X1 < (int32_t)X2);
+op_BGE: BRANCH((int32_t)X1 >= (int32_t)X2);
+op_BLTU: BRANCH(X1 < X2);
+op_BGEU: BRANCH(X1 >= X2);
+
+op_LB: x[d.rd] = (uint32_t)(int32_t)(int8_t)bus->load_byte(X1 + d.imm); NEXT(curPC + 4);
+op_LH: x[d.rd] = (uint32_t)(int32_t)(int16_t)bus->load_halfword(X1 + d.imm); NEXT(curPC + 4);
+op_LW: x[d.rd] = bus->load_word(X1 + d.imm); NEXT(curPC + 4);
+op_LBU: x[d.rd] = bus->load_byte(X1 + d.imm); NEXT(curPC + 4);
+op_LHU: x[d.rd] = bus->load_halfword(X1 + d.imm); NEXT(curPC + 4);
+op_SB: bus->store_byte(X1 + d.imm, (uint8_t)X2); STORED();
+op_SH: bus->store_halfword(X1 + d.imm, (uint16_t)X2); STORED();
+op_SW: bus->store_word(X1 + d.imm, X2); STORED();
+
+op_ADDI: x[d.rd] = X1 + d.imm; NEXT(curPC + 4);
+op_SLTI: x[d.rd] = ((int32_t)X1 < d.imm) ? 1 : 0; NEXT(curPC + 4);
+op_SLTIU: x[d.rd] = (X1 < (uint32_t)d.imm) ? 1 : 0; NEXT(curPC + 4);
+op_XORI: x[d.rd] = X1 ^ d.imm; NEXT(curPC + 4);
+op_ORI: x[d.rd] = X1 | d.imm; NEXT(curPC + 4);
+op_ANDI: x[d.rd] = X1 & d.imm; NEXT(curPC + 4);
+op_SLLI: x[d.rd] = X1 << d.imm; NEXT(curPC + 4);
+op_SRLI: x[d.rd] = X1 >> d.imm; NEXT(curPC + 4);
+op_SRAI: x[d.rd] = (uint32_t)((int32_t)X1 >> d.imm); NEXT(curPC + 4);
+
+op_ADD: x[d.rd] = X1 + X2; NEXT(curPC + 4);
+op_SUB: x[d.rd] = X1 - X2; NEXT(curPC + 4);
+op_SLL: x[d.rd] = X1 << (X2 & 0x0000001F); NEXT(curPC + 4);
+op_SLT: x[d.rd] = ((int32_t)X1 < (int32_t)X2) ? 1 : 0; NEXT(curPC + 4);
+op_SLTU: x[d.rd] = (X1 < X2) ? 1 : 0; NEXT(curPC + 4);
+op_XOR: x[d.rd] = X1 ^ X2; NEXT(curPC + 4);
+op_SRL: x[d.rd] = X1 >> (X2 & 0x0000001F); NEXT(curPC + 4);
+op_SRA: x[d.rd] = (uint32_t)((int32_t)X1 >> (X2 & 0x0000001F)); NEXT(curPC + 4);
+op_OR: x[d.rd] = X1 | X2; NEXT(curPC + 4);
+op_AND: x[d.rd] = X1 & X2; NEXT(curPC + 4);
+
+op_MUL: x[d.rd] = X1 * X2; NEXT(curPC + 4);
+op_MULH: x[d.rd] = (uint32_t)(((int64_t)(int32_t)X1 * (int64_t)(int32_t)X2) >> 32); NEXT(curPC + 4);
+op_MULHSU: x[d.rd] = (uint32_t)(((int64_t)(int32_t)X1 * (int64_t)(uint64_t)X2) >> 32); NEXT(curPC + 4);
+op_MULHU: x[d.rd] = (uint32_t)(((uint64_t)X1 * (uint64_t)X2) >> 32); NEXT(curPC + 4);
+op_DIV: x[d.rd] = rv32_div(X1, X2); NEXT(curPC + 4);
+op_DIVU: x[d.rd] = rv32_divu(X1, X2); NEXT(curPC + 4);
+op_REM: x[d.rd] = rv32_rem(X1, X2); NEXT(curPC + 4);
+op_REMU: x[d.rd] = rv32_remu(X1, X2); NEXT(curPC + 4);
+
+op_FENCE: NEXT(curPC + 4);
+
+op_slow:
+	// execute() sees the same state as it would from step()
+	pc = curPC;
+	next_pc = curPC + 4;
+	instret = startInstret + n;
+	execute(d);
+	++sideEffects;
+	if (next_pc != curPC + 4) {
+		// trapped (which the trace already has) or returned from a trap
+		trace.transfer(curPC, next_pc, startInstret + n + 1);
+		if (Profiling) END_BLOCK(next_pc);
+	}
+	// run() takes over if this trapped, slept, enabled an interrupt that's waiting, or moved a deadline
+	if (trapped || sleeping || (mstatus_ie && interrupts != NULL && interrupts->is_asserted())
+			|| bus->get_deadline_changes() != deadlineChanges) {
+		result = trapped ? RUN_TRAPPED : sleeping ? RUN_SLEEPING : RUN_BUDGET_EXHAUSTED;
+		curPC = next_pc;
+		++n;
+		goto done;
+	}
+	NEXT(next_pc);
+
+check_spin:
+	// back at the same place, with the same registers and nothing else changed,
+	// after a short enough trip that it couldn't have been a different loop
+	if (loopHead == spinHead && n - spinStart <= MAX_SPIN_LENGTH && sideEffects == spinSideEffects
+			&& memcmp(x + 1, spinRegisters + 1, 31 * sizeof(uint32_t)) == 0) {
+		curPC = loopHead;
+		++n;
+		sleep();
+		result = RUN_SLEEPING;
+		goto done;
+	}
+	spinHead = loopHead;
+	spinStart = n;
+	spinSideEffects = sideEffects;
+	memcpy(spinRegisters + 1, x + 1, 31 * sizeof(uint32_t));
+	NEXT(loopHead);
+
+#undef NEXT
+#undef END_BLOCK
+#undef JUMP
+#undef X1
+#undef X2
+#undef BRANCH
+#undef STORED
+
+done:
+	if (Profiling && n > blockStart) {
+		// the budget ran out partway through
+		prof->block(blockPC, n - blockStart);
+	}
+	x[0] = 0;
+	pc = curPC;
+	instret = startInstret + n;
+	return result;
+}
+
+#else
+
+template <bool Profiling> RV32Core::RunResult RV32Core::run_interpreted(uint64_t cycleBudget) {
+	const uint32_t deadlineChanges = system_bus->get_deadline_changes();
+	for (uint64_t n = 0; n < cycleBudget; ++n) {
+		uint32_t stepPC = pc;
+		uint64_t stepInstret = instret;
+		single_step();
+		if (Profiling) {
+			profile_step(stepPC, stepInstret);
+		}
+		if (trapped) {
+			return RUN_TRAPPED;
+		}
+		if (sleeping) {
+			return RUN_SLEEPING;
+		}
+		if (system_bus->get_deadline_changes() != deadlineChanges) {
+			break;
+		}
+	}
+	return RUN_BUDGET_EXHAUSTED;
+}
+
+#endif
+
 /* Register 0 is fixed to the value zero, so reads and writes
  * are handled specially.
  */
@@ -73,17 +613,17 @@ uint32_t RV32Core::read_csr(int csr) {
 	case 0x343:
 		return mbadaddr;
 	case 0xC00:
-		// TODO RDCYCLE
-		return 0;
+		// RDCYCLE
+		return (uint32_t)(get_cycle() & 0x00000000FFFFFFFFL);
 	case 0xC80:
-		// TODO RDCYCLEH
-		return 0;
+		// RDCYCLEH
+		return (uint32_t)((get_cycle() & 0xFFFFFFFF00000000L) >> 32);
 	case 0xC01:
-		// TODO RDTIME
-		return 0;
+		// RDTIME
+		return (uint32_t)(get_time() & 0x00000000FFFFFFFFL);
 	case 0xC81:
-		// TODO RDTIMEH
-		return 0;
+		// RDTIMEH
+		return (uint32_t)((get_time() & 0xFFFFFFFF00000000L) >> 32);
 	case 0xC02:
 		// RDINSTRET
 		return (uint32_t)(instret & 0x00000000FFFFFFFFL);
@@ -103,7 +643,7 @@ uint32_t RV32Core::read_csr(int csr) {
 		return 0x00108000;
 	case 0xF10:
 		// mhartid
-		return 0;
+		return hartid;
 	default:
 		// attempts to access a non-existent CSR raise an illegal instruction exception
 		illegal_instruction(); return 0;
@@ -135,703 +675,323 @@ void RV32Core::write_csr(int csr, uint32_t value) {
 	}
 }
 
-void RV32Core::processor_trap(uint32_t cause) {
+void RV32Core::processor_trap(uint32_t cause, bool interrupt) {
     // when a trap is taken, the mstatus stack is pushed to the left
     // and IE is set to 0
     mstatus_ie1 = mstatus_ie;
     mstatus_ie = false;
+    trapped = true;
     // save program counter
     mepc = pc;
     // set mcause
     mcause = cause;
     // counts as a context switch
-    system_bus->clear_all_reservations();
+    system_bus->clear_reservation(hartid);
     // jump to the correct trap handler, which is always at 0x100 + whatever offset
     if (true) {
       // trap from machine mode
       next_pc = 0x000001C0;
     }
+    trace.trap(cause, interrupt, instret, next_pc);
 }
 
 void RV32Core::illegal_instruction() {
 	processor_trap(2);
 }
 
+// Called between instructions, so the trap is taken right away rather than at the end of one.
 void RV32Core::external_interrupt() {
-	processor_trap(15);
+	sleeping = false;
+	processor_trap(15, true);
+	pc = next_pc;
 }
 
 void RV32Core::execute(uint32_t insn) {
-	// Table 8.1 gives us a quick way to decode most of an instruction:
-	// check that bits [1:0] are "11", then
-	// check bits [6:2] of the instruction word
-	// and jump to an appropriate handler
-
-	if ((insn & 0x00000003) != 3) {
-		// bits [1:0] not "11", this is not an RV32 base opcode
-		illegal_instruction(); return;
-	}
-
-	uint8_t opcodeTag = (insn & 0x0000007C) >> 2;
-
-	switch (opcodeTag) {
-	    // 0: LOAD
-	case 0:
-		execute_LOAD(insn); break;
-		// 1: LOAD-FP
-		// 2: custom-0
-		// 3: MISC-MEM
-	case 3:
-		execute_MISC_MEM(insn); break;
-		// 4: OP-IMM
-	case 4:
-		execute_OP_IMM(insn); break;
-		// 5: AUIPC
-	case 5:
-	{
-	    uint32_t imm = (insn & 0b11111111111111111111000000000000);
-        int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-        set_register(rd, pc + imm);
-	} break;
-		// 6: OP-IMM-32
-		// 7: 48b
-		// 8: STORE
-	case 8:
-		execute_STORE(insn); break;
-		// 9: STORE-FP
-		// 10: custom-1
-		// 11: AMO
-	case 11:
-		execute_AMO(insn); break;
-		// 12: OP
-	case 12:
-		execute_OP(insn); break;
-		// 13: LUI
-	case 13:
-	{
-	    uint32_t imm = (insn & 0b11111111111111111111000000000000);
-	    int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-	    set_register(rd, imm);
-	} break;
-		// 14: OP-32
-		// 15: 64b
-		// 16: MADD
-		// 17: MSUB
-		// 18: NMSUB
-		// 19: NMADD
-		// 20: OP-FP
-		// 21: reserved
-		// 22: custom-2
-		// 23: 48b
-		// 24: BRANCH
-	case 24:
-		execute_BRANCH(insn); break;
-		// 25: JALR
-	case 25:
-	{
-	    int32_t imm = ( ((int32_t)insn) & (int32_t)0b11111111111100000000000000000000) >> 20;
-        int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-        int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-
-        uint32_t target = (uint32_t) ((int32_t)get_register(rs1) + imm);
-        target &= ~(0x00000001);
-        next_pc = target;
-        set_register(rd, pc + 4);
-	} break;
-		// 26: reserved
-		// 27: JAL
-	case 27:
-	{
-	    // immediate is broken over effectively four fields
-	    // [20] [10:1] [11] [19:12]
-	    uint32_t imm =    (insn & 0x80000000) >> (31-20) // [20]
-	                    | (insn & 0x000ff000)            // [19:12]
-	                    | (insn & 0x00100000) >> (20-11) // [11]
-	                    | (insn & 0x7fe00000) >> (21-1)  // [10:1]
-	                    ;
-	    // sign-extend bit 20
-	    if (imm & 0x00100000) {
-	        imm |= 0xFFE00000;
-	    }
-	    int32_t offset = (int32_t)imm;
-	    int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-	    next_pc = (uint32_t) ((int32_t)pc + offset);
-	    set_register(rd, pc + 4);
-	} break;
-		// 28: SYSTEM
-	case 28:
-		execute_SYSTEM(insn); break;
-		// 29: reserved
-		// 30: custom-3
-		// 31: >= 80b
-	default:
-		illegal_instruction(); break;
-	}
-
+	DecodedInstruction d;
+	decode_instruction(insn, d);
+	execute(d);
 }
 
-void RV32Core::execute_LOAD(uint32_t insn) {
-	uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    int32_t imm = ( ((int32_t)insn) & (int32_t)0b11111111111100000000000000000000) >> 20;
-	int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-	int rd = (insn & 0b00000000000000000000111110000000) >> 7;
+void RV32Core::execute(const DecodedInstruction &insn) {
+	uint32_t x1 = xRegister[insn.rs1];
+	uint32_t x2 = xRegister[insn.rs2];
+	int32_t x1_s = (int32_t)x1;
+	int32_t x2_s = (int32_t)x2;
+	int rd = insn.rd;
+	int32_t imm = insn.imm;
+
+	switch (insn.op) {
+	case RV32_LUI:
+		set_register(rd, (uint32_t)imm); break;
+	case RV32_AUIPC:
+		set_register(rd, pc + imm); break;
+	case RV32_JAL:
+		next_pc = (uint32_t) ((int32_t)pc + imm);
+		set_register(rd, pc + 4);
+		break;
+	case RV32_JALR:
+		next_pc = (uint32_t) (x1_s + imm) & ~(0x00000001);
+		set_register(rd, pc + 4);
+		break;
 
-	uint32_t addr = (uint32_t)((int32_t)get_register(rs1) + imm);
-	uint32_t val = 0;
-	bool cancel_load = false; // will be set to true if a bus error occurs
+	case RV32_BEQ:
+		if (x1 == x2) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
+	case RV32_BNE:
+		if (x1 != x2) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
+	case RV32_BLT:
+		if (x1_s < x2_s) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
+	case RV32_BGE:
+		if (x1_s >= x2_s) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
+	case RV32_BLTU:
+		if (x1 < x2) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
+	case RV32_BGEU:
+		if (x1 >= x2) next_pc = (uint32_t) ((int32_t)pc + imm);
+		break;
 
 	// TODO check legal address on system bus
-
-	switch (funct3) {
-	case 0b000: // LB
-	{
-		uint8_t di = system_bus->load_byte(addr);
+	case RV32_LB:
 		// sign-extend to 32 bits
-		val = (uint32_t)di;
-		if (di & 0x80) {
-			val |= 0xFFFFFF00;
-		}
-	} break;
-	case 0b001: // LH
-	{
-		uint16_t di = system_bus->load_halfword(addr);
+		set_register(rd, (uint32_t)(int32_t)(int8_t)system_bus->load_byte(x1 + imm)); break;
+	case RV32_LH:
 		// sign-extend to 32 bits
-		val = (uint32_t)di;
-		if (di & 0x8000) {
-			val |= 0xFFFF0000;
-		}
-	} break;
-	case 0b010: // LW
-	{
-		val = system_bus->load_word(addr);
-	} break;
-	case 0b100: // LBU
-	{
-		// do not sign-extend
-		val = (uint32_t)system_bus->load_byte(addr);
-	} break;
-	case 0b101: // LHU
-	{
-		// do not sign-extend
-		val = (uint32_t)system_bus->load_halfword(addr);
-	} break;
-	default:
-		illegal_instruction(); cancel_load = true; break;
-	}
-
-	if (!cancel_load) {
-		set_register(rd, val);
-	}
-}
-
-void RV32Core::execute_MISC_MEM(uint32_t insn) {
-    uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    switch (funct3) {
-    case 0b000: // FENCE
-        // should be a no-op here.
-        break;
-    case 0b001: // FENCEI
-        // clear instruction cache, if we have one
-        break;
-    default:
-        illegal_instruction(); break;
-    }
-}
-
-void RV32Core::execute_OP_IMM(uint32_t insn) {
-	int32_t imm = ( ((int32_t)insn) & (int32_t)0b11111111111100000000000000000000) >> 20;
-	int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-	uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-	int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-	uint8_t funct7 = (insn & 0b11111110000000000000000000000000) >> 25;
-	uint8_t shamt = (insn & 0b00000001111100000000000000000000) >> 20;
-	switch (funct3) {
-	case 0: // ADDI
-	{
-		set_register(rd, get_register(rs1) + imm);
-	} break;
-	case 1:
-	{
-		if (funct7 == 0) {
-			// SLLI
-			set_register(rd, get_register(rs1) << shamt);
+		set_register(rd, (uint32_t)(int32_t)(int16_t)system_bus->load_halfword(x1 + imm)); break;
+	case RV32_LW:
+		set_register(rd, system_bus->load_word(x1 + imm)); break;
+	case RV32_LBU:
+		set_register(rd, (uint32_t)system_bus->load_byte(x1 + imm)); break;
+	case RV32_LHU:
+		set_register(rd, (uint32_t)system_bus->load_halfword(x1 + imm)); break;
+	case RV32_SB:
+		system_bus->store_byte(x1 + imm, (uint8_t) (x2 & 0x000000FF)); break;
+	case RV32_SH:
+		system_bus->store_halfword(x1 + imm, (uint16_t) (x2 & 0x0000FFFF)); break;
+	case RV32_SW:
+		system_bus->store_word(x1 + imm, x2); break;
+
+	case RV32_ADDI:
+		set_register(rd, x1 + imm); break;
+	case RV32_SLTI:
+		set_register(rd, (x1_s < imm) ? 1 : 0); break;
+	case RV32_SLTIU:
+		set_register(rd, (x1 < (uint32_t)imm) ? 1 : 0); break;
+	case RV32_XORI:
+		set_register(rd, x1 ^ imm); break;
+	case RV32_ORI:
+		set_register(rd, x1 | imm); break;
+	case RV32_ANDI:
+		set_register(rd, x1 & imm); break;
+	case RV32_SLLI:
+		set_register(rd, x1 << imm); break;
+	case RV32_SRLI:
+		set_register(rd, x1 >> imm); break;
+	case RV32_SRAI:
+		set_register(rd, (uint32_t)(x1_s >> imm)); break;
+
+	case RV32_ADD:
+		set_register(rd, x1 + x2); break;
+	case RV32_SUB:
+		set_register(rd, x1 - x2); break;
+	case RV32_SLL:
+		set_register(rd, x1 << (x2 & 0x0000001F)); break;
+	case RV32_SLT:
+		set_register(rd, (x1_s < x2_s) ? 1 : 0); break;
+	case RV32_SLTU:
+		set_register(rd, (x1 < x2) ? 1 : 0); break;
+	case RV32_XOR:
+		set_register(rd, x1 ^ x2); break;
+	case RV32_SRL:
+		set_register(rd, x1 >> (x2 & 0x0000001F)); break;
+	case RV32_SRA:
+		set_register(rd, (uint32_t)(x1_s >> (x2 & 0x0000001F))); break;
+	case RV32_OR:
+		set_register(rd, x1 | x2); break;
+	case RV32_AND:
+		set_register(rd, x1 & x2); break;
+
+	case RV32_MUL:
+		set_register(rd, x1 * x2); break;
+	case RV32_MULH:
+		set_register(rd, (uint32_t)(((int64_t)x1_s * (int64_t)x2_s) >> 32)); break;
+	case RV32_MULHSU:
+		set_register(rd, (uint32_t)(((int64_t)x1_s * (int64_t)(uint64_t)x2) >> 32)); break;
+	case RV32_MULHU:
+		set_register(rd, (uint32_t)(((uint64_t)x1 * (uint64_t)x2) >> 32)); break;
+	case RV32_DIV:
+		if (x2_s == 0) {
+			// DIV/0
+			set_register(rd, -1);
+		} else if (x1_s == INT32_MIN && x2_s == -1) {
+			// signed overflow
+			set_register(rd, x1);
 		} else {
-			illegal_instruction();
+			set_register(rd, x1_s / x2_s);
 		}
-	} break;
-	case 2: // SLTI
-	{
-		int32_t val = (int32_t)get_register(rs1);
-		if (val < imm) {
-		    set_register(rd, 1);
+		break;
+	case RV32_DIVU:
+		if (x2 == 0) {
+			// DIV/0
+			set_register(rd, 0xFFFFFFFF);
 		} else {
-		    set_register(rd, 0);
+			set_register(rd, x1 / x2);
 		}
-	} break;
-	case 3: // SLTIU
-	{
-		uint32_t cnst = (uint32_t)imm;
-		if (get_register(rs1) < cnst) {
-		    set_register(rd, 1);
+		break;
+	case RV32_REM:
+		if (x2_s == 0) {
+			// DIV/0
+			set_register(rd, x1);
+		} else if (x1_s == INT32_MIN && x2_s == -1) {
+			// signed overflow
+			set_register(rd, 0);
 		} else {
-		    set_register(rd, 0);
+			set_register(rd, x1_s % x2_s);
 		}
-	} break;
-	case 4: // XORI
-	{
-		set_register(rd, get_register(rs1) ^ imm);
-	} break;
-	case 5:
-	{
-		if (funct7 == 0) {
-			// SRLI
-			set_register(rd, get_register(rs1) >> shamt);
-		} else if (funct7 == 0b0100000) {
-			// SRAI
-			int32_t val = (int32_t)get_register(rs1);
-			val = val >> shamt;
-			set_register(rd, (uint32_t)val);
+		break;
+	case RV32_REMU:
+		if (x2 == 0) {
+			// DIV/0
+			set_register(rd, x1);
 		} else {
-			illegal_instruction();
+			set_register(rd, x1 % x2);
 		}
-	} break;
-	case 6: // ORI
-	{
-		set_register(rd, get_register(rs1) | imm);
-	} break;
-	case 7: // ANDI
-	{
-		set_register(rd, get_register(rs1) & imm);
-	} break;
+		break;
+
+	case RV32_FENCE:
+		// should be a no-op here.
+		break;
+	case RV32_FENCE_I:
+		// stores have already invalidated what they overwrote,
+		// but code may also have been changed behind the bus' back
+		flush_instruction_cache();
+		break;
+
+	case RV32_SCALL: case RV32_SBREAK: case RV32_ERET: case RV32_WFI:
+	case RV32_CSRRW: case RV32_CSRRS: case RV32_CSRRC:
+	case RV32_CSRRWI: case RV32_CSRRSI: case RV32_CSRRCI:
+		execute_SYSTEM(insn); break;
+
+	case RV32_LR_W: case RV32_SC_W:
+	case RV32_AMOSWAP_W: case RV32_AMOADD_W: case RV32_AMOXOR_W: case RV32_AMOAND_W: case RV32_AMOOR_W:
+	case RV32_AMOMIN_W: case RV32_AMOMAX_W: case RV32_AMOMINU_W: case RV32_AMOMAXU_W:
+		execute_AMO(insn); break;
+
 	default:
 		illegal_instruction(); break;
 	}
 }
 
-void RV32Core::execute_STORE(uint32_t insn) {
-	int funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    uint32_t imm = (insn & 0b11111110000000000000000000000000) >> (25-5)
-        | (insn & 0b00000000000000000000111110000000) >> 7;
-    // sign-extend to 32 bits
-    if (imm & 0x00000800) {
-    	imm |= 0xFFFFF000;
-    }
-    int32_t offset = (int32_t)imm;
-    int rs2 = (insn & 0b00000001111100000000000000000000) >> 20;
-    int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-
-    uint32_t addr = (uint32_t)((int32_t)get_register(rs1) + offset);
-
-    // TODO system bus checks valid address
+void RV32Core::execute_AMO(const DecodedInstruction &insn) {
+	// TODO system bus validate address
+	uint32_t addr = get_register(insn.rs1);
+	uint32_t data_out = get_register(insn.rs2);
+	int rd = insn.rd;
 
-	switch (funct3) {
-	case 0b000: // SB
+	switch (insn.op) {
+	case RV32_LR_W:
 	{
-		uint8_t dout = (uint8_t) (get_register(rs2) & 0x000000FF);
-		system_bus->store_byte(addr, dout);
+		// reserved before loading, so that a store by another hart either breaks the reservation or is loaded
+		system_bus->set_reservation(hartid, addr);
+		uint32_t data_in = system_bus->load_word(addr);
+		reservedValue = data_in;
+		set_register(rd, data_in);
 	} break;
-	case 0b001: // SH
+	case RV32_SC_W:
 	{
-		uint16_t dout = (uint16_t) (get_register(rs2) & 0x0000FFFF);
-		system_bus->store_halfword(addr, dout);
-	} break;
-	case 0b010: // SW
-	{
-		uint32_t dout = get_register(rs2);
-		system_bus->store_word(addr, dout);
+		// a store by a hart on another thread can slip past the reservation, but not past
+		// the check that the word still holds what LR loaded; succeeds or not, SC gives up the reservation
+		if (system_bus->is_reserved(hartid, addr) && system_bus->store_word_conditional(addr, reservedValue, data_out)) {
+			set_register(rd, 0);
+		} else {
+			set_register(rd, 1);
+		}
+		system_bus->clear_reservation(hartid);
 	} break;
 	default:
-		illegal_instruction(); break;
-	}
-}
-
-void RV32Core::execute_AMO(uint32_t insn) {
-	uint8_t funct7 = (insn & 0b11111110000000000000000000000000) >> 25;
-	uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-	int rs2 = (insn & 0b00000001111100000000000000000000) >> 20;
-	int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-	int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-	// check funct3 = 010
-	if (funct3 == 0b010) {
-		// early validate address
-		uint32_t addr = get_register(rs1);
-		// TODO system bus validate address
-		uint32_t data_out = get_register(rs2);
-		// decode the 5 highest bits of funct7
-		uint8_t amofunct = funct7 >> 2;
-		switch (amofunct) {
-		case 0b00010: // LRW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->set_reservation(addr);
-		} break;
-		case 0b00011: // SCW
-		{
-			if (system_bus->is_reserved(addr)) {
-				system_bus->store_word(addr, data_out);
-				system_bus->clear_reservation(addr);
-			} else {
-				set_register(rd, 1);
-			}
-		} break;
-		case 0b00001: // AMOSWAPW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->store_word(addr, data_out);
-		} break;
-		case 0b00000: // AMOADDW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->store_word(addr, data_in + data_out);
-		} break;
-		case 0b00100: // AMOXORW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->store_word(addr, data_in ^ data_out);
-		} break;
-		case 0b01100: // AMOANDW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->store_word(addr, data_in & data_out);
-		} break;
-		case 0b01000: // AMOORW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			system_bus->store_word(addr, data_in | data_out);
-		} break;
-		case 0b10000: // AMOMINW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-
-			int32_t data_in_s = (int32_t)data_in;
-			int32_t data_out_s = (int32_t)data_out;
-			if (data_in_s < data_out_s) {
-				system_bus->store_word(addr, data_in);
-			} else {
-				system_bus->store_word(addr, data_out);
-			}
-		} break;
-		case 0b10100: // AMOMAXW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-
-			int32_t data_in_s = (int32_t)data_in;
-			int32_t data_out_s = (int32_t)data_out;
-			if (data_in_s > data_out_s) {
-				system_bus->store_word(addr, data_in);
-			} else {
-				system_bus->store_word(addr, data_out);
-			}
-		} break;
-		case 0b11000: // AMOMINUW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			if (data_in < data_out) {
-				system_bus->store_word(addr, data_in);
-			} else {
-				system_bus->store_word(addr, data_out);
-			}
-		} break;
-		case 0b11100: // AMOMAXUW
-		{
-			uint32_t data_in = system_bus->load_word(addr);
-			set_register(rd, data_in);
-			if (data_in > data_out) {
-				system_bus->store_word(addr, data_in);
-			} else {
-				system_bus->store_word(addr, data_out);
+	{
+		// every other AMO is an atomic read-modify-write of one word
+		uint32_t op = insn.op;
+		uint32_t data_in = system_bus->modify_word(addr, [op, data_out](uint32_t data_in) -> uint32_t {
+			switch (op) {
+			case RV32_AMOSWAP_W: return data_out;
+			case RV32_AMOADD_W: return data_in + data_out;
+			case RV32_AMOXOR_W: return data_in ^ data_out;
+			case RV32_AMOAND_W: return data_in & data_out;
+			case RV32_AMOOR_W: return data_in | data_out;
+			case RV32_AMOMIN_W: return ((int32_t)data_in < (int32_t)data_out) ? data_in : data_out;
+			case RV32_AMOMAX_W: return ((int32_t)data_in > (int32_t)data_out) ? data_in : data_out;
+			case RV32_AMOMINU_W: return (data_in < data_out) ? data_in : data_out;
+			default: return (data_in > data_out) ? data_in : data_out; // AMOMAXU.W
 			}
-		} break;
-		default:
-			illegal_instruction(); break;
-		}
-	} else {
-		illegal_instruction(); return;
+		});
+		set_register(rd, data_in);
+	} break;
 	}
 }
 
-void RV32Core::execute_OP(uint32_t insn) {
-    // first decode funct7 as MUL/DIV have a different prefix
-    uint8_t funct7 = (insn & 0b11111110000000000000000000000000) >> 25;
-    uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    int rs2 = (insn & 0b00000001111100000000000000000000) >> 20;
-    int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-    int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-
-    switch (funct7) {
-    case 0b0000000:
-        // standard integer ops
-    {
-        switch (funct3) {
-        case 0b000: // ADD
-            set_register(rd, get_register(rs1) + get_register(rs2));
-            break;
-        case 0b001: // SLL
-            set_register(rd, get_register(rs1) << (get_register(rs2) & 0x0000001F));
-            break;
-        case 0b010: // SLT
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            if (x1 < x2) {
-                set_register(rd, 1);
-            } else {
-                set_register(rd, 0);
-            }
-        } break;
-        case 0b011: // SLTU
-        {
-            uint32_t x1 = get_register(rs1);
-            uint32_t x2 = get_register(rs2);
-            if (x1 < x2) {
-                set_register(rd, 1);
-            } else {
-                set_register(rd, 0);
-            }
-        } break;
-        case 0b100: // XOR
-            set_register(rd, get_register(rs1) ^ get_register(rs2));
-            break;
-        case 0b101: // SRL
-            set_register(rd, get_register(rs1) >> (get_register(rs2) & 0x0000001F));
-            break;
-        case 0b110: // OR
-            set_register(rd, get_register(rs1) | get_register(rs2));
-            break;
-        case 0b111: // AND
-            set_register(rd, get_register(rs1) & get_register(rs2));
-            break;
-        default:
-            illegal_instruction(); break;
-        }
-    } break;
-    case 0b0000001:
-        // MUL/DIV
-    {
-        switch (funct3) {
-        case 0b000: // MUL
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            set_register(rd, x1 * x2);
-        } break;
-        case 0b001: // MULH
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            int64_t product = (int64_t)x1 * (int64_t)x2;
-            set_register(rd, (uint32_t)(product >> 32));
-        } break;
-        case 0b010: // MULHSU
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            int64_t product = (int64_t)x1 * ((int64_t)x2) & 0x00000000FFFFFFFFl;
-            set_register(rd, (uint32_t)(product >> 32));
-        } break;
-        case 0b011: // MULHU
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            int64_t product = ((int64_t)x1)&0x00000000FFFFFFFFL * ((int64_t)x2)&0x00000000FFFFFFFFL;
-            set_register(rd, (uint32_t)(product >> 32));
-        } break;
-        case 0b100: // DIV
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            if (x2 == 0) {
-                // DIV/0
-                set_register(rd, -1);
-            } else if (x1 == -2147483648 && x2 == -1) {
-                // signed overflow
-                set_register(rd, -2147483648);
-            } else {
-                set_register(rd, x1 / x2);
-            }
-        } break;
-        case 0b101: // DIVU
-        {
-            uint32_t x1 = get_register(rs1);
-            uint32_t x2 = get_register(rs2);
-            if (x2 == 0) {
-                // DIV/0
-                set_register(rd, 0xFFFFFFFF);
-            } else {
-                set_register(rd, x1 / x2);
-            }
-        } break;
-        case 0b110: // REM
-        {
-            int32_t x1 = (int32_t)get_register(rs1);
-            int32_t x2 = (int32_t)get_register(rs2);
-            if (x2 == 0) {
-                // DIV/0
-                set_register(rd, x1);
-            } else if (x1 == -2147483648 && x2 == -1) {
-                // signed overflow
-                set_register(rd, 0);
-            } else {
-                set_register(rd, x1 % x2);
-            }
-        } break;
-        case 0b111: // REMU
-        {
-            uint32_t x1 = get_register(rs1);
-            uint32_t x2 = get_register(rs2);
-            if (x2 == 0) {
-                // DIV/0
-                set_register(rd, x1);
-            } else {
-                set_register(rd, x1 % x2);
-            }
-        } break;
-        default:
-            illegal_instruction(); break;
-        }
-    } break;
-    case 0b0100000:
-        // other standard integer ops
-    {
-        switch (funct3) {
-        case 0b000: // SUB
-            set_register(rd, get_register(rs1) - get_register(rs2));
-            break;
-        case 0b101: // SRA
-        {
-            int32_t val = (int32_t)get_register(rs1);
-            val = val >> (int32_t)(get_register(rs2) & 0x0000001F);
-            set_register(rd, (uint32_t)val);
-        } break;
-        default:
-            illegal_instruction(); break;
-        }
-    } break;
-    default:
-        illegal_instruction(); break;
-    }
-}
-
-void RV32Core::execute_BRANCH(uint32_t insn) {
-    uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    int32_t imm = (insn & 0b10000000000000000000000000000000) >> (31-12)
-        | (insn & 0b01111110000000000000000000000000) >> (25-5)
-        | (insn & 0b00000000000000000000111100000000) >> (8-1)
-        | (insn & 0b00000000000000000000000010000000) << (11-7);
-    int rs2 = (insn & 0b00000001111100000000000000000000) >> 20;
-    int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-
-    uint32_t x1_u = get_register(rs1);
-    uint32_t x2_u = get_register(rs2);
-    int32_t x1_s = (int32_t)get_register(rs1);
-    int32_t x2_s = (int32_t)get_register(rs2);
-
-    bool branch_taken;
-
-    switch (funct3) {
-    case 0b000: // BEQ
-        branch_taken = (x1_u == x2_u); break;
-    case 0b001: // BNE
-        branch_taken = (x1_u != x2_u); break;
-    case 0b100: // BLT
-        branch_taken = (x1_s < x2_s); break;
-    case 0b101: // BGE
-        branch_taken = (x1_s >= x2_s); break;
-    case 0b110: // BLTU
-        branch_taken = (x1_u < x2_u); break;
-    case 0b111: // BGEU
-        branch_taken = (x1_u >= x2_u); break;
-    default:
-        illegal_instruction(); return;
-    }
-
-    if (branch_taken) {
-        next_pc = (uint32_t) ( (int32_t)pc + imm );
-    }
-}
-
-void RV32Core::execute_SYSTEM(uint32_t insn) {
-    uint8_t funct3 = (insn & 0b00000000000000000111000000000000) >> 12;
-    int32_t imm = ( ((int32_t)insn) & (int32_t)0b11111111111100000000000000000000) >> 20;
-    int rs1 = (insn & 0b00000000000011111000000000000000) >> 15;
-    int rd = (insn & 0b00000000000000000000111110000000) >> 7;
-
-    switch (funct3) {
-    case 0b000:
-    {
-        // decode imm (funct12)
-        int imm = (insn & 0b11111111111100000000000000000000) >> 20;
-        switch (imm) {
-        case 0b000000000000: // SCALL
-            processor_trap(11); break;
-        case 0b000000000001: // SBREAK
-            processor_trap(3); break;
-        case 0b000100000000: // ERET
-            // pop the interrupt stack to the right and set
-            // the leftmost entry to interrupts enabled
-            mstatus_ie = mstatus_ie1;
-            mstatus_ie1 = true;
-            next_pc = mepc;
-            // counts as a context switch
-            system_bus->clear_all_reservations();
-            break;
-        default:
-            illegal_instruction(); break;
-        }
-    } break;
-    case 0b001: // CSRRW
+void RV32Core::execute_SYSTEM(const DecodedInstruction &insn) {
+    int csr = insn.imm;
+    int rs1 = insn.rs1;
+    int rd = insn.rd;
+
+    switch (insn.op) {
+    case RV32_SCALL:
+        processor_trap(11); break;
+    case RV32_SBREAK:
+        processor_trap(3); break;
+    case RV32_WFI:
+        // resumes at the next instruction when woken up
+        sleep(); break;
+    case RV32_ERET:
+        // pop the interrupt stack to the right and set
+        // the leftmost entry to interrupts enabled
+        mstatus_ie = mstatus_ie1;
+        mstatus_ie1 = true;
+        next_pc = mepc;
+        // counts as a context switch
+        system_bus->clear_reservation(hartid);
+        break;
+    case RV32_CSRRW:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         write_csr(csr, get_register(rs1));
         set_register(rd, old_value);
     } break;
-    case 0b010: // CSRRS
+    case RV32_CSRRS:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         if (rs1 != 0) {
             write_csr(csr, old_value | get_register(rs1));
         }
         set_register(rd, old_value);
     } break;
-    case 0b011: // CSRRC
+    case RV32_CSRRC:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         if (rs1 != 0) {
             write_csr(csr, old_value & ~get_register(rs1));
         }
         set_register(rd, old_value);
     } break;
-    case 0b101: // CSRRWI
+    case RV32_CSRRWI:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         write_csr(csr, rs1);
         set_register(rd, old_value);
     } break;
-    case 0b110: // CSRRSI
+    case RV32_CSRRSI:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         if (rs1 != 0) {
             write_csr(csr, old_value | rs1);
         }
         set_register(rd, old_value);
     } break;
-    case 0b111: // CSRRCI
+    case RV32_CSRRCI:
     {
-        int csr = imm;
         uint32_t old_value = read_csr(csr);
         if (rs1 != 0) {
             write_csr(csr, old_value & ~rs1);
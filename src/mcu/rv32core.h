@@ -2,28 +2,165 @@
 #define _MCU_RV32CORE_
 
 #include <cstdint>
+#include <ostream>
 #include "system_bus.h"
+#include "decoded_instruction.h"
+#include "instruction_cache.h"
+#include "rv32_jit.h"
+#include "rv32_aot.h"
+#include "rv32_trace.h"
+
+class ROM;
+class InterruptController;
+class RV32Profiler;
 
 class RV32Core {
 public:
+	// a core with its own system bus
 	RV32Core();
+	// Another hart on a bus that's shared with other cores, which the caller owns.
+	// Each hart has its own mhartid (the lowest one no other hart on the bus has) and LR/SC reservation,
+	// and the harts can run on different threads. Stores from one hart don't wake another that's asleep.
+	// Throws std::runtime_error if the bus already has SystemBus::MAX_HARTS harts.
+	RV32Core(SystemBus *sharedBus);
 	virtual ~RV32Core();
 
+	// Executes one instruction, or with the JIT enabled, usually a whole basic block.
 	void step();
+
+	enum RunResult {
+		RUN_BUDGET_EXHAUSTED,
+		RUN_TRAPPED, // stopped just after taking a trap; pc is the trap handler
+		RUN_SLEEPING, // slept through the end of the budget (see is_sleeping())
+	};
+	// Runs for up to cycleBudget cycles (one per instruction), without returning
+	// between instructions; this is what an occupant hosting the MCU should call
+	// once per tick from its preprocess(). Translated code (JIT or AOT) runs whole blocks,
+	// so the budget may be overshot by the rest of a block; get_cycle() says by how much.
+	// A core that is asleep, or goes to sleep, sleeps through the rest of the budget unless a
+	// timed peripheral's deadline (see SystemBusPeripheral::get_deadline()) wakes it up first.
+	// Deadlines are checked again after every store to a timed peripheral, so one that
+	// the running code sets is met as well.
+	RunResult run(uint64_t cycleBudget);
+	uint64_t get_instret() const { return instret; }
+
+	// The core's clock keeps running while it sleeps: the cycle CSR counts both,
+	// and the time CSR counts timesteps of cyclesPerTimestep cycles.
+	uint64_t get_cycle() const { return instret + idleCycles; }
+	uint64_t get_time() const { return get_cycle() / cyclesPerTimestep; }
+	void set_cycles_per_timestep(uint64_t cycles) { cyclesPerTimestep = cycles; }
+	uint64_t get_cycles_per_timestep() const { return cyclesPerTimestep; }
+	static const uint64_t DEFAULT_CYCLES_PER_TIMESTEP = 100000;
+
+	// Where external interrupts come from (and the controller should be attached to the bus too);
+	// NULL if there are none.
+	void set_interrupt_controller(InterruptController *controller) { interrupts = controller; }
+
+	// A core sleeps after WFI, or (with spin detection) when it's stuck in a loop that can't
+	// get anywhere until something outside the core changes. Sleeping cores don't step or run.
+	// A core wakes up on wake(), on an external interrupt, or when is_sleeping() notices
+	// that a peripheral has changed since it went to sleep (see SystemBusPeripheral::get_changes()).
+	bool is_sleeping();
+	void wake() { sleeping = false; }
+	// Spin detection (off by default) puts the core to sleep when run() sees it go around a loop
+	// of at most MAX_SPIN_LENGTH instructions with no stores, CSR accesses or other side effects,
+	// ending up with exactly the same registers, so that every further iteration would do the same.
+	// It's only sound if every peripheral the loop polls reports its changes,
+	// and only works in the interpreter, not in translated (JIT or AOT) code.
+	// It's off for harts on a shared bus, whatever this says: spinning on a word in RAM
+	// that another hart sets is the usual way for harts to wait for each other,
+	// and stores to RAM don't count as changes, so the spinning hart would never wake.
+	void set_spin_detection(bool enabled) { spinDetection = enabled; }
+	static const uint32_t MAX_SPIN_LENGTH = 16;
+
+	// The architectural state of a core and of its peripherals.
+	class Snapshot {
+	public:
+		~Snapshot() { delete bus; }
+	protected:
+		friend class RV32Core;
+		uint32_t xRegister[32];
+		uint32_t pc;
+		bool mstatus_ie;
+		bool mstatus_ie1;
+		uint32_t mscratch;
+		uint32_t mepc;
+		uint32_t mcause;
+		uint32_t mbadaddr;
+		uint64_t instret;
+		uint64_t idleCycles;
+		bool sleeping;
+		SystemBus::Snapshot *bus;
+	};
+	// Saving copies no memory; RAM is shared copy-on-write with the snapshot.
+	Snapshot * save_state();
+	// Returns this core, or forks it into another core with the same kinds of peripherals
+	// attached in the same order, to the state in a snapshot. The snapshot can be reused.
+	void restore_state(const Snapshot *snapshot);
 	void execute(uint32_t insn);
+	void execute(const DecodedInstruction &insn);
 	bool interrupts_enabled() const { return mstatus_ie; }
 	void external_interrupt();
 
 	SystemBus * get_system_bus() const { return system_bus; }
+	// the mhartid CSR
+	uint32_t get_hart_id() const { return hartid; }
+
+	// Counts where run() spends its instructions (see RV32Profiler), or with NULL (the default) doesn't.
+	// The core doesn't own the profiler.
+	void set_profiler(RV32Profiler *p) { profiler = p; }
+	RV32Profiler * get_profiler() const { return profiler; }
+
+	// Every core keeps a trace of its last taken branches, jumps and traps (see RV32Trace),
+	// RV32Trace::DEFAULT_SIZE words unless set_trace_size() says otherwise,
+	// including while an RV32CoreBank runs the core in lockstep.
+	const RV32Trace & get_trace() const { return trace; }
+	void set_trace_size(uint32_t words);
+	// Saves the trace and where the core is now, for the rv32_trace tool (see rv32_trace_tool.cc).
+	void save_trace(std::ostream &out) const { trace.write(out, pc, instret); }
+
+	// Stores through the system bus keep the instruction cache up to date,
+	// but anything that changes memory behind its back (e.g. set_contents()) must flush it.
+	void flush_instruction_cache();
+
+	// Translates code in ROM to native code where possible (see RV32JIT).
+	// Returns false if the JIT isn't supported on this platform.
+	bool set_jit_enabled(bool enabled);
+	bool is_jit_enabled() const { return jit != NULL; }
+
+	// Runs code in rom (mapped at baseAddress) with its ahead-of-time translation,
+	// if one was compiled in for exactly these contents (see rv32_aot.h);
+	// otherwise returns false and the code is interpreted (or JITted) as usual.
+	// NULL stops using the translation. If the ROM's contents change afterwards,
+	// flush_instruction_cache() looks the translation up again.
+	bool use_translated_rom(const ROM *rom, uint32_t baseAddress);
+	bool is_using_translated_rom() const { return aot != NULL; }
 protected:
+	friend class RV32CoreBank;
+
 	uint32_t xRegister[32];
 	uint32_t get_register(int idx) const;
 	void set_register(int idx, uint32_t val);
 
 	uint32_t pc;
 	uint32_t next_pc;
+	bool trapped; // set by processor_trap(), so that run() can stop
+	bool sleeping;
+	uint64_t sleepChanges; // the bus' get_peripheral_changes() when the core went to sleep
+	bool spinDetection;
 
 	SystemBus * system_bus;
+	bool ownsBus;
+	uint32_t hartid;
+	uint32_t reservedValue; // what LR loaded from the reserved word
+	InterruptController * interrupts;
+	RV32Profiler * profiler;
+	RV32Trace trace;
+	InstructionCache icache;
+	RV32JIT * jit;
+	const ROM * aotRom;
+	uint32_t aotBaseAddress;
+	const RV32AOTImage * aot;
 
 	// use a split mstatus register; we only need two fields
 	bool mstatus_ie;
@@ -44,21 +181,36 @@ protected:
 
 	// instructions-retired counter
 	uint64_t instret;
+	// cycles spent asleep
+	uint64_t idleCycles;
+	uint64_t cyclesPerTimestep;
 
 	uint32_t read_csr(int csr);
 	void write_csr(int csr, uint32_t val);
 
-	void execute_LOAD(uint32_t insn);
-	void execute_MISC_MEM(uint32_t insn);
-	void execute_OP_IMM(uint32_t insn);
-	void execute_STORE(uint32_t insn);
-	void execute_AMO(uint32_t insn);
-	void execute_OP(uint32_t insn);
-	void execute_BRANCH(uint32_t insn);
-	void execute_SYSTEM(uint32_t insn);
+	void execute_AMO(const DecodedInstruction &insn);
+	void execute_SYSTEM(const DecodedInstruction &insn);
+	// step() without checking the trace, for run(), which checks it once
+	void single_step();
+	template <bool Profiling> RunResult run_interpreted(uint64_t cycleBudget);
+	// tells the profiler about what one step() from stepPC ran
+	void profile_step(uint32_t stepPC, uint64_t stepInstret);
+	// how a block whose last instruction is at last ends (see RV32Profiler::BlockExit)
+	uint8_t block_exit(uint32_t last);
+	// Tells the trace where the core is if it's been moved behind the trace's back
+	// (e.g. by a subclass setting pc).
+	void sync_trace() {
+		if (!trace.follows(pc, instret)) {
+			trace.sync(pc, instret);
+		}
+	}
+	void sleep();
+	// Advances timed peripherals to the current cycle, and wakes the core for (or takes) a pending interrupt.
+	// Returns true if an interrupt was taken.
+	bool poll_peripherals();
 
 	void illegal_instruction();
-	void processor_trap(uint32_t cause);
+	void processor_trap(uint32_t cause, bool interrupt = false);
 
 };
 
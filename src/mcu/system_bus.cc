@@ -1,89 +1,197 @@
 #include "system_bus.h"
 
-static const uint32_t LAST_VALID_PAGE = 0xFFFFFFFF >> 10;
+const uint32_t SystemBus::MAX_HARTS;
+const uint32_t SystemBus::NO_HART;
 
-SystemBus::SystemBus() {
+static const uint32_t LAST_VALID_PAGE = 0xFFFFFFFF >> 10;
 
+SystemBus::SystemBus()
+: regions(1), nReservations(0), nHarts(0), nHartSlots(0), deadlineChanges(0) {
+    for (uint32_t i = 0; i < NUMBER_OF_TABLES; ++i) {
+        page_tables[i] = NULL;
+    }
+    for (uint32_t i = 0; i < MAX_HARTS; ++i) {
+        reservations[i] = NO_RESERVATION;
+        instruction_caches[i] = NULL;
+    }
 }
 
 SystemBus::~SystemBus() {
-
+    for (uint32_t i = 0; i < NUMBER_OF_TABLES; ++i) {
+        delete[] page_tables[i];
+    }
 }
 
 void SystemBus::attach_peripheral(SystemBusPeripheral *p, uint32_t baseAddress) {
     uint32_t basePage = baseAddress >> 10;
+    uint32_t nPages = p->get_number_of_pages();
+    if (nPages == 0 || regions.size() >= MAX_REGIONS) {
+        return;
+    }
     // validate address
-    for (uint32_t i = basePage; i < basePage + p->get_number_of_pages(); ++i) {
+    for (uint32_t i = basePage; i < basePage + nPages; ++i) {
         if (i > LAST_VALID_PAGE) {
             return;
         }
-        if (mapped_pages.find(i) != mapped_pages.end()) {
+        const uint8_t *table = page_tables[i / PAGES_PER_TABLE];
+        if (table != NULL && table[i % PAGES_PER_TABLE] != 0) {
             // tried to map two peripherals into the same page
             return;
         }
     }
-    for (uint32_t i = basePage; i < basePage + p->get_number_of_pages(); ++i) {
-        mapped_pages[i] = p;
-    }
-}
-
-uint8_t SystemBus::load_byte(uint32_t pAddr) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        return it->second->read_byte(pAddr);
-    } else {
-        // bus error
-        return 0;
-    }
-}
-uint16_t SystemBus::load_halfword(uint32_t pAddr) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        return it->second->read_halfword(pAddr);
-    } else {
-        // bus error
-        return 0;
-    }
-}
-uint32_t SystemBus::load_word(uint32_t pAddr) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        return it->second->read_word(pAddr);
-    } else {
-        // bus error
-        return 0;
-    }
-}
-void SystemBus::store_byte(uint32_t pAddr, uint8_t value) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        it->second->write_byte(pAddr, value);
-        clear_reservation(pAddr);
-    } else {
-        // bus error
-    }
-}
-void SystemBus::store_halfword(uint32_t pAddr, uint16_t value) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        it->second->write_halfword(pAddr, value);
-        clear_reservation(pAddr);
-    } else {
-        // bus error
-    }
-}
-void SystemBus::store_word(uint32_t pAddr, uint32_t value) {
-    uint32_t pageNumber = (pAddr & 0xFFFFF800) >> 10;
-    std::map<uint32_t, SystemBusPeripheral*>::iterator it = mapped_pages.find(pageNumber);
-    if (it != mapped_pages.end()) {
-        it->second->write_word(pAddr, value);
-        clear_reservation(pAddr);
-    } else {
-        // bus error
+
+    Region r;
+    r.peripheral = p;
+    r.base = basePage << 10;
+    r.readOnly = p->is_read_only();
+    r.readable = p->get_readable_pages();
+    r.writable = p->get_writable_pages();
+    r.timed = p->is_timed();
+    if (r.timed) {
+        timed.push_back(p);
+    }
+    uint8_t index = (uint8_t)regions.size();
+    regions.push_back(r);
+
+    for (uint32_t i = basePage; i < basePage + nPages; ++i) {
+        uint8_t *&table = page_tables[i / PAGES_PER_TABLE];
+        if (table == NULL) {
+            table = new uint8_t[PAGES_PER_TABLE];
+            memset(table, 0, PAGES_PER_TABLE);
+        }
+        table[i % PAGES_PER_TABLE] = index;
+    }
+    flush_instruction_caches();
+}
+
+SystemBus::Snapshot::~Snapshot() {
+    for (size_t i = 0; i < peripherals.size(); ++i) {
+        delete peripherals[i];
+    }
+}
+
+SystemBus::Snapshot * SystemBus::save_state() {
+    Snapshot *snapshot = new Snapshot();
+    for (size_t i = 1; i < regions.size(); ++i) {
+        snapshot->peripherals.push_back(regions[i].peripheral->save_state());
+    }
+    return snapshot;
+}
+
+void SystemBus::restore_state(const Snapshot *snapshot) {
+    for (size_t i = 1; i < regions.size() && i - 1 < snapshot->peripherals.size(); ++i) {
+        if (snapshot->peripherals[i - 1] != NULL) {
+            regions[i].peripheral->restore_state(snapshot->peripherals[i - 1]);
+        }
+    }
+    clear_all_reservations();
+    flush_instruction_caches();
+}
+
+uint64_t SystemBus::get_peripheral_changes() const {
+    uint64_t changes = 0;
+    for (size_t i = 1; i < regions.size(); ++i) {
+        changes += regions[i].peripheral->get_changes();
+    }
+    return changes;
+}
+
+uint64_t SystemBus::get_next_deadline() const {
+    uint64_t deadline = SystemBusPeripheral::NO_DEADLINE;
+    for (size_t i = 0; i < timed.size(); ++i) {
+        uint64_t d = timed[i]->get_deadline();
+        if (d < deadline) {
+            deadline = d;
+        }
+    }
+    return deadline;
+}
+
+uint32_t SystemBus::add_hart(InstructionCache *cache) {
+    for (uint32_t i = 0; i < MAX_HARTS; ++i) {
+        if (instruction_caches[i] == NULL) {
+            instruction_caches[i] = cache;
+            ++nHarts;
+            if (i >= nHartSlots) {
+                nHartSlots = i + 1;
+            }
+            return i;
+        }
+    }
+    return NO_HART;
+}
+
+void SystemBus::remove_hart(uint32_t hart) {
+    if (hart < MAX_HARTS && instruction_caches[hart] != NULL) {
+        clear_reservation(hart);
+        instruction_caches[hart] = NULL;
+        --nHarts;
+        while (nHartSlots > 0 && instruction_caches[nHartSlots - 1] == NULL) {
+            --nHartSlots;
+        }
+    }
+}
+
+void SystemBus::flush_instruction_caches() {
+    for (uint32_t i = 0; i < nHartSlots; ++i) {
+        if (instruction_caches[i] != NULL) {
+            instruction_caches[i]->flush();
+        }
+    }
+}
+
+void SystemBus::set_reservation(uint32_t hart, uint32_t addr) {
+    if (hart >= MAX_HARTS) {
+        return;
+    }
+    if (reservations[hart].exchange(addr & ~0x00000003) == NO_RESERVATION) {
+        ++nReservations;
+    }
+}
+
+void SystemBus::clear_reservation(uint32_t hart) {
+    if (hart >= MAX_HARTS) {
+        return;
+    }
+    if (reservations[hart].exchange(NO_RESERVATION) != NO_RESERVATION) {
+        --nReservations;
+    }
+}
+
+void SystemBus::clear_all_reservations() {
+    for (uint32_t i = 0; i < MAX_HARTS; ++i) {
+        clear_reservation(i);
+    }
+}
+
+bool SystemBus::store_word_conditional(uint32_t pAddr, uint32_t expected, uint32_t desired) {
+    uint32_t *word = atomic_word(pAddr);
+    if (word == NULL) {
+        std::unique_lock<std::mutex> lock(atomicLock, std::defer_lock);
+        if (nHarts > 1) {
+            lock.lock();
+        }
+        store_through_peripheral(pAddr, desired);
+        return true;
+    }
+    if (!__atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    stored(pAddr, 4);
+    return true;
+}
+
+// a store of nBytes at pAddr breaks any reservation on the words it touches
+void SystemBus::clear_reservations(uint32_t pAddr, uint32_t nBytes) {
+    uint32_t first = pAddr & ~0x00000003;
+    uint32_t last = (pAddr + nBytes - 1) & ~0x00000003;
+    for (uint32_t i = 0; i < nHartSlots; ++i) {
+        uint32_t reserved = reservations[i].load(std::memory_order_relaxed);
+        if (reserved == first || reserved == last) {
+            // only if it's still the same reservation
+            if (reservations[i].compare_exchange_strong(reserved, NO_RESERVATION)) {
+                --nReservations;
+            }
+        }
     }
 }
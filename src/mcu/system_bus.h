@@ -1,14 +1,22 @@
 #ifndef _MCU_SYSTEM_BUS_
 #define _MCU_SYSTEM_BUS_
 
+#include <atomic>
 #include <cstdint>
-#include <map>
-#include <unordered_set>
+#include <mutex>
+#include <vector>
 #include <cstring>
+#include "instruction_cache.h"
+
+// The saved state of one peripheral; see SystemBusPeripheral::save_state().
+class PeripheralSnapshot {
+public:
+    virtual ~PeripheralSnapshot() {}
+};
 
 class SystemBusPeripheral {
 public:
-    SystemBusPeripheral() : mask(0) {}
+    SystemBusPeripheral() : mask(0), changes(0) {}
     virtual ~SystemBusPeripheral() {}
     virtual uint32_t get_number_of_pages() const = 0;
 
@@ -31,11 +39,46 @@ public:
     virtual void write_halfword(uint32_t pAddr, uint16_t value) = 0;
     virtual void write_word(uint32_t pAddr, uint32_t value) = 0;
 
+    // Peripherals that are plain memory can let the bus load (store) directly
+    // by returning an array with the host memory backing each of their pages,
+    // in RISC-V (little-endian) byte order, or NULL for a page that has to go through read_*() (write_*()).
+    // The array must stay valid for as long as the peripheral is attached,
+    // but the peripheral may change its entries at any time (atomically, with release order,
+    // if harts on other threads share the bus: see RAM).
+    virtual uint8_t * const * get_readable_pages() { return NULL; }
+    virtual uint8_t * const * get_writable_pages() { return NULL; }
+    // true if nothing but the host (e.g. set_contents()) ever changes what this peripheral reads back
+    virtual bool is_read_only() const { return false; }
+
+    // Captures whatever state the peripheral has, for restore_state() to go back to later,
+    // on this peripheral or another one of the same kind (which forks it).
+    // NULL if there is nothing to save (e.g. ROM).
+    virtual PeripheralSnapshot * save_state() { return NULL; }
+    virtual void restore_state(const PeripheralSnapshot *snapshot) {}
+
     virtual void cycle() = 0;
     // called once per timestep after all global cycles have completed
     virtual void timestep() = 0;
+
+    // Peripherals that keep time (e.g. timers) are brought up to the core's cycle count
+    // with advance_to() before each run of instructions, and get_deadline() says by which cycle
+    // they next need that to happen, or NO_DEADLINE; the core never runs past a deadline.
+    // A store to a timed peripheral may move its deadline, so it ends the core's run of instructions
+    // (see SystemBus::get_deadline_changes()).
+    // Only peripherals that are timed when they are attached are ever advanced.
+    static const uint64_t NO_DEADLINE = UINT64_MAX;
+    virtual bool is_timed() const { return false; }
+    virtual void advance_to(uint64_t cycle) {}
+    virtual uint64_t get_deadline() const { return NO_DEADLINE; }
+
+    // How many times what the peripheral reads back has changed other than by the core's own stores;
+    // a core sleeping on (or spinning over) the peripheral wakes when it goes up.
+    uint64_t get_changes() const { return changes; }
 protected:
     uint32_t mask;
+    uint64_t changes;
+    // peripherals call this whenever something outside the core changes them (e.g. in timestep())
+    void changed() { ++changes; }
 };
 
 class SystemBus {
@@ -45,24 +88,262 @@ public:
 
     void attach_peripheral(SystemBusPeripheral *p, uint32_t baseAddress);
 
-    uint8_t load_byte(uint32_t pAddr);
-    uint16_t load_halfword(uint32_t pAddr);
-    uint32_t load_word(uint32_t pAddr);
-    void store_byte(uint32_t pAddr, uint8_t value);
-    void store_halfword(uint32_t pAddr, uint16_t value);
-    void store_word(uint32_t pAddr, uint32_t value);
+    uint8_t load_byte(uint32_t pAddr) { return load<uint8_t>(pAddr); }
+    uint16_t load_halfword(uint32_t pAddr) { return load<uint16_t>(pAddr); }
+    uint32_t load_word(uint32_t pAddr) { return load<uint32_t>(pAddr); }
+    void store_byte(uint32_t pAddr, uint8_t value) { store<uint8_t>(pAddr, value); }
+    void store_halfword(uint32_t pAddr, uint16_t value) { store<uint16_t>(pAddr, value); }
+    void store_word(uint32_t pAddr, uint32_t value) { store<uint32_t>(pAddr, value); }
+
+    // Loads and stores that only go to memory the bus can access directly (T is uint8_t, uint16_t or uint32_t).
+    // They return false, without touching any peripheral, if the access would have to go through one.
+    template <typename T> bool load_direct(uint32_t pAddr, T &value) const {
+        const Region &r = region_of(pAddr);
+        const uint8_t *page = page_of(r.readable, r, pAddr);
+        if (page == NULL || (pAddr & (PAGE_SIZE - 1)) > PAGE_SIZE - sizeof(T)) {
+            return false;
+        }
+        value = read_host<T>(page + (pAddr & (PAGE_SIZE - 1)));
+        return true;
+    }
+    template <typename T> bool store_direct(uint32_t pAddr, T value) {
+        const Region &r = region_of(pAddr);
+        uint8_t *page = page_of(r.writable, r, pAddr);
+        if (page == NULL || (pAddr & (PAGE_SIZE - 1)) > PAGE_SIZE - sizeof(T)) {
+            return false;
+        }
+        write_host<T>(page + (pAddr & (PAGE_SIZE - 1)), value);
+        stored(pAddr, sizeof(T));
+        return true;
+    }
+
+    // Atomic accesses for SC and the AMOs. In directly-accessible memory they're host atomics,
+    // so plain stores by other harts (which don't lock anything) are never lost in between;
+    // a word behind a peripheral is loaded (and stored) once, under the bus' lock.
+    // Stores desired to the word at pAddr if it still holds expected (which isn't checked for a peripheral).
+    bool store_word_conditional(uint32_t pAddr, uint32_t expected, uint32_t desired);
+    // Replaces the word at pAddr with f(what it holds), and returns what it held.
+    template <typename F> uint32_t modify_word(uint32_t pAddr, F f) {
+        uint32_t *word = atomic_word(pAddr);
+        if (word == NULL) {
+            std::unique_lock<std::mutex> lock(atomicLock, std::defer_lock);
+            if (nHarts > 1) {
+                lock.lock();
+            }
+            uint32_t value = load_word(pAddr);
+            store_through_peripheral(pAddr, f(value));
+            return value;
+        }
+        uint32_t value = __atomic_load_n(word, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(word, &value, f(value), false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            // value is what got in between
+        }
+        stored(pAddr, 4);
+        return value;
+    }
+
+    // True if pAddr is in directly-readable memory of a read-only peripheral (i.e. ROM),
+    // which can only change behind the bus' back.
+    bool is_read_only(uint32_t pAddr) const {
+        const Region &r = region_of(pAddr);
+        return r.readOnly && page_of(r.readable, r, pAddr) != NULL;
+    }
+
+    // Several harts (cores) can share a bus: each one registers its instruction cache,
+    // which every store keeps up to date, and gets the lowest hart ID that no other hart has
+    // (so a removed hart's ID is reused). Returns NO_HART if there are already MAX_HARTS.
+    static const uint32_t MAX_HARTS = 8;
+    static const uint32_t NO_HART = 0xFFFFFFFF;
+    uint32_t add_hart(InstructionCache *cache);
+    void remove_hart(uint32_t hart);
+    // harts that have been added and not removed
+    uint32_t get_number_of_harts() const { return nHarts; }
+
+    // LR/SC reservations: each hart holds at most one, on a single word, which any store to that word
+    // (by any hart) clears. Stores only look at the reservations while one is held,
+    // so a store usually pays a single compare for them. A store on another thread can still
+    // miss a reservation that's being taken, so SC also checks (with store_word_conditional())
+    // that the word holds what LR loaded. Hart IDs of MAX_HARTS or more never hold one.
+    void set_reservation(uint32_t hart, uint32_t addr);
+    bool is_reserved(uint32_t hart, uint32_t addr) const {
+        return hart < MAX_HARTS && reservations[hart].load(std::memory_order_relaxed) == (addr & ~0x00000003);
+    }
+    void clear_reservation(uint32_t hart);
+    void clear_all_reservations();
+
+    // The state of every attached peripheral, in the order they were attached.
+    class Snapshot {
+    public:
+        ~Snapshot();
+        std::vector<PeripheralSnapshot*> peripherals;
+    };
+    Snapshot * save_state();
+    // Restores each peripheral from its snapshot; the peripherals attached to this bus
+    // have to be of the same kinds and sizes, attached in the same order, as where the snapshot came from.
+    void restore_state(const Snapshot *snapshot);
+
+    // the sum of every attached peripheral's get_changes()
+    uint64_t get_peripheral_changes() const;
 
-    void set_reservation(uint32_t addr) { reserved_addresses.insert(addr >> 2); }
-    bool is_reserved(uint32_t addr) const { return reserved_addresses.find(addr >> 2) != reserved_addresses.end(); }
-    void clear_reservation(uint32_t addr) { reserved_addresses.erase(addr >> 2); }
-    void clear_all_reservations() { reserved_addresses.clear(); }
+    // advance_to() and the earliest get_deadline() of every timed peripheral
+    bool has_timed_peripherals() const { return !timed.empty(); }
+    void advance_to(uint64_t cycle) {
+        for (size_t i = 0; i < timed.size(); ++i) {
+            timed[i]->advance_to(cycle);
+        }
+    }
+    uint64_t get_next_deadline() const;
+    // Goes up with every store to a timed peripheral, after which get_next_deadline() has to be asked again.
+    uint32_t get_deadline_changes() const { return deadlineChanges.load(std::memory_order_relaxed); }
+
+    static const uint32_t PAGE_SIZE = 1024;
 
 protected:
+    // A peripheral and the addresses it is mapped at.
+    // regions[0] is the empty region that unmapped pages belong to.
+    struct Region {
+        Region() : peripheral(NULL), base(0), readOnly(false), timed(false), readable(NULL), writable(NULL) {}
+        SystemBusPeripheral *peripheral;
+        uint32_t base;
+        bool readOnly; // the peripheral's is_read_only()
+        bool timed; // and is_timed()
+        // the peripheral's get_readable_pages() and get_writable_pages()
+        uint8_t * const *readable;
+        uint8_t * const *writable;
+    };
+    std::vector<Region> regions;
+
+    // The page table maps each 1 KB page to the index of its region in two levels:
+    // address bits [31:22] pick one of 1024 tables, and bits [21:10] pick one of that table's pages.
+    // Tables are only allocated for the parts of the address space that have something mapped,
+    // so a typical MCU with its ROM and RAM far apart only needs two 4 KB tables.
+    // Loads and stores within a page that has host memory never leave the bus;
+    // anything else (MMIO, accesses that straddle pages) goes through the peripheral.
+    static const uint32_t NUMBER_OF_TABLES = 1024;
+    static const uint32_t PAGES_PER_TABLE = 4096;
+    static const uint32_t MAX_REGIONS = 256;
+    uint8_t *page_tables[NUMBER_OF_TABLES];
+
+    const Region & region_of(uint32_t pAddr) const {
+        const uint8_t *table = page_tables[pAddr >> 22];
+        if (table == NULL) {
+            return regions[0];
+        }
+        return regions[table[(pAddr >> 10) & (PAGES_PER_TABLE - 1)]];
+    }
+
+    // the host memory for the page at pAddr, or NULL if it has to go through the peripheral;
+    // a peripheral on a shared bus can change its pages while harts on other threads are using them
+    static uint8_t * page_of(uint8_t * const *pages, const Region &r, uint32_t pAddr) {
+        if (pages == NULL) {
+            return NULL;
+        }
+        return __atomic_load_n(pages + ((pAddr - r.base) >> 10), __ATOMIC_ACQUIRE);
+    }
+
+    // Harts on other threads may be using the same host memory, so aligned accesses to it
+    // are (relaxed) atomic, which costs the same as a plain access on x86;
+    // misaligned ones aren't atomic, as on the hardware.
+    template <typename T> static T read_host(const uint8_t *p) {
+        T value;
+        if (((uintptr_t)p & (sizeof(T) - 1)) == 0) {
+            value = __atomic_load_n((const T*)p, __ATOMIC_RELAXED);
+        } else {
+            memcpy(&value, p, sizeof(T));
+        }
+        return value;
+    }
+    template <typename T> static void write_host(uint8_t *p, T value) {
+        if (((uintptr_t)p & (sizeof(T) - 1)) == 0) {
+            __atomic_store_n((T*)p, value, __ATOMIC_RELAXED);
+        } else {
+            memcpy(p, &value, sizeof(T));
+        }
+    }
+    // the host memory for the aligned word at pAddr, if it can be accessed directly
+    uint32_t * atomic_word(uint32_t pAddr) {
+        const Region &r = region_of(pAddr);
+        uint8_t *page = page_of(r.writable, r, pAddr);
+        if (page == NULL || page_of(r.readable, r, pAddr) != page) {
+            return NULL;
+        }
+        uint8_t *word = page + (pAddr & (PAGE_SIZE - 1));
+        return (((uintptr_t)word & 0x00000003) == 0) ? (uint32_t*)word : NULL;
+    }
+
+    template <typename T> T load(uint32_t pAddr) {
+        T value;
+        if (load_direct(pAddr, value)) {
+            return value;
+        }
+        SystemBusPeripheral *p = region_of(pAddr).peripheral;
+        if (p == NULL) {
+            // bus error
+            return 0;
+        }
+        switch (sizeof(T)) {
+        case 1: return (T)p->read_byte(pAddr);
+        case 2: return (T)p->read_halfword(pAddr);
+        default: return (T)p->read_word(pAddr);
+        }
+    }
+
+    template <typename T> void store(uint32_t pAddr, T value) {
+        if (store_direct(pAddr, value)) {
+            return;
+        }
+        // peripherals (including RAM making a page writable) only see one hart at a time
+        std::unique_lock<std::mutex> lock(atomicLock, std::defer_lock);
+        if (nHarts > 1) {
+            lock.lock();
+        }
+        store_through_peripheral(pAddr, value);
+    }
+    template <typename T> void store_through_peripheral(uint32_t pAddr, T value) {
+        const Region &r = region_of(pAddr);
+        SystemBusPeripheral *p = r.peripheral;
+        if (p == NULL) {
+            // bus error
+            return;
+        }
+        switch (sizeof(T)) {
+        case 1: p->write_byte(pAddr, (uint8_t)value); break;
+        case 2: p->write_halfword(pAddr, (uint16_t)value); break;
+        default: p->write_word(pAddr, (uint32_t)value); break;
+        }
+        if (r.timed) {
+            deadlineChanges.fetch_add(1, std::memory_order_relaxed);
+        }
+        stored(pAddr, sizeof(T));
+    }
 
-    std::map<uint32_t, SystemBusPeripheral*> mapped_pages;
-    std::unordered_set<uint32_t> reserved_addresses;
+    void stored(uint32_t pAddr, uint32_t nBytes) {
+        if (nReservations.load(std::memory_order_relaxed) != 0) {
+            clear_reservations(pAddr, nBytes);
+        }
+        for (uint32_t i = 0; i < nHartSlots; ++i) {
+            if (instruction_caches[i] != NULL) {
+                instruction_caches[i]->invalidate(pAddr, nBytes);
+            }
+        }
+    }
+    void clear_reservations(uint32_t pAddr, uint32_t nBytes);
+    void flush_instruction_caches();
 
+    // each hart's reserved word, or NO_RESERVATION (never a word address)
+    static const uint32_t NO_RESERVATION = 0x00000001;
+    std::atomic<uint32_t> reservations[MAX_HARTS];
+    std::atomic<uint32_t> nReservations; // harts holding one
+    std::mutex atomicLock; // for stores and atomic accesses that go through a peripheral
+    InstructionCache *instruction_caches[MAX_HARTS]; // NULL for free hart IDs
+    uint32_t nHarts;
+    uint32_t nHartSlots; // one past the highest hart ID in use
+    std::vector<SystemBusPeripheral*> timed;
+    std::atomic<uint32_t> deadlineChanges;
 
+private:
+    SystemBus(const SystemBus &);
+    SystemBus & operator=(const SystemBus &);
 };
 
 #endif // _MCU_SYSTEM_BUS_
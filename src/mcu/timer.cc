@@ -0,0 +1,81 @@
+#include "timer.h"
+#include "interrupt_controller.h"
+
+const uint32_t Timer::COMPARE;
+const uint32_t Timer::COMPAREH;
+
+Timer::Timer(InterruptController *controller, uint32_t line)
+: controller(controller), line(line), compare(NO_DEADLINE), armed(true) {}
+
+void Timer::set_compare(uint64_t cycle) {
+	compare = cycle;
+	armed = true;
+	controller->clear(line);
+}
+
+void Timer::advance_to(uint64_t cycle) {
+	if (armed && cycle >= compare) {
+		armed = false;
+		controller->raise(line);
+	}
+}
+
+uint32_t Timer::read_word(uint32_t pAddr) {
+	switch (translate_address(pAddr) & ~0x3u) {
+	case COMPARE:
+		return (uint32_t)compare;
+	case COMPAREH:
+		return (uint32_t)(compare >> 32);
+	default:
+		return 0;
+	}
+}
+
+// narrower accesses see (and replace) part of the word they fall in
+uint8_t Timer::read_byte(uint32_t pAddr) {
+	return (uint8_t)(read_word(pAddr) >> (8 * (pAddr & 0x3)));
+}
+
+uint16_t Timer::read_halfword(uint32_t pAddr) {
+	return (uint16_t)(read_word(pAddr) >> (8 * (pAddr & 0x2)));
+}
+
+void Timer::write_word(uint32_t pAddr, uint32_t value) {
+	switch (translate_address(pAddr) & ~0x3u) {
+	case COMPARE:
+		set_compare((compare & 0xFFFFFFFF00000000ULL) | value);
+		break;
+	case COMPAREH:
+		set_compare((compare & 0x00000000FFFFFFFFULL) | ((uint64_t)value << 32));
+		break;
+	default:
+		break;
+	}
+}
+
+void Timer::write_byte(uint32_t pAddr, uint8_t value) {
+	uint32_t shift = 8 * (pAddr & 0x3);
+	write_word(pAddr, (read_word(pAddr) & ~(0xFFu << shift)) | ((uint32_t)value << shift));
+}
+
+void Timer::write_halfword(uint32_t pAddr, uint16_t value) {
+	uint32_t shift = 8 * (pAddr & 0x2);
+	write_word(pAddr, (read_word(pAddr) & ~(0xFFFFu << shift)) | ((uint32_t)value << shift));
+}
+
+PeripheralSnapshot * Timer::save_state() {
+	Snapshot *snapshot = new Snapshot();
+	snapshot->compare = compare;
+	snapshot->armed = armed;
+	return snapshot;
+}
+
+void Timer::restore_state(const PeripheralSnapshot *snapshot) {
+	const Snapshot *s = dynamic_cast<const Snapshot*>(snapshot);
+	if (s == NULL) {
+		return;
+	}
+	compare = s->compare;
+	armed = s->armed;
+	changed();
+}
@@ -0,0 +1,65 @@
+#ifndef _MCU_TIMER_
+#define _MCU_TIMER_
+
+#include <cstdint>
+#include "system_bus.h"
+
+class InterruptController;
+
+/*
+ * A compare timer: raises an interrupt line once the core's cycle count
+ * (the cycle CSR) reaches the compare value, and reports the compare value
+ * as its deadline, so that the core stops (or wakes up) at exactly that cycle.
+ * Writing either half of the compare value re-arms the timer and clears the line.
+ * The core's run of instructions ends at each store to the timer, so a compare value
+ * the running code sets takes effect straight away (after the rest of the block,
+ * in translated code), even if it's already in the past.
+ *
+ * One page of registers, all 32 bits:
+ *   0x0 COMPARE   low half of the compare value
+ *   0x4 COMPAREH  high half; the compare value starts out all ones (never)
+ */
+class Timer : public SystemBusPeripheral {
+public:
+	static const uint32_t COMPARE = 0x0;
+	static const uint32_t COMPAREH = 0x4;
+
+	Timer(InterruptController *controller, uint32_t line);
+	virtual ~Timer() {}
+
+	void set_compare(uint64_t cycle);
+	uint64_t get_compare() const { return compare; }
+
+	uint32_t get_number_of_pages() const { return 1; }
+
+	uint8_t read_byte(uint32_t pAddr);
+	uint16_t read_halfword(uint32_t pAddr);
+	uint32_t read_word(uint32_t pAddr);
+
+	void write_byte(uint32_t pAddr, uint8_t value);
+	void write_halfword(uint32_t pAddr, uint16_t value);
+	void write_word(uint32_t pAddr, uint32_t value);
+
+	bool is_timed() const { return true; }
+	void advance_to(uint64_t cycle);
+	uint64_t get_deadline() const { return armed ? compare : NO_DEADLINE; }
+
+	PeripheralSnapshot * save_state();
+	void restore_state(const PeripheralSnapshot *snapshot);
+
+	void cycle() {}
+	void timestep() {}
+protected:
+	InterruptController *controller;
+	uint32_t line;
+	uint64_t compare;
+	bool armed; // hasn't fired since the compare value was last set
+
+	class Snapshot : public PeripheralSnapshot {
+	public:
+		uint64_t compare;
+		bool armed;
+	};
+};
+
+#endif // _MCU_TIMER_
@@ -0,0 +1,114 @@
+#ifndef _MODEL_SLOT_MAP_
+#define _MODEL_SLOT_MAP_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * A stable reference to a value stored in a SlotMap.
+ * Each slot carries a generation number that is bumped whenever its value
+ * is erased, so a handle to an erased value never resolves to whatever
+ * is stored in that slot later.
+ */
+struct SlotHandle {
+	SlotHandle() : index(UINT32_MAX), generation(0) {}
+	SlotHandle(uint32_t i, uint32_t g) : index(i), generation(g) {}
+
+	bool is_null() const { return index == UINT32_MAX; }
+	bool operator==(const SlotHandle &h) const { return index == h.index && generation == h.generation; }
+	bool operator!=(const SlotHandle &h) const { return !(*this == h); }
+
+	uint32_t index;
+	uint32_t generation;
+};
+
+/*
+ * An unordered container with O(1) insertion, erasure and lookup by handle.
+ * Values are kept packed together in a single array,
+ * so iterating over them is as cheap as iterating over a std::vector;
+ * erasing a value moves the last value into its place.
+ */
+template <typename T> class SlotMap {
+public:
+	SlotMap() : freeList(UINT32_MAX) {}
+
+	size_t size() const { return values.size(); }
+	bool empty() const { return values.empty(); }
+
+	typename std::vector<T>::const_iterator begin() const { return values.begin(); }
+	typename std::vector<T>::const_iterator end() const { return values.end(); }
+
+	SlotHandle insert(const T &value) {
+		uint32_t slotIndex;
+		if (freeList != UINT32_MAX) {
+			slotIndex = freeList;
+			freeList = slots[slotIndex].position;
+		} else {
+			slotIndex = (uint32_t)slots.size();
+			slots.push_back(Slot());
+		}
+		Slot &slot = slots[slotIndex];
+		slot.position = (uint32_t)values.size();
+		values.push_back(value);
+		owners.push_back(slotIndex);
+		return SlotHandle(slotIndex, slot.generation);
+	}
+
+	bool contains(const SlotHandle &h) const {
+		if (h.index >= slots.size()) return false;
+		const Slot &slot = slots[h.index];
+		// free slots keep their generation, so also check that the slot owns a value
+		return slot.generation == h.generation
+				&& slot.position < owners.size() && owners[slot.position] == h.index;
+	}
+
+	// Returns a pointer to the value for `h`, or NULL if it has been erased.
+	const T * find(const SlotHandle &h) const {
+		if (!contains(h)) return NULL;
+		return &(values[slots[h.index].position]);
+	}
+	T * find(const SlotHandle &h) {
+		if (!contains(h)) return NULL;
+		return &(values[slots[h.index].position]);
+	}
+
+	bool erase(const SlotHandle &h) {
+		if (!contains(h)) return false;
+		Slot &slot = slots[h.index];
+		uint32_t hole = slot.position;
+		uint32_t last = (uint32_t)values.size() - 1;
+		if (hole != last) {
+			values[hole] = values[last];
+			owners[hole] = owners[last];
+			slots[owners[hole]].position = hole;
+		}
+		values.pop_back();
+		owners.pop_back();
+		++slot.generation;
+		slot.position = freeList;
+		freeList = h.index;
+		return true;
+	}
+
+	void clear() {
+		while (!values.empty()) {
+			erase(SlotHandle(owners.back(), slots[owners.back()].generation));
+		}
+	}
+
+protected:
+	struct Slot {
+		Slot() : position(0), generation(0) {}
+		// while in use, the index of the value; while free, the next free slot
+		uint32_t position;
+		uint32_t generation;
+	};
+
+	std::vector<T> values;
+	std::vector<uint32_t> owners; // the slot that owns each value
+	std::vector<Slot> slots;
+	uint32_t freeList;
+};
+
+#endif // _MODEL_SLOT_MAP_
@@ -9,7 +9,9 @@
 
 class Bedrock : public Structure {
 public:
-    Bedrock() : Structure(MaterialLibrary::inst()->get_material("bedrock")) {}
+    Bedrock() : Structure(MaterialLibrary::inst()->get_material("bedrock")) {
+        set_current_durability(get_maximum_durability());
+    }
 
     virtual bool impedesXYMovement() const { return true; }
 
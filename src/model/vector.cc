@@ -1,11 +1,5 @@
 #include "vector.h"
 
-Vector::Vector(int32_t x, int32_t y, int32_t z)
-: x(x), y(y), z(z) {
-}
-
-Vector::~Vector() { }
-
 Vector Vector::operator+(const Vector & v) const {
 	return Vector(x + v.x, y + v.y, z + v.z);
 }
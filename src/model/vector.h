@@ -10,8 +10,8 @@
  */
 class Vector {
 public:
-	Vector(int32_t x, int32_t y, int32_t z);
-	~Vector();
+	Vector(int32_t x, int32_t y, int32_t z) : x(x), y(y), z(z) {}
+	~Vector() {}
 
 	int32_t getX() const { return x; }
 	int32_t getY() const { return y; }
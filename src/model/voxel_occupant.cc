@@ -4,7 +4,27 @@
 VoxelOccupant::VoxelOccupant()
 : uuid(), position(0,0,0), subvoxelPosition(0,0,0),
   velocity(0,0,0), subvoxelVelocity(0,0,0),
-  durability(1) {
+  durability(1), world(NULL), traits(0) {
+	for (int i = 0; i < NUMBER_OF_PHASES; ++i) {
+		activeIndex[i] = -1;
+	}
+}
+
+uint8_t VoxelOccupant::get_traits() const {
+	uint8_t t = 0;
+	if (impedesXYMovement()) t |= TRAIT_IMPEDES_XY_MOVEMENT;
+	if (impedesZMovement()) t |= TRAIT_IMPEDES_Z_MOVEMENT;
+	if (impedesXYFluidFlow()) t |= TRAIT_IMPEDES_XY_FLUID_FLOW;
+	if (impedesZFluidFlow()) t |= TRAIT_IMPEDES_Z_FLUID_FLOW;
+	if (supportsOthers()) t |= TRAIT_SUPPORTS_OTHERS;
+	if (is_transport_tube()) t |= TRAIT_TRANSPORT_TUBE;
+	return t;
+}
+
+void VoxelOccupant::notify_state_changed() {
+	if (world != NULL) {
+		world->update_registration(this);
+	}
 }
 
 std::vector<WorldUpdate> VoxelOccupant::on_destroy() {
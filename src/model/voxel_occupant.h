@@ -27,6 +27,9 @@ public:
 	virtual bool supportsOthers() const = 0;
 	virtual bool needsSupport() const = 0;
 	virtual bool canMove() const = 0;
+	// the VoxelTrait flags for the answers above; the World caches these
+	// when the occupant is added, so they must not change while it is in a world
+	uint8_t get_traits() const;
 
 	virtual uint16_t get_kind() const = 0;
 	virtual uint32_t get_type() const = 0; // more specific than kind, but sometimes unavailable
@@ -42,12 +45,18 @@ public:
 	virtual Vector get_extents() const = 0;
 
 	Vector get_velocity() const { return velocity; }
-	void set_velocity(Vector & v) {	velocity = v; }
+	void set_velocity(Vector & v) {	velocity = v; notify_state_changed(); }
 
 	// invariant: the absolute value of each component of
 	// subvoxelVelocity is no larger than TimeConstants.SUBVOXELS_PER_VOXEL
 	Vector get_subvoxel_velocity() const { return subvoxelVelocity; }
-	void set_subvoxel_velocity(Vector & v) { subvoxelVelocity = v; }
+	void set_subvoxel_velocity(Vector & v) { subvoxelVelocity = v; notify_state_changed(); }
+
+	// the world this occupant has been added to, if any
+	World * get_world() const { return world; }
+	// a reference to this occupant that is safe to hold onto even if
+	// the occupant is later removed; null if not in a world
+	OccupantHandle get_handle() const { return handle; }
 
 	// true iff the object has stuff to do before the timestep update,
 	// e.g. running a processor
@@ -82,6 +91,20 @@ protected:
 	Vector subvoxelVelocity;
 
 	int32_t durability;
+
+	// Subclasses must call this whenever the answer to requires_preprocessing(),
+	// requires_timestep() or has_world_updates() changes, unless the change
+	// happens inside one of those phases' own callbacks
+	// (the World re-checks those answers after every callback).
+	void notify_state_changed();
+
+private:
+	friend class World;
+	World *world;
+	OccupantHandle handle;
+	uint8_t traits; // get_traits() as of when we were added to the world
+	// our index in each of the world's active occupant lists, or -1
+	int32_t activeIndex[NUMBER_OF_PHASES];
 };
 
 /**
@@ -136,9 +159,9 @@ protected:
 
 class Structure : public VoxelOccupant {
 public:
-    Structure(Material *m) : material(m) {
-        set_current_durability(get_maximum_durability());
-    }
+    // get_base_durability() can't be called from here,
+    // so subclasses set their own starting durability
+    Structure(Material *m) : material(m) {}
     virtual ~Structure() {}
     Material *get_material() const { return material; }
 
@@ -0,0 +1,111 @@
+#ifndef _MODEL_VOXEL_RAY_
+#define _MODEL_VOXEL_RAY_
+
+#include <cstdint>
+#include <cmath>
+#include "vector.h"
+
+/*
+ * A ray from the center of an origin voxel to the center of (origin + direction),
+ * in a form that many rays can be handed over in at once; see World::trace_rays().
+ */
+struct Ray {
+	Ray() : origin(0,0,0), direction(0,0,0) {}
+	Ray(const Vector &o, const Vector &d) : origin(o), direction(d) {}
+	Vector origin;
+	Vector direction;
+};
+
+/*
+ * Walks the voxels crossed by a Ray, one face-adjacent step at a time.
+ * This is the traversal of Amanatides and Woo, and steps exactly as
+ * World::raycast() always has: the times at which the ray crosses
+ * each axis' voxel boundaries are accumulated in doubles, and whenever
+ * two crossings look simultaneous, y is preferred over x and z over both.
+ * (Rays often do pass exactly through edges, and which way the accumulated
+ * sums round decides the order, so these can't be replaced with exact
+ * integer comparisons without changing which voxels are visited.)
+ *
+ * Note that, as before, the first crossing along an axis with a negative
+ * direction is taken to be one voxel late, so rays with a negative component
+ * don't always pass through their destination.
+ */
+class VoxelRay {
+public:
+	VoxelRay(const Vector &origin, const Vector &direction)
+	: x(origin.getX()), y(origin.getY()), z(origin.getZ()),
+	  destX(origin.getX() + direction.getX()),
+	  destY(origin.getY() + direction.getY()),
+	  destZ(origin.getZ() + direction.getZ()) {
+		init_axis(x, direction.getX(), stepX, tMaxX, tDeltaX);
+		init_axis(y, direction.getY(), stepY, tMaxY, tDeltaY);
+		init_axis(z, direction.getZ(), stepZ, tMaxZ, tDeltaZ);
+	}
+
+	// a ray with no direction doesn't go anywhere
+	bool is_empty() const { return stepX == 0 && stepY == 0 && stepZ == 0; }
+
+	// Moves into the next voxel along the ray.
+	void step() {
+		if (tMaxX < tMaxY) {
+			if (tMaxX < tMaxZ) {
+				x += stepX;
+				tMaxX += tDeltaX;
+			} else {
+				z += stepZ;
+				tMaxZ += tDeltaZ;
+			}
+		} else {
+			if (tMaxY < tMaxZ) {
+				y += stepY;
+				tMaxY += tDeltaY;
+			} else {
+				z += stepZ;
+				tMaxZ += tDeltaZ;
+			}
+		}
+	}
+
+	/*
+	 * Steps until the ray leaves the box from (x0, y0, z0) to (x1, y1, z1) inclusive.
+	 * (Jumping straight to the exit would mean accumulating each axis' crossing times
+	 * one at a time anyway to stay exact, which turns out to be no faster.)
+	 */
+	void skip_box(int32_t x0, int32_t y0, int32_t z0, int32_t x1, int32_t y1, int32_t z1) {
+		do {
+			step();
+		} while (x >= x0 && x <= x1 && y >= y0 && y <= y1 && z >= z0 && z <= z1);
+	}
+
+	Vector get_position() const { return Vector(x, y, z); }
+	int32_t get_x() const { return x; }
+	int32_t get_y() const { return y; }
+	int32_t get_z() const { return z; }
+	bool at_destination() const { return x == destX && y == destY && z == destZ; }
+
+protected:
+	int32_t x, y, z;
+	int32_t destX, destY, destZ;
+	int32_t stepX, stepY, stepZ;
+	// the time (as a fraction of the direction) at which the ray next crosses
+	// a voxel boundary along each axis, and the time between crossings
+	double tMaxX, tMaxY, tMaxZ;
+	double tDeltaX, tDeltaY, tDeltaZ;
+
+	static void init_axis(int32_t c, int32_t d, int32_t &step, double &tMax, double &tDelta) {
+		if (d == 0) {
+			// never crosses; never chosen, as every comparison against infinity fails
+			step = 0;
+			tMax = HUGE_VAL;
+			tDelta = 0.0;
+			return;
+		}
+		step = (d > 0) ? 1 : -1;
+		// (c + 0.5) mod 1 is 0.5 or -0.5 depending on the signs of c and d
+		double fraction = ((d > 0) == (c >= 0)) ? 0.5 : 1.5;
+		tMax = fraction / (double)(d * step);
+		tDelta = 1.0 / (double)(d * step);
+	}
+};
+
+#endif // _MODEL_VOXEL_RAY_
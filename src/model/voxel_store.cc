@@ -0,0 +1,152 @@
+#include "voxel_store.h"
+#include <algorithm>
+
+VoxelCell::~VoxelCell() {
+	if (is_spilled()) {
+		delete get_spill();
+	}
+}
+
+uint32_t VoxelCell::size() const {
+	if (head == NULL) {
+		return 0;
+	} else if (is_spilled()) {
+		return (uint32_t)get_spill()->size();
+	} else {
+		return 1;
+	}
+}
+
+VoxelOccupant * const * VoxelCell::begin() const {
+	if (is_spilled()) {
+		return get_spill()->data();
+	} else {
+		return &head;
+	}
+}
+
+VoxelOccupant * const * VoxelCell::end() const {
+	if (is_spilled()) {
+		std::vector<VoxelOccupant*> *spill = get_spill();
+		return spill->data() + spill->size();
+	} else if (head == NULL) {
+		return &head;
+	} else {
+		return &head + 1;
+	}
+}
+
+bool VoxelCell::contains(const VoxelOccupant *occ) const {
+	return std::find(begin(), end(), occ) != end();
+}
+
+bool VoxelCell::insert(VoxelOccupant *occ) {
+	if (head == NULL) {
+		head = occ;
+		return true;
+	}
+	if (contains(occ)) {
+		return false;
+	}
+	if (is_spilled()) {
+		get_spill()->push_back(occ);
+	} else {
+		// second occupant; move both into a heap list
+		std::vector<VoxelOccupant*> *spill = new std::vector<VoxelOccupant*>();
+		spill->reserve(4);
+		spill->push_back(head);
+		spill->push_back(occ);
+		set_spill(spill);
+	}
+	return true;
+}
+
+bool VoxelCell::erase(const VoxelOccupant *occ) {
+	if (head == NULL) {
+		return false;
+	}
+	if (!is_spilled()) {
+		if (head != occ) return false;
+		head = NULL;
+		return true;
+	}
+	std::vector<VoxelOccupant*> *spill = get_spill();
+	std::vector<VoxelOccupant*>::iterator it = std::find(spill->begin(), spill->end(), occ);
+	if (it == spill->end()) {
+		return false;
+	}
+	spill->erase(it);
+	if (spill->size() == 1) {
+		// back down to a single occupant, store it inline again
+		VoxelOccupant *last = spill->front();
+		delete spill;
+		head = last;
+	}
+	return true;
+}
+
+VoxelStore::VoxelStore(uint32_t xDim, uint32_t yDim)
+: chunksX((xDim + CHUNK_MASK) >> CHUNK_BITS), chunksY((yDim + CHUNK_MASK) >> CHUNK_BITS),
+  allocatedChunks(0), columns((size_t)chunksX * (size_t)chunksY) {
+}
+
+VoxelStore::~VoxelStore() {
+	for (std::vector<Chunk*> &column : columns) {
+		for (Chunk *chunk : column) {
+			delete chunk;
+		}
+	}
+}
+
+VoxelStore::Chunk * VoxelStore::get_or_create_chunk(const Vector &position) {
+	std::vector<Chunk*> &column = columns[column_index(position)];
+	size_t cz = (size_t)(position.getZ() >> CHUNK_BITS);
+	if (cz >= column.size()) {
+		column.resize(cz + 1, NULL);
+	}
+	if (column[cz] == NULL) {
+		column[cz] = new Chunk();
+		++allocatedChunks;
+	}
+	return column[cz];
+}
+
+void VoxelStore::set_traits(const Vector &position, uint8_t traits) {
+	get_or_create_chunk(position)->change_traits(cell_index(position), traits);
+}
+
+bool VoxelStore::insert(const Vector &position, VoxelOccupant *occ, uint8_t traits) {
+	Chunk *chunk = get_or_create_chunk(position);
+	int32_t index = cell_index(position);
+	VoxelCell &cell = chunk->cells[index];
+	bool wasEmpty = cell.empty();
+	if (!cell.insert(occ)) {
+		return false;
+	}
+	if (wasEmpty) {
+		++chunk->occupiedCells;
+	}
+	chunk->change_traits(index, chunk->traits[index] | traits);
+	return true;
+}
+
+bool VoxelStore::erase(const Vector &position, const VoxelOccupant *occ) {
+	// chunks are never freed once allocated, as movers would otherwise
+	// repeatedly free and reallocate the chunks they pass through
+	std::vector<Chunk*> &column = columns[column_index(position)];
+	size_t cz = (size_t)(position.getZ() >> CHUNK_BITS);
+	if (cz >= column.size() || column[cz] == NULL) {
+		return false;
+	}
+	Chunk *chunk = column[cz];
+	int32_t index = cell_index(position);
+	VoxelCell &cell = chunk->cells[index];
+	if (!cell.erase(occ)) {
+		return false;
+	}
+	if (cell.empty()) {
+		--chunk->occupiedCells;
+		chunk->change_traits(index, 0);
+	}
+	return true;
+}
@@ -0,0 +1,193 @@
+#ifndef _MODEL_VOXEL_STORE_
+#define _MODEL_VOXEL_STORE_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "vector.h"
+
+class VoxelOccupant;
+
+/*
+ * The list of occupants of a single voxel.
+ * Almost every occupied voxel holds exactly one occupant, so that occupant
+ * is stored inline; only voxels holding two or more occupants spill
+ * over into a heap-allocated list. The low bit of `head` distinguishes
+ * the two cases (occupants are always at least 2-byte aligned).
+ */
+class VoxelCell {
+public:
+	VoxelCell() : head(NULL) {}
+	~VoxelCell();
+
+	bool empty() const { return head == NULL; }
+	uint32_t size() const;
+
+	VoxelOccupant * const * begin() const;
+	VoxelOccupant * const * end() const;
+
+	bool contains(const VoxelOccupant *occ) const;
+	// returns false if `occ` was already present
+	bool insert(VoxelOccupant *occ);
+	// returns false if `occ` was not present
+	bool erase(const VoxelOccupant *occ);
+
+protected:
+	VoxelOccupant *head;
+
+	bool is_spilled() const { return (reinterpret_cast<uintptr_t>(head) & 1) != 0; }
+	std::vector<VoxelOccupant*> * get_spill() const {
+		return reinterpret_cast<std::vector<VoxelOccupant*>*>(reinterpret_cast<uintptr_t>(head) & ~(uintptr_t)1);
+	}
+	void set_spill(std::vector<VoxelOccupant*> *spill) {
+		head = reinterpret_cast<VoxelOccupant*>(reinterpret_cast<uintptr_t>(spill) | 1);
+	}
+
+private:
+	VoxelCell(const VoxelCell &);
+	VoxelCell & operator=(const VoxelCell &);
+};
+
+/*
+ * Dense storage for the contents of every voxel in a World.
+ * Space is divided into cubic chunks of CHUNK_SIZE voxels per edge,
+ * which are allocated the first time anything is stored inside them.
+ * Chunks are found through a flat table of (x, y) columns,
+ * each of which is a list of chunks indexed by z,
+ * so no lookup ever has to hash a position.
+ *
+ * Alongside each cell, a chunk keeps a byte of traits: the bitwise OR
+ * of the VoxelTrait flags of everything in that cell,
+ * so that most collision and support checks never have to look
+ * at the occupants themselves. The store doesn't know the traits of
+ * individual occupants; the World recomputes a cell's traits with
+ * set_traits() when an occupant leaves a cell that is still occupied.
+ * Each chunk also counts how many of its cells have each trait,
+ * so a search for a trait can pass over a whole chunk at once.
+ *
+ * All positions passed to a VoxelStore must be in bounds for its World.
+ */
+class VoxelStore {
+public:
+	static const int32_t CHUNK_BITS = 4;
+	static const int32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+	static const int32_t CHUNK_MASK = CHUNK_SIZE - 1;
+	static const int32_t CHUNK_VOLUME = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
+	static const int32_t TRAIT_BITS = 8;
+
+	VoxelStore(uint32_t xDim, uint32_t yDim);
+	~VoxelStore();
+
+	// Returns the cell at `position`, or NULL if its chunk has never been allocated.
+	const VoxelCell * find(const Vector &position) const {
+		const Chunk *chunk = find_chunk(position);
+		if (chunk == NULL) return NULL;
+		return &(chunk->cells[cell_index(position)]);
+	}
+
+	// Returns the traits of the cell at `position`; unallocated cells have none.
+	uint8_t get_traits(const Vector &position) const {
+		const Chunk *chunk = find_chunk(position);
+		if (chunk == NULL) return 0;
+		return chunk->traits[cell_index(position)];
+	}
+	void set_traits(const Vector &position, uint8_t traits);
+	// False if no cell in the chunk containing `position` has any of `traits`.
+	bool chunk_has_traits(const Vector &position, uint8_t traits) const {
+		const Chunk *chunk = find_chunk(position);
+		if (chunk == NULL) return false;
+		for (int32_t bit = 0; bit < TRAIT_BITS; ++bit) {
+			if ((traits & (1 << bit)) && chunk->cellsWithTrait[bit] != 0) return true;
+		}
+		return false;
+	}
+
+	// insert() adds `traits` to those of the cell;
+	// erase() clears the cell's traits if it is left empty.
+	bool insert(const Vector &position, VoxelOccupant *occ, uint8_t traits);
+	bool erase(const Vector &position, const VoxelOccupant *occ);
+
+	// Calls f(position, cell) for every non-empty cell.
+	template <typename F> void for_each_cell(F f) const {
+		for (size_t col = 0; col < columns.size(); ++col) {
+			const std::vector<Chunk*> &column = columns[col];
+			for (size_t cz = 0; cz < column.size(); ++cz) {
+				const Chunk *chunk = column[cz];
+				if (chunk == NULL || chunk->occupiedCells == 0) continue;
+				int32_t baseX = (int32_t)(col % chunksX) << CHUNK_BITS;
+				int32_t baseY = (int32_t)(col / chunksX) << CHUNK_BITS;
+				int32_t baseZ = (int32_t)cz << CHUNK_BITS;
+				for (int32_t i = 0; i < CHUNK_VOLUME; ++i) {
+					const VoxelCell &cell = chunk->cells[i];
+					if (cell.empty()) continue;
+					Vector position(baseX + (i & CHUNK_MASK),
+							baseY + ((i >> CHUNK_BITS) & CHUNK_MASK),
+							baseZ + (i >> (2 * CHUNK_BITS)));
+					f(position, cell);
+				}
+			}
+		}
+	}
+
+	size_t get_number_of_chunks() const { return allocatedChunks; }
+
+protected:
+	struct Chunk {
+		Chunk() : occupiedCells(0) {
+			for (int32_t i = 0; i < CHUNK_VOLUME; ++i) {
+				traits[i] = 0;
+			}
+			for (int32_t bit = 0; bit < TRAIT_BITS; ++bit) {
+				cellsWithTrait[bit] = 0;
+			}
+		}
+		VoxelCell cells[CHUNK_VOLUME];
+		uint8_t traits[CHUNK_VOLUME];
+		uint32_t occupiedCells;
+		uint16_t cellsWithTrait[TRAIT_BITS];
+
+		void change_traits(int32_t index, uint8_t newTraits) {
+			uint8_t changed = traits[index] ^ newTraits;
+			for (int32_t bit = 0; changed != 0; ++bit, changed >>= 1) {
+				if (changed & 1) {
+					if (newTraits & (1 << bit)) {
+						++cellsWithTrait[bit];
+					} else {
+						--cellsWithTrait[bit];
+					}
+				}
+			}
+			traits[index] = newTraits;
+		}
+	};
+
+	uint32_t chunksX;
+	uint32_t chunksY;
+	size_t allocatedChunks;
+	// indexed by (cy * chunksX + cx), then by cz
+	std::vector< std::vector<Chunk*> > columns;
+
+	static int32_t cell_index(const Vector &position) {
+		return (position.getX() & CHUNK_MASK)
+				| ((position.getY() & CHUNK_MASK) << CHUNK_BITS)
+				| ((position.getZ() & CHUNK_MASK) << (2 * CHUNK_BITS));
+	}
+
+	size_t column_index(const Vector &position) const {
+		return (size_t)(position.getY() >> CHUNK_BITS) * chunksX + (size_t)(position.getX() >> CHUNK_BITS);
+	}
+
+	const Chunk * find_chunk(const Vector &position) const {
+		const std::vector<Chunk*> &column = columns[column_index(position)];
+		size_t cz = (size_t)(position.getZ() >> CHUNK_BITS);
+		if (cz >= column.size()) return NULL;
+		return column[cz];
+	}
+	Chunk * get_or_create_chunk(const Vector &position);
+
+private:
+	VoxelStore(const VoxelStore &);
+	VoxelStore & operator=(const VoxelStore &);
+};
+
+#endif // _MODEL_VOXEL_STORE_
@@ -3,51 +3,103 @@
 #include "transport_tube.h"
 #include "time_constants.h"
 #include "structures.h"
+#include "thread_pool.h"
 #include <algorithm>
 #include <deque>
 
-World::World(uint32_t xd, uint32_t yd) : xDim(xd), yDim(yd) {
+World::World(uint32_t xd, uint32_t yd)
+: voxels(xd, yd), xDim(xd), yDim(yd), terrain(NULL), terrain_traits(0), terrain_top(0), thread_pool(NULL), in_parallel_phase(false) {
 }
 
 World::~World() {
+	if (thread_pool != NULL) {
+		delete thread_pool;
+	}
 	// delete all occupants
 	for (VoxelOccupant *occ : all_occupants) {
 		delete occ;
 	}
+	if (terrain != NULL) {
+		delete terrain;
+	}
 }
 
-bool World::location_in_bounds(const Vector position) const {
-    if (position.getX() < 0 || position.getY() < 0 || position.getZ() < 0) return false;
-    if ((uint32_t)position.getX() >= xDim || (uint32_t)position.getY() >= yDim) return false;
-    return true;
+std::unordered_set<VoxelOccupant*> World::get_occupants(const Vector position) const {
+	OccupantRange occupants = occupants_at(position);
+	return std::unordered_set<VoxelOccupant*>(occupants.begin(), occupants.end());
 }
 
-std::unordered_set<VoxelOccupant*> World::get_occupants(const Vector position) const {
-	if (!location_in_bounds(position)) {
-		return std::unordered_set<VoxelOccupant*>();
-	} else {
-		std::unordered_map<Vector, std::unordered_set<VoxelOccupant*> >::const_iterator it;
-		it = voxels.find(position);
-		if (it == voxels.end()) {
-			return std::unordered_set<VoxelOccupant*>();
-		} else {
-			return std::unordered_set<VoxelOccupant*>(it->second);
+std::unordered_set<VoxelOccupant*> World::get_occupants(const Vector position, const Vector extents) const {
+	std::unordered_set<VoxelOccupant*> allOccupants;
+	for_each_occupant(position, extents, [&](VoxelOccupant *occ) {
+		allOccupants.insert(occ);
+	});
+	return allOccupants;
+}
+
+static const uint8_t IMPEDES_ALL_MOVEMENT = TRAIT_IMPEDES_XY_MOVEMENT | TRAIT_IMPEDES_Z_MOVEMENT;
+
+VoxelOccupant * World::first_hit(const Vector &origin, const Vector &direction, Vector &hitVoxel,
+		uint8_t traits, const VoxelOccupant *ignore) const {
+	VoxelRay ray(origin, direction);
+	if (ray.is_empty()) return NULL;
+	bool checkTerrain = (terrain_traits & traits) != 0 && terrain != ignore;
+	Vector destination = origin + direction;
+	ray.step();
+	while (true) {
+		Vector v = ray.get_position();
+		if (!location_in_bounds(v)) return NULL;
+		if (checkTerrain && v.getZ() < (int32_t)terrain_top && is_terrain(v)) {
+			hitVoxel = v;
+			return terrain;
+		}
+		if (!voxels.chunk_has_traits(v, traits)) {
+			// nothing in this chunk (above any terrain) can stop the ray;
+			// skip straight to where it leaves, unless it might end along the way
+			int32_t x0 = v.getX() & ~VoxelStore::CHUNK_MASK;
+			int32_t y0 = v.getY() & ~VoxelStore::CHUNK_MASK;
+			int32_t z0 = v.getZ() & ~VoxelStore::CHUNK_MASK;
+			int32_t x1 = std::min(x0 + VoxelStore::CHUNK_MASK, (int32_t)xDim - 1);
+			int32_t y1 = std::min(y0 + VoxelStore::CHUNK_MASK, (int32_t)yDim - 1);
+			int32_t z1 = z0 + VoxelStore::CHUNK_MASK;
+			if (checkTerrain) {
+				z0 = std::max(z0, (int32_t)terrain_top);
+			}
+			bool endsInBox = destination.getX() >= x0 && destination.getX() <= x1
+					&& destination.getY() >= y0 && destination.getY() <= y1
+					&& destination.getZ() >= z0 && destination.getZ() <= z1;
+			if (v.getZ() >= z0 && !endsInBox) {
+				ray.skip_box(x0, y0, z0, x1, y1, z1);
+				continue;
+			}
+		} else if ((voxels.get_traits(v) & traits) != 0) {
+			for (VoxelOccupant *occ : *voxels.find(v)) {
+				if (occ != ignore && (occ->traits & traits) != 0) {
+					hitVoxel = v;
+					return occ;
+				}
+			}
 		}
+		if (ray.at_destination()) return NULL;
+		ray.step();
 	}
 }
 
-std::unordered_set<VoxelOccupant*> World::get_occupants(const Vector position, const Vector extents) const {
-	std::unordered_set<VoxelOccupant*> allOccupants;
+bool World::box_has_traits(const Vector position, const Vector extents, uint8_t traits, const VoxelOccupant *ignore) const {
 	for (int32_t x = position.getX(); x < position.getX() + extents.getX(); ++x) {
-		for (int y = position.getY(); y < position.getY() + extents.getY(); ++y) {
-			for (int z = position.getZ(); z < position.getZ() + extents.getZ(); ++z) {
+		for (int32_t y = position.getY(); y < position.getY() + extents.getY(); ++y) {
+			for (int32_t z = position.getZ(); z < position.getZ() + extents.getZ(); ++z) {
 				Vector v(x, y, z);
-				std::unordered_set<VoxelOccupant*> occupants = get_occupants(v);
-				allOccupants.insert(occupants.begin(), occupants.end());
+				if ((get_voxel_traits(v) & traits) == 0) continue;
+				if (ignore == NULL) return true;
+				// make sure it isn't just `ignore` that has them
+				for (const VoxelOccupant *occ : occupants_at(v)) {
+					if (occ != ignore && (occ->traits & traits) != 0) return true;
+				}
 			}
 		}
 	}
-	return std::unordered_set<VoxelOccupant*>(allOccupants);
+	return false;
 }
 
 bool World::can_occupy(Vector position, const VoxelOccupant *obj) const {
@@ -59,13 +111,18 @@ bool World::can_occupy(Vector position, const VoxelOccupant *obj) const {
 			for (int z = position.getZ(); z < position.getZ() + obj->get_extents().getZ(); ++z) {
 				Vector v(x, y, z);
 				if (!location_in_bounds(v)) return false;
-				std::unordered_set<VoxelOccupant*> occupants = get_occupants(v);
-				for (const VoxelOccupant *occ : occupants) {
-					if (occ->impedesXYMovement() && occ->impedesZMovement()) {
+				uint8_t traits = get_voxel_traits(v);
+				if ((traits & IMPEDES_ALL_MOVEMENT) != IMPEDES_ALL_MOVEMENT
+						&& !((traits & TRAIT_TRANSPORT_TUBE) && obj->is_transport_tube())) {
+					// nothing here can get in the way
+					continue;
+				}
+				for (const VoxelOccupant *occ : occupants_at(v)) {
+					if ((occ->traits & IMPEDES_ALL_MOVEMENT) == IMPEDES_ALL_MOVEMENT) {
 						// cannot move there
 						return false;
 					}
-					if (occ->is_transport_tube() && obj->is_transport_tube()) {
+					if ((occ->traits & TRAIT_TRANSPORT_TUBE) && obj->is_transport_tube()) {
 						TransportTube *tThis = (TransportTube*)obj;
 						TransportTube *tThat = (TransportTube*)occ;
 						// two transport tubes with the same transport ID cannot share a voxel
@@ -87,43 +144,93 @@ bool World::add_occupant(Vector position, Vector subvoxelPosition, VoxelOccupant
 	// place the object;
 	// track it in our list of all occupants, and add it to
 	// every voxel that it occupies
-	all_occupants.push_back(obj);
-
-	for (int x = position.getX(); x < position.getX() + obj->get_extents().getX(); ++x) {
-		for (int y = position.getY(); y < position.getY() + obj->get_extents().getY(); ++y) {
-			for (int z = position.getZ(); z < position.getZ() + obj->get_extents().getZ(); ++z) {
-				Vector v(x, y, z);
-				voxels[v].insert(obj);
-			}
-		}
-	}
+	obj->handle = all_occupants.insert(obj);
+	obj->traits = obj->get_traits();
+	place_in_voxels(obj, position);
     obj->set_position(position);
     obj->set_subvoxel_position(subvoxelPosition);
+    obj->world = this;
+    update_registration(obj);
     return true;
 }
 
 void World::remove_occupant(VoxelOccupant *obj) {
+	if (obj == terrain) return;
 	// delete from all_occupants
-	all_occupants.erase(std::remove(all_occupants.begin(), all_occupants.end(), obj), all_occupants.end());
+	if (obj->world == this) {
+		all_occupants.erase(obj->handle);
+		obj->handle = OccupantHandle();
+	}
+	unregister_occupant(obj);
 	// delete from all voxels it occupies
-	for (int x = obj->get_position().getX(); x < obj->get_position().getX() + obj->get_extents().getX(); ++x) {
-		for (int y = obj->get_position().getY(); y < obj->get_position().getY() + obj->get_extents().getY(); ++y) {
-			for (int z = obj->get_position().getZ(); z < obj->get_position().getZ() + obj->get_extents().getZ(); ++z) {
-				Vector v(x, y, z);
-				std::unordered_set<VoxelOccupant*>::iterator it = voxels[v].find(obj);
-				if (it != voxels[v].end()) {
-					if (obj->is_transport_tube()) {
-						remove_transport_tube((TransportTube*)obj);
-					}
-					voxels[v].erase(it);
-				}
-			}
+	if (take_from_voxels(obj, obj->get_position())) {
+		if (obj->is_transport_tube()) {
+			remove_transport_tube((TransportTube*)obj);
 		}
 	}
 }
 
-template <typename T> int sgn(T val) {
-    return (T(0) < val) - (val < T(0));
+bool World::takes_part_in(const VoxelOccupant *obj, WorldPhase phase) const {
+    switch (phase) {
+    case PHASE_PREPROCESS:
+        return obj->requires_preprocessing();
+    case PHASE_TIMESTEP:
+        return obj->requires_timestep();
+    case PHASE_WORLD_UPDATES:
+        return obj->has_world_updates();
+    case PHASE_MOVEMENT:
+    {
+        // if velocity component is non-zero, the object is moving
+        Vector zeroVector(0,0,0);
+        return !(obj->get_subvoxel_velocity() == zeroVector)
+                || !(obj->get_velocity() == zeroVector);
+    }
+    default:
+        return false;
+    }
+}
+
+void World::update_registration(VoxelOccupant *obj) {
+    if (obj->world != this) return;
+    if (in_parallel_phase) return; // caught up once the phase ends
+    for (int i = 0; i < NUMBER_OF_PHASES; ++i) {
+        bool wanted = takes_part_in(obj, (WorldPhase)i);
+        bool registered = (obj->activeIndex[i] >= 0);
+        if (wanted && !registered) {
+            obj->activeIndex[i] = (int32_t)active_occupants[i].size();
+            active_occupants[i].push_back(obj);
+        } else if (!wanted && registered) {
+            deactivate(obj, i);
+        }
+    }
+}
+
+void World::unregister_occupant(VoxelOccupant *obj) {
+    if (obj->world != this) return;
+    for (int i = 0; i < NUMBER_OF_PHASES; ++i) {
+        if (obj->activeIndex[i] >= 0) {
+            deactivate(obj, i);
+        }
+    }
+    obj->world = NULL;
+}
+
+void World::deactivate(VoxelOccupant *obj, int phase) {
+    // swap the last entry into our slot
+    std::vector<VoxelOccupant*> &list = active_occupants[phase];
+    int32_t idx = obj->activeIndex[phase];
+    VoxelOccupant *last = list.back();
+    list[idx] = last;
+    last->activeIndex[phase] = idx;
+    list.pop_back();
+    obj->activeIndex[phase] = -1;
+}
+
+// orders positions by z, then y, then x
+static bool is_lower(const Vector &a, const Vector &b) {
+    if (a.getZ() != b.getZ()) return a.getZ() < b.getZ();
+    if (a.getY() != b.getY()) return a.getY() < b.getY();
+    return a.getX() < b.getX();
 }
 
 /**
@@ -146,61 +253,27 @@ template <typename T> int sgn(T val) {
  */
 std::vector<Vector> World::raycast(Vector origin, Vector direction) const {
 	std::vector<Vector> visitedVoxels;
+	trace_ray(origin, direction, [&](const Vector &v) {
+		visitedVoxels.push_back(v);
+		return true;
+	});
+	return visitedVoxels;
+}
 
-	int x = origin.getX();
-	int y = origin.getY();
-	int z = origin.getZ();
-
-	int dx = direction.getX();
-	int dy = direction.getY();
-	int dz = direction.getZ();
-
-	int stepX = sgn(dx);
-	int stepY = sgn(dy);
-	int stepZ = sgn(dz);
-
-	double tMaxX = intbound(x + 0.5, dx);
-	double tMaxY = intbound(y + 0.5, dy);
-	double tMaxZ = intbound(z + 0.5, dz);
-
-	double tDeltaX = (double)(stepX) / (double)(dx);
-	double tDeltaY = (double)(stepY) / (double)(dy);
-	double tDeltaZ = (double)(stepZ) / (double)(dz);
-
-	if (dx == 0 && dy == 0 && dz == 0) {
-		return visitedVoxels;
+void World::raycast(const std::vector<Ray> &rays, std::vector<Vector> &voxels, std::vector<size_t> &firstVoxel) const {
+	voxels.clear();
+	firstVoxel.resize(rays.size() + 1);
+	for (size_t i = 0; i < rays.size(); ++i) {
+		firstVoxel[i] = voxels.size();
+		trace_ray(rays[i].origin, rays[i].direction, [&](const Vector &v) {
+			voxels.push_back(v);
+			return true;
+		});
 	}
-
-	Vector destination = origin + direction;
-	while (true) {
-		// find the next voxel we enter
-		if (tMaxX < tMaxY) {
-			if (tMaxX < tMaxZ) {
-				x += stepX;
-				tMaxX += tDeltaX;
-			} else {
-				z += stepZ;
-				tMaxZ += tDeltaZ;
-			}
-		} else {
-			if (tMaxY < tMaxZ) {
-				y += stepY;
-				tMaxY += tDeltaY;
-			} else {
-				z += stepZ;
-				tMaxZ += tDeltaZ;
-			}
-		}
-		Vector nextVoxel(x, y, z);
-		if (!location_in_bounds(nextVoxel)) break;
-		visitedVoxels.push_back(nextVoxel);
-		if (nextVoxel == destination) break;
-	} // while()
-
-	return std::vector<Vector>(visitedVoxels);
+	firstVoxel[rays.size()] = voxels.size();
 }
 
-Vector World::calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj) {
+Vector World::calculate_trajectory(const VoxelOccupant *obj, std::vector<Vector> &traj) const {
     std::deque<Vector> trajectory;
     // prime the queue with the current position so that staying still will
     // resolve gravity, etc.
@@ -217,12 +290,11 @@ Vector World::calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj
         Vector deltaP = nextPosition - currentPosition;
         bool moveXY = deltaP.getX() != 0 || deltaP.getY() != 0;
         bool moveZ = deltaP.getZ() != 0;
-        bool canMove = true;
 
-        for (VoxelOccupant *occ : get_occupants(currentPosition, obj->get_extents())) {
+        // TODO occupant is ramp; there are no ramps yet, so this is not run
+        /*
+        for_each_occupant(currentPosition, obj->get_extents(), [&](VoxelOccupant *occ) {
             // check for special stuff in our current position that can let us move differently
-            // TODO occupant is ramp
-            /*
              if (occ instanceof Ramp) {
               Ramp ramp = (Ramp)occ;
               Vector preferredDirection = ramp.getPreferredDirection();
@@ -238,51 +310,32 @@ Vector World::calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj
                 break;
               }
             }
-            */
-        }
+        });
+        */
         // check for objects in the next voxel that prevent movement
-        for (VoxelOccupant *occ : get_occupants(nextPosition, obj->get_extents())) {
-            if ((moveXY && occ->impedesXYMovement()) || (moveZ && occ->impedesZMovement())) {
-                canMove = false;
-                break;
-            }
-        }
-        if (!canMove) {
+        uint8_t impedingTraits = (moveXY ? TRAIT_IMPEDES_XY_MOVEMENT : 0) | (moveZ ? TRAIT_IMPEDES_Z_MOVEMENT : 0);
+        if (impedingTraits != 0 && box_has_traits(nextPosition, obj->get_extents(), impedingTraits, obj)) {
             // do not change currentPosition, we cannot make this move
             break;
         }
         // check to see whether any voxel in the target position + extents, only on the lowest z-level,
         // provides support
         if (obj->needsSupport()) {
-            bool isSupported = false;
             Vector footprintSize(obj->get_extents().getX(), obj->get_extents().getY(), 1);
-            for (VoxelOccupant *occ : get_occupants(nextPosition, footprintSize)) {
-                if (occ->supportsOthers()) {
-                    isSupported = true;
-                    break;
-                }
-            }
+            bool isSupported = box_has_traits(nextPosition, footprintSize, TRAIT_SUPPORTS_OTHERS);
             // if we're not supported, we might fall
             if (!isSupported) {
                 // if there's anything below us that might impede our movement in the z-direction,
                 // we cannot fall
-                bool canMoveDown = true;
-                // save a copy of this set as we will use it more than once
-                std::unordered_set<VoxelOccupant*> occupantsBelowNewPosition
-                    = get_occupants(nextPosition - Vector(0, 0, 1), footprintSize);
-                for (VoxelOccupant *occ : occupantsBelowNewPosition) {
-                    if (occ->impedesZMovement()) {
-                        canMoveDown = false;
-                        break;
-                    }
-                }
+                Vector belowNewPosition = nextPosition - Vector(0, 0, 1);
+                bool canMoveDown = !box_has_traits(belowNewPosition, footprintSize, TRAIT_IMPEDES_Z_MOVEMENT);
                 if (canMoveDown) {
                     // now check to see whether any of the voxels below us contains a ramp
                     // that we are attempting to traverse in the reverse of its preferred direction;
                     // if this is the case, we move down one voxel and continue on our current trajectory
-                    for (VoxelOccupant *occ : occupantsBelowNewPosition) {
-                        // TODO occupant is ramp
-                        /*
+                    // TODO occupant is ramp; there are no ramps yet, so this is not run
+                    /*
+                    for_each_occupant(belowNewPosition, footprintSize, [&](VoxelOccupant *occ) {
                         if (occ instanceof Ramp) {
                             Ramp ramp = (Ramp)occ;
                             Vector preferredDirection = ramp.getPreferredDirection();
@@ -298,8 +351,8 @@ Vector World::calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj
                                 break;
                             }
                         }
-                        */
-                    }
+                    });
+                    */
                     // TODO gravity and whatever else
                 }
             }
@@ -311,46 +364,45 @@ Vector World::calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj
 }
 
 void World::timestep() {
-    // build up a list of all objects that require pre-timestep processing
-    // TODO maybe cache this?
-    std::vector<VoxelOccupant*> preprocessList;
-    for (auto elem : voxels) {
-        std::unordered_set<VoxelOccupant*> &occupants = elem.second;
-        for (VoxelOccupant *occupant : occupants) {
-            if (occupant->requires_preprocessing()) {
-                preprocessList.push_back(occupant);
-            }
+    // each phase works from a snapshot of its active list,
+    // as callbacks may add, remove or re-register occupants
+
+    // run processing for each occupant that requires pre-timestep processing;
+    // occupants are independent of each other here, so this runs in parallel
+    std::vector<VoxelOccupant*> preprocessList(active_occupants[PHASE_PREPROCESS]);
+    if (thread_pool == NULL) {
+        for (VoxelOccupant *proc : preprocessList) {
+            proc->preprocess();
         }
+    } else {
+        in_parallel_phase = true;
+        thread_pool->parallel_for(preprocessList.size(), [&](size_t i) {
+            preprocessList[i]->preprocess();
+        });
+        in_parallel_phase = false;
     }
-
-    // run processing for each occupant
-    // TODO these can be run in parallel
     for (VoxelOccupant *proc : preprocessList) {
-        proc->preprocess();
+        update_registration(proc);
     }
 
     // perform timestep update
-    // TODO maybe cache these too
-    for (auto elem : voxels) {
-        std::unordered_set<VoxelOccupant*> &occupants = elem.second;
-        for (VoxelOccupant *occupant : occupants) {
-            if (occupant->requires_timestep()) {
-                occupant->timestep();
-            }
+    std::vector<VoxelOccupant*> timestepList(active_occupants[PHASE_TIMESTEP]);
+    for (VoxelOccupant *occupant : timestepList) {
+        if (occupant->requires_timestep()) {
+            occupant->timestep();
         }
+        update_registration(occupant);
     }
 
     // perform world updates
-    std::unordered_map<VoxelOccupant*, std::vector<WorldUpdate*>> worldUpdates;
-    for (auto elem : voxels) {
-        std::unordered_set<VoxelOccupant*> &occupants = elem.second;
-        for (VoxelOccupant *occupant : occupants) {
-            if (occupant->has_world_updates()) {
-                worldUpdates[occupant] = occupant->get_world_updates();
-            }
+    std::vector<VoxelOccupant*> worldUpdatesList(active_occupants[PHASE_WORLD_UPDATES]);
+    std::vector< std::pair<VoxelOccupant*, std::vector<WorldUpdate*> > > worldUpdates;
+    for (VoxelOccupant *occupant : worldUpdatesList) {
+        if (occupant->has_world_updates()) {
+            worldUpdates.push_back(std::make_pair(occupant, occupant->get_world_updates()));
         }
     }
-    for (auto entry : worldUpdates) {
+    for (auto &entry : worldUpdates) {
         VoxelOccupant *obj = entry.first;
         std::vector<WorldUpdate*> &updates = entry.second;
         std::unordered_map<WorldUpdate*, WorldUpdateResult> results;
@@ -359,80 +411,197 @@ void World::timestep() {
             results.insert(std::unordered_map<WorldUpdate*, WorldUpdateResult>::value_type(update, result));
         }
         obj->collect_update_results(results);
+        update_registration(obj);
     }
 
-    std::unordered_set<VoxelOccupant*> movingObjects;
-    Vector zeroVector(0,0,0);
-    for (auto elem : voxels) {
-        std::unordered_set<VoxelOccupant*> &occupants = elem.second;
-        for (VoxelOccupant *occupant : occupants) {
-            // if velocity component is non-zero, the object is moving
-            if (!(occupant->get_subvoxel_velocity() == zeroVector)
-                    || !(occupant->get_velocity() == zeroVector)) {
-                movingObjects.insert(occupant);
-            }
+    // perform movement updates in two phases:
+    // first every mover works out where it would like to go, in parallel,
+    // against the world as it stands at the start of the phase;
+    // then the moves are committed one at a time in a fixed order,
+    // so that the outcome never depends on how the first phase was scheduled
+    std::vector<MoveProposal> proposals;
+    proposals.reserve(active_occupants[PHASE_MOVEMENT].size());
+    for (VoxelOccupant *obj : active_occupants[PHASE_MOVEMENT]) {
+        proposals.push_back(MoveProposal(obj));
+    }
+    if (thread_pool == NULL) {
+        for (MoveProposal &proposal : proposals) {
+            propose_move(proposal);
         }
+    } else {
+        in_parallel_phase = true;
+        thread_pool->parallel_for(proposals.size(), [&](size_t i) {
+            propose_move(proposals[i]);
+        });
+        in_parallel_phase = false;
     }
+    // when two movers want the same space, the one that started lowest
+    // (by z, then y, then x) gets it
+    std::stable_sort(proposals.begin(), proposals.end(), [](const MoveProposal &a, const MoveProposal &b) {
+        return is_lower(a.origin, b.origin);
+    });
+    for (const MoveProposal &proposal : proposals) {
+        commit_move(proposal);
+    }
+}
+
+World::MoveProposal::MoveProposal(VoxelOccupant *o)
+: obj(o), origin(o->get_position()), position(o->get_position()),
+  subvoxelPosition(o->get_subvoxel_position()) {
+}
 
-    // perform movement updates
-    // TODO this could potentially be parallelized, but updating the map would require locking/concurrent data structures
-    // at least as much as calculating new positions could be done in parallel
-    for (VoxelOccupant *obj : movingObjects) {
-        // calculate new position
-        Vector newPos = obj->get_position() + obj->get_velocity();
-        int32_t newX = newPos.getX();
-        int32_t newY = newPos.getY();
-        int32_t newZ = newPos.getZ();
-        Vector newSVPos = obj->get_subvoxel_position() + obj->get_subvoxel_velocity();
-        int32_t newX_sv = newSVPos.getX();
-        int32_t newY_sv = newSVPos.getY();
-        int32_t newZ_sv = newSVPos.getZ();
-
-        // determine whether we've ended up in a new voxel
-
-        if (newX_sv <= -SUBVOXELS_PER_VOXEL) {
-            newX_sv += SUBVOXELS_PER_VOXEL;
-            --newX;
-        } else if (newX_sv >= SUBVOXELS_PER_VOXEL) {
-            newX_sv -= SUBVOXELS_PER_VOXEL;
-            ++newX;
+void World::propose_move(MoveProposal &proposal) const {
+    const VoxelOccupant *obj = proposal.obj;
+    // calculate new position
+    Vector newPos = obj->get_position() + obj->get_velocity();
+    int32_t newX = newPos.getX();
+    int32_t newY = newPos.getY();
+    int32_t newZ = newPos.getZ();
+    Vector newSVPos = obj->get_subvoxel_position() + obj->get_subvoxel_velocity();
+    int32_t newX_sv = newSVPos.getX();
+    int32_t newY_sv = newSVPos.getY();
+    int32_t newZ_sv = newSVPos.getZ();
+
+    // determine whether we've ended up in a new voxel
+
+    if (newX_sv <= -SUBVOXELS_PER_VOXEL) {
+        newX_sv += SUBVOXELS_PER_VOXEL;
+        --newX;
+    } else if (newX_sv >= SUBVOXELS_PER_VOXEL) {
+        newX_sv -= SUBVOXELS_PER_VOXEL;
+        ++newX;
+    }
+
+    if (newY_sv <= -SUBVOXELS_PER_VOXEL) {
+        newY_sv += SUBVOXELS_PER_VOXEL;
+        --newY;
+    } else if (newY_sv >= SUBVOXELS_PER_VOXEL) {
+        newY_sv -= SUBVOXELS_PER_VOXEL;
+        ++newY;
+    }
+
+    if (newZ_sv <= -SUBVOXELS_PER_VOXEL) {
+        newZ_sv += SUBVOXELS_PER_VOXEL;
+        --newZ;
+    } else if (newZ_sv >= SUBVOXELS_PER_VOXEL) {
+        newZ_sv -= SUBVOXELS_PER_VOXEL;
+        ++newZ;
+    }
+
+    newPos = Vector(newX, newY, newZ);
+    newSVPos = Vector(newX_sv, newY_sv, newZ_sv);
+
+    std::vector<Vector> visitedPositions = raycast(obj->get_position(), newPos - obj->get_position());
+    proposal.position = calculate_trajectory(obj, visitedPositions);
+    proposal.subvoxelPosition = newSVPos;
+}
+
+void World::commit_move(const MoveProposal &proposal) {
+    VoxelOccupant *obj = proposal.obj;
+    Vector oldPos = obj->get_position();
+    Vector newPos = proposal.position;
+    Vector newSVPos = proposal.subvoxelPosition;
+    if (!(newPos == oldPos)) {
+        // lift the object out of the world so that it doesn't get in its own way
+        take_from_voxels(obj, oldPos);
+        if (can_occupy(newPos, obj)) {
+            place_in_voxels(obj, newPos);
+        } else {
+            // somebody else got here first; stay where we are
+            place_in_voxels(obj, oldPos);
+            return;
         }
+    }
+    obj->set_position(newPos);
+    obj->set_subvoxel_position(newSVPos);
+}
 
-        if (newY_sv <= -SUBVOXELS_PER_VOXEL) {
-            newY_sv += SUBVOXELS_PER_VOXEL;
-            --newY;
-        } else if (newY_sv >= SUBVOXELS_PER_VOXEL) {
-            newY_sv -= SUBVOXELS_PER_VOXEL;
-            ++newY;
+void World::place_in_voxels(VoxelOccupant *obj, const Vector &position) {
+    Vector extents = obj->get_extents();
+    for (int x = position.getX(); x < position.getX() + extents.getX(); ++x) {
+        for (int y = position.getY(); y < position.getY() + extents.getY(); ++y) {
+            for (int z = position.getZ(); z < position.getZ() + extents.getZ(); ++z) {
+                Vector v(x, y, z);
+                voxels.insert(v, obj, obj->traits);
+            }
         }
+    }
+}
 
-        if (newZ_sv <= -SUBVOXELS_PER_VOXEL) {
-            newZ_sv += SUBVOXELS_PER_VOXEL;
-            --newZ;
-        } else if (newZ_sv >= SUBVOXELS_PER_VOXEL) {
-            newZ_sv -= SUBVOXELS_PER_VOXEL;
-            ++newZ;
+bool World::take_from_voxels(VoxelOccupant *obj, const Vector &position) {
+    bool found = false;
+    Vector extents = obj->get_extents();
+    for (int x = position.getX(); x < position.getX() + extents.getX(); ++x) {
+        for (int y = position.getY(); y < position.getY() + extents.getY(); ++y) {
+            for (int z = position.getZ(); z < position.getZ() + extents.getZ(); ++z) {
+                Vector v(x, y, z);
+                if (!location_in_bounds(v)) continue;
+                if (voxels.erase(v, obj)) {
+                    found = true;
+                    // recompute the traits of whatever is left behind
+                    const VoxelCell *cell = voxels.find(v);
+                    if (!cell->empty()) {
+                        uint8_t traits = 0;
+                        for (const VoxelOccupant *occ : *cell) {
+                            traits |= occ->traits;
+                        }
+                        voxels.set_traits(v, traits);
+                    }
+                }
+            }
         }
+    }
+    return found;
+}
 
-        newPos = Vector(newX, newY, newZ);
-        newSVPos = Vector(newX_sv, newY_sv, newZ_sv);
+void World::set_worker_threads(uint32_t workers) {
+    if (thread_pool != NULL) {
+        delete thread_pool;
+        thread_pool = NULL;
+    }
+    ThreadPool *pool = new ThreadPool(workers);
+    if (pool->get_number_of_workers() > 1) {
+        thread_pool = pool;
+    } else {
+        delete pool;
+    }
+}
 
-        std::vector<Vector> visitedPositions = raycast(obj->get_position(), newPos - obj->get_position());
-        newPos = calculate_trajectory(obj, visitedPositions);
-        // now newPos and newSVPos are correct;
-        // we remove the object from its old position and add it to its new one
-        remove_occupant(obj);
-        add_occupant(newPos, newSVPos, obj);
+uint32_t World::get_worker_threads() const {
+    if (thread_pool == NULL) {
+        return 1;
+    } else {
+        return thread_pool->get_number_of_workers();
     }
 }
 
+bool World::set_terrain_height(int32_t x, int32_t y, uint16_t height) {
+    if (!location_in_bounds(Vector(x, y, 0))) return false;
+    uint16_t oldHeight = get_terrain_height(x, y);
+    for (int32_t z = oldHeight; z < height; ++z) {
+        const VoxelCell *cell = voxels.find(Vector(x, y, z));
+        if (cell != NULL && !cell->empty()) {
+            return false;
+        }
+    }
+    if (terrain_heights.empty()) {
+        if (height == 0) return true;
+        terrain_heights.assign((size_t)xDim * yDim, 0);
+        terrain = new Bedrock();
+        terrain_traits = terrain->get_traits();
+        terrain->traits = terrain_traits;
+    }
+    terrain_heights[(uint32_t)y * xDim + (uint32_t)x] = height;
+    terrain_top = std::max(terrain_top, height);
+    return true;
+}
+
 void World::create_bedrock_layer() {
-    Vector subvoxelPos(0, 0, 0);
     for (uint32_t y = 0; y < yDim; ++y) {
       for (uint32_t x = 0; x < xDim; ++x) {
-        Vector pos((int32_t)x, (int32_t)y, 0);
-        Bedrock *bedrock = new Bedrock();
-        add_occupant(pos, subvoxelPos, bedrock);
+        if (get_terrain_height(x, y) == 0) {
+          set_terrain_height(x, y, 1);
+        }
       }
     }
 }
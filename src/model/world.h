@@ -7,10 +7,18 @@
 #include <vector>
 #include <cmath>
 #include "vector.h"
+#include "voxel_store.h"
+#include "slot_map.h"
+#include "voxel_ray.h"
 #include <functional>
+#include <algorithm>
 
 class VoxelOccupant;
 class TransportTube;
+class ThreadPool;
+
+// A reference to an occupant that can safely outlive it; see World::resolve().
+typedef SlotHandle OccupantHandle;
 
 class WorldUpdateResult {
 public:
@@ -22,6 +30,51 @@ protected:
 	bool succeeded;
 };
 
+/*
+ * A read-only view of the occupants of a single voxel.
+ * The view is only valid until the world is next modified.
+ */
+class OccupantRange {
+public:
+	OccupantRange() : first(NULL), last(NULL) {}
+	OccupantRange(VoxelOccupant * const *b, VoxelOccupant * const *e) : first(b), last(e) {}
+
+	VoxelOccupant * const * begin() const { return first; }
+	VoxelOccupant * const * end() const { return last; }
+	bool empty() const { return first == last; }
+	size_t size() const { return (size_t)(last - first); }
+protected:
+	VoxelOccupant * const *first;
+	VoxelOccupant * const *last;
+};
+
+/*
+ * The phases of World::timestep(), in the order in which they run.
+ * The World keeps a list of the occupants that take part in each phase
+ * so that a timestep never has to visit idle occupants.
+ */
+enum WorldPhase {
+	PHASE_PREPROCESS = 0,
+	PHASE_TIMESTEP,
+	PHASE_WORLD_UPDATES,
+	PHASE_MOVEMENT,
+	NUMBER_OF_PHASES
+};
+
+/*
+ * Flags summarizing what the occupants of a voxel do to things around them.
+ * The World keeps the union of its occupants' flags for every voxel;
+ * see VoxelOccupant::get_traits() and World::get_voxel_traits().
+ */
+enum VoxelTrait {
+	TRAIT_IMPEDES_XY_MOVEMENT = 0x01,
+	TRAIT_IMPEDES_Z_MOVEMENT = 0x02,
+	TRAIT_IMPEDES_XY_FLUID_FLOW = 0x04,
+	TRAIT_IMPEDES_Z_FLUID_FLOW = 0x08,
+	TRAIT_SUPPORTS_OTHERS = 0x10,
+	TRAIT_TRANSPORT_TUBE = 0x20
+};
+
 class World {
 public:
 	World(uint32_t xd, uint32_t yd);
@@ -30,13 +83,114 @@ public:
 	uint32_t get_xDim() const { return xDim; }
 	uint32_t get_yDim() const { return yDim; }
 
-	bool location_in_bounds(const Vector position) const;
+	bool location_in_bounds(const Vector position) const {
+		if (position.getX() < 0 || position.getY() < 0 || position.getZ() < 0) return false;
+		if ((uint32_t)position.getX() >= xDim || (uint32_t)position.getY() >= yDim) return false;
+		return true;
+	}
 	std::unordered_set<VoxelOccupant*> get_occupants(const Vector position) const;
 	std::unordered_set<VoxelOccupant*> get_occupants(const Vector position, const Vector extents) const;
+
+	/*
+	 * Allocation-free versions of get_occupants().
+	 * occupants_at() returns a view of the occupants of a single voxel.
+	 * for_each_occupant() calls f(occupant) exactly once for each occupant
+	 * overlapping the box from `position` to (position + extents),
+	 * even if that occupant covers several voxels of the box.
+	 * find_occupant() returns the first occupant in the same box
+	 * for which pred(occupant) is true, or NULL if there is none.
+	 */
+	OccupantRange occupants_at(const Vector position) const {
+		if (!location_in_bounds(position)) return OccupantRange();
+		if (is_terrain(position)) return OccupantRange(&terrain, &terrain + 1);
+		const VoxelCell *cell = voxels.find(position);
+		if (cell == NULL) return OccupantRange();
+		return OccupantRange(cell->begin(), cell->end());
+	}
+	template <typename F> void for_each_occupant(const Vector position, const Vector extents, F f) const {
+		find_occupant(position, extents, [&](VoxelOccupant *occ) { f(occ); return false; });
+	}
+	template <typename P> VoxelOccupant * find_occupant(const Vector position, const Vector extents, P pred) const {
+		bool seenTerrain = false;
+		for (int32_t x = position.getX(); x < position.getX() + extents.getX(); ++x) {
+			for (int32_t y = position.getY(); y < position.getY() + extents.getY(); ++y) {
+				for (int32_t z = position.getZ(); z < position.getZ() + extents.getZ(); ++z) {
+					Vector v(x, y, z);
+					for (VoxelOccupant *occ : occupants_at(v)) {
+						if (occ == terrain) {
+							// the terrain occupant has no position of its own
+							if (seenTerrain) continue;
+							seenTerrain = true;
+						} else if (!first_overlap(occ, v, position)) {
+							continue;
+						}
+						if (pred(occ)) return occ;
+					}
+				}
+			}
+		}
+		return NULL;
+	}
+	/*
+	 * The union of the VoxelTrait flags of everything at `position`.
+	 * A flag being set means that at least one occupant has it,
+	 * not necessarily the same occupant for every flag.
+	 */
+	uint8_t get_voxel_traits(const Vector position) const {
+		if (!location_in_bounds(position)) return 0;
+		if (is_terrain(position)) return terrain_traits;
+		return voxels.get_traits(position);
+	}
+	// True iff some occupant other than `ignore` in the box from `position`
+	// to (position + extents) has any of the flags in `traits`.
+	bool box_has_traits(const Vector position, const Vector extents, uint8_t traits, const VoxelOccupant *ignore = NULL) const;
+
 	bool can_occupy(Vector position, const VoxelOccupant *occupant) const;
 	bool add_occupant(Vector position, Vector subvoxelPosition, VoxelOccupant *obj);
 	void remove_occupant(VoxelOccupant *obj);
 
+	/*
+	 * Static terrain is not made of individual occupants.
+	 * Instead each (x, y) column has a terrain height, and every voxel
+	 * of the column below that height is solid bedrock.
+	 * Terrain voxels are reported by occupants_at() and friends
+	 * as a single shared occupant, get_terrain_occupant(),
+	 * which is never in any active list and cannot be removed.
+	 * set_terrain_height() fails if any of the voxels it would fill are occupied.
+	 */
+	uint16_t get_terrain_height(int32_t x, int32_t y) const {
+		if (terrain_heights.empty()) return 0;
+		return terrain_heights[(uint32_t)y * xDim + (uint32_t)x];
+	}
+	bool set_terrain_height(int32_t x, int32_t y, uint16_t height);
+	bool is_terrain(const Vector position) const {
+		return position.getZ() < (int32_t)get_terrain_height(position.getX(), position.getY());
+	}
+	// Fills z = 0 of every column with bedrock.
+	void create_bedrock_layer();
+	VoxelOccupant * get_terrain_occupant() const { return terrain; }
+
+	/*
+	 * Returns the occupant that `handle` refers to,
+	 * or NULL if it has since been removed from this world.
+	 * Handles are obtained from VoxelOccupant::get_handle() while the occupant is in the world.
+	 */
+	VoxelOccupant * resolve(const OccupantHandle &handle) const {
+		VoxelOccupant * const *occ = all_occupants.find(handle);
+		return (occ == NULL) ? NULL : *occ;
+	}
+	size_t get_number_of_occupants() const { return all_occupants.size(); }
+
+	/*
+	 * Re-examines which timestep phases `obj` takes part in.
+	 * The World does this itself whenever an occupant is added or removed,
+	 * after each of the occupant's own phase callbacks,
+	 * and whenever its velocity changes; see VoxelOccupant::notify_state_changed().
+	 */
+	void update_registration(VoxelOccupant *obj);
+	// The occupants that currently take part in `phase`, in no particular order.
+	const std::vector<VoxelOccupant*> & get_active_occupants(WorldPhase phase) const { return active_occupants[phase]; }
+
 	/*
 	 * Traces a ray from the center of an origin voxel in a given direction
 	 * (with distances measured in voxels),
@@ -44,35 +198,108 @@ public:
 	 * or when the resulting position would be outside of the world.
 	 */
 	std::vector<Vector> raycast(Vector origin, Vector direction) const;
+	/*
+	 * Allocation-free versions of raycast().
+	 * trace_ray() calls f(voxel) for each voxel that raycast() would return, in order,
+	 * and stops early if f returns false.
+	 * trace_rays() does the same for each of `count` rays in turn, calling f(i, voxel)
+	 * for the voxels of rays[i]; returning false stops only ray i.
+	 * The batch form of raycast() clears `voxels` and appends the voxels of each ray to it;
+	 * those of rays[i] are found at [firstVoxel[i], firstVoxel[i + 1]).
+	 */
+	template <typename F> void trace_ray(const Vector &origin, const Vector &direction, F f) const {
+		VoxelRay ray(origin, direction);
+		if (ray.is_empty()) return;
+		while (true) {
+			ray.step();
+			Vector v = ray.get_position();
+			if (!location_in_bounds(v)) return;
+			if (!f(v)) return;
+			if (ray.at_destination()) return;
+		}
+	}
+	template <typename F> void trace_rays(const Ray *rays, size_t count, F f) const {
+		for (size_t i = 0; i < count; ++i) {
+			trace_ray(rays[i].origin, rays[i].direction, [&](const Vector &v) { return f(i, v); });
+		}
+	}
+	void raycast(const std::vector<Ray> &rays, std::vector<Vector> &voxels, std::vector<size_t> &firstVoxel) const;
+	/*
+	 * Follows the same voxels as raycast() and returns the first occupant
+	 * other than `ignore` that has any of `traits`, storing its voxel in `hitVoxel`,
+	 * or NULL if the ray reaches its end without hitting anything.
+	 * Chunks with no such occupants are crossed without looking at their voxels.
+	 */
+	VoxelOccupant * first_hit(const Vector &origin, const Vector &direction, Vector &hitVoxel,
+			uint8_t traits = TRAIT_IMPEDES_XY_MOVEMENT | TRAIT_IMPEDES_Z_MOVEMENT,
+			const VoxelOccupant *ignore = NULL) const;
 
 	/*
 	 * Computes the rest position of `obj` as it moves through each voxel of `traj` in turn.
 	 * Returns the final resting position of `obj`.
 	 */
-	Vector calculate_trajectory(VoxelOccupant *obj, std::vector<Vector> &traj);
+	Vector calculate_trajectory(const VoxelOccupant *obj, std::vector<Vector> &traj) const;
 
 	void timestep();
 
+	/*
+	 * Sets the number of threads that run the parallel parts of timestep(),
+	 * counting the calling thread; 0 means one per hardware thread.
+	 * With a single worker (the default) every phase runs serially
+	 * in a deterministic order.
+	 * Occupants' preprocess() methods run concurrently with each other
+	 * when there is more than one worker, so they must only touch
+	 * the state of the occupant they are called on.
+	 */
+	void set_worker_threads(uint32_t workers);
+	uint32_t get_worker_threads() const;
+
 protected:
-	std::unordered_map<Vector, std::unordered_set<VoxelOccupant*> > voxels;
+	VoxelStore voxels;
 	uint32_t xDim;
 	uint32_t yDim;
 
-	std::vector<VoxelOccupant*> all_occupants; // for memory management
+	// terrain height of each column, indexed by y * xDim + x; empty until terrain is first added
+	std::vector<uint16_t> terrain_heights;
+	VoxelOccupant *terrain; // shared by all terrain voxels; NULL until terrain is first added
+	uint8_t terrain_traits;
+	uint16_t terrain_top; // no column's terrain is higher than this
 
-	void create_bedrock_layer();
+	SlotMap<VoxelOccupant*> all_occupants; // for memory management
+	std::vector<VoxelOccupant*> active_occupants[NUMBER_OF_PHASES];
+
+	ThreadPool *thread_pool; // NULL when running single-threaded
+	// set while occupant callbacks may be running on several threads;
+	// registration changes are deferred until the phase ends
+	bool in_parallel_phase;
+
+	// A mover's intended position at the end of the movement phase.
+	struct MoveProposal {
+		MoveProposal(VoxelOccupant *o);
+		VoxelOccupant *obj;
+		Vector origin;
+		Vector position;
+		Vector subvoxelPosition;
+	};
+	void propose_move(MoveProposal &proposal) const;
+	void commit_move(const MoveProposal &proposal);
+	void place_in_voxels(VoxelOccupant *obj, const Vector &position);
+	bool take_from_voxels(VoxelOccupant *obj, const Vector &position);
+
+	bool takes_part_in(const VoxelOccupant *obj, WorldPhase phase) const;
+	void unregister_occupant(VoxelOccupant *obj);
+	void deactivate(VoxelOccupant *obj, int phase);
 
 	void remove_transport_tube(TransportTube *transport);
 
-	// Find the smallest positive t such that s + t*ds is an integer
-	double intbound(double s, double ds) const {
-		if (ds < 0.0) {
-			return intbound(-s, -ds);
-		} else {
-			s = fmod(s, 1.0);
-			// now we have s + t*ds = 1
-			return (1.0 - s) / ds;
-		}
+	// True iff `voxel` is the first voxel of a box starting at `boxOrigin`
+	// in which `occ` appears, i.e. the corner of the overlap between the two.
+	// (This is a template only so that VoxelOccupant can still be incomplete here.)
+	template <typename Occupant> static bool first_overlap(const Occupant *occ, const Vector &voxel, const Vector &boxOrigin) {
+		Vector origin = occ->get_position();
+		return voxel.getX() == std::max(origin.getX(), boxOrigin.getX())
+				&& voxel.getY() == std::max(origin.getY(), boxOrigin.getY())
+				&& voxel.getZ() == std::max(origin.getZ(), boxOrigin.getZ());
 	}
 };
 
@@ -1,8 +1,7 @@
 #include "world_updates.h"
 
 static TransportTube *find_transport(World *w, Vector position, uint32_t transportID) {
-    auto occupants = w->get_occupants(position);
-    for (VoxelOccupant *occ : occupants) {
+    for (VoxelOccupant *occ : w->occupants_at(position)) {
         if (!(occ->is_transport_tube())) continue;
         TransportTube *transport = (TransportTube*)occ;
         if (transport->get_transport_id() == transportID) {
@@ -92,7 +91,11 @@ WorldUpdateResult CreateTransportTubeUpdate::apply(World *w) {
 }
 
 WorldUpdateResult RemoveObjectUpdate::apply(World *w) {
-	w->remove_occupant(target);
+	VoxelOccupant *obj = w->resolve(target);
+	if (obj == NULL) {
+		return WorldUpdateResult(false);
+	}
+	w->remove_occupant(obj);
 	return WorldUpdateResult(true);
 }
 
@@ -64,11 +64,12 @@ class RelativeRemoveObjectUpdate : public WorldUpdate {
 
 class RemoveObjectUpdate : public WorldUpdate {
 public:
-	RemoveObjectUpdate(VoxelOccupant * tgt) : target(tgt) {}
+	RemoveObjectUpdate(VoxelOccupant * tgt) : target(tgt->get_handle()) {}
 	~RemoveObjectUpdate() {}
 	WorldUpdateResult apply(World *w);
 protected:
-	VoxelOccupant *target;
+	// held by handle, as the target may already be gone by the time this is applied
+	OccupantHandle target;
 };
 
 class TakeWithManipulatorByUUIDUpdate : public WorldUpdate {
@@ -2,16 +2,32 @@
 #include "rv32core.h"
 #include "rom.h"
 #include "ram.h"
+#include "mcu_scheduler.h"
+#include "rv32_core_bank.h"
+#include "interrupt_controller.h"
+#include "timer.h"
+#include "rv32_profiler.h"
 #include <cstdint>
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <random>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
 
 static const uint32_t textMemoryBase = 0x00000000;
 static const uint32_t textMemoryPages = 4;
 static const uint32_t dataMemoryBase = 0x10000000;
 static const uint32_t dataMemoryPages = 4;
 
+// set by --jit; runs the code execution tests with the JIT enabled
+static bool useJIT = false;
+
 class RV32CoreTest: public RV32Core, public ::testing::Test {
 };
 
@@ -28,6 +44,9 @@ public:
 		// stack pointer initially goes to top of RAM, 16-byte aligned
 		uint32_t dataMemoryTop = dataMemoryBase + (dataMemoryPages * 1024) - 1;
 		set_register(2, dataMemoryTop & 0xFFFFFFF0);
+		if (useJIT) {
+			ASSERT_TRUE(set_jit_enabled(true));
+		}
 	}
 
 	void TearDown() {
@@ -56,6 +75,18 @@ public:
 		load_program(program.data(), program.size());
 	}
 
+	// places words at the start of data memory and zeroes the rest
+	void load_data(std::vector<uint32_t> words) {
+		std::vector<uint8_t> bytes(dataMemoryPages * 1024, 0);
+		for (uint32_t i = 0; i < words.size() && 4*i < bytes.size(); ++i) {
+			bytes[4*i+0] = (uint8_t)((words[i] & 0x000000FF));
+			bytes[4*i+1] = (uint8_t)((words[i] & 0x0000FF00) >>  8);
+			bytes[4*i+2] = (uint8_t)((words[i] & 0x00FF0000) >> 16);
+			bytes[4*i+3] = (uint8_t)((words[i] & 0xFF000000) >> 24);
+		}
+		data_memory->set_contents(bytes.data());
+	}
+
 	void run(uint32_t maxCycles) {
 		// prime ra (x1) with a target return address
 		uint32_t retTarget = 0xDDCCDDCC;
@@ -77,6 +108,239 @@ public:
 	}
 };
 
+// a memory-mapped register that counts its accesses
+class TestMMIORegister: public SystemBusPeripheral {
+public:
+	TestMMIORegister() : value(0), reads(0), writes(0) {}
+	uint32_t get_number_of_pages() const { return 1; }
+	uint8_t read_byte(uint32_t pAddr) { ++reads; return (uint8_t)value; }
+	uint16_t read_halfword(uint32_t pAddr) { ++reads; return (uint16_t)value; }
+	uint32_t read_word(uint32_t pAddr) { ++reads; return value; }
+	void write_byte(uint32_t pAddr, uint8_t v) { ++writes; value = v; }
+	void write_halfword(uint32_t pAddr, uint16_t v) { ++writes; value = v; }
+	void write_word(uint32_t pAddr, uint32_t v) { ++writes; value = v; }
+	void cycle() {}
+	void timestep() {}
+	// as if something other than the core changed it
+	void set(uint32_t v) { value = v; changed(); }
+
+	uint32_t value;
+	uint32_t reads;
+	uint32_t writes;
+};
+
+class SystemBusTest: public ::testing::Test {
+public:
+	SystemBusTest() : rom(textMemoryPages), ram(dataMemoryPages) {}
+
+	void SetUp() {
+		std::vector<uint8_t> text(textMemoryPages * 1024);
+		for (uint32_t i = 0; i < text.size(); ++i) {
+			text[i] = (uint8_t)i;
+		}
+		rom.set_contents(text.data());
+		bus.attach_peripheral(&rom, textMemoryBase);
+		bus.attach_peripheral(&ram, dataMemoryBase);
+	}
+
+	SystemBus bus;
+	ROM rom;
+	RAM ram;
+};
+
+TEST_F (SystemBusTest, LittleEndianLoads) {
+	ASSERT_EQ(0x07, bus.load_byte(textMemoryBase + 0x407));
+	ASSERT_EQ(0x0908, bus.load_halfword(textMemoryBase + 0x408));
+	ASSERT_EQ(0x0F0E0D0C, bus.load_word(textMemoryBase + 0x40C));
+}
+
+TEST_F (SystemBusTest, StoresToEveryRAMPage) {
+	for (uint32_t page = 0; page < dataMemoryPages; ++page) {
+		bus.store_word(dataMemoryBase + page * 1024 + 8, 0xCAFE0000 | page);
+	}
+	for (uint32_t page = 0; page < dataMemoryPages; ++page) {
+		EXPECT_EQ(0xCAFE0000 | page, bus.load_word(dataMemoryBase + page * 1024 + 8));
+		EXPECT_EQ(0xCAFE0000 | page, ram.read_word(dataMemoryBase + page * 1024 + 8));
+	}
+	bus.store_byte(dataMemoryBase + 9, 0x12);
+	ASSERT_EQ(0xCAFE1200, bus.load_word(dataMemoryBase + 8));
+	bus.store_halfword(dataMemoryBase + 10, 0xBEEF);
+	ASSERT_EQ(0xBEEF1200, bus.load_word(dataMemoryBase + 8));
+}
+
+TEST_F (SystemBusTest, AccessAcrossPageBoundary) {
+	uint32_t addr = dataMemoryBase + 1024 - 2;
+	bus.store_word(addr, 0x44332211);
+	ASSERT_EQ(0x44332211, bus.load_word(addr));
+	ASSERT_EQ(0x2211, bus.load_halfword(addr));
+	ASSERT_EQ(0x4433, bus.load_halfword(addr + 2));
+}
+
+TEST_F (SystemBusTest, ROMIgnoresStores) {
+	bus.store_word(textMemoryBase + 0x40C, 0xFFFFFFFF);
+	ASSERT_EQ(0x0F0E0D0C, bus.load_word(textMemoryBase + 0x40C));
+}
+
+TEST_F (SystemBusTest, UnmappedAddressesReadZero) {
+	bus.store_word(0x20000000, 0xFFFFFFFF);
+	ASSERT_EQ(0, bus.load_word(0x20000000));
+	ASSERT_EQ(0, bus.load_byte(dataMemoryBase + dataMemoryPages * 1024));
+}
+
+TEST_F (SystemBusTest, MMIOGoesThroughPeripheral) {
+	TestMMIORegister reg;
+	bus.attach_peripheral(&reg, 0x40000000);
+	bus.store_word(0x40000000, 42);
+	ASSERT_EQ(1, reg.writes);
+	ASSERT_EQ(42, bus.load_word(0x40000000));
+	ASSERT_EQ(1, reg.reads);
+}
+
+TEST_F (SystemBusTest, OverlappingPeripheralIsNotAttached) {
+	TestMMIORegister reg;
+	bus.attach_peripheral(&reg, dataMemoryBase + 1024);
+	bus.store_word(dataMemoryBase + 1024, 42);
+	ASSERT_EQ(0, reg.writes);
+	ASSERT_EQ(42, bus.load_word(dataMemoryBase + 1024));
+}
+
+TEST_F (SystemBusTest, RAMSnapshotIsCopyOnWrite) {
+	std::vector<uint8_t> zeroes(dataMemoryPages * 1024, 0);
+	ram.set_contents(zeroes.data());
+	RAM::Snapshot *before = dynamic_cast<RAM::Snapshot*>(ram.save_state());
+	ASSERT_TRUE(before != NULL);
+	ASSERT_TRUE(ram.get_dirty_pages().empty());
+	// nothing is copied until it's written
+	for (uint32_t i = 0; i < dataMemoryPages; ++i) {
+		ASSERT_EQ(before->get_page(i), ram.get_readable_pages()[i]);
+	}
+
+	bus.store_word(dataMemoryBase + 1024 + 8, 0x12345678);
+	bus.store_word(dataMemoryBase + 1024 + 12, 0x9ABCDEF0);
+	bus.store_byte(dataMemoryBase + 3 * 1024, 0x55);
+	ASSERT_EQ(std::vector<uint32_t>({1, 3}), ram.get_dirty_pages());
+	ASSERT_NE(before->get_page(1), ram.get_readable_pages()[1]);
+	ASSERT_EQ(before->get_page(2), ram.get_readable_pages()[2]);
+	ASSERT_EQ(0x12345678u, bus.load_word(dataMemoryBase + 1024 + 8));
+
+	RAM::Snapshot *after = dynamic_cast<RAM::Snapshot*>(ram.save_state());
+	ASSERT_EQ(std::vector<uint32_t>({1, 3}), after->get_changed_pages(before));
+	ASSERT_TRUE(ram.get_dirty_pages().empty());
+
+	ram.restore_state(before);
+	ASSERT_EQ(0u, bus.load_word(dataMemoryBase + 1024 + 8));
+	ASSERT_EQ(0u, bus.load_byte(dataMemoryBase + 3 * 1024));
+	// the snapshot is untouched by writes after restoring it
+	bus.store_word(dataMemoryBase + 8, 0xFFFFFFFF);
+	ASSERT_EQ(0u, *(const uint32_t*)(before->get_page(0) + 8));
+
+	// and can be restored into another RAM, forking it
+	RAM fork(dataMemoryPages);
+	fork.restore_state(after);
+	ASSERT_EQ(0x9ABCDEF0u, fork.read_word(dataMemoryBase + 1024 + 12));
+	delete before;
+	delete after;
+	ASSERT_EQ(0x9ABCDEF0u, fork.read_word(dataMemoryBase + 1024 + 12));
+}
+
+TEST (RAMTest, PagesAreAllocatedOnFirstWrite) {
+	RAM ram(1024);
+	SystemBus bus;
+	bus.attach_peripheral(&ram, dataMemoryBase);
+	ASSERT_EQ(1024u * 1024u, ram.get_declared_size());
+	ASSERT_EQ(0u, ram.get_resident_size());
+	ASSERT_EQ(0u, bus.load_word(dataMemoryBase + 5000));
+	ASSERT_EQ(0u, bus.load_byte(dataMemoryBase + 1024 * 1024 - 1));
+	ASSERT_EQ(0u, ram.get_resident_size());
+
+	bus.store_byte(dataMemoryBase + 5000, 0xAB);
+	bus.store_word(dataMemoryBase + 5004, 0x12345678);
+	ASSERT_EQ(1024u, ram.get_resident_size());
+	ASSERT_EQ(0x000000ABu, bus.load_word(dataMemoryBase + 5000));
+	ASSERT_EQ(0x12345678u, bus.load_word(dataMemoryBase + 5004));
+	// the rest of the page was zeroed, and other pages are still untouched
+	ASSERT_EQ(0u, bus.load_word(dataMemoryBase + 4096));
+	ASSERT_EQ(0u, bus.load_word(dataMemoryBase + 6000));
+	// a word across two untouched pages
+	bus.store_word(dataMemoryBase + 2 * 1024 * 100 - 2, 0xCAFEF00D);
+	ASSERT_EQ(3u * 1024u, ram.get_resident_size());
+	ASSERT_EQ(0xCAFEF00Du, bus.load_word(dataMemoryBase + 2 * 1024 * 100 - 2));
+
+	std::vector<uint8_t> contents(1024 * 1024, 0);
+	contents[1024 * 7 + 3] = 1;
+	ram.set_contents(contents.data());
+	ASSERT_EQ(1024u, ram.get_resident_size());
+	ASSERT_EQ(0x01000000u, bus.load_word(dataMemoryBase + 1024 * 7));
+	ASSERT_EQ(0u, bus.load_word(dataMemoryBase + 5004));
+}
+
+TEST (ROMImageTest, IdenticalContentsAreShared) {
+	std::vector<uint8_t> firmware(textMemoryPages * 1024), other(textMemoryPages * 1024);
+	for (uint32_t i = 0; i < firmware.size(); ++i) {
+		firmware[i] = (uint8_t)(i * 13 + 1);
+		other[i] = (uint8_t)(i * 13 + 2);
+	}
+	uint32_t imagesBefore = ROMImage::get_number_of_images();
+	{
+		ROM a(textMemoryPages), b(textMemoryPages), c(textMemoryPages);
+		a.set_contents(firmware.data());
+		b.set_contents(firmware.data());
+		c.set_contents(other.data());
+		ASSERT_EQ(a.get_image(), b.get_image());
+		ASSERT_EQ(a.get_readable_pages()[1], b.get_readable_pages()[1]);
+		ASSERT_NE(a.get_image(), c.get_image());
+		ASSERT_EQ(a.get_content_hash(), ROM::hash_contents(firmware.data(), firmware.size()));
+
+		SystemBus bus;
+		bus.attach_peripheral(&b, textMemoryBase);
+		ASSERT_EQ(0x281b0e01u, bus.load_word(textMemoryBase + 1024));
+		// the shared image has 2 references, plus the images of zeroes the ROMs started out with
+		ASSERT_LE(imagesBefore + 2, ROMImage::get_number_of_images());
+	}
+	// freed along with the last ROM using them
+	ASSERT_EQ(imagesBefore, ROMImage::get_number_of_images());
+}
+
+TEST (ROMImageTest, MappedFileIsShared) {
+	char filename[] = "/tmp/test_mcu_rom_XXXXXX";
+	int fd = mkstemp(filename);
+	ASSERT_NE(-1, fd);
+	// not a whole number of pages; the rest reads as zeroes
+	std::vector<uint8_t> firmware(1500);
+	for (uint32_t i = 0; i < firmware.size(); ++i) {
+		firmware[i] = (uint8_t)(i * 7 + 3);
+	}
+	ASSERT_EQ((ssize_t)firmware.size(), write(fd, firmware.data(), firmware.size()));
+	close(fd);
+
+	ROMImage *image = ROMImage::map_file(filename);
+	unlink(filename);
+	ASSERT_TRUE(image != NULL);
+	ASSERT_TRUE(image->is_mapped());
+	ASSERT_EQ(2048u, image->get_size());
+
+	ROM mapped(image), copied(2);
+	image->release();
+	ASSERT_EQ(2u, mapped.get_number_of_pages());
+	firmware.resize(2048, 0);
+	copied.set_contents(firmware.data());
+	ASSERT_EQ(mapped.get_image(), copied.get_image());
+
+	SystemBus bus;
+	bus.attach_peripheral(&mapped, textMemoryBase);
+	ASSERT_EQ(0x18110a03u, bus.load_word(textMemoryBase + 0));
+	ASSERT_EQ(0u, bus.load_word(textMemoryBase + 1500));
+	ASSERT_EQ(0u, bus.load_word(textMemoryBase + 2044));
+	// it's still ROM
+	bus.store_word(textMemoryBase, 0);
+	ASSERT_EQ(0x18110a03u, bus.load_word(textMemoryBase + 0));
+
+	ROMImage *small = ROMImage::acquire(NULL, 1024);
+	ASSERT_FALSE(copied.set_image(small));
+	small->release();
+	ASSERT_TRUE(ROMImage::map_file("/nonexistent/firmware.bin") == NULL);
+}
+
 TEST_F (RV32CoreTest, X0_ConstantZero) {
 	EXPECT_EQ((uint32_t)0, get_register(0));
 	// should still be 0 after write
@@ -353,7 +617,1363 @@ TEST_F(RV32CodeExecution, Fibonacci15) {
 	ASSERT_EQ(expected_result, actual_result);
 }
 
+TEST_F(RV32CodeExecution, CountdownLoop) {
+    // sums 10 + 9 + ... + 1 into a0 with a backward branch
+    std::vector<uint32_t> program {
+        0x00000513, // li a0, 0
+        0x00a00293, // li t0, 10
+        0x00550533, // loop: add a0, a0, t0
+        0xfff28293, // addi t0, t0, -1
+        0xfe029ce3, // bnez t0, loop
+        0x00008067, // ret
+    };
+    load_program(program);
+    run(33);
+    ASSERT_EQ(55, get_register(10));
+}
+
+TEST_F(RV32CodeExecution, StoreInvalidatesDecodedInstruction) {
+    // calls a function in RAM, overwrites its first instruction, and calls it again
+    load_data({
+        0x00150513, // addi a0, a0, 1
+        0x000e0067, // jr t3
+    });
+    std::vector<uint32_t> program {
+        0x100002b7, // lui t0, 0x10000
+        0x00028e67, // jalr t3, 0(t0)
+        0x00250337, // lui t1, 0x250
+        0x51330313, // addi t1, t1, 0x513 (t1 = "addi a0, a0, 2")
+        0x0062a023, // sw t1, 0(t0)
+        0x00028e67, // jalr t3, 0(t0)
+        0x00008067, // ret
+    };
+    load_program(program);
+    set_register(10, 0);
+    run(11);
+    ASSERT_EQ(3, get_register(10));
+}
+
+TEST_F(RV32CodeExecution, FenceIFlushesDecodedInstructions) {
+    // the function in RAM is replaced behind the bus' back between the two runs;
+    // only FENCE.I makes the core see the new code
+    load_data({
+        0x00150513, // addi a0, a0, 1
+        0x000e0067, // jr t3
+    });
+    std::vector<uint32_t> program {
+        0x0000100f, // fence.i
+        0x100002b7, // lui t0, 0x10000
+        0x00028e67, // jalr t3, 0(t0)
+        0x00008067, // ret
+    };
+    load_program(program);
+    set_register(10, 0);
+    run(6);
+    ASSERT_EQ(1, get_register(10));
+
+    load_data({
+        0x00250513, // addi a0, a0, 2
+        0x000e0067, // jr t3
+    });
+    pc = 0;
+    run(6);
+    ASSERT_EQ(3, get_register(10));
+}
+
+// instruction encoders for generated programs
+static uint32_t r_type(uint32_t funct7, int rs2, int rs1, uint32_t funct3, int rd, uint32_t opcode = 0x33) {
+	return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t i_type(int32_t imm, int rs1, uint32_t funct3, int rd, uint32_t opcode) {
+	return (((uint32_t)imm & 0xFFF) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t s_type(int32_t imm, int rs2, int rs1, uint32_t funct3) {
+	uint32_t u = (uint32_t)imm & 0xFFF;
+	return ((u >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((u & 0x1F) << 7) | 0x23;
+}
+static uint32_t b_type(int32_t imm, int rs2, int rs1, uint32_t funct3) {
+	uint32_t u = (uint32_t)imm & 0x1FFF;
+	return (((u >> 12) & 1) << 31) | (((u >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15)
+			| (funct3 << 12) | (((u >> 1) & 0xF) << 8) | (((u >> 11) & 1) << 7) | 0x63;
+}
+
+// A core with ROM, RAM and an MMIO register, for comparing the JIT against the interpreter.
+class TestMachine: public RV32Core {
+public:
+	static const uint32_t mmioBase = 0x40000000;
+
+	TestMachine(bool jit) : rom(textMemoryPages), ram(dataMemoryPages) {
+		system_bus->attach_peripheral(&rom, textMemoryBase);
+		system_bus->attach_peripheral(&ram, dataMemoryBase);
+		system_bus->attach_peripheral(&mmio, mmioBase);
+		set_jit_enabled(jit);
+	}
+
+	void load(const std::vector<uint32_t> &program, const std::vector<uint32_t> &registers) {
+		std::vector<uint8_t> text(textMemoryPages * 1024, 0);
+		memcpy(text.data(), program.data(), program.size() * 4);
+		rom.set_contents(text.data());
+		std::vector<uint8_t> data(dataMemoryPages * 1024, 0);
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = (uint8_t)(i * 7);
+		}
+		ram.set_contents(data.data());
+		for (int i = 0; i < 32; ++i) {
+			set_register(i, registers[i]);
+		}
+		pc = textMemoryBase;
+	}
+
+	// returns the number of calls to step()
+	uint32_t run_until(uint32_t returnAddress, uint32_t maxSteps) {
+		uint32_t steps = 0;
+		while (pc != returnAddress && steps < maxSteps) {
+			step();
+			++steps;
+		}
+		return steps;
+	}
+
+	uint32_t get_pc() const { return pc; }
+	void set_pc(uint32_t value) { pc = value; }
+	uint32_t reg(int i) const { return get_register(i); }
+	uint32_t ram_word(uint32_t offset) { return ram.read_word(dataMemoryBase + offset); }
+	const RV32JIT * get_jit() const { return jit; }
+
+	ROM rom;
+	RAM ram;
+	TestMMIORegister mmio;
+};
+
+// A random loop body of everything a block can contain or stop at, repeated a few times:
+// x1 is the return address, x3 the loop counter, x4 the RAM base and x31 the MMIO base.
+static std::vector<uint32_t> random_program(std::mt19937 &rng, uint32_t length) {
+	static const int regs[] = {0, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+	std::uniform_int_distribution<int> pickReg(0, sizeof(regs)/sizeof(regs[0]) - 1);
+	std::vector<uint32_t> p;
+	while (p.size() < length) {
+		int rd = regs[pickReg(rng)], rs1 = regs[pickReg(rng)], rs2 = regs[pickReg(rng)];
+		int32_t imm = (int32_t)(rng() % 4096) - 2048;
+		switch (rng() % 12) {
+		case 0: case 1: case 2: // OP, including MUL/DIV
+		{
+			uint32_t funct3 = rng() % 8;
+			uint32_t funct7 = (rng() % 3 == 0) ? 1 : 0;
+			if (funct7 == 0 && (funct3 == 0 || funct3 == 5) && rng() % 2) funct7 = 0x20; // SUB, SRA
+			p.push_back(r_type(funct7, rs2, rs1, funct3, rd));
+		} break;
+		case 3: case 4: // OP-IMM
+		{
+			uint32_t funct3 = rng() % 8;
+			if (funct3 == 1 || funct3 == 5) {
+				imm = (rng() % 32) | ((funct3 == 5 && rng() % 2) ? 0x400 : 0);
+			}
+			p.push_back(i_type(imm, rs1, funct3, rd, 0x13));
+		} break;
+		case 5: // LUI, AUIPC
+			p.push_back(((rng() & 0xFFFFF) << 12) | (rd << 7) | ((rng() % 2) ? 0x37 : 0x17));
+			break;
+		case 6: // load from RAM
+		{
+			static const uint32_t funct3s[] = {0, 1, 2, 4, 5};
+			uint32_t funct3 = funct3s[rng() % 5];
+			int32_t offset = (int32_t)(rng() % 2048) & ~((1 << (funct3 & 3)) - 1);
+			p.push_back(i_type(offset, 4, funct3, rd, 0x03));
+		} break;
+		case 7: // store to RAM
+		{
+			uint32_t funct3 = rng() % 3;
+			int32_t offset = (int32_t)(rng() % 2048) & ~((1 << funct3) - 1);
+			p.push_back(s_type(offset, rs2, 4, funct3));
+		} break;
+		case 8: // forward branch over the next instruction
+			p.push_back(b_type(8, rs2, rs1, (rng() % 2) ? (rng() % 2) : (4 + rng() % 4)));
+			break;
+		case 9: // MMIO
+			if (rng() % 2) {
+				p.push_back(i_type(0, 31, 2, rd, 0x03));  // lw rd, 0(x31)
+			} else {
+				p.push_back(s_type(0, rs2, 31, 2));       // sw rs2, 0(x31)
+			}
+			break;
+		case 10: // amoadd.w rd, rs2, (x4)
+			p.push_back(r_type(0, rs2, 4, 2, rd, 0x2F));
+			break;
+		default: // csrrs rd, instret, x0
+			p.push_back(i_type(0xC02, 0, 2, rd, 0x73));
+			break;
+		}
+	}
+	p.push_back(i_type(0, 0, 0, 0, 0x13));           // nop, so a branch can't skip the next one
+	int32_t loopOffset = -4 * (int32_t)p.size();
+	p.push_back(i_type(-1, 3, 0, 3, 0x13));          // addi x3, x3, -1
+	p.push_back(b_type(loopOffset - 4, 0, 3, 1));    // bnez x3, start
+	p.push_back(i_type(0, 1, 0, 0, 0x67));           // ret
+	return p;
+}
+
+TEST(RV32JITTest, MatchesInterpreter) {
+	if (!RV32JIT::is_supported()) {
+		return;
+	}
+	std::mt19937 rng(2016);
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	for (int trial = 0; trial < 25; ++trial) {
+		std::vector<uint32_t> program = random_program(rng, 200);
+		std::vector<uint32_t> registers(32);
+		for (int i = 0; i < 32; ++i) {
+			registers[i] = rng();
+		}
+		registers[1] = returnAddress;
+		registers[3] = 4;
+		registers[4] = dataMemoryBase;
+		registers[31] = TestMachine::mmioBase;
+
+		TestMachine interpreter(false), jit(true);
+		interpreter.load(program, registers);
+		jit.load(program, registers);
+		uint32_t interpreterSteps = interpreter.run_until(returnAddress, 10000);
+		uint32_t jitSteps = jit.run_until(returnAddress, 10000);
+
+		ASSERT_EQ(returnAddress, interpreter.get_pc()) << "trial " << trial;
+		ASSERT_EQ(returnAddress, jit.get_pc()) << "trial " << trial;
+		EXPECT_LT(jitSteps, interpreterSteps) << "trial " << trial;
+		ASSERT_EQ(interpreter.get_instret(), jit.get_instret()) << "trial " << trial;
+		for (int i = 0; i < 32; ++i) {
+			ASSERT_EQ(interpreter.reg(i), jit.reg(i)) << "trial " << trial << ", x" << i;
+		}
+		for (uint32_t offset = 0; offset < dataMemoryPages * 1024; offset += 4) {
+			ASSERT_EQ(interpreter.ram_word(offset), jit.ram_word(offset)) << "trial " << trial << ", offset " << offset;
+		}
+		ASSERT_EQ(interpreter.mmio.value, jit.mmio.value) << "trial " << trial;
+		ASSERT_EQ(interpreter.mmio.reads, jit.mmio.reads) << "trial " << trial;
+		ASSERT_EQ(interpreter.mmio.writes, jit.mmio.writes) << "trial " << trial;
+	}
+}
+
+TEST(RV32RunTest, MatchesStep) {
+	std::mt19937 rng(2017);
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	for (int trial = 0; trial < 25; ++trial) {
+		std::vector<uint32_t> program = random_program(rng, 200);
+		std::vector<uint32_t> registers(32);
+		for (int i = 0; i < 32; ++i) {
+			registers[i] = rng();
+		}
+		registers[1] = returnAddress;
+		registers[3] = 4;
+		registers[4] = dataMemoryBase;
+		registers[31] = TestMachine::mmioBase;
+
+		TestMachine stepped(false), ran(useJIT);
+		stepped.load(program, registers);
+		ran.load(program, registers);
+		stepped.run_until(returnAddress, 10000);
+		ASSERT_EQ(returnAddress, stepped.get_pc()) << "trial " << trial;
+		// in uneven slices, so that the budget runs out all over the place
+		uint64_t total = stepped.get_instret();
+		while (ran.get_instret() < total) {
+			uint64_t budget = std::min<uint64_t>(1 + rng() % 50, total - ran.get_instret());
+			ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, ran.run(budget)) << "trial " << trial;
+		}
+
+		ASSERT_EQ(returnAddress, ran.get_pc()) << "trial " << trial;
+		ASSERT_EQ(total, ran.get_instret()) << "trial " << trial;
+		for (int i = 0; i < 32; ++i) {
+			ASSERT_EQ(stepped.reg(i), ran.reg(i)) << "trial " << trial << ", x" << i;
+		}
+		for (uint32_t offset = 0; offset < dataMemoryPages * 1024; offset += 4) {
+			ASSERT_EQ(stepped.ram_word(offset), ran.ram_word(offset)) << "trial " << trial << ", offset " << offset;
+		}
+		ASSERT_EQ(stepped.mmio.reads, ran.mmio.reads) << "trial " << trial;
+		ASSERT_EQ(stepped.mmio.writes, ran.mmio.writes) << "trial " << trial;
+	}
+}
+
+// mappings of this process that are both writable and executable
+static uint32_t writable_executable_mappings() {
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	uint32_t n = 0;
+	while (std::getline(maps, line)) {
+		std::istringstream fields(line);
+		std::string range, permissions;
+		fields >> range >> permissions;
+		if (permissions.size() >= 3 && permissions[1] == 'w' && permissions[2] == 'x') {
+			++n;
+		}
+	}
+	return n;
+}
+
+TEST(RV32JITTest, CodeBufferIsMappedLazilyAndNeverWritableAndExecutable) {
+	if (!RV32JIT::is_supported()) {
+		return;
+	}
+	std::mt19937 rng(2027);
+	uint32_t before = writable_executable_mappings();
+	std::vector<TestMachine*> machines;
+	for (int i = 0; i < 4; ++i) {
+		machines.push_back(new TestMachine(true));
+		ASSERT_FALSE(machines[i]->get_jit()->has_code_buffer());
+	}
+	for (int i = 0; i < 3; ++i) {
+		std::vector<uint32_t> registers(32);
+		for (int r = 0; r < 32; ++r) {
+			registers[r] = rng();
+		}
+		registers[1] = 0xDDCCDDCC;
+		registers[3] = 4;
+		registers[4] = dataMemoryBase;
+		registers[31] = TestMachine::mmioBase;
+		machines[i]->load(random_program(rng, 200), registers);
+		machines[i]->run_until(0xDDCCDDCC, 10000);
+		ASSERT_TRUE(machines[i]->get_jit()->has_code_buffer());
+	}
+	// the last machine never ran anything
+	ASSERT_FALSE(machines[3]->get_jit()->has_code_buffer());
+	ASSERT_EQ(before, writable_executable_mappings());
+	for (int i = 0; i < 4; ++i) {
+		delete machines[i];
+	}
+}
+
+TEST(RV32RunTest, StopsAfterTrap) {
+	std::vector<uint32_t> program = {
+		i_type(1, 5, 0, 5, 0x13),    // loop: addi x5, x5, 1
+		i_type(0, 0, 0, 0, 0x73),    // ecall
+		b_type(-8, 0, 0, 0),         // j loop
+	};
+	TestMachine m(useJIT);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	ASSERT_EQ(RV32Core::RUN_TRAPPED, m.run(1000));
+	ASSERT_EQ(0x000001C0u, m.get_pc());
+	ASSERT_EQ(2u, m.get_instret());
+	ASSERT_EQ(1u, m.reg(5));
+}
+
+TEST(RV32RunTest, StopsWhenBudgetRunsOut) {
+	std::vector<uint32_t> program = {
+		i_type(1, 5, 0, 5, 0x13),    // loop: addi x5, x5, 1
+		b_type(-4, 0, 0, 0),         // j loop
+	};
+	TestMachine m(false);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(0));
+	ASSERT_EQ(0u, m.get_instret());
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(101));
+	ASSERT_EQ(101u, m.get_instret());
+	ASSERT_EQ(51u, m.reg(5));
+	ASSERT_EQ(0x00000004u, m.get_pc());
+}
+
+TEST(RV32CoreBankTest, MatchesIndependentCores) {
+	std::mt19937 rng(2019);
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	const uint32_t nCores = 13; // not a whole number of vectors
+	const uint64_t budget = 2000;
+	std::vector<uint32_t> program = random_program(rng, 200);
+	// a few different starting points, so that some cores run in lockstep and others don't
+	std::vector<std::vector<uint32_t> > starts(4, std::vector<uint32_t>(32));
+	for (size_t s = 0; s < starts.size(); ++s) {
+		for (int i = 0; i < 32; ++i) {
+			starts[s][i] = rng();
+		}
+		starts[s][1] = returnAddress;
+		starts[s][3] = 4;
+		starts[s][4] = dataMemoryBase;
+		starts[s][31] = TestMachine::mmioBase;
+	}
+
+	std::vector<TestMachine*> banked, alone;
+	std::vector<RV32Core*> cores;
+	for (uint32_t i = 0; i < nCores; ++i) {
+		banked.push_back(new TestMachine(false));
+		alone.push_back(new TestMachine(false));
+		banked[i]->load(program, starts[i % starts.size()]);
+		alone[i]->load(program, starts[i % starts.size()]);
+		cores.push_back(banked[i]);
+	}
+	RV32CoreBank bank(cores);
+	bank.run(budget);
+	ASSERT_EQ(nCores * budget, bank.get_core_instructions());
+	ASSERT_LT(bank.get_steps(), nCores * budget);
+
+	for (uint32_t c = 0; c < nCores; ++c) {
+		// run() stops at traps
+		while (alone[c]->get_instret() < budget) {
+			alone[c]->run(budget - alone[c]->get_instret());
+		}
+		ASSERT_EQ(alone[c]->get_pc(), banked[c]->get_pc()) << "core " << c;
+		ASSERT_EQ(budget, banked[c]->get_instret()) << "core " << c;
+		for (int i = 0; i < 32; ++i) {
+			ASSERT_EQ(alone[c]->reg(i), banked[c]->reg(i)) << "core " << c << ", x" << i;
+		}
+		for (uint32_t offset = 0; offset < dataMemoryPages * 1024; offset += 4) {
+			ASSERT_EQ(alone[c]->ram_word(offset), banked[c]->ram_word(offset)) << "core " << c << ", offset " << offset;
+		}
+		ASSERT_EQ(alone[c]->mmio.reads, banked[c]->mmio.reads) << "core " << c;
+		ASSERT_EQ(alone[c]->mmio.writes, banked[c]->mmio.writes) << "core " << c;
+		delete banked[c];
+		delete alone[c];
+	}
+}
+
+TEST(RV32CoreBankTest, IdenticalCoresStayInLockstep) {
+	std::mt19937 rng(2020);
+	std::vector<uint32_t> program = random_program(rng, 200);
+	std::vector<uint32_t> registers(32);
+	for (int i = 0; i < 32; ++i) {
+		registers[i] = rng();
+	}
+	registers[1] = 0xDDCCDDCC;
+	registers[3] = 4;
+	registers[4] = dataMemoryBase;
+	registers[31] = TestMachine::mmioBase;
+	std::vector<TestMachine*> machines;
+	std::vector<RV32Core*> cores;
+	for (int i = 0; i < 10; ++i) {
+		machines.push_back(new TestMachine(false));
+		machines[i]->load(program, registers);
+		cores.push_back(machines[i]);
+	}
+	RV32CoreBank bank(cores);
+	bank.run(1000);
+	ASSERT_EQ(1000u, bank.get_steps());
+	ASSERT_EQ(10000u, bank.get_core_instructions());
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(machines[0]->get_pc(), machines[i]->get_pc());
+		ASSERT_EQ(machines[0]->reg(5), machines[i]->reg(5));
+		delete machines[i];
+	}
+}
+
+TEST(RV32CoreBankTest, PicksUpCodeThatChanges) {
+	std::vector<TestMachine*> machines;
+	std::vector<RV32Core*> cores;
+	for (int i = 0; i < 3; ++i) {
+		machines.push_back(new TestMachine(false));
+		machines[i]->load({
+			i_type(1, 5, 0, 5, 0x13),    // loop: addi x5, x5, 1
+			b_type(-4, 0, 0, 0),         // j loop
+		}, std::vector<uint32_t>(32, 0));
+		cores.push_back(machines[i]);
+	}
+	RV32CoreBank bank(cores);
+	bank.run(10);
+	ASSERT_EQ(5u, machines[2]->reg(5));
+
+	// new ROM contents between runs
+	std::vector<uint8_t> text(textMemoryPages * 1024, 0);
+	uint32_t addTen[] = { i_type(10, 5, 0, 5, 0x13), b_type(-4, 0, 0, 0) };
+	memcpy(text.data(), addTen, sizeof(addTen));
+	for (int i = 0; i < 3; ++i) {
+		machines[i]->rom.set_contents(text.data());
+	}
+	bank.run(10);
+	ASSERT_EQ(55u, machines[2]->reg(5));
+
+	// and code in RAM, which stores can change
+	for (int i = 0; i < 3; ++i) {
+		machines[i]->get_system_bus()->store_word(dataMemoryBase, i_type(100, 5, 0, 5, 0x13));
+		machines[i]->get_system_bus()->store_word(dataMemoryBase + 4, b_type(-4, 0, 0, 0));
+		machines[i]->set_pc(dataMemoryBase);
+	}
+	bank.run(2);
+	ASSERT_EQ(155u, machines[2]->reg(5));
+	for (int i = 0; i < 3; ++i) {
+		machines[i]->get_system_bus()->store_word(dataMemoryBase, i_type(1000, 5, 0, 5, 0x13));
+	}
+	bank.run(2);
+	for (int i = 0; i < 3; ++i) {
+		ASSERT_EQ(1155u, machines[i]->reg(5));
+		ASSERT_EQ(dataMemoryBase, machines[i]->get_pc());
+		delete machines[i];
+	}
+}
+
+TEST(RV32SnapshotTest, ForkRunsLikeTheOriginal) {
+	std::mt19937 rng(2018);
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	std::vector<uint32_t> program = random_program(rng, 200);
+	std::vector<uint32_t> registers(32);
+	for (int i = 0; i < 32; ++i) {
+		registers[i] = rng();
+	}
+	registers[1] = returnAddress;
+	registers[3] = 4;
+	registers[4] = dataMemoryBase;
+	registers[31] = TestMachine::mmioBase;
+
+	TestMachine original(useJIT), fork(useJIT);
+	original.load(program, registers);
+	fork.load(program, std::vector<uint32_t>(32, 0));
+	original.run(300);
+	RV32Core::Snapshot *snapshot = original.save_state();
+	fork.restore_state(snapshot);
+	ASSERT_EQ(original.get_pc(), fork.get_pc());
+
+	original.run_until(returnAddress, 10000);
+	fork.run_until(returnAddress, 10000);
+	ASSERT_EQ(returnAddress, fork.get_pc());
+	ASSERT_EQ(original.get_instret(), fork.get_instret());
+	for (int i = 0; i < 32; ++i) {
+		ASSERT_EQ(original.reg(i), fork.reg(i)) << "x" << i;
+	}
+	for (uint32_t offset = 0; offset < dataMemoryPages * 1024; offset += 4) {
+		ASSERT_EQ(original.ram_word(offset), fork.ram_word(offset)) << "offset " << offset;
+	}
+
+	// going back to the snapshot undoes everything since
+	uint32_t finalWord = original.ram_word(0);
+	original.restore_state(snapshot);
+	delete snapshot;
+	original.run_until(returnAddress, 10000);
+	ASSERT_EQ(fork.get_instret(), original.get_instret());
+	ASSERT_EQ(finalWord, original.ram_word(0));
+}
+
+static const uint32_t WFI = 0x10500073;
+
+TEST(RV32SleepTest, WFISleepsUntilWoken) {
+	std::vector<uint32_t> program = {
+		i_type(1, 5, 0, 5, 0x13),    // addi x5, x5, 1
+		WFI,
+		i_type(1, 5, 0, 5, 0x13),    // addi x5, x5, 1
+		b_type(0, 0, 0, 0),          // j .
+	};
+	TestMachine m(useJIT);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(100));
+	ASSERT_TRUE(m.is_sleeping());
+	ASSERT_EQ(0x00000008u, m.get_pc());
+	ASSERT_EQ(2u, m.get_instret());
+	// nothing happens until it's woken up
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(100));
+	m.step();
+	ASSERT_EQ(2u, m.get_instret());
+	m.wake();
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(1));
+	ASSERT_EQ(2u, m.reg(5));
+}
+
+TEST(RV32SleepTest, InterruptOrPeripheralChangeWakes) {
+	std::vector<uint32_t> program = { WFI, b_type(-4, 0, 0, 0) }; // j back to the wfi
+	TestMachine m(useJIT);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(100));
+	m.external_interrupt();
+	ASSERT_FALSE(m.is_sleeping());
+	ASSERT_EQ(0x000001C0u, m.get_pc());
+
+	m.load(program, std::vector<uint32_t>(32, 0));
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(100));
+	ASSERT_TRUE(m.is_sleeping());
+	m.mmio.set(1);
+	ASSERT_FALSE(m.is_sleeping());
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(100));
+	ASSERT_EQ(4u, m.get_instret());
+}
+
+TEST(RV32SleepTest, SpinLoopSleepsUntilPolledRegisterChanges) {
+	std::vector<uint32_t> program = {
+		i_type(0, 31, 2, 5, 0x03),   // poll: lw x5, 0(x31)
+		b_type(-4, 0, 5, 0),         // beqz x5, poll
+		i_type(1, 0, 0, 6, 0x13),    // li x6, 1
+		b_type(0, 0, 0, 0),          // j .
+	};
+	std::vector<uint32_t> registers(32, 0);
+	registers[31] = TestMachine::mmioBase;
+	// spin detection only applies to the interpreter
+	TestMachine m(false);
+	m.load(program, registers);
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(1000));
+	ASSERT_EQ(1000u, m.get_instret());
+
+	m.load(program, registers);
+	m.set_spin_detection(true);
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(1000));
+	ASSERT_EQ(0x00000000u, m.get_pc());
+	ASSERT_LE(m.get_instret(), 1000u + 2 * RV32Core::MAX_SPIN_LENGTH);
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(1000));
+	ASSERT_EQ(0u, m.reg(6));
+
+	m.mmio.set(7);
+	// and an empty loop is a spin as well
+	ASSERT_EQ(RV32Core::RUN_SLEEPING, m.run(1000));
+	ASSERT_EQ(1u, m.reg(6));
+	ASSERT_EQ(0x0000000Cu, m.get_pc());
+}
+
+TEST(RV32SleepTest, LoopThatGetsSomewhereIsNotASpin) {
+	std::vector<uint32_t> program = {
+		i_type(-1, 5, 0, 5, 0x13),   // loop: addi x5, x5, -1
+		b_type(-4, 0, 5, 1),         // bnez x5, loop
+		s_type(0, 5, 4, 2),          // store: sw x5, 0(x4)
+		b_type(-4, 0, 0, 0),         // j store
+	};
+	std::vector<uint32_t> registers(32, 0);
+	registers[4] = dataMemoryBase;
+	registers[5] = 100;
+	TestMachine m(false);
+	m.load(program, registers);
+	m.set_spin_detection(true);
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(1000));
+	ASSERT_EQ(0u, m.reg(5));
+	ASSERT_EQ(0u, m.ram_word(0));
+}
+
+TEST(MCUSchedulerTest, SleepingCoresAreSkipped) {
+	std::vector<uint32_t> idle = { WFI, b_type(-4, 0, 0, 0) };
+	std::vector<uint32_t> busy = { i_type(1, 5, 0, 5, 0x13), b_type(-4, 0, 0, 0) };
+	TestMachine a(useJIT), b(useJIT);
+	a.load(idle, std::vector<uint32_t>(32, 0));
+	b.load(busy, std::vector<uint32_t>(32, 0));
+	MCUScheduler scheduler;
+	scheduler.add_core(&a);
+	scheduler.add_core(&b);
+	ASSERT_EQ(0.0, scheduler.get_sleep_ratio(0));
+	for (int i = 0; i < 10; ++i) {
+		scheduler.tick(1000);
+	}
+	ASSERT_EQ(1u, a.get_instret());
+	ASSERT_EQ(1u, scheduler.get_cycles_run(0));
+	ASSERT_EQ(9999u, scheduler.get_cycles_slept(0));
+	ASSERT_GE(b.get_instret(), 10000u);
+	ASSERT_EQ(0.0, scheduler.get_sleep_ratio(1));
+
+	a.mmio.set(1);
+	scheduler.tick(1000);
+	ASSERT_EQ(3u, a.get_instret());
+	ASSERT_DOUBLE_EQ(10997.0 / 11000.0, scheduler.get_sleep_ratio(0));
+}
+
+// with a timer on line 3 of an interrupt controller
+class TimedTestMachine: public TestMachine {
+public:
+	static const uint32_t interruptsBase = 0x40001000;
+	static const uint32_t timerBase = 0x40002000;
+	static const uint32_t timerLine = 3;
+
+	TimedTestMachine(bool jit) : TestMachine(jit), timer(&interrupts, timerLine) {
+		system_bus->attach_peripheral(&interrupts, interruptsBase);
+		system_bus->attach_peripheral(&timer, timerBase);
+		set_interrupt_controller(&interrupts);
+	}
+
+	InterruptController interrupts;
+	Timer timer;
+};
+
+TEST(InterruptControllerTest, ClaimsLowestEnabledLine) {
+	InterruptController interrupts;
+	SystemBus bus;
+	bus.attach_peripheral(&interrupts, 0x40000000);
+	interrupts.raise(2);
+	interrupts.raise(5);
+	interrupts.raise(9);
+	ASSERT_FALSE(interrupts.is_asserted());
+	bus.store_word(0x40000000 + InterruptController::ENABLE, 0x00000024);
+	ASSERT_TRUE(interrupts.is_asserted());
+	bus.store_word(0x40000000 + InterruptController::PENDING, 0x00000200);
+	ASSERT_EQ(0x00000024u, bus.load_word(0x40000000 + InterruptController::PENDING));
+	ASSERT_EQ(2u, bus.load_word(0x40000000 + InterruptController::CLAIM));
+	ASSERT_EQ(5u, bus.load_word(0x40000000 + InterruptController::CLAIM));
+	ASSERT_EQ(InterruptController::NO_LINE, bus.load_word(0x40000000 + InterruptController::CLAIM));
+	ASSERT_FALSE(interrupts.is_asserted());
+}
+
+TEST(RV32TimerTest, SleepsUntilCompare) {
+	std::vector<uint32_t> program = {
+		WFI,
+		i_type(0xC00, 0, 2, 5, 0x73),    // csrr x5, cycle
+		i_type(0xC01, 0, 2, 6, 0x73),    // csrr x6, time
+		b_type(0, 0, 0, 0),              // j .
+	};
+	TimedTestMachine m(useJIT);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	m.set_cycles_per_timestep(100);
+	m.interrupts.write_word(TimedTestMachine::interruptsBase + InterruptController::ENABLE, 1u << TimedTestMachine::timerLine);
+	m.timer.set_compare(500);
+	// with interrupts disabled, it just wakes up
+	ASSERT_EQ(RV32Core::RUN_BUDGET_EXHAUSTED, m.run(1000));
+	ASSERT_EQ(500u, m.reg(5));
+	ASSERT_EQ(5u, m.reg(6));
+	ASSERT_LE(1000u, m.get_cycle());
+	ASSERT_EQ(m.get_cycle() - 499, m.get_instret());
+	ASSERT_EQ(1u << TimedTestMachine::timerLine, m.interrupts.get_pending());
+}
+
+TEST(RV32TimerTest, InterruptsAtCompare) {
+	std::vector<uint32_t> program = {
+		i_type(0x300, 1, 6, 0, 0x73),    // csrsi mstatus, 1
+		i_type(1, 5, 0, 5, 0x13),        // loop: addi x5, x5, 1
+		b_type(-4, 0, 0, 0),             // j loop
+	};
+	TimedTestMachine m(false);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	m.interrupts.write_word(TimedTestMachine::interruptsBase + InterruptController::ENABLE, 1u << TimedTestMachine::timerLine);
+	// set by the firmware
+	m.get_system_bus()->store_word(TimedTestMachine::timerBase + Timer::COMPAREH, 0);
+	m.get_system_bus()->store_word(TimedTestMachine::timerBase + Timer::COMPARE, 300);
+	ASSERT_EQ(RV32Core::RUN_TRAPPED, m.run(1000));
+	ASSERT_EQ(0x000001C0u, m.get_pc());
+	ASSERT_EQ(300u, m.get_cycle());
+	ASSERT_FALSE(m.interrupts_enabled());
+}
+
+TEST(RV32TimerTest, InterruptsAtCompareSetByFirmware) {
+	std::vector<uint32_t> program = {
+		i_type(0x300, 1, 6, 0, 0x73),    // csrsi mstatus, 1
+		s_type(Timer::COMPAREH, 0, 31, 2), // sw x0, COMPAREH(x31)
+		i_type(300, 0, 0, 5, 0x13),      // addi x5, x0, 300
+		s_type(Timer::COMPARE, 5, 31, 2), // sw x5, COMPARE(x31)
+		i_type(1, 6, 0, 6, 0x13),        // loop: addi x6, x6, 1
+		b_type(-4, 0, 0, 0),             // j loop
+	};
+	std::vector<uint32_t> registers(32, 0);
+	registers[31] = TimedTestMachine::timerBase;
+	TimedTestMachine m(useJIT);
+	m.load(program, registers);
+	m.interrupts.write_word(TimedTestMachine::interruptsBase + InterruptController::ENABLE, 1u << TimedTestMachine::timerLine);
+	// the deadline is only known once the core has run, so run() has to notice it changing
+	ASSERT_EQ(RV32Core::RUN_TRAPPED, m.run(100000));
+	ASSERT_EQ(0x000001C0u, m.get_pc());
+	ASSERT_EQ(300u, m.get_cycle());
+}
+
+TEST(MCUSchedulerTest, SleepingCoreWakesAtItsDeadline) {
+	std::vector<uint32_t> program = {
+		WFI,
+		i_type(0xC00, 0, 2, 5, 0x73),    // csrr x5, cycle
+		i_type(InterruptController::CLAIM, 31, 2, 6, 0x03), // lw x6, CLAIM(x31)
+		b_type(-12, 0, 0, 0),            // j back to the wfi
+	};
+	std::vector<uint32_t> registers(32, 0);
+	registers[31] = TimedTestMachine::interruptsBase;
+	TimedTestMachine m(useJIT);
+	m.load(program, registers);
+	m.interrupts.write_word(TimedTestMachine::interruptsBase + InterruptController::ENABLE, 1u << TimedTestMachine::timerLine);
+	m.timer.set_compare(2500);
+	MCUScheduler scheduler;
+	scheduler.add_core(&m);
+	for (int i = 0; i < 5; ++i) {
+		scheduler.tick(1000);
+	}
+	ASSERT_EQ(2500u, m.reg(5));
+	ASSERT_EQ(3u, m.reg(6));
+	ASSERT_EQ(5u, m.get_instret());
+	ASSERT_EQ(5u, scheduler.get_cycles_run(0));
+	ASSERT_EQ(4995u, scheduler.get_cycles_slept(0));
+}
+
+TEST(MCUSchedulerTest, ResultsDontDependOnThreads) {
+	const int nCores = 16;
+	std::vector<TestMachine*> serial, parallel;
+	MCUScheduler serialScheduler, parallelScheduler;
+	parallelScheduler.set_worker_threads(4);
+	for (int i = 0; i < nCores; ++i) {
+		// each core adds a different step, and half of them sleep on the MMIO register every so often
+		std::vector<uint32_t> program = {
+			i_type(i + 1, 5, 0, 5, 0x13),    // addi x5, x5, i+1
+			r_type(0, 5, 6, 0, 6, 0x33),     // add x6, x6, x5
+			i_type(0, 31, 2, 7, 0x03),       // lw x7, 0(x31)
+			b_type(-12, 0, 7, 1),            // bne x7, x0, back to the start
+			(i % 2) ? WFI : 0x00000013, // wfi or nop
+			b_type(-20, 0, 0, 0),            // j back to the start
+		};
+		std::vector<uint32_t> registers(32, 0);
+		registers[31] = TestMachine::mmioBase;
+		TestMachine *a = new TestMachine(useJIT), *b = new TestMachine(useJIT);
+		a->load(program, registers);
+		b->load(program, registers);
+		serial.push_back(a);
+		parallel.push_back(b);
+		serialScheduler.add_core(a);
+		parallelScheduler.add_core(b);
+	}
+	ASSERT_EQ(4u, parallelScheduler.get_worker_threads());
+	for (int tick = 0; tick < 20; ++tick) {
+		serialScheduler.tick(997);
+		parallelScheduler.tick(997);
+	}
+	for (int i = 0; i < nCores; ++i) {
+		ASSERT_EQ(serial[i]->get_instret(), parallel[i]->get_instret()) << "core " << i;
+		ASSERT_EQ(serial[i]->get_cycle(), parallel[i]->get_cycle()) << "core " << i;
+		ASSERT_EQ(serial[i]->reg(5), parallel[i]->reg(5)) << "core " << i;
+		ASSERT_EQ(serial[i]->reg(6), parallel[i]->reg(6)) << "core " << i;
+		ASSERT_EQ(serialScheduler.get_cycles_slept(i), parallelScheduler.get_cycles_slept(i)) << "core " << i;
+		delete serial[i];
+		delete parallel[i];
+	}
+	ASSERT_EQ(20u, parallelScheduler.get_number_of_tick_times());
+	ASSERT_LE(parallelScheduler.get_tick_time(50), parallelScheduler.get_tick_time(99));
+	ASSERT_LE(parallelScheduler.get_tick_time(99), parallelScheduler.get_tick_time(100));
+}
+
+TEST(MCUSchedulerTest, OvershootIsTakenOutOfTheNextTick) {
+	// a block of 7 instructions, which translated code only leaves at the branch
+	std::vector<uint32_t> program;
+	for (int i = 0; i < 6; ++i) {
+		program.push_back(i_type(1, 5, 0, 5, 0x13));
+	}
+	program.push_back(b_type(-24, 0, 0, 0));
+	TestMachine m(true);
+	m.load(program, std::vector<uint32_t>(32, 0));
+	MCUScheduler scheduler;
+	scheduler.add_core(&m);
+	bool overshot = false;
+	for (uint64_t tick = 1; tick <= 50; ++tick) {
+		scheduler.tick(100);
+		ASSERT_GE(m.get_cycle(), 100 * tick);
+		ASSERT_LT(m.get_cycle(), 100 * tick + 7);
+		ASSERT_EQ(m.get_cycle() - 100 * tick, scheduler.get_overshoot(0));
+		overshot = overshot || scheduler.get_overshoot(0) > 0;
+	}
+	ASSERT_TRUE(overshot);
+}
+
+// a hart on a bus shared with others
+class TestHart: public RV32Core {
+public:
+	TestHart(SystemBus *bus, bool jit) : RV32Core(bus) {
+		set_jit_enabled(jit);
+	}
+	uint32_t reg(int i) const { return get_register(i); }
+	void set_reg(int i, uint32_t value) { set_register(i, value); }
+	void set_pc(uint32_t value) { pc = value; }
+};
+
+static uint32_t lr_w(int rd, int rs1) { return r_type(0x08, 0, rs1, 2, rd, 0x2F); }
+static uint32_t sc_w(int rd, int rs2, int rs1) { return r_type(0x0C, rs2, rs1, 2, rd, 0x2F); }
+static uint32_t amoadd_w(int rd, int rs2, int rs1) { return r_type(0x00, rs2, rs1, 2, rd, 0x2F); }
+
+TEST(RV32HartTest, EachHartHasItsOwnIdAndReservation) {
+	SystemBus bus;
+	RAM ram(dataMemoryPages);
+	bus.attach_peripheral(&ram, dataMemoryBase);
+	TestHart a(&bus, false), b(&bus, false);
+	ASSERT_EQ(2u, bus.get_number_of_harts());
+	a.execute(i_type(0xF10, 0, 2, 5, 0x73)); // csrr x5, mhartid
+	b.execute(i_type(0xF10, 0, 2, 5, 0x73));
+	ASSERT_EQ(0u, a.reg(5));
+	ASSERT_EQ(1u, b.reg(5));
+
+	a.set_reg(10, dataMemoryBase);
+	b.set_reg(10, dataMemoryBase);
+	a.set_reg(6, 111);
+	b.set_reg(6, 222);
+	a.execute(lr_w(5, 10));
+	b.execute(lr_w(5, 10));
+	// b's store breaks a's reservation
+	b.execute(sc_w(7, 6, 10));
+	a.execute(sc_w(7, 6, 10));
+	ASSERT_EQ(0u, b.reg(7));
+	ASSERT_EQ(1u, a.reg(7));
+	ASSERT_EQ(222u, ram.read_word(dataMemoryBase));
+
+	// a plain store to the next word leaves it alone, but one to any byte of the word breaks it
+	a.execute(lr_w(5, 10));
+	b.execute(s_type(4, 0, 10, 2)); // sw x0, 4(x10)
+	a.execute(sc_w(7, 6, 10));
+	ASSERT_EQ(0u, a.reg(7));
+	a.execute(lr_w(5, 10));
+	b.execute(s_type(3, 0, 10, 0)); // sb x0, 3(x10)
+	a.execute(sc_w(7, 6, 10));
+	ASSERT_EQ(1u, a.reg(7));
+}
+
+TEST(RV32HartTest, HartIdsAreReusedAndABusHoldsAtMostMaxHarts) {
+	SystemBus bus;
+	RAM ram(dataMemoryPages);
+	bus.attach_peripheral(&ram, dataMemoryBase);
+	TestHart first(&bus, false);
+	// many more harts than fit, though never more than two at once
+	for (uint32_t i = 0; i < 3 * SystemBus::MAX_HARTS; ++i) {
+		TestHart *h = new TestHart(&bus, false);
+		ASSERT_EQ(1u, h->get_hart_id());
+		ASSERT_EQ(2u, bus.get_number_of_harts());
+		delete h;
+		ASSERT_EQ(1u, bus.get_number_of_harts());
+	}
+
+	std::vector<TestHart*> harts;
+	for (uint32_t i = 1; i < SystemBus::MAX_HARTS; ++i) {
+		harts.push_back(new TestHart(&bus, false));
+		ASSERT_EQ(i, harts.back()->get_hart_id());
+	}
+	ASSERT_EQ(SystemBus::MAX_HARTS, bus.get_number_of_harts());
+	ASSERT_THROW(TestHart extra(&bus, false), std::runtime_error);
+	ASSERT_EQ(SystemBus::MAX_HARTS, bus.get_number_of_harts());
+
+	// a hole in the middle is filled first
+	delete harts[2];
+	harts[2] = new TestHart(&bus, false);
+	ASSERT_EQ(3u, harts[2]->get_hart_id());
+	for (size_t i = 0; i < harts.size(); ++i) {
+		delete harts[i];
+	}
+	ASSERT_EQ(1u, bus.get_number_of_harts());
+
+	// and harts that don't exist never hold a reservation
+	bus.set_reservation(SystemBus::NO_HART, dataMemoryBase);
+	ASSERT_FALSE(bus.is_reserved(SystemBus::NO_HART, dataMemoryBase));
+	bus.clear_reservation(SystemBus::NO_HART);
+	first.set_reg(10, dataMemoryBase);
+	first.execute(lr_w(5, 10));
+	first.execute(sc_w(7, 6, 10));
+	ASSERT_EQ(0u, first.reg(7));
+}
+
+TEST(RV32HartTest, AtomicsWorkAcrossThreads) {
+	const uint32_t nHarts = 4;
+	const uint32_t iterations = 2000;
+	std::vector<uint32_t> program = {
+		amoadd_w(0, 6, 10),       // loop: amoadd.w x0, x6, (x10)
+		lr_w(5, 12),              // retry: lr.w x5, (x12)
+		i_type(1, 5, 0, 5, 0x13), // addi x5, x5, 1
+		sc_w(7, 5, 12),           // sc.w x7, x5, (x12)
+		b_type(-12, 0, 7, 1),     // bnez x7, retry
+		i_type(-1, 11, 0, 11, 0x13), // addi x11, x11, -1
+		b_type(-24, 0, 11, 1),    // bnez x11, loop
+		WFI,
+		b_type(-4, 0, 0, 0),      // j back to the wfi
+	};
+	std::vector<uint8_t> text(textMemoryPages * 1024, 0);
+	memcpy(text.data(), program.data(), program.size() * 4);
+	SystemBus bus;
+	ROM rom(textMemoryPages);
+	RAM ram(dataMemoryPages);
+	rom.set_contents(text.data());
+	bus.attach_peripheral(&rom, textMemoryBase);
+	bus.attach_peripheral(&ram, dataMemoryBase);
+
+	std::vector<TestHart*> harts;
+	MCUScheduler scheduler;
+	scheduler.set_worker_threads(nHarts);
+	scheduler.set_deterministic(false);
+	for (uint32_t i = 0; i < nHarts; ++i) {
+		TestHart *hart = new TestHart(&bus, useJIT);
+		hart->set_reg(6, 1);
+		hart->set_reg(10, dataMemoryBase);
+		hart->set_reg(11, iterations);
+		hart->set_reg(12, dataMemoryBase + 4);
+		harts.push_back(hart);
+		scheduler.add_core(hart);
+	}
+	for (int tick = 0; tick < 100; ++tick) {
+		scheduler.tick(1000);
+	}
+	for (uint32_t i = 0; i < nHarts; ++i) {
+		ASSERT_EQ(0u, harts[i]->reg(11)) << "hart " << i;
+		delete harts[i];
+	}
+	ASSERT_EQ(nHarts * iterations, ram.read_word(dataMemoryBase));
+	ASSERT_EQ(nHarts * iterations, ram.read_word(dataMemoryBase + 4));
+}
+
+// a loop that calls f, which calls g, and then calls g itself; g spends most of the time
+static const uint32_t callTree[] = {
+	0x010000ef, // 0x00 main: jal ra, f
+	0x024000ef, // 0x04 jal ra, g
+	0xff9ff06f, // 0x08 j main
+	0x00000013, // 0x0c nop
+	0xffc10113, // 0x10 f: addi sp, sp, -4
+	0x00112023, // 0x14 sw ra, 0(sp)
+	0x010000ef, // 0x18 jal ra, g
+	0x00012083, // 0x1c lw ra, 0(sp)
+	0x00410113, // 0x20 addi sp, sp, 4
+	0x00008067, // 0x24 ret
+	0x01400293, // 0x28 g: li x5, 20
+	0xfff28293, // 0x2c loop: addi x5, x5, -1
+	0xfe029ee3, // 0x30 bnez x5, loop
+	0x00008067, // 0x34 ret
+};
+
+TEST(RV32ProfilerTest, CountsBlocksAndFollowsCalls) {
+	std::vector<uint32_t> program(callTree, callTree + sizeof(callTree) / sizeof(callTree[0]));
+	std::vector<uint32_t> registers(32, 0);
+	registers[2] = dataMemoryBase + 1024;
+	TestMachine plain(useJIT), profiled(useJIT);
+	plain.load(program, registers);
+	profiled.load(program, registers);
+	RV32Profiler profiler(textMemoryBase, textMemoryPages * 1024, 97);
+	profiler.add_symbol(0x00, "main");
+	profiler.add_symbol(0x10, "f");
+	profiler.add_symbol(0x28, "g");
+	profiled.set_profiler(&profiler);
+	for (int i = 0; i < 10; ++i) {
+		plain.run(10000);
+		profiled.run(10000);
+	}
+
+	// profiling doesn't change what runs
+	ASSERT_EQ(plain.get_instret(), profiled.get_instret());
+	ASSERT_EQ(plain.get_pc(), profiled.get_pc());
+	for (int i = 0; i < 32; ++i) {
+		ASSERT_EQ(plain.reg(i), profiled.reg(i)) << "x" << i;
+	}
+
+	ASSERT_EQ(profiled.get_instret(), profiler.get_instructions());
+	std::vector<RV32Profiler::Block> hot = profiler.get_hot_blocks(3);
+	ASSERT_EQ(3u, hot.size());
+	ASSERT_EQ(0x2Cu, hot[0].pc);
+	ASSERT_GT(hot[0].instructions, profiler.get_instructions() * 8 / 10);
+	ASSERT_GE(hot[0].instructions, hot[1].instructions);
+	ASSERT_GE(hot[1].instructions, hot[2].instructions);
+
+	ASSERT_EQ(profiled.get_instret() / 97, profiler.get_samples());
+	std::stringstream folded;
+	profiler.write_folded_stacks(folded);
+	std::map<std::string, uint64_t> stacks;
+	uint64_t total = 0;
+	std::string stack;
+	uint64_t count;
+	while (folded >> stack >> count) {
+		stacks[stack] = count;
+		total += count;
+	}
+	ASSERT_EQ(profiler.get_samples(), total);
+	// g is called from f and from main, and runs about as long either way
+	ASSERT_GT(stacks["root;f;g"], total / 3);
+	ASSERT_GT(stacks["root;g"], total / 3);
+	for (std::map<std::string, uint64_t>::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+		ASSERT_TRUE(it->first == "root" || it->first == "root;f" || it->first == "root;g" || it->first == "root;f;g")
+			<< it->first;
+	}
+
+	std::stringstream report;
+	profiler.write_hot_blocks(report, 1);
+	ASSERT_NE(std::string::npos, report.str().find("0x0000002c"));
+	ASSERT_NE(std::string::npos, report.str().find("g+0x4"));
+}
+
+// the instructions in a saved trace
+static std::vector<RV32Trace::Event> replay_trace(const RV32Core &core) {
+	std::stringstream saved;
+	core.save_trace(saved);
+	std::vector<uint32_t> records;
+	uint32_t pc;
+	uint64_t instret;
+	std::vector<RV32Trace::Event> events;
+	EXPECT_TRUE(RV32Trace::read(saved, records, pc, instret));
+	EXPECT_TRUE(RV32Trace::replay(records, pc, instret, events));
+	return events;
+}
+
+TEST(RV32TraceTest, ReconstructsWhatRan) {
+	std::mt19937 rng(2025);
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	for (int trial = 0; trial < 10; ++trial) {
+		std::vector<uint32_t> program = random_program(rng, 200);
+		std::vector<uint32_t> registers(32);
+		for (int i = 0; i < 32; ++i) {
+			registers[i] = rng();
+		}
+		registers[1] = returnAddress;
+		registers[3] = 4;
+		registers[4] = dataMemoryBase;
+		registers[31] = TestMachine::mmioBase;
+
+		// one instruction per step
+		TestMachine stepped(false), ran(useJIT);
+		stepped.load(program, registers);
+		ran.load(program, registers);
+		ran.set_trace_size(1 << 16);
+		std::vector<uint32_t> pcs;
+		while (stepped.get_pc() != returnAddress && pcs.size() < 10000) {
+			pcs.push_back(stepped.get_pc());
+			stepped.step();
+		}
+		while (ran.get_instret() < pcs.size()) {
+			ran.run(std::min<uint64_t>(1 + rng() % 50, pcs.size() - ran.get_instret()));
+		}
+		ASSERT_EQ(returnAddress, ran.get_pc()) << "trial " << trial;
+
+		std::vector<RV32Trace::Event> events = replay_trace(ran);
+		ASSERT_EQ(pcs.size(), events.size()) << "trial " << trial;
+		for (size_t i = 0; i < events.size(); ++i) {
+			ASSERT_EQ(RV32Trace::Event::INSTRUCTION, events[i].kind) << "trial " << trial << ", " << i;
+			ASSERT_EQ(pcs[i], events[i].pc) << "trial " << trial << ", " << i;
+			ASSERT_EQ(i, events[i].instret) << "trial " << trial << ", " << i;
+		}
+	}
+}
+
+TEST(RV32TraceTest, KeepsTheLatestInstructionsAndTraps) {
+	std::vector<uint32_t> program = {
+		i_type(1, 6, 0, 6, 0x13),        // loop: addi x6, x6, 1
+		i_type(15, 6, 7, 7, 0x13),       // andi x7, x6, 15
+		b_type(-8, 0, 7, 1),             // bnez x7, loop
+		i_type(0, 0, 0, 0, 0x73),        // ecall
+		b_type(-16, 0, 0, 0),            // j loop
+	};
+	program.resize(0x1C0 / 4, i_type(0, 0, 0, 0, 0x13));
+	program.push_back(i_type(0x341, 0, 2, 5, 0x73));   // handler: csrr x5, mepc
+	program.push_back(i_type(4, 5, 0, 5, 0x13));       // addi x5, x5, 4
+	program.push_back(i_type(0x341, 5, 1, 0, 0x73));   // csrw mepc, x5
+	program.push_back(0x10000073);                     // eret
+	TestMachine stepped(false), ran(useJIT);
+	stepped.load(program, std::vector<uint32_t>(32, 0));
+	ran.load(program, std::vector<uint32_t>(32, 0));
+	while (ran.get_instret() < 100000) {
+		ran.run(100000 - ran.get_instret());
+	}
+	// translated code can overshoot the budget
+	std::vector<uint32_t> pcs;
+	while (pcs.size() < ran.get_instret()) {
+		pcs.push_back(stepped.get_pc());
+		stepped.step();
+	}
+	ASSERT_LT(ran.get_trace().get_size(), ran.get_trace().get_words_recorded());
+
+	// as much as the buffer still holds, up to the last instruction
+	std::vector<RV32Trace::Event> events = replay_trace(ran);
+	ASSERT_LT(1000u, events.size());
+	uint64_t first = events[0].instret;
+	uint32_t traps = 0;
+	uint64_t instret = first;
+	for (size_t i = 0; i < events.size(); ++i) {
+		if (events[i].kind == RV32Trace::Event::TRAP) {
+			ASSERT_EQ(11u, events[i].cause);
+			ASSERT_EQ(0x0Cu, events[i].pc);
+			ASSERT_EQ(RV32Trace::Event::INSTRUCTION, events[i-1].kind);
+			ASSERT_EQ(0x0Cu, events[i-1].pc);
+			ASSERT_EQ(0x1C0u, events[i+1].pc);
+			++traps;
+			continue;
+		}
+		ASSERT_EQ(RV32Trace::Event::INSTRUCTION, events[i].kind) << i;
+		ASSERT_EQ(instret, events[i].instret) << i;
+		ASSERT_EQ(pcs[instret], events[i].pc) << i;
+		++instret;
+	}
+	ASSERT_EQ(pcs.size(), instret);
+	ASSERT_LT(10u, traps);
+}
+
+TEST(RV32TraceTest, FollowsCoresInABank) {
+	std::mt19937 rng(2026);
+	const uint32_t nCores = 11;
+	const uint64_t budget = 2000;
+	std::vector<uint32_t> program = random_program(rng, 200);
+	// a few different starting points, so that the cores branch apart
+	std::vector<std::vector<uint32_t> > starts(3, std::vector<uint32_t>(32));
+	for (size_t s = 0; s < starts.size(); ++s) {
+		for (int i = 0; i < 32; ++i) {
+			starts[s][i] = rng();
+		}
+		starts[s][1] = 0xDDCCDDCC;
+		starts[s][3] = 4;
+		starts[s][4] = dataMemoryBase;
+		starts[s][31] = TestMachine::mmioBase;
+	}
+
+	std::vector<TestMachine*> banked, alone;
+	std::vector<RV32Core*> cores;
+	for (uint32_t i = 0; i < nCores; ++i) {
+		banked.push_back(new TestMachine(false));
+		alone.push_back(new TestMachine(false));
+		banked[i]->load(program, starts[i % starts.size()]);
+		alone[i]->load(program, starts[i % starts.size()]);
+		banked[i]->set_trace_size(1 << 16);
+		alone[i]->set_trace_size(1 << 16);
+		cores.push_back(banked[i]);
+	}
+	RV32CoreBank bank(cores);
+	// in two runs, so that the trace carries on from one to the next
+	bank.run(budget / 2);
+	bank.run(budget / 2);
+
+	for (uint32_t c = 0; c < nCores; ++c) {
+		while (alone[c]->get_instret() < budget) {
+			alone[c]->run(budget - alone[c]->get_instret());
+		}
+		std::vector<RV32Trace::Event> expected = replay_trace(*alone[c]);
+		std::vector<RV32Trace::Event> events = replay_trace(*banked[c]);
+		ASSERT_EQ(expected.size(), events.size()) << "core " << c;
+		for (size_t i = 0; i < events.size(); ++i) {
+			ASSERT_NE(RV32Trace::Event::GAP, events[i].kind) << "core " << c << ", " << i;
+			ASSERT_EQ(expected[i].kind, events[i].kind) << "core " << c << ", " << i;
+			ASSERT_EQ(expected[i].pc, events[i].pc) << "core " << c << ", " << i;
+			ASSERT_EQ(expected[i].instret, events[i].instret) << "core " << c << ", " << i;
+			ASSERT_EQ(expected[i].cause, events[i].cause) << "core " << c << ", " << i;
+		}
+		delete banked[c];
+		delete alone[c];
+	}
+}
+
+TEST(RV32HartTest, SpinningOnAnotherHartsStoreDoesntSleep) {
+	const uint32_t setterBase = 0x100;
+	std::vector<uint32_t> waiter = {
+		i_type(0, 10, 2, 5, 0x03),   // loop: lw x5, 0(x10)
+		b_type(-4, 0, 5, 0),         // beqz x5, loop
+		i_type(1, 0, 0, 6, 0x13),    // li x6, 1
+		WFI,
+		b_type(-4, 0, 0, 0),         // j back to the wfi
+	};
+	std::vector<uint32_t> setter = {
+		i_type(-1, 7, 0, 7, 0x13),   // loop: addi x7, x7, -1
+		b_type(-4, 0, 7, 1),         // bnez x7, loop
+		s_type(0, 6, 10, 2),         // sw x6, 0(x10)
+		WFI,
+		b_type(-4, 0, 0, 0),         // j back to the wfi
+	};
+	std::vector<uint8_t> text(textMemoryPages * 1024, 0);
+	memcpy(text.data(), waiter.data(), waiter.size() * 4);
+	memcpy(text.data() + setterBase, setter.data(), setter.size() * 4);
+	SystemBus bus;
+	ROM rom(textMemoryPages);
+	RAM ram(dataMemoryPages);
+	rom.set_contents(text.data());
+	bus.attach_peripheral(&rom, textMemoryBase);
+	bus.attach_peripheral(&ram, dataMemoryBase);
+
+	// the waiter would otherwise go to sleep as soon as it had been round the loop twice
+	TestHart a(&bus, false), b(&bus, false);
+	a.set_spin_detection(true);
+	b.set_spin_detection(true);
+	a.set_reg(10, dataMemoryBase);
+	b.set_reg(10, dataMemoryBase);
+	b.set_reg(6, 1);
+	b.set_reg(7, 500);
+	b.set_pc(setterBase);
+	MCUScheduler scheduler;
+	scheduler.add_core(&a);
+	scheduler.add_core(&b);
+	for (int tick = 0; tick < 3; ++tick) {
+		scheduler.tick(1000);
+	}
+	ASSERT_EQ(1u, ram.read_word(dataMemoryBase));
+	ASSERT_EQ(1u, a.reg(6));
+}
+
+TEST(RV32HartTest, PlainStoresRaceWithAtomics) {
+	// one word: three harts count in its low half with AMOs and LR/SC,
+	// while a fourth counts in its high half with plain loads and stores, and counts
+	// how often it doesn't read back what it last stored (i.e. an atomic wrote over its store)
+	const uint32_t nAtomicHarts = 3;
+	const uint32_t iterations = 10000;
+	const uint32_t plainBase = 0x100;
+	std::vector<uint32_t> atomics = {
+		amoadd_w(0, 6, 12),       // loop: amoadd.w x0, x6, (x12)
+		lr_w(5, 12),              // retry: lr.w x5, (x12)
+		i_type(1, 5, 0, 5, 0x13), // addi x5, x5, 1
+		sc_w(7, 5, 12),           // sc.w x7, x5, (x12)
+		b_type(-12, 0, 7, 1),     // bnez x7, retry
+		i_type(-1, 11, 0, 11, 0x13), // addi x11, x11, -1
+		b_type(-24, 0, 11, 1),    // bnez x11, loop
+		WFI,
+		b_type(-4, 0, 0, 0),      // j back to the wfi
+	};
+	std::vector<uint32_t> plain = {
+		i_type(2, 12, 5, 5, 0x03), // loop: lhu x5, 2(x12)
+		b_type(8, 8, 5, 0),       // beq x5, x8, stored
+		i_type(1, 9, 0, 9, 0x13), // addi x9, x9, 1
+		i_type(1, 8, 0, 8, 0x13), // stored: addi x8, x8, 1
+		s_type(2, 8, 12, 1),      // sh x8, 2(x12)
+		i_type(-1, 11, 0, 11, 0x13), // addi x11, x11, -1
+		b_type(-24, 0, 11, 1),    // bnez x11, loop
+		WFI,
+		b_type(-4, 0, 0, 0),      // j back to the wfi
+	};
+	std::vector<uint8_t> text(textMemoryPages * 1024, 0);
+	memcpy(text.data(), atomics.data(), atomics.size() * 4);
+	memcpy(text.data() + plainBase, plain.data(), plain.size() * 4);
+	SystemBus bus;
+	ROM rom(textMemoryPages);
+	RAM ram(dataMemoryPages);
+	rom.set_contents(text.data());
+	bus.attach_peripheral(&rom, textMemoryBase);
+	bus.attach_peripheral(&ram, dataMemoryBase);
+	ram.write_word(dataMemoryBase, 0);
+
+	std::vector<TestHart*> harts;
+	MCUScheduler scheduler;
+	scheduler.set_worker_threads(nAtomicHarts + 1);
+	scheduler.set_deterministic(false);
+	for (uint32_t i = 0; i < nAtomicHarts + 1; ++i) {
+		TestHart *hart = new TestHart(&bus, useJIT);
+		hart->set_reg(6, 1);
+		hart->set_reg(11, iterations);
+		hart->set_reg(12, dataMemoryBase);
+		if (i == nAtomicHarts) {
+			hart->set_pc(plainBase);
+		}
+		harts.push_back(hart);
+		scheduler.add_core(hart);
+	}
+	for (int tick = 0; tick < 200; ++tick) {
+		scheduler.tick(1000);
+	}
+	for (uint32_t i = 0; i < harts.size(); ++i) {
+		ASSERT_EQ(0u, harts[i]->reg(11)) << "hart " << i;
+	}
+	ASSERT_EQ(0u, harts[nAtomicHarts]->reg(9));
+	ASSERT_EQ((iterations << 16) | (2 * nAtomicHarts * iterations), ram.read_word(dataMemoryBase));
+	for (uint32_t i = 0; i < harts.size(); ++i) {
+		delete harts[i];
+	}
+}
+
+// translated into the test binary at build time; see add_rv32_aot_firmware() in test/CMakeLists.txt
+static const uint32_t aotChecksum[] = {
+#include "firmware/aot_checksum.hex"
+};
+
+TEST(RV32AOTTest, MatchesInterpreter) {
+	std::vector<uint32_t> program(aotChecksum, aotChecksum + sizeof(aotChecksum) / sizeof(aotChecksum[0]));
+	const uint32_t returnAddress = 0xDDCCDDCC;
+	std::vector<uint32_t> registers(32, 0);
+	registers[1] = returnAddress;
+	registers[10] = 50;
+
+	TestMachine interpreter(false), aot(false);
+	interpreter.load(program, registers);
+	aot.load(program, registers);
+	ASSERT_TRUE(aot.use_translated_rom(&aot.rom, textMemoryBase));
+	uint32_t interpreterSteps = interpreter.run_until(returnAddress, 100000);
+	uint32_t aotSteps = aot.run_until(returnAddress, 100000);
+
+	ASSERT_EQ(returnAddress, interpreter.get_pc());
+	ASSERT_EQ(returnAddress, aot.get_pc());
+	EXPECT_LT(aotSteps, interpreterSteps);
+	ASSERT_EQ(interpreter.get_instret(), aot.get_instret());
+	for (int i = 0; i < 32; ++i) {
+		ASSERT_EQ(interpreter.reg(i), aot.reg(i)) << "x" << i;
+	}
+	for (uint32_t offset = 0; offset < dataMemoryPages * 1024; offset += 4) {
+		ASSERT_EQ(interpreter.ram_word(offset), aot.ram_word(offset)) << "offset " << offset;
+	}
+	ASSERT_EQ(1u, aot.mmio.writes);
+	ASSERT_EQ(1u, aot.mmio.reads);
+	ASSERT_EQ(interpreter.mmio.value, aot.mmio.value);
+}
+
+TEST(RV32AOTTest, OnlyMatchingContentsAreTranslated) {
+	std::vector<uint32_t> program(aotChecksum, aotChecksum + sizeof(aotChecksum) / sizeof(aotChecksum[0]));
+	std::vector<uint32_t> registers(32, 0);
+	TestMachine m(false);
+	m.load(program, registers);
+	ASSERT_FALSE(m.use_translated_rom(&m.rom, textMemoryBase + 1024));
+	ASSERT_TRUE(m.use_translated_rom(&m.rom, textMemoryBase));
+
+	// a single changed word anywhere in the ROM means it's different firmware
+	program.resize(512, 0);
+	program[511] = 1;
+	m.load(program, registers);
+	m.flush_instruction_cache();
+	ASSERT_FALSE(m.is_using_translated_rom());
+	ASSERT_FALSE(m.use_translated_rom(&m.rom, textMemoryBase));
+}
+
 int main (int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--jit") == 0) {
+			useJIT = true;
+		}
+	}
 	return RUN_ALL_TESTS();
 }
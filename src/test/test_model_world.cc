@@ -0,0 +1,632 @@
+#include "gtest/gtest.h"
+#include "vector.h"
+#include "world.h"
+#include "voxel_occupant.h"
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// A stationary occupant of configurable size that blocks all movement.
+class TestBlock : public VoxelOccupant {
+public:
+    TestBlock(Vector ext) : extents(ext) {}
+    virtual ~TestBlock() {}
+
+    virtual bool impedesXYMovement() const { return true; }
+    virtual bool impedesZMovement() const { return true; }
+    virtual bool impedesXYFluidFlow() const { return true; }
+    virtual bool impedesZFluidFlow() const { return true; }
+    virtual bool supportsOthers() const { return true; }
+    virtual bool needsSupport() const { return false; }
+    virtual bool canMove() const { return false; }
+    virtual uint16_t get_kind() const { return 0; }
+    virtual uint32_t get_type() const { return 0; }
+    virtual Vector get_extents() const { return extents; }
+    virtual bool requires_timestep() const { return false; }
+    virtual bool has_world_updates() const { return false; }
+    virtual int32_t get_maximum_durability() const { return 1; }
+protected:
+    Vector extents;
+};
+
+// A multi-voxel machine that counts its timesteps.
+class TestCountingMachine : public TestBlock {
+public:
+    TestCountingMachine(Vector ext) : TestBlock(ext), timesteps(0), active(true) {}
+    virtual bool requires_timestep() const { return active; }
+    virtual void timestep() { ++timesteps; }
+
+    void set_active(bool a) { active = a; notify_state_changed(); }
+
+    uint32_t timesteps;
+protected:
+    bool active;
+};
+
+// A 1x1x1 occupant that counts its preprocessing steps.
+class TestPreprocessor : public TestBlock {
+public:
+    TestPreprocessor() : TestBlock(Vector(1,1,1)), preprocessed(0) {}
+    virtual bool requires_preprocessing() const { return true; }
+    virtual void preprocess() { ++preprocessed; }
+
+    uint32_t preprocessed;
+};
+
+// An occupant that asks for world updates once when woken, and wakes others while being asked.
+class TestOneShotUpdater : public TestBlock {
+public:
+    TestOneShotUpdater() : TestBlock(Vector(1,1,1)), asked(0), pending(false) {}
+    virtual bool has_world_updates() const { return pending; }
+    virtual std::vector<WorldUpdate*> get_world_updates() {
+        ++asked;
+        pending = false;
+        notify_state_changed();
+        for (TestOneShotUpdater *other : wakes) {
+            other->wake();
+        }
+        return std::vector<WorldUpdate*>();
+    }
+
+    void wake() { pending = true; notify_state_changed(); }
+
+    uint32_t asked;
+    std::vector<TestOneShotUpdater*> wakes;
+protected:
+    bool pending;
+};
+
+class TestWorld : public ::testing::Test {
+public:
+    void SetUp() {
+        world = new World(40, 40);
+    }
+
+    void TearDown() {
+        if (world != NULL) {
+            delete world;
+        }
+    }
+
+    World *world;
+};
+
+TEST_F (TestWorld, OccupantsAt_Empty) {
+    ASSERT_TRUE(world->occupants_at(Vector(3,3,3)).empty());
+    // out of bounds
+    ASSERT_TRUE(world->occupants_at(Vector(-1,3,3)).empty());
+    ASSERT_TRUE(world->occupants_at(Vector(3,40,3)).empty());
+}
+
+TEST_F (TestWorld, OccupantsAt_SpansChunks) {
+    // 2x2x2 block straddling the corner of eight chunks
+    TestBlock *block = new TestBlock(Vector(2,2,2));
+    ASSERT_TRUE(world->add_occupant(Vector(15,15,15), Vector(0,0,0), block));
+    for (int32_t x = 15; x <= 16; ++x) {
+        for (int32_t y = 15; y <= 16; ++y) {
+            for (int32_t z = 15; z <= 16; ++z) {
+                OccupantRange occupants = world->occupants_at(Vector(x,y,z));
+                ASSERT_EQ(1, occupants.size());
+                ASSERT_EQ(block, *(occupants.begin()));
+            }
+        }
+    }
+    ASSERT_TRUE(world->occupants_at(Vector(17,15,15)).empty());
+    world->remove_occupant(block);
+    ASSERT_TRUE(world->occupants_at(Vector(16,16,16)).empty());
+    delete block;
+}
+
+TEST_F (TestWorld, ForEachOccupant_VisitsMultiVoxelOccupantOnce) {
+    TestBlock *big = new TestBlock(Vector(3,3,1));
+    TestBlock *small = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(2,2,1), Vector(0,0,0), big));
+    ASSERT_TRUE(world->add_occupant(Vector(5,5,1), Vector(0,0,0), small));
+
+    std::vector<VoxelOccupant*> visited;
+    world->for_each_occupant(Vector(0,0,0), Vector(10,10,3), [&](VoxelOccupant *occ) {
+        visited.push_back(occ);
+    });
+    ASSERT_EQ(2, visited.size());
+    ASSERT_EQ(1, std::count(visited.begin(), visited.end(), big));
+    ASSERT_EQ(1, std::count(visited.begin(), visited.end(), small));
+
+    // a box starting inside the large occupant still sees it exactly once
+    visited.clear();
+    world->for_each_occupant(Vector(3,3,1), Vector(2,2,1), [&](VoxelOccupant *occ) {
+        visited.push_back(occ);
+    });
+    ASSERT_EQ(1, visited.size());
+    ASSERT_EQ(big, visited.at(0));
+    ASSERT_EQ(1, world->get_occupants(Vector(3,3,1), Vector(2,2,1)).size());
+}
+
+TEST_F (TestWorld, FindOccupant) {
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(4,4,2), Vector(0,0,0), block));
+    VoxelOccupant *found = world->find_occupant(Vector(0,0,0), Vector(8,8,8), [](VoxelOccupant *occ) {
+        return occ->supportsOthers();
+    });
+    ASSERT_EQ(block, found);
+    found = world->find_occupant(Vector(0,0,0), Vector(8,8,8), [](VoxelOccupant *occ) {
+        return occ->needsSupport();
+    });
+    ASSERT_TRUE(found == NULL);
+}
+
+TEST_F (TestWorld, Handle_ResolvesWhileInWorld) {
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(block->get_handle().is_null());
+    ASSERT_TRUE(world->add_occupant(Vector(4,4,2), Vector(0,0,0), block));
+    OccupantHandle h = block->get_handle();
+    ASSERT_FALSE(h.is_null());
+    ASSERT_EQ(block, world->resolve(h));
+    ASSERT_EQ(1, world->get_number_of_occupants());
+
+    world->remove_occupant(block);
+    ASSERT_TRUE(world->resolve(h) == NULL);
+    ASSERT_EQ(0, world->get_number_of_occupants());
+    // removing twice is harmless
+    world->remove_occupant(block);
+    ASSERT_EQ(0, world->get_number_of_occupants());
+    delete block;
+}
+
+TEST_F (TestWorld, Handle_StaleAfterSlotReuse) {
+    TestBlock *a = new TestBlock(Vector(1,1,1));
+    TestBlock *b = new TestBlock(Vector(1,1,1));
+    TestBlock *c = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(1,1,1), Vector(0,0,0), a));
+    ASSERT_TRUE(world->add_occupant(Vector(2,1,1), Vector(0,0,0), b));
+    OccupantHandle ha = a->get_handle();
+    world->remove_occupant(a);
+    delete a;
+    // c takes over a's slot, but a's handle must not resolve to it
+    ASSERT_TRUE(world->add_occupant(Vector(3,1,1), Vector(0,0,0), c));
+    ASSERT_EQ(ha.index, c->get_handle().index);
+    ASSERT_TRUE(world->resolve(ha) == NULL);
+    ASSERT_EQ(b, world->resolve(b->get_handle()));
+    ASSERT_EQ(c, world->resolve(c->get_handle()));
+}
+
+TEST_F (TestWorld, Terrain_BedrockLayer) {
+    ASSERT_TRUE(world->get_terrain_occupant() == NULL);
+    world->create_bedrock_layer();
+    VoxelOccupant *bedrock = world->get_terrain_occupant();
+    ASSERT_TRUE(bedrock != NULL);
+    ASSERT_EQ(0, world->get_number_of_occupants());
+
+    OccupantRange occupants = world->occupants_at(Vector(7,9,0));
+    ASSERT_EQ(1, occupants.size());
+    ASSERT_EQ(bedrock, *(occupants.begin()));
+    ASSERT_TRUE(bedrock->impedesZMovement());
+    ASSERT_TRUE(world->occupants_at(Vector(7,9,1)).empty());
+    // the whole layer is one occupant
+    ASSERT_EQ(1, world->get_occupants(Vector(0,0,0), Vector(40,40,2)).size());
+
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_FALSE(world->can_occupy(Vector(7,9,0), block));
+    ASSERT_TRUE(world->can_occupy(Vector(7,9,1), block));
+    delete block;
+
+    // terrain can't be removed
+    world->remove_occupant(bedrock);
+    ASSERT_EQ(bedrock, *(world->occupants_at(Vector(7,9,0)).begin()));
+}
+
+TEST_F (TestWorld, Terrain_SetHeight) {
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(3,3,2), Vector(0,0,0), block));
+    ASSERT_TRUE(world->set_terrain_height(5, 5, 4));
+    ASSERT_EQ(4, world->get_terrain_height(5, 5));
+    ASSERT_EQ(0, world->get_terrain_height(5, 6));
+    ASSERT_TRUE(world->is_terrain(Vector(5,5,3)));
+    ASSERT_FALSE(world->is_terrain(Vector(5,5,4)));
+    // the column would bury the block
+    ASSERT_FALSE(world->set_terrain_height(3, 3, 3));
+    ASSERT_EQ(0, world->get_terrain_height(3, 3));
+    ASSERT_TRUE(world->set_terrain_height(3, 3, 2));
+    // out of bounds
+    ASSERT_FALSE(world->set_terrain_height(40, 3, 1));
+}
+
+// A 1x1x1 occupant that shares its voxel and only supports others.
+class TestFloor : public TestBlock {
+public:
+    TestFloor() : TestBlock(Vector(1,1,1)) {}
+    virtual bool impedesXYMovement() const { return false; }
+    virtual bool impedesZMovement() const { return false; }
+    virtual bool impedesXYFluidFlow() const { return false; }
+};
+
+TEST_F (TestWorld, VoxelTraits_UpdatedOnAddAndRemove) {
+    Vector v(6,6,3);
+    ASSERT_EQ(0, world->get_voxel_traits(v));
+    TestFloor *floor = new TestFloor();
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(v, Vector(0,0,0), floor));
+    ASSERT_EQ(TRAIT_SUPPORTS_OTHERS | TRAIT_IMPEDES_Z_FLUID_FLOW, world->get_voxel_traits(v));
+    ASSERT_TRUE(world->add_occupant(v, Vector(0,0,0), block));
+    ASSERT_EQ(block->get_traits(), world->get_voxel_traits(v));
+    ASSERT_TRUE(world->box_has_traits(v, Vector(1,1,1), TRAIT_IMPEDES_XY_MOVEMENT));
+    ASSERT_FALSE(world->box_has_traits(v, Vector(1,1,1), TRAIT_IMPEDES_XY_MOVEMENT, block));
+    ASSERT_TRUE(world->box_has_traits(v, Vector(1,1,1), TRAIT_SUPPORTS_OTHERS, block));
+
+    world->remove_occupant(block);
+    ASSERT_EQ(floor->get_traits(), world->get_voxel_traits(v));
+    world->remove_occupant(floor);
+    ASSERT_EQ(0, world->get_voxel_traits(v));
+    delete block;
+    delete floor;
+
+    world->create_bedrock_layer();
+    ASSERT_EQ(world->get_terrain_occupant()->get_traits(), world->get_voxel_traits(Vector(0,0,0)));
+}
+
+TEST_F (TestWorld, ActiveOccupants_TimestepOncePerOccupant) {
+    TestCountingMachine *machine = new TestCountingMachine(Vector(2,2,2));
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(1,1,1), Vector(0,0,0), machine));
+    ASSERT_TRUE(world->add_occupant(Vector(5,5,1), Vector(0,0,0), block));
+    ASSERT_EQ(1, world->get_active_occupants(PHASE_TIMESTEP).size());
+    ASSERT_TRUE(world->get_active_occupants(PHASE_PREPROCESS).empty());
+    ASSERT_TRUE(world->get_active_occupants(PHASE_MOVEMENT).empty());
+
+    world->timestep();
+    ASSERT_EQ(1, machine->timesteps);
+
+    machine->set_active(false);
+    ASSERT_TRUE(world->get_active_occupants(PHASE_TIMESTEP).empty());
+    world->timestep();
+    ASSERT_EQ(1, machine->timesteps);
+
+    machine->set_active(true);
+    world->timestep();
+    ASSERT_EQ(2, machine->timesteps);
+
+    world->remove_occupant(machine);
+    ASSERT_TRUE(world->get_active_occupants(PHASE_TIMESTEP).empty());
+    delete machine;
+}
+
+TEST_F (TestWorld, ActiveOccupants_VelocityRegistersMover) {
+    TestBlock *block = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(5,5,1), Vector(0,0,0), block));
+    ASSERT_TRUE(world->get_active_occupants(PHASE_MOVEMENT).empty());
+    Vector v(0,0,10);
+    block->set_subvoxel_velocity(v);
+    ASSERT_EQ(1, world->get_active_occupants(PHASE_MOVEMENT).size());
+    Vector zero(0,0,0);
+    block->set_subvoxel_velocity(zero);
+    ASSERT_TRUE(world->get_active_occupants(PHASE_MOVEMENT).empty());
+}
+
+TEST_F (TestWorld, ActiveOccupants_WorldUpdatesMayReregister) {
+    TestOneShotUpdater *first = new TestOneShotUpdater();
+    ASSERT_TRUE(world->add_occupant(Vector(1,1,1), Vector(0,0,0), first));
+    for (int i = 0; i < 64; ++i) {
+        TestOneShotUpdater *other = new TestOneShotUpdater();
+        ASSERT_TRUE(world->add_occupant(Vector(3 + i % 32, 3 + 2 * (i / 32), 1), Vector(0,0,0), other));
+        first->wakes.push_back(other);
+    }
+    TestOneShotUpdater *second = new TestOneShotUpdater();
+    ASSERT_TRUE(world->add_occupant(Vector(1,3,1), Vector(0,0,0), second));
+    first->wake();
+    second->wake();
+    ASSERT_EQ(2, world->get_active_occupants(PHASE_WORLD_UPDATES).size());
+
+    // the ones woken during the phase wait for the next timestep
+    world->timestep();
+    ASSERT_EQ(1, first->asked);
+    ASSERT_EQ(1, second->asked);
+    ASSERT_EQ(64, world->get_active_occupants(PHASE_WORLD_UPDATES).size());
+    for (TestOneShotUpdater *other : first->wakes) {
+        ASSERT_EQ(0, other->asked);
+    }
+    world->timestep();
+    for (TestOneShotUpdater *other : first->wakes) {
+        ASSERT_EQ(1, other->asked);
+    }
+    ASSERT_TRUE(world->get_active_occupants(PHASE_WORLD_UPDATES).empty());
+}
+
+TEST_F (TestWorld, ParallelPreprocess_EachOccupantOnce) {
+    world->set_worker_threads(4);
+    ASSERT_EQ(4, world->get_worker_threads());
+    std::vector<TestPreprocessor*> procs;
+    for (int32_t x = 0; x < 40; ++x) {
+        for (int32_t y = 0; y < 40; ++y) {
+            TestPreprocessor *p = new TestPreprocessor();
+            ASSERT_TRUE(world->add_occupant(Vector(x,y,1), Vector(0,0,0), p));
+            procs.push_back(p);
+        }
+    }
+    world->timestep();
+    world->timestep();
+    for (TestPreprocessor *p : procs) {
+        ASSERT_EQ(2, p->preprocessed);
+    }
+    world->set_worker_threads(1);
+    ASSERT_EQ(1, world->get_worker_threads());
+    world->timestep();
+    for (TestPreprocessor *p : procs) {
+        ASSERT_EQ(3, p->preprocessed);
+    }
+}
+
+TEST_F (TestWorld, Movement_ConflictGoesToLowestMover) {
+    TestBlock *a = new TestBlock(Vector(1,1,1));
+    TestBlock *b = new TestBlock(Vector(1,1,1));
+    // add b first so that it is first in the mover list
+    ASSERT_TRUE(world->add_occupant(Vector(3,5,1), Vector(0,0,0), b));
+    ASSERT_TRUE(world->add_occupant(Vector(1,5,1), Vector(0,0,0), a));
+    Vector right(1,0,0);
+    Vector left(-1,0,0);
+    a->set_velocity(right);
+    b->set_velocity(left);
+    world->timestep();
+    // both want (2,5,1); a started at a lower x, so it wins
+    ASSERT_TRUE(a->get_position() == Vector(2,5,1));
+    ASSERT_TRUE(b->get_position() == Vector(3,5,1));
+    ASSERT_EQ(a, *(world->occupants_at(Vector(2,5,1)).begin()));
+    ASSERT_EQ(b, *(world->occupants_at(Vector(3,5,1)).begin()));
+    ASSERT_TRUE(world->occupants_at(Vector(1,5,1)).empty());
+}
+
+TEST_F (TestWorld, Movement_LargeMoverDoesNotBlockItself) {
+    TestBlock *a = new TestBlock(Vector(2,2,1));
+    ASSERT_TRUE(world->add_occupant(Vector(1,1,1), Vector(0,0,0), a));
+    Vector right(1,0,0);
+    a->set_velocity(right);
+    world->timestep();
+    ASSERT_TRUE(a->get_position() == Vector(2,1,1));
+    ASSERT_TRUE(world->occupants_at(Vector(1,1,1)).empty());
+    ASSERT_EQ(1, world->occupants_at(Vector(3,2,1)).size());
+}
+
+static std::vector<Vector> run_crowd(uint32_t threads) {
+    World w(40, 40);
+    w.set_worker_threads(threads);
+    std::vector<TestBlock*> movers;
+    for (int32_t i = 0; i < 200; ++i) {
+        TestBlock *block = new TestBlock(Vector(1,1,1));
+        Vector position((i * 7) % 40, (i * 13) % 40, 1 + (i % 3));
+        if (!w.add_occupant(position, Vector(0,0,0), block)) {
+            delete block;
+            continue;
+        }
+        Vector velocity((i % 3) - 1, ((i / 3) % 3) - 1, 0);
+        Vector subvoxelVelocity(((i * 37) % 150) - 75, ((i * 53) % 150) - 75, 0);
+        block->set_velocity(velocity);
+        block->set_subvoxel_velocity(subvoxelVelocity);
+        movers.push_back(block);
+    }
+    for (int t = 0; t < 20; ++t) {
+        w.timestep();
+    }
+    std::vector<Vector> positions;
+    for (TestBlock *block : movers) {
+        positions.push_back(block->get_position());
+        positions.push_back(block->get_subvoxel_position());
+    }
+    return positions;
+}
+
+TEST_F (TestWorld, Movement_IndependentOfThreadCount) {
+    std::vector<Vector> serial = run_crowd(1);
+    for (uint32_t threads : {2, 3, 8}) {
+        std::vector<Vector> parallel = run_crowd(threads);
+        ASSERT_EQ(serial.size(), parallel.size());
+        for (size_t i = 0; i < serial.size(); ++i) {
+            ASSERT_TRUE(serial.at(i) == parallel.at(i)) << "mismatch at " << i << " with " << threads << " threads";
+        }
+    }
+}
+
+// World::raycast() as it was originally written, with double-precision boundary crossings.
+static double reference_intbound(double s, double ds) {
+    if (ds < 0.0) {
+        return reference_intbound(-s, -ds);
+    } else {
+        s = fmod(s, 1.0);
+        return (1.0 - s) / ds;
+    }
+}
+
+static int reference_sgn(int val) {
+    return (0 < val) - (val < 0);
+}
+
+static std::vector<Vector> reference_raycast(const World *w, Vector origin, Vector direction) {
+    std::vector<Vector> visitedVoxels;
+    int x = origin.getX();
+    int y = origin.getY();
+    int z = origin.getZ();
+    int dx = direction.getX();
+    int dy = direction.getY();
+    int dz = direction.getZ();
+    int stepX = reference_sgn(dx);
+    int stepY = reference_sgn(dy);
+    int stepZ = reference_sgn(dz);
+    double tMaxX = reference_intbound(x + 0.5, dx);
+    double tMaxY = reference_intbound(y + 0.5, dy);
+    double tMaxZ = reference_intbound(z + 0.5, dz);
+    double tDeltaX = (double)(stepX) / (double)(dx);
+    double tDeltaY = (double)(stepY) / (double)(dy);
+    double tDeltaZ = (double)(stepZ) / (double)(dz);
+    if (dx == 0 && dy == 0 && dz == 0) {
+        return visitedVoxels;
+    }
+    Vector destination = origin + direction;
+    while (true) {
+        if (tMaxX < tMaxY) {
+            if (tMaxX < tMaxZ) {
+                x += stepX;
+                tMaxX += tDeltaX;
+            } else {
+                z += stepZ;
+                tMaxZ += tDeltaZ;
+            }
+        } else {
+            if (tMaxY < tMaxZ) {
+                y += stepY;
+                tMaxY += tDeltaY;
+            } else {
+                z += stepZ;
+                tMaxZ += tDeltaZ;
+            }
+        }
+        Vector nextVoxel(x, y, z);
+        if (!w->location_in_bounds(nextVoxel)) break;
+        visitedVoxels.push_back(nextVoxel);
+        if (nextVoxel == destination) break;
+    }
+    return visitedVoxels;
+}
+
+// Every short direction from a few origins, plus long rays in pseudo-random directions.
+static std::vector<Ray> raycast_corpus() {
+    std::vector<Ray> rays;
+    Vector origins[] = { Vector(0,0,0), Vector(20,20,20), Vector(39,0,5), Vector(7,33,1) };
+    for (const Vector &origin : origins) {
+        for (int32_t dx = -5; dx <= 5; ++dx) {
+            for (int32_t dy = -5; dy <= 5; ++dy) {
+                for (int32_t dz = -5; dz <= 5; ++dz) {
+                    rays.push_back(Ray(origin, Vector(dx, dy, dz)));
+                }
+            }
+        }
+    }
+    uint32_t seed = 12345;
+    for (int i = 0; i < 20000; ++i) {
+        int32_t c[6];
+        for (int j = 0; j < 6; ++j) {
+            seed = seed * 1103515245 + 12345;
+            c[j] = (int32_t)((seed >> 16) % 81);
+        }
+        rays.push_back(Ray(Vector(c[0] % 40, c[1] % 40, c[2] % 40), Vector(c[3] - 40, c[4] - 40, c[5] - 40)));
+    }
+    return rays;
+}
+
+static bool same_voxels(const std::vector<Vector> &a, const Vector *b, size_t bSize) {
+    if (a.size() != bSize) return false;
+    for (size_t i = 0; i < bSize; ++i) {
+        if (!(a[i] == b[i])) return false;
+    }
+    return true;
+}
+
+TEST_F (TestWorld, Raycast_MatchesReference) {
+    std::vector<Ray> rays = raycast_corpus();
+    for (const Ray &ray : rays) {
+        std::vector<Vector> expected = reference_raycast(world, ray.origin, ray.direction);
+        std::vector<Vector> actual = world->raycast(ray.origin, ray.direction);
+        ASSERT_TRUE(same_voxels(expected, actual.data(), actual.size()));
+    }
+}
+
+TEST_F (TestWorld, Raycast_BatchMatchesReference) {
+    std::vector<Ray> rays = raycast_corpus();
+    std::vector<Vector> voxels;
+    std::vector<size_t> firstVoxel;
+    world->raycast(rays, voxels, firstVoxel);
+    ASSERT_EQ(rays.size() + 1, firstVoxel.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        std::vector<Vector> expected = reference_raycast(world, rays[i].origin, rays[i].direction);
+        ASSERT_TRUE(same_voxels(expected, voxels.data() + firstVoxel[i], firstVoxel[i + 1] - firstVoxel[i]));
+    }
+
+    // trace_rays() visits the same voxels, ray by ray
+    size_t visited = 0;
+    bool matches = true;
+    world->trace_rays(rays.data(), rays.size(), [&](size_t i, const Vector &v) {
+        if (visited < firstVoxel[i] || visited >= firstVoxel[i + 1] || !(voxels[visited] == v)) {
+            matches = false;
+        }
+        ++visited;
+        return true;
+    });
+    ASSERT_TRUE(matches);
+    ASSERT_EQ(voxels.size(), visited);
+}
+
+TEST_F (TestWorld, Raycast_StopsEarly) {
+    std::vector<Vector> visited;
+    world->trace_ray(Vector(0,0,0), Vector(10,0,0), [&](const Vector &v) {
+        visited.push_back(v);
+        return v.getX() < 3;
+    });
+    ASSERT_EQ(3, visited.size());
+    ASSERT_TRUE(visited.back() == Vector(3,0,0));
+}
+
+TEST_F (TestWorld, FirstHit_Blocks) {
+    TestFloor *floor = new TestFloor();
+    TestBlock *near = new TestBlock(Vector(1,1,1));
+    TestBlock *far = new TestBlock(Vector(1,1,1));
+    ASSERT_TRUE(world->add_occupant(Vector(10,5,5), Vector(0,0,0), floor));
+    ASSERT_TRUE(world->add_occupant(Vector(20,5,5), Vector(0,0,0), near));
+    ASSERT_TRUE(world->add_occupant(Vector(30,5,5), Vector(0,0,0), far));
+    Vector hit(0,0,0);
+    // the floor doesn't block anything, and the ray crosses several empty chunks first
+    ASSERT_EQ(near, world->first_hit(Vector(0,5,5), Vector(39,0,0), hit));
+    ASSERT_TRUE(hit == Vector(20,5,5));
+    ASSERT_EQ(floor, world->first_hit(Vector(0,5,5), Vector(39,0,0), hit, TRAIT_SUPPORTS_OTHERS));
+    ASSERT_EQ(far, world->first_hit(Vector(0,5,5), Vector(39,0,0), hit, TRAIT_IMPEDES_XY_MOVEMENT, near));
+    ASSERT_TRUE(hit == Vector(30,5,5));
+    // stops at the end of the ray
+    ASSERT_TRUE(world->first_hit(Vector(0,5,5), Vector(15,0,0), hit) == NULL);
+
+    world->remove_occupant(near);
+    world->remove_occupant(far);
+    ASSERT_TRUE(world->first_hit(Vector(0,5,5), Vector(39,0,0), hit) == NULL);
+    delete near;
+    delete far;
+}
+
+TEST_F (TestWorld, FirstHit_Terrain) {
+    world->set_terrain_height(12, 3, 1);
+    Vector hit(0,0,0);
+    ASSERT_EQ(world->get_terrain_occupant(), world->first_hit(Vector(12,3,10), Vector(0,0,-10), hit));
+    ASSERT_TRUE(hit == Vector(12,3,0));
+}
+
+TEST_F (TestWorld, FirstHit_MatchesVoxelByVoxelSearch) {
+    uint32_t seed = 777;
+    std::vector<Ray> rays = raycast_corpus();
+    // first with most chunks empty, then with most of them occupied
+    for (int i = 0; i < 300; ++i) {
+        seed = seed * 1103515245 + 12345;
+        Vector position((seed >> 8) % 40, (seed >> 16) % 40, (seed >> 24) % 20);
+        VoxelOccupant *occ = (i % 3 == 0) ? (VoxelOccupant*)new TestFloor() : (VoxelOccupant*)new TestBlock(Vector(1,1,1));
+        if (!world->add_occupant(position, Vector(0,0,0), occ)) delete occ;
+        if (i != 5 && i != 299) continue;
+        for (const Ray &ray : rays) {
+            VoxelOccupant *expected = NULL;
+            Vector expectedVoxel(0,0,0);
+            world->trace_ray(ray.origin, ray.direction, [&](const Vector &v) {
+                for (VoxelOccupant *occ : world->occupants_at(v)) {
+                    if (occ->impedesXYMovement() || occ->impedesZMovement()) {
+                        expected = occ;
+                        expectedVoxel = v;
+                        return false;
+                    }
+                }
+                return true;
+            });
+            Vector hit(0,0,0);
+            ASSERT_EQ(expected, world->first_hit(ray.origin, ray.direction, hit));
+            if (expected != NULL) {
+                ASSERT_TRUE(hit == expectedVoxel);
+            }
+        }
+    }
+}
+
+int main (int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
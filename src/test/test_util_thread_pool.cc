@@ -0,0 +1,50 @@
+#include "gtest/gtest.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+TEST (ThreadPool, SingleWorker_RunsInOrder) {
+    ThreadPool pool(1);
+    ASSERT_EQ(1, pool.get_number_of_workers());
+    std::vector<size_t> order;
+    pool.parallel_for(100, [&](size_t i) { order.push_back(i); });
+    ASSERT_EQ(100, order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        ASSERT_EQ(i, order.at(i));
+    }
+}
+
+TEST (ThreadPool, ManyWorkers_EachIndexOnce) {
+    ThreadPool pool(4);
+    ASSERT_EQ(4, pool.get_number_of_workers());
+    for (size_t count : {1, 3, 4, 31, 1000, 12345}) {
+        std::vector<std::atomic<uint32_t>> hits(count);
+        for (auto &h : hits) h.store(0);
+        pool.parallel_for(count, [&](size_t i) { hits[i].fetch_add(1); });
+        for (size_t i = 0; i < count; ++i) {
+            ASSERT_EQ(1, hits[i].load()) << "index " << i << " of " << count;
+        }
+    }
+}
+
+TEST (ThreadPool, UnevenWork_Completes) {
+    ThreadPool pool(3);
+    std::atomic<uint64_t> total(0);
+    // all of the expensive work is at the front of the range
+    pool.parallel_for(300, [&](size_t i) {
+        uint64_t x = i;
+        uint32_t spins = (i < 10) ? 200000 : 10;
+        for (uint32_t j = 0; j < spins; ++j) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        total.fetch_add(x & 1);
+        total.fetch_add(1000);
+    });
+    ASSERT_GE(total.load(), 300 * 1000);
+}
+
+int main (int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,139 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+// tasks per worker per job; more tasks balance better but cost more to claim
+static const size_t TASKS_PER_WORKER = 8;
+
+static inline uint64_t pack_range(uint32_t first, uint32_t last) {
+	return ((uint64_t)first << 32) | (uint64_t)last;
+}
+static inline uint32_t range_first(uint64_t r) { return (uint32_t)(r >> 32); }
+static inline uint32_t range_last(uint64_t r) { return (uint32_t)(r & 0xFFFFFFFFUL); }
+
+ThreadPool::ThreadPool(uint32_t workers)
+: nWorkers(workers), queues(NULL), generation(0), shutdown(false), workersFinished(0),
+  jobBody(NULL), jobCount(0), jobGrain(1) {
+	if (nWorkers == 0) {
+		nWorkers = std::thread::hardware_concurrency();
+		if (nWorkers == 0) {
+			nWorkers = 1;
+		}
+	}
+	queues = new TaskRange[nWorkers];
+	for (uint32_t i = 0; i < nWorkers; ++i) {
+		queues[i].range.store(0);
+	}
+	for (uint32_t i = 1; i < nWorkers; ++i) {
+		threads.push_back(std::thread(&ThreadPool::worker_main, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		shutdown = true;
+	}
+	jobStarted.notify_all();
+	for (std::thread &t : threads) {
+		t.join();
+	}
+	delete[] queues;
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t, size_t)> &body) {
+	size_t nTasks = std::min(count, (size_t)nWorkers * TASKS_PER_WORKER);
+	size_t grain = (count + nTasks - 1) / nTasks;
+	nTasks = (count + grain - 1) / grain;
+
+	// deal out contiguous blocks of tasks
+	for (uint32_t i = 0; i < nWorkers; ++i) {
+		uint32_t first = (uint32_t)(nTasks * i / nWorkers);
+		uint32_t last = (uint32_t)(nTasks * (i + 1) / nWorkers);
+		queues[i].range.store(pack_range(first, last));
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		jobBody = &body;
+		jobCount = count;
+		jobGrain = grain;
+		workersFinished = 0;
+		++generation;
+	}
+	jobStarted.notify_all();
+
+	work(0);
+
+	// wait for the helpers to run out of work, so that none of them
+	// is still looking at this job when the next one is set up
+	std::unique_lock<std::mutex> lock(mutex);
+	while (workersFinished < nWorkers - 1) {
+		jobFinished.wait(lock);
+	}
+	jobBody = NULL;
+}
+
+void ThreadPool::worker_main(uint32_t index) {
+	uint64_t seenGeneration = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!shutdown && generation == seenGeneration) {
+				jobStarted.wait(lock);
+			}
+			if (shutdown) return;
+			seenGeneration = generation;
+		}
+		work(index);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			++workersFinished;
+		}
+		jobFinished.notify_one();
+	}
+}
+
+void ThreadPool::work(uint32_t index) {
+	while (true) {
+		uint32_t task;
+		if (take_own_task(index, task)) {
+			size_t begin = (size_t)task * jobGrain;
+			size_t end = std::min(begin + jobGrain, jobCount);
+			(*jobBody)(begin, end);
+		} else if (!steal_tasks(index)) {
+			// every queue is empty
+			return;
+		}
+	}
+}
+
+bool ThreadPool::take_own_task(uint32_t index, uint32_t &task) {
+	std::atomic<uint64_t> &q = queues[index].range;
+	uint64_t r = q.load();
+	while (range_first(r) < range_last(r)) {
+		if (q.compare_exchange_weak(r, pack_range(range_first(r) + 1, range_last(r)))) {
+			task = range_first(r);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::steal_tasks(uint32_t thief) {
+	for (uint32_t offset = 1; offset < nWorkers; ++offset) {
+		uint32_t victim = (thief + offset) % nWorkers;
+		std::atomic<uint64_t> &q = queues[victim].range;
+		uint64_t r = q.load();
+		while (range_first(r) < range_last(r)) {
+			// take the back half, rounded up
+			uint32_t first = range_first(r);
+			uint32_t last = range_last(r);
+			uint32_t mid = first + (last - first) / 2;
+			if (q.compare_exchange_weak(r, pack_range(first, mid))) {
+				// our own queue is empty, so nobody else can be updating it
+				queues[thief].range.store(pack_range(mid, last));
+				return true;
+			}
+		}
+	}
+	return false;
+}
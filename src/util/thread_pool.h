@@ -0,0 +1,88 @@
+#ifndef _UTIL_THREAD_POOL_
+#define _UTIL_THREAD_POOL_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed-size pool of worker threads for data-parallel loops.
+ *
+ * parallel_for() cuts its index range into small tasks and deals them out
+ * to the workers in contiguous blocks. Each worker takes tasks from the front
+ * of its own block, and a worker that runs out steals the back half
+ * of another worker's remaining block, so uneven per-index costs
+ * (e.g. one busy robot among many idle ones) still balance across cores.
+ *
+ * The calling thread always acts as worker 0. A pool with a single worker
+ * starts no threads and runs every loop in index order on the caller,
+ * which makes it a deterministic fallback.
+ */
+class ThreadPool {
+public:
+	// 0 workers means one per hardware thread
+	ThreadPool(uint32_t workers = 0);
+	~ThreadPool();
+
+	uint32_t get_number_of_workers() const { return nWorkers; }
+
+	// Calls f(i) once for every i in [0, count) and returns when all calls have finished.
+	// Calls may run concurrently and in any order unless the pool has a single worker.
+	template <typename F> void parallel_for(size_t count, F f) {
+		if (count == 0) return;
+		if (nWorkers == 1 || count == 1) {
+			for (size_t i = 0; i < count; ++i) {
+				f(i);
+			}
+			return;
+		}
+		std::function<void(size_t, size_t)> body = [&f](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				f(i);
+			}
+		};
+		run(count, body);
+	}
+
+protected:
+	// Each worker's unclaimed tasks, packed as (first << 32) | last
+	// so that the owner and thieves can both update it with one CAS.
+	// Padded out to a cache line so workers don't contend on each other's queues.
+	struct TaskRange {
+		std::atomic<uint64_t> range;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	uint32_t nWorkers;
+	std::vector<std::thread> threads;
+	TaskRange *queues;
+
+	std::mutex mutex;
+	std::condition_variable jobStarted;
+	std::condition_variable jobFinished;
+	uint64_t generation; // incremented for every job
+	bool shutdown;
+	uint32_t workersFinished; // helper threads done with the current job
+
+	// the current job
+	const std::function<void(size_t, size_t)> *jobBody;
+	size_t jobCount;
+	size_t jobGrain;
+
+	void run(size_t count, const std::function<void(size_t, size_t)> &body);
+	void worker_main(uint32_t index);
+	void work(uint32_t index);
+	bool take_own_task(uint32_t index, uint32_t &task);
+	bool steal_tasks(uint32_t thief);
+
+private:
+	ThreadPool(const ThreadPool &);
+	ThreadPool & operator=(const ThreadPool &);
+};
+
+#endif // _UTIL_THREAD_POOL_